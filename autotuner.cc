@@ -0,0 +1,209 @@
+#include "autotuner.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <sstream>
+#include <vector>
+
+#include <Matog.h>
+#include "common.h"
+
+namespace AutoTuner
+{
+	using namespace FluidSim;
+
+	namespace
+	{
+		struct Entry
+		{
+			std::string device;
+			int width, height;
+			std::string kernel;
+			int x, y;
+			float ms;
+		};
+
+		std::vector<Entry> readDatabase(const char* path)
+		{
+			std::vector<Entry> entries;
+			std::ifstream in(path);
+			std::string line;
+			while (std::getline(in, line))
+			{
+				if (line.empty() || line[0] == '#')
+					continue;
+				// tab separated, device names contain spaces
+				std::vector<std::string> fields;
+				std::stringstream columns(line);
+				std::string field;
+				while (std::getline(columns, field, '\t'))
+					fields.push_back(field);
+				if (fields.size() != 7)
+					continue;
+				Entry e = { fields[0], atoi(fields[1].c_str()), atoi(fields[2].c_str()), fields[3],
+					atoi(fields[4].c_str()), atoi(fields[5].c_str()), static_cast<float>(atof(fields[6].c_str())) };
+				entries.push_back(e);
+			}
+			return entries;
+		}
+
+		bool writeDatabase(const char* path, const std::vector<Entry>& entries)
+		{
+			FILE* f = fopen(path, "w");
+			if (!f)
+			{
+				fprintf(stderr, "Error writing tuning database %s\n", path);
+				return false;
+			}
+			fprintf(f, "# fluidsim block shapes: device\twidth\theight\tkernel\tthreads_x\tthreads_y\tms\n");
+			for (const Entry& e : entries)
+				fprintf(f, "%s\t%d\t%d\t%s\t%d\t%d\t%.5f\n", e.device.c_str(), e.width, e.height, e.kernel.c_str(), e.x, e.y, e.ms);
+			fclose(f);
+			return true;
+		}
+
+		// mean time of one launch in ms
+		float timeKernel(const std::function<void()>& launch)
+		{
+			CUevent start, stop;
+			CHECK(cuEventCreate(&start, CU_EVENT_DEFAULT));
+			CHECK(cuEventCreate(&stop, CU_EVENT_DEFAULT));
+
+			launch();
+			int reps = 1;
+			float ms = 0.f;
+			// at least 5 ms of work per measurement, the best of three
+			float best = 1e30f;
+			for (int round = 0; round < 3; ++round)
+			{
+				for (;;)
+				{
+					CHECK(cuEventRecord(start, 0));
+					for (int r = 0; r < reps; ++r)
+						launch();
+					CHECK(cuEventRecord(stop, 0));
+					CHECK(cuEventSynchronize(stop));
+					CHECK(cuEventElapsedTime(&ms, start, stop));
+					if (ms >= 5.f || reps >= 4096)
+						break;
+					reps *= 4;
+				}
+				best = std::min(best, ms / reps);
+			}
+
+			cuEventDestroy(start);
+			cuEventDestroy(stop);
+			return best;
+		}
+	}
+
+	std::string deviceKey(CUdevice device)
+	{
+		char name[100];
+		int major = 0, minor = 0;
+		cuDeviceGetName(name, 100, device);
+		CHECK(cuDeviceComputeCapability(&major, &minor, device));
+		std::ostringstream key;
+		key << name << " sm" << major << "." << minor;
+		return key.str();
+	}
+
+	bool load(const char* databasePath, cudaInfo & info)
+	{
+		if (!databasePath || databasePath[0] == '\0')
+			return false;
+
+		std::string device = deviceKey(info.device);
+		int found = 0;
+		for (const Entry& e : readDatabase(databasePath))
+		{
+			if (e.device != device || e.width != info.width || e.height != info.height || e.x <= 0 || e.y <= 0)
+				continue;
+			for (int k = 0; k < KERNEL_COUNT; ++k)
+				if (e.kernel == kernelName(k))
+				{
+					info.blocks[k].x = e.x;
+					info.blocks[k].y = e.y;
+					++found;
+				}
+		}
+		if (found > 0)
+			printf("> Block shapes for %dx%d from %s\n", info.width, info.height, databasePath);
+		return found > 0;
+	}
+
+	void tune(const char* databasePath, cudaInfo & info, const Arrays & arrays)
+	{
+		int maxThreads = 1024;
+		CHECK(cuDeviceGetAttribute(&maxThreads, CU_DEVICE_ATTRIBUTE_MAX_THREADS_PER_BLOCK, info.device));
+
+		// whole warps, from 32 to the device limit
+		std::vector<BlockShape> candidates;
+		for (int x = 8; x <= 512; x *= 2)
+			for (int y = 1; y <= 32; y *= 2)
+				if (x * y >= 32 && x * y <= maxThreads && (x * y) % 32 == 0)
+					candidates.push_back(BlockShape{ x, y });
+
+		Array2D::Device *a = arrays.a, *b = arrays.b, *c = arrays.c, *d = arrays.d, *e = arrays.e;
+		CUdeviceptr image = arrays.image;
+		CUdeviceptr lattice = arrays.lattice;
+		std::function<void()> launches[KERNEL_COUNT] = {
+			[&] { advect(info, a, c, a, b, 0.001f, 10.f); },
+			[&] { jacobi(info, a, c, b, 100.f, 1.f / 104.f); },
+			[&] { divergence(info, a, b, c, 5.f); },
+			[&] { subtractGradient(info, e, a, b, c, d, 5.f); },
+			[&] { boundary(info, c, -1.f); },
+			[&] { addInk(info, c, d, c, info.width / 2, info.height / 2, 0.f, 0.f, 0.f); },
+			[&] { convertToColor(info, image, a); },
+			[&] { convertToColor2(info, image, a, b, e); },
+			[&] { residual(info, a, b, image, 100.f, 1.f / 104.f); },
+			[&] { streamCollide(info, lattice, c, d, c, d, e, 0, 1.f, 1.f, 1.f); },
+			[&] { splat(info, c, info.width / 2, info.height / 2, 0.f, 1.f, 0.f, 255.f); },
+			[&] { advectDye(info, arrays.dye, arrays.dyeNew, a, b, arrays.species, arrays.layout, 0.001f, 10.f, 1.f); },
+			[&] { addDye(info, arrays.dyeNew, arrays.species, arrays.layout, 0, info.width / 2, info.height / 2, 0.f); },
+			[&] { dyeToColor(info, image, arrays.dye, arrays.species, arrays.layout, arrays.palette); },
+		};
+
+		printf("> Tuning block shapes for %dx%d (%zu candidates per kernel)\n", info.width, info.height, candidates.size());
+		std::string device = deviceKey(info.device);
+		std::vector<Entry> winners;
+		for (int k = 0; k < KERNEL_COUNT; ++k)
+		{
+			if (k == STREAM_COLLIDE && !lattice)
+				continue;
+			if ((k == ADVECT_DYE || k == ADD_DYE || k == DYE_TO_COLOR) && !arrays.dye)
+				continue;
+			BlockShape best = { info.threads_x, info.threads_y };
+			float bestMs = 1e30f;
+			for (const BlockShape& shape : candidates)
+			{
+				info.blocks[k] = shape;
+				float ms = timeKernel(launches[k]);
+				if (ms < bestMs)
+				{
+					bestMs = ms;
+					best = shape;
+				}
+			}
+			info.blocks[k] = best;
+			printf("  %-17s %3dx%-3d %9.4f ms\n", kernelName(k), best.x, best.y, bestMs);
+			Entry entry = { device, info.width, info.height, kernelName(k), best.x, best.y, bestMs };
+			winners.push_back(entry);
+		}
+
+		if (!databasePath || databasePath[0] == '\0')
+			return;
+
+		// replace the entries of this device and grid size
+		std::vector<Entry> entries = readDatabase(databasePath);
+		entries.erase(std::remove_if(entries.begin(), entries.end(), [&](const Entry& x) {
+			return x.device == device && x.width == info.width && x.height == info.height;
+		}), entries.end());
+		entries.insert(entries.end(), winners.begin(), winners.end());
+		if (writeDatabase(databasePath, entries))
+			printf("- Stored block shapes in %s\n", databasePath);
+	}
+}
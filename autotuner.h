@@ -0,0 +1,37 @@
+#pragma once
+
+#include <string>
+
+#include "fluidSimKernel.h"
+
+// Auto-tuning of the thread block shape of every kernel.
+//
+// The field layouts are tuned by MATOG; what remains hand-picked is the block
+// shape (-t). tune() times each kernel with every candidate shape on the
+// simulation's own arrays and keeps the fastest. Winners are cached in a text
+// database, one line per kernel keyed by device name, compute capability and
+// grid size, and applied by load() on the next start.
+namespace AutoTuner
+{
+	// scratch arrays at the grid size; outputs are written to c, d, image,
+	// lattice and dyeNew only; kernels without their buffer are not tuned
+	struct Arrays
+	{
+		Array2D::Device *a, *b, *c, *d, *e;
+		CUdeviceptr image;
+		CUdeviceptr lattice;
+		// dye buffers (dye.h) and palette
+		CUdeviceptr dye, dyeNew, palette;
+		int species, layout;
+	};
+
+	// "<device name> sm<major>.<minor>"
+	std::string deviceKey(CUdevice device);
+
+	// sets info.blocks from the database, false if the device and grid have no entry
+	bool load(const char* databasePath, FluidSim::cudaInfo & info);
+
+	// benchmarks the candidate shapes, sets info.blocks to the winners and
+	// stores them in the database (if databasePath is not empty)
+	void tune(const char* databasePath, FluidSim::cudaInfo & info, const Arrays & arrays);
+}
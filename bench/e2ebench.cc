@@ -0,0 +1,339 @@
+/*
+ * End-to-end benchmark runner.
+ *
+ * Reads a scenario manifest, generates an event script for every scenario and
+ * runs the fluidsim executable on it. Wall time, frames/s and peak RSS of each
+ * run are written to a tab-separated results file in manifest order, so that
+ * results of two builds can be compared with diff.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <random>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+namespace
+{
+	struct Scenario
+	{
+		std::string name;
+		int width, height;
+		int frames;
+		double density;
+		std::string output;
+		int interval;
+		unsigned seed;
+	};
+
+	struct Result
+	{
+		double wallSeconds;
+		double loopSeconds;
+		long peakRssKb;
+		int status;
+	};
+
+	bool loadManifest(const char* path, std::vector<Scenario>& scenarios)
+	{
+		std::ifstream in(path);
+		if (!in)
+		{
+			fprintf(stderr, "Error opening manifest %s\n", path);
+			return false;
+		}
+
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(in, line))
+		{
+			++lineNumber;
+			size_t first = line.find_first_not_of(" \t\r");
+			if (first == std::string::npos || line[first] == '#')
+				continue;
+
+			Scenario s;
+			std::istringstream fields(line);
+			if (!(fields >> s.name >> s.width >> s.height >> s.frames >> s.density >> s.output >> s.interval >> s.seed)
+				|| s.width <= 0 || s.height <= 0 || s.frames <= 0 || s.interval <= 0
+				|| (s.output != "none" && s.output != "gif" && s.output != "raw"))
+			{
+				fprintf(stderr, "Error in manifest %s, line %d: %s\n", path, lineNumber, line.c_str());
+				return false;
+			}
+			scenarios.push_back(s);
+		}
+		return true;
+	}
+
+	// uniform in [0,1), identical on every platform unlike std::uniform_real_distribution
+	float uniform(std::mt19937& rng)
+	{
+		return (rng() >> 8) * (1.f / 16777216.f);
+	}
+
+	// Writes a random event script of the given length. Events last 5 to 40 frames,
+	// draw a line between two random points and the last one ends at frame `frames`,
+	// so the simulation runs for exactly that many frames.
+	bool generateScript(const char* path, int frames, double density, unsigned seed)
+	{
+		FILE* f = fopen(path, "w");
+		if (!f)
+		{
+			fprintf(stderr, "Error writing event script %s\n", path);
+			return false;
+		}
+
+		std::mt19937 rng(seed);
+		long count = std::max(1L, static_cast<long>(frames * density / 100.0));
+		fprintf(f, "# generated by fluidsim_e2e: %d frames, %g events per 100 frames, seed %u\n", frames, density, seed);
+		for (long n = 0; n < count; ++n)
+		{
+			int duration = std::min(frames, 5 + static_cast<int>(uniform(rng) * 36));
+			int start = n + 1 == count ? frames - duration : static_cast<int>(uniform(rng) * (frames - duration + 1));
+			float x0 = 0.05f + 0.9f * uniform(rng);
+			float x1 = 0.05f + 0.9f * uniform(rng);
+			float y0 = 0.05f + 0.9f * uniform(rng);
+			float y1 = 0.05f + 0.9f * uniform(rng);
+			float amount = 50.f + 450.f * uniform(rng);
+			fprintf(f, "%6d %6d   %.4f  %.4f  %.4f  %.4f  %.1f\n", start, start + duration, x0, x1, y0, y1, amount);
+		}
+		fclose(f);
+		return true;
+	}
+
+	// runs fluidsim with stdout/stderr redirected to logPath
+	Result run(const std::string& fluidsim, const std::vector<std::string>& args, const std::string& logPath)
+	{
+		Result result = { 0.0, 0.0, 0, -1 };
+
+		std::vector<char*> argv;
+		argv.push_back(const_cast<char*>(fluidsim.c_str()));
+		for (auto& a : args)
+			argv.push_back(const_cast<char*>(a.c_str()));
+		argv.push_back(nullptr);
+
+		auto start = std::chrono::steady_clock::now();
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork");
+			return result;
+		}
+		if (pid == 0)
+		{
+			int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0)
+			{
+				dup2(fd, 1);
+				dup2(fd, 2);
+				close(fd);
+			}
+			execv(argv[0], argv.data());
+			perror("execv");
+			_exit(127);
+		}
+
+		int status = 0;
+		struct rusage usage;
+		memset(&usage, 0, sizeof(usage));
+		if (wait4(pid, &status, 0, &usage) < 0)
+		{
+			perror("wait4");
+			return result;
+		}
+		result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		result.peakRssKb = usage.ru_maxrss;
+		result.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+
+		// time of the simulation loop alone, without CUDA and MATOG start-up
+		std::ifstream log(logPath.c_str());
+		std::string line;
+		while (std::getline(log, line))
+		{
+			int frames = 0;
+			long long ms = 0;
+			if (sscanf(line.c_str(), "- Simulated %d frames in %lld ms", &frames, &ms) == 2)
+				result.loopSeconds = ms * 1e-3;
+		}
+		return result;
+	}
+
+	void show_usage(std::string name)
+	{
+		std::cout << "Usage: " << name << " <option(s)>\n"
+			<< "Options:\n"
+			<< "\t-h,--help\t\t\tShow this help message\n"
+			<< "\t-m,--manifest\tPATH\t\tScenario manifest (default scenarios.manifest)\n"
+			<< "\t-o,--output\tPATH\t\tResults file (default e2e_results.tsv)\n"
+			<< "\t-b,--binary\tPATH\t\tfluidsim executable (default ./fluidsim)\n"
+			<< "\t-w,--work-dir\tPATH\t\tDirectory for generated scripts and logs (default e2e)\n"
+			<< "\t-f,--filter\tNAME,...\tOnly run these scenarios\n"
+			<< "\t-r,--repeat\tN\t\tRun every scenario N times and keep the median (default 1)\n"
+			<< "\t-g,--generate\tNAME\t\tOnly write the event script of scenario NAME to the work dir\n"
+			<< "\t-a,--args\t\"ARGS\"\t\tExtra fluidsim arguments for every scenario, e.g. \"--engine lbm\"\n"
+			<< std::endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string manifestPath = "scenarios.manifest";
+	std::string resultsPath = "e2e_results.tsv";
+	std::string fluidsim = "./fluidsim";
+	std::string workDir = "e2e";
+	std::vector<std::string> filter;
+	std::string generateOnly;
+	std::vector<std::string> extraArgs;
+	int repeat = 1;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if ((arg == "-h") || (arg == "--help")) {
+			show_usage(argv[0]);
+			return 0;
+		}
+		else if (((arg == "-m") || (arg == "--manifest")) && i + 1 < argc) {
+			manifestPath = argv[++i];
+		}
+		else if (((arg == "-o") || (arg == "--output")) && i + 1 < argc) {
+			resultsPath = argv[++i];
+		}
+		else if (((arg == "-b") || (arg == "--binary")) && i + 1 < argc) {
+			fluidsim = argv[++i];
+		}
+		else if (((arg == "-w") || (arg == "--work-dir")) && i + 1 < argc) {
+			workDir = argv[++i];
+		}
+		else if (((arg == "-f") || (arg == "--filter")) && i + 1 < argc) {
+			std::stringstream in(argv[++i]);
+			std::string item;
+			while (std::getline(in, item, ','))
+				filter.push_back(item);
+		}
+		else if (((arg == "-r") || (arg == "--repeat")) && i + 1 < argc) {
+			repeat = std::max(1, atoi(argv[++i]));
+		}
+		else if (((arg == "-g") || (arg == "--generate")) && i + 1 < argc) {
+			generateOnly = argv[++i];
+		}
+		else if (((arg == "-a") || (arg == "--args")) && i + 1 < argc) {
+			std::stringstream in(argv[++i]);
+			std::string item;
+			while (in >> item)
+				extraArgs.push_back(item);
+		}
+		else {
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Scenario> scenarios;
+	if (!loadManifest(manifestPath.c_str(), scenarios))
+		return 1;
+	mkdir(workDir.c_str(), 0755);
+
+	if (!generateOnly.empty())
+	{
+		for (auto& s : scenarios)
+			if (s.name == generateOnly)
+			{
+				std::string script = workDir + "/" + s.name + ".events";
+				if (!generateScript(script.c_str(), s.frames, s.density, s.seed))
+					return 1;
+				printf("%s\n", script.c_str());
+				return 0;
+			}
+		fprintf(stderr, "No scenario %s in %s\n", generateOnly.c_str(), manifestPath.c_str());
+		return 1;
+	}
+
+	FILE* results = fopen(resultsPath.c_str(), "w");
+	if (!results)
+	{
+		fprintf(stderr, "Error writing results %s\n", resultsPath.c_str());
+		return 1;
+	}
+	fprintf(results, "# name\twidth\theight\tframes\toutput\twall_s\tloop_s\tfps\tpeak_rss_mb\tstatus\n");
+
+	int failures = 0;
+	for (auto& s : scenarios)
+	{
+		if (!filter.empty() && std::find(filter.begin(), filter.end(), s.name) == filter.end())
+			continue;
+
+		std::string script = workDir + "/" + s.name + ".events";
+		std::string log = workDir + "/" + s.name + ".log";
+		if (!generateScript(script.c_str(), s.frames, s.density, s.seed))
+			return 1;
+
+		std::vector<std::string> args = {
+			"-s", std::to_string(s.width), std::to_string(s.height),
+			"-p", script,
+			"-i", std::to_string(s.interval)
+		};
+		if (s.output == "gif")
+			args.push_back("-g");
+		else if (s.output == "raw")
+		{
+			args.push_back("-r");
+			args.push_back("/dev/null");
+		}
+		args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+
+		printf("> %-18s %5dx%-5d %6d frames, %s ... ", s.name.c_str(), s.width, s.height, s.frames, s.output.c_str());
+		fflush(stdout);
+
+		// a failed repeat ends the scenario and is reported instead of the median
+		std::vector<Result> runs;
+		Result median = { 0.0, 0.0, 0, 0 };
+		bool failed = false;
+		for (int r = 0; r < repeat && !failed; ++r)
+		{
+			Result result = run(fluidsim, args, log);
+			failed = result.status != 0;
+			if (failed)
+				median = result;
+			else
+				runs.push_back(result);
+		}
+		if (!failed)
+		{
+			std::sort(runs.begin(), runs.end(), [](const Result& a, const Result& b) { return a.wallSeconds < b.wallSeconds; });
+			median = runs[runs.size() / 2];
+		}
+
+		// frames/s of the simulation loop when fluidsim reported it, else of the whole process
+		double seconds = median.loopSeconds > 0.0 ? median.loopSeconds : median.wallSeconds;
+		double fps = median.status == 0 && seconds > 0.0 ? s.frames / seconds : 0.0;
+		fprintf(results, "%s\t%d\t%d\t%d\t%s\t%.3f\t%.3f\t%.1f\t%.1f\t%d\n", s.name.c_str(), s.width, s.height, s.frames,
+			s.output.c_str(), median.wallSeconds, median.loopSeconds, fps, median.peakRssKb / 1024.0, median.status);
+		fflush(results);
+
+		if (median.status != 0)
+		{
+			++failures;
+			printf("failed with status %d, see %s\n", median.status, log.c_str());
+		}
+		else
+			printf("%.2f s, %.1f fps, %.1f MB\n", median.wallSeconds, fps, median.peakRssKb / 1024.0);
+	}
+	fclose(results);
+
+	printf("- Results written to %s\n", resultsPath.c_str());
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,300 @@
+/*
+ * Microbenchmarks for the FluidSim operators and the gif writer.
+ * Sweeps grid sizes and thread block shapes and reports cells/s, GB/s and
+ * the fraction of the device copy bandwidth (STREAM copy) that is achieved.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <chrono>
+
+#include "../fluidSimKernel.h"
+#include "../common.h"
+#include "../gif.h"
+#include "../trafficmodel.h"
+
+using namespace FluidSim;
+
+namespace
+{
+	struct Result
+	{
+		std::string op;
+		int size;
+		int threads_x, threads_y;
+		double ms;
+		double cellsPerSecond;
+		double gbPerSecond;
+		double gflopsPerSecond;
+		double streamFraction;
+	};
+
+	std::vector<int> parseList(const std::string& s)
+	{
+		std::vector<int> values;
+		std::stringstream in(s);
+		std::string item;
+		while (std::getline(in, item, ','))
+			values.push_back(atoi(item.c_str()));
+		return values;
+	}
+
+	// measures repeated launches with CUDA events until minMs has passed
+	double timeDevice(const std::function<void()>& launch, double minMs)
+	{
+		CUevent start, stop;
+		CHECK(cuEventCreate(&start, CU_EVENT_DEFAULT));
+		CHECK(cuEventCreate(&stop, CU_EVENT_DEFAULT));
+
+		launch();
+		CHECK(cuCtxSynchronize());
+
+		int reps = 1;
+		float ms = 0.f;
+		for (;;)
+		{
+			CHECK(cuEventRecord(start, 0));
+			for (int r = 0; r < reps; ++r)
+				launch();
+			CHECK(cuEventRecord(stop, 0));
+			CHECK(cuEventSynchronize(stop));
+			CHECK(cuEventElapsedTime(&ms, start, stop));
+			if (ms >= minMs || reps >= (1 << 16))
+				break;
+			reps *= ms > 0.f ? std::max(2, static_cast<int>(minMs / ms) + 1) : 16;
+		}
+
+		cuEventDestroy(start);
+		cuEventDestroy(stop);
+		return ms / reps;
+	}
+
+	// STREAM copy: device-to-device copy of a large buffer, counting read + write
+	double measureStreamBandwidth(size_t bytes, double minMs)
+	{
+		CUdeviceptr a, b;
+		CHECK(cuMemAlloc(&a, bytes));
+		CHECK(cuMemAlloc(&b, bytes));
+		CHECK(cuMemsetD8(a, 1, bytes));
+		double ms = timeDevice([&] { CHECK(cuMemcpyDtoD(b, a, bytes)); }, minMs);
+		CHECK(cuMemFree(a));
+		CHECK(cuMemFree(b));
+		return 2.0 * bytes / (ms * 1e6);
+	}
+
+	void fillHost(Array2D::Host<>& h, int size, float amplitude)
+	{
+		for (int y = 0; y < size; ++y)
+			for (int x = 0; x < size; ++x)
+				h[y][x] = amplitude * std::sin(0.05f * x) * std::cos(0.03f * y);
+	}
+
+	void show_usage(std::string name)
+	{
+		std::cout << "Usage: " << name << " <option(s)>\n"
+			<< "Options:\n"
+			<< "\t-h,--help\t\t\tShow this help message\n"
+			<< "\t-s,--sizes\tN,N,...\t\tGrid sizes (default 64,128,...,8192)\n"
+			<< "\t-t,--threads\tXxY,XxY,...\tThread block shapes (default 8x8,16x16,32x8,32x16)\n"
+			<< "\t-o,--ops\tNAME,...\tOperators to run (default all)\n"
+			<< "\t--gif-max-size\tN\t\tLargest grid for the gif writer (default 2048)\n"
+			<< "\t--min-time\tMS\t\tMinimum measured time per case (default 50)\n"
+			<< "\t--csv\t\tPATH\t\tAlso write the results as CSV\n"
+			<< std::endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<int> sizes;
+	for (int s = 64; s <= 8192; s *= 2)
+		sizes.push_back(s);
+	std::vector<std::pair<int, int>> blocks = { { 8, 8 }, { 16, 16 }, { 32, 8 }, { 32, 16 } };
+	std::vector<std::string> ops;
+	int gifMaxSize = 2048;
+	double minMs = 50.0;
+	const char* csvPath = "";
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if ((arg == "-h") || (arg == "--help")) {
+			show_usage(argv[0]);
+			return 0;
+		}
+		else if (((arg == "-s") || (arg == "--sizes")) && i + 1 < argc) {
+			sizes = parseList(argv[++i]);
+		}
+		else if (((arg == "-t") || (arg == "--threads")) && i + 1 < argc) {
+			blocks.clear();
+			std::stringstream in(argv[++i]);
+			std::string item;
+			while (std::getline(in, item, ',')) {
+				int x = 0, y = 0;
+				if (sscanf(item.c_str(), "%dx%d", &x, &y) == 2)
+					blocks.push_back(std::make_pair(x, y));
+			}
+		}
+		else if (((arg == "-o") || (arg == "--ops")) && i + 1 < argc) {
+			std::stringstream in(argv[++i]);
+			std::string item;
+			while (std::getline(in, item, ','))
+				ops.push_back(item);
+		}
+		else if (arg == "--gif-max-size" && i + 1 < argc) {
+			gifMaxSize = atoi(argv[++i]);
+		}
+		else if (arg == "--min-time" && i + 1 < argc) {
+			minMs = atof(argv[++i]);
+		}
+		else if (arg == "--csv" && i + 1 < argc) {
+			csvPath = argv[++i];
+		}
+		else {
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	auto selected = [&](const char* name) {
+		return ops.empty() || std::find(ops.begin(), ops.end(), name) != ops.end();
+	};
+
+	cudaInfo info;
+	memset(&info, 0, sizeof(info));
+	CHECK(cuInit(0));
+	CHECK(cuDeviceGet(&info.device, 0));
+	char deviceName[100];
+	cuDeviceGetName(deviceName, 100, info.device);
+	CHECK(cuDeviceTotalMem(&info.totalGlobalMem, info.device));
+	CHECK(cuCtxCreate(&info.context, 0, info.device));
+	loadKernels(info);
+
+	double stream = measureStreamBandwidth(std::min<size_t>(info.totalGlobalMem / 8, size_t(256) << 20), minMs);
+	printf("Device: %s, %zu MB\n", deviceName, info.totalGlobalMem >> 20);
+	printf("STREAM copy bandwidth: %.1f GB/s\n\n", stream);
+	printf("%-17s %6s %7s %10s %12s %9s %9s %7s\n", "operator", "size", "block", "ms", "Mcells/s", "GB/s", "GFLOP/s", "STREAM");
+
+	// bytes and flops of a launch come from the traffic model
+	std::vector<Result> results;
+	auto report = [&](const char* name, const TrafficModel::Cost& cost, int size, int tx, int ty, double ms) {
+		double cells = double(size) * size;
+		Result r = { name, size, tx, ty, ms, cells / (ms * 1e-3), cost.bytes / (ms * 1e6), cost.flops / (ms * 1e6), 0.0 };
+		r.streamFraction = r.gbPerSecond / stream;
+		results.push_back(r);
+		printf("%-17s %6d %3dx%-3d %10.4f %12.1f %9.1f %9.1f %6.1f%%\n", name, size, tx, ty, ms,
+			r.cellsPerSecond * 1e-6, r.gbPerSecond, r.gflopsPerSecond, 100.0 * r.streamFraction);
+		fflush(stdout);
+	};
+	auto reportKernel = [&](TrafficModel::Operator op, int size, int tx, int ty, double ms) {
+		report(TrafficModel::operatorName(op), TrafficModel::launch(op, size, size), size, tx, ty, ms);
+	};
+
+	for (int size : sizes)
+	{
+		// advect needs the most arrays at once: q, qNew, u, v; plus the colour image
+		size_t needed = 6 * sizeof(float) * size_t(size) * size;
+		if (needed > info.totalGlobalMem * 0.9)
+		{
+			printf("%-17s %6d skipped, needs %zu MB of device memory\n", "all", size, needed >> 20);
+			continue;
+		}
+
+		info.width = size;
+		info.height = size;
+
+		Array2D::Host<> h(size, size, _fl);
+		fillHost(h, size, 10.f);
+		Array2D::Device* a = new Array2D::Device(size, size, _fl);
+		Array2D::Device* b = new Array2D::Device(size, size, _fl);
+		Array2D::Device* u = new Array2D::Device(size, size, _fl);
+		Array2D::Device* v = new Array2D::Device(size, size, _fl);
+		Array2D::Device* c = new Array2D::Device(size, size, _fl);
+		CHECK(cuMemcpyHtoD(a, &h, 0));
+		CHECK(cuMemcpyHtoD(b, &h, 0));
+		CHECK(cuMemcpyHtoD(u, &h, 0));
+		CHECK(cuMemcpyHtoD(v, &h, 0));
+		CHECK(cuMemcpyHtoD(c, &h, 0));
+		CUdeviceptr image;
+		CHECK(cuMemAlloc(&image, 4 * size_t(size) * size));
+
+		float dt = 0.001f, rdx = 10.f, halfrdx = 5.f;
+		for (auto& block : blocks)
+		{
+			info.threads_x = block.first;
+			info.threads_y = block.second;
+			int tx = block.first, ty = block.second;
+
+			if (selected("advect"))
+				reportKernel(TrafficModel::ADVECT, size, tx, ty, timeDevice([&] { advect(info, a, b, u, v, dt, rdx); }, minMs));
+			if (selected("jacobi"))
+				reportKernel(TrafficModel::JACOBI, size, tx, ty, timeDevice([&] { jacobi(info, a, b, c, 10000.f, 1.f / 10004.f); }, minMs));
+			if (selected("divergence"))
+				reportKernel(TrafficModel::DIVERGENCE, size, tx, ty, timeDevice([&] { divergence(info, u, v, a, halfrdx); }, minMs));
+			if (selected("subtractGradient"))
+				reportKernel(TrafficModel::SUBTRACT_GRADIENT, size, tx, ty, timeDevice([&] { subtractGradient(info, c, u, v, a, b, halfrdx); }, minMs));
+			if (selected("boundary"))
+				reportKernel(TrafficModel::BOUNDARY, size, tx, ty, timeDevice([&] { boundary(info, a, -1.f); }, minMs));
+			if (selected("addInk"))
+				reportKernel(TrafficModel::ADD_INK, size, tx, ty, timeDevice([&] { addInk(info, u, v, a, size / 2, size / 2, 0.f, 0.f, 0.f); }, minMs));
+			if (selected("convertToColor2"))
+				reportKernel(TrafficModel::CONVERT_TO_COLOR2, size, tx, ty, timeDevice([&] { convertToColor2(info, image, a, b, c); }, minMs));
+		}
+
+		if (selected("gif") && size <= gifMaxSize)
+		{
+			// the gif writer runs on the host, one frame per measurement
+			std::vector<uint8_t> rgba(4 * size_t(size) * size);
+			CHECK(cuMemcpyDtoH(rgba.data(), image, rgba.size()));
+			GifWriter writer;
+			GifBegin(&writer, "/dev/null", size, size, 4);
+			int frames = 0;
+			auto t0 = std::chrono::steady_clock::now();
+			double elapsed = 0.0;
+			do
+			{
+				// vary the frame so delta encoding has work to do
+				rgba[4 * (frames % (size * size))] ^= 0xff;
+				GifWriteFrame(&writer, rgba.data(), size, size, 4);
+				++frames;
+				elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+			} while (elapsed < minMs);
+			GifEnd(&writer);
+			// RGBA8 input, host only
+			TrafficModel::Cost cost = { 1.0, 4.0 * size * size, 0.0 };
+			report("gif", cost, size, 0, 0, elapsed / frames);
+		}
+
+		CHECK(cuMemFree(image));
+		delete a;
+		delete b;
+		delete u;
+		delete v;
+		delete c;
+	}
+
+	if (csvPath[0] != '\0')
+	{
+		FILE* f = fopen(csvPath, "w");
+		if (!f)
+		{
+			fprintf(stderr, "Error writing %s\n", csvPath);
+			return 1;
+		}
+		fprintf(f, "device,operator,size,threads_x,threads_y,ms,cells_per_s,gb_per_s,gflop_per_s,stream_gb_per_s,stream_fraction\n");
+		for (auto& r : results)
+			fprintf(f, "\"%s\",%s,%d,%d,%d,%.6f,%.6e,%.3f,%.3f,%.3f,%.4f\n", deviceName, r.op.c_str(), r.size,
+				r.threads_x, r.threads_y, r.ms, r.cellsPerSecond, r.gbPerSecond, r.gflopsPerSecond, stream, r.streamFraction);
+		fclose(f);
+	}
+
+	cuCtxDetach(info.context);
+	return 0;
+}
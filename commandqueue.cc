@@ -0,0 +1,73 @@
+#include "commandqueue.h"
+
+#include <chrono>
+
+CommandQueue::CommandQueue(size_t capacity)
+	: enqueuePosition(0)
+	, dequeuePosition(0)
+	, droppedCount(0)
+{
+	size_t size = 2;
+	while (size < capacity)
+		size *= 2;
+	cells.reset(new Cell[size]);
+	mask = size - 1;
+	for (size_t i = 0; i < size; ++i)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+}
+
+uint64_t CommandQueue::now()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+bool CommandQueue::push(Command command)
+{
+	command.submitted = now();
+
+	size_t position = enqueuePosition.load(std::memory_order_relaxed);
+	Cell* cell;
+	for (;;)
+	{
+		cell = &cells[position & mask];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t difference = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(position);
+		if (difference == 0)
+		{
+			// the cell is free for this position, try to claim it
+			if (enqueuePosition.compare_exchange_weak(position, position + 1, std::memory_order_relaxed))
+				break;
+		}
+		else if (difference < 0)
+		{
+			// the consumer has not freed this cell yet: full
+			droppedCount.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+		else
+			position = enqueuePosition.load(std::memory_order_relaxed);
+	}
+
+	cell->command = command;
+	cell->sequence.store(position + 1, std::memory_order_release);
+	return true;
+}
+
+bool CommandQueue::pop(Command& command)
+{
+	Cell* cell = &cells[dequeuePosition & mask];
+	size_t sequence = cell->sequence.load(std::memory_order_acquire);
+	// empty, or the producer of this position has not published it yet
+	if (sequence != dequeuePosition + 1)
+		return false;
+
+	command = cell->command;
+	cell->sequence.store(dequeuePosition + mask + 1, std::memory_order_release);
+	++dequeuePosition;
+	return true;
+}
+
+bool CommandQueue::empty() const
+{
+	return cells[dequeuePosition & mask].sequence.load(std::memory_order_acquire) != dequeuePosition + 1;
+}
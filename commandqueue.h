@@ -0,0 +1,66 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Bounded lock-free multi-producer single-consumer queue of user commands.
+//
+// Any thread may push(); only the simulation thread pops. Every cell carries a
+// sequence number (Vyukov's bounded queue): producers claim a position with a
+// CAS and publish the cell by advancing its sequence, so the consumer never
+// sees a half-written command. A full queue rejects the command instead of
+// blocking the producer.
+class CommandQueue
+{
+public:
+	enum Type
+	{
+		INJECT,		// ink and force at a normalized position
+		SELECT_INK,	// dye species of later injections without an explicit species
+		RESET		// clear all fields
+	};
+
+	struct Command
+	{
+		Type type;
+		float x, y;
+		float u, v;
+		float amount;
+		int ink;			// dye species, -1 for the selected one
+		uint64_t submitted;	// now() at push, set by push()
+	};
+
+	// capacity is rounded up to a power of two
+	explicit CommandQueue(size_t capacity = 4096);
+
+	// any thread; false if the queue is full
+	bool push(Command command);
+	// consumer thread only; false if empty
+	bool pop(Command& command);
+	// consumer thread only; nothing published to pop
+	bool empty() const;
+
+	unsigned long long dropped() const { return droppedCount.load(std::memory_order_relaxed); }
+
+	// steady clock in nanoseconds
+	static uint64_t now();
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		Command command;
+	};
+
+	std::unique_ptr<Cell[]> cells;
+	size_t mask;
+
+	// producers and the consumer work on separate cache lines
+	char padding0[64];
+	std::atomic<size_t> enqueuePosition;
+	char padding1[64];
+	size_t dequeuePosition;
+	std::atomic<unsigned long long> droppedCount;
+};
@@ -0,0 +1,391 @@
+#include "decomposition.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "timer.h"
+
+using namespace FluidSim;
+
+// fields exchanged at once at most
+const int exchangeFields = 2;
+// the field dumps of FluidSimulation
+const int dumpFieldCount = 4;
+const char* const dumpNames[dumpFieldCount] = { "p", "u", "v", "ink_r" };
+
+struct DecompositionShared
+{
+	pthread_barrier_t barrier;
+	// reduction slots, double-buffered
+	double values[2][Decomposition::maxRanks];
+	// followed by the halo slots (halo rows of width floats) of every rank,
+	// parity, edge and field
+};
+
+namespace
+{
+	enum Edge
+	{
+		TOP,
+		BOTTOM
+	};
+
+	float* haloSlot(DecompositionShared* shared, int width, int rank, int parity, int edge, int field)
+	{
+		size_t slot = ((size_t(rank) * 2 + parity) * 2 + edge) * exchangeFields + field;
+		return reinterpret_cast<float*>(shared + 1) + slot * Decomposition::halo * width;
+	}
+
+	std::string dumpPath(const Decomposition::Options& options, int field, int frame)
+	{
+		return std::string(options.dumpDir) + "/" + dumpNames[field] + "_" + std::to_string(frame) + ".f32";
+	}
+}
+
+bool Decomposition::run(const Options& options)
+{
+	int ranks = options.ranks;
+	if (ranks < 1 || ranks > maxRanks)
+	{
+		fprintf(stderr, "Error: --ranks must be between 1 and %d\n", maxRanks);
+		return false;
+	}
+	if (options.height / ranks < halo)
+	{
+		fprintf(stderr, "Error: %d ranks leave strips of less than %d rows\n", ranks, halo);
+		return false;
+	}
+	if (options.inputFile[0] == '\0')
+	{
+		fprintf(stderr, "Error: --ranks requires --predefined\n");
+		return false;
+	}
+
+	// the ranks write their rows in place, an older, longer dump must not
+	// keep its tail
+	for (int frame : options.dumpFrames)
+	{
+		for (int f = 0; f < dumpFieldCount; ++f)
+		{
+			std::string path = dumpPath(options, f, frame);
+			int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (file < 0)
+			{
+				fprintf(stderr, "Error creating field dump %s\n", path.c_str());
+				return false;
+			}
+			close(file);
+		}
+	}
+
+	size_t bytes = sizeof(DecompositionShared) + size_t(ranks) * 2 * 2 * exchangeFields * halo * options.width * sizeof(float);
+	void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED)
+	{
+		perror("Error mapping the halo buffers");
+		return false;
+	}
+	DecompositionShared* shared = static_cast<DecompositionShared*>(memory);
+	pthread_barrierattr_t attributes;
+	pthread_barrierattr_init(&attributes);
+	pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+	pthread_barrier_init(&shared->barrier, &attributes, ranks);
+	pthread_barrierattr_destroy(&attributes);
+
+	// the ranks initialize CUDA themselves, a context does not survive fork()
+	fflush(stdout);
+	std::vector<pid_t> pids;
+	bool ok = true;
+	for (int r = 0; r < ranks && ok; ++r)
+	{
+		pid_t pid = fork();
+		if (pid == 0)
+		{
+			{
+				Decomposition decomposition(options, shared, r);
+				decomposition.runRank();
+			}
+			fflush(stdout);
+			_exit(0);
+		}
+		if (pid < 0)
+		{
+			perror("Error starting a rank");
+			ok = false;
+		}
+		else
+			pids.push_back(pid);
+	}
+	// the started ranks would wait at the barrier for the missing ones
+	if (!ok)
+		for (pid_t pid : pids)
+			kill(pid, SIGTERM);
+
+	// a failed rank would leave the others waiting at the barrier
+	for (size_t n = 0; n < pids.size(); ++n)
+	{
+		int status = 0;
+		pid_t pid = wait(&status);
+		if (pid > 0 && WIFEXITED(status) && WEXITSTATUS(status) == 0)
+			continue;
+		if (!ok)
+			continue;
+		fprintf(stderr, "Error: a rank failed, stopping the others\n");
+		ok = false;
+		for (pid_t other : pids)
+			if (other != pid)
+				kill(other, SIGTERM);
+	}
+
+	pthread_barrier_destroy(&shared->barrier);
+	munmap(memory, bytes);
+	return ok;
+}
+
+Decomposition::Decomposition(const Options& options, DecompositionShared* shared, int rank)
+	: options(options)
+	, shared(shared)
+	, rank(rank)
+	, exchanges(0)
+	, reductions(0)
+	, waitMs(0.0)
+	, maxResidual(0.0)
+	, maxSpeed(0.0)
+	, checks(0)
+{
+	// the first height % ranks strips get one row more
+	int rowsPerRank = options.height / options.ranks;
+	int extra = options.height % options.ranks;
+	firstRow = rank * rowsPerRank + std::min(rank, extra);
+	endRow = firstRow + rowsPerRank + (rank < extra ? 1 : 0);
+	haloAbove = rank > 0 ? halo : 0;
+	haloBelow = rank < options.ranks - 1 ? halo : 0;
+
+	info.width = options.width;
+	info.height = endRow - firstRow + haloAbove + haloBelow;
+	info.members = 1;
+	info.threads = options.threads;
+	info.tracer = nullptr;
+
+	int deviceCount = 0;
+	if (cuInit(0) == CUDA_SUCCESS)
+		CHECK(cuDeviceGetCount(&deviceCount));
+	if (deviceCount == 0)
+	{
+		fprintf(stderr, "Error: no devices supporting CUDA\n");
+		exit(-1);
+	}
+	CUdevice device;
+	CHECK(cuDeviceGet(&device, rank % deviceCount));
+	CHECK(cuCtxCreate(&context, 0, device));
+	FluidSim::loadEnsembleKernels(info);
+	printf("> Rank %d: rows %d..%d on device %d\n", rank, firstRow, endRow - 1, rank % deviceCount);
+
+	if (!events.load(options.inputFile))
+		exit(-1);
+
+	size_t cells = size_t(info.width) * info.height;
+	for (CUdeviceptr& field : d_fields)
+	{
+		CHECK(cuMemAlloc(&field, cells * sizeof(float)));
+		CHECK(cuMemsetD32(field, 0, cells));
+	}
+
+	// a stencil pass makes one more halo row stale
+	stepper.setViscosities(std::vector<float>(1, viscosity), options.diffusionTolerance);
+	stepper.exchange = [this](CUdeviceptr* buffers, int count) { exchange(buffers, count); };
+	stepper.exchangeSweeps = halo - 1;
+}
+
+Decomposition::~Decomposition()
+{
+	for (CUdeviceptr field : d_fields)
+		cuMemFree(field);
+	stepper.release();
+	cuModuleUnload(info.module);
+	cuCtxDestroy(context);
+}
+
+void Decomposition::runRank()
+{
+	Timer timer;
+	timer.reset();
+	timer.tic();
+
+	int end = events.endFrame();
+	for (int frame = 0; frame < end; ++frame)
+	{
+		update(frame);
+		if (std::find(options.dumpFrames.begin(), options.dumpFrames.end(), frame) != options.dumpFrames.end())
+			dumpFields(frame);
+	}
+
+	cuCtxSynchronize();
+	timer.toc();
+	double ms = reduceMax(static_cast<double>(timer.getTotalTime()));
+	double meanWait = reduceSum(waitMs) / options.ranks;
+	double maxWait = reduceMax(waitMs);
+	if (rank != 0)
+		return;
+
+	int rowsPerRank = options.height / options.ranks;
+	printf("- Decomposition: %d ranks with %d..%d rows of %d, %d frames in %.0f ms\n",
+		options.ranks, rowsPerRank, rowsPerRank + (options.height % options.ranks ? 1 : 0), options.width, end, ms);
+	printf("- Halo exchanges: %llu of %d rows, Jacobi sweeps exchange every %d; barrier wait %.0f ms mean, %.0f ms max (%.0f%%)\n",
+		exchanges, halo, halo - 1, meanWait, maxWait, 100.0 * maxWait / std::max(ms, 1.0));
+	printf("- Global reductions: pressure residual <= %.2e of the right-hand side, max |u| + |v| %.3g (%d checks)\n",
+		maxResidual, maxSpeed, checks);
+}
+
+// the script's events at global positions, checked every 100 frames and in the last one
+void Decomposition::update(int frame)
+{
+	events.active(frame, activeEvents);
+	for (uint32_t id : activeEvents)
+		stepper.addInjection(events[id], frame, 0, options.width, options.height, firstRow - haloAbove);
+
+	bool checkDue = frame % 100 == 0 || frame == events.endFrame() - 1;
+	stepper.pressureSolved = checkDue ? [this]() { checkResidual(); } : std::function<void()>();
+	stepper.frame(info, d_fields);
+	if (checkDue)
+		checkSpeed();
+}
+
+void Decomposition::exchange(CUdeviceptr* fields, int count)
+{
+	int parity = exchanges++ & 1;
+	int width = info.width;
+	size_t rowBytes = width * sizeof(float);
+	size_t bytes = halo * rowBytes;
+	int ownedRows = endRow - firstRow;
+
+	// the owned rows next to each neighbour, then the neighbours' into the halo
+	for (int k = 0; k < count; ++k)
+	{
+		if (haloAbove)
+			CHECK(cuMemcpyDtoH(haloSlot(shared, width, rank, parity, TOP, k), fields[k] + haloAbove * rowBytes, bytes));
+		if (haloBelow)
+			CHECK(cuMemcpyDtoH(haloSlot(shared, width, rank, parity, BOTTOM, k), fields[k] + (haloAbove + ownedRows - halo) * rowBytes, bytes));
+	}
+	barrier();
+	for (int k = 0; k < count; ++k)
+	{
+		if (haloAbove)
+			CHECK(cuMemcpyHtoD(fields[k], haloSlot(shared, width, rank - 1, parity, BOTTOM, k), bytes));
+		if (haloBelow)
+			CHECK(cuMemcpyHtoD(fields[k] + (haloAbove + ownedRows) * rowBytes, haloSlot(shared, width, rank + 1, parity, TOP, k), bytes));
+	}
+}
+
+// a slot is written again two exchanges or reductions later, after every rank
+// has passed the barrier of the one in between and so has read it
+void Decomposition::barrier()
+{
+	auto start = std::chrono::steady_clock::now();
+	pthread_barrier_wait(&shared->barrier);
+	waitMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+double Decomposition::reduceSum(double value)
+{
+	double* values = shared->values[reductions++ & 1];
+	values[rank] = value;
+	barrier();
+	double sum = 0.0;
+	for (int r = 0; r < options.ranks; ++r)
+		sum += values[r];
+	return sum;
+}
+
+double Decomposition::reduceMax(double value)
+{
+	double* values = shared->values[reductions++ & 1];
+	values[rank] = value;
+	barrier();
+	return *std::max_element(values, values + options.ranks);
+}
+
+void Decomposition::checkResidual()
+{
+	// p and the divergence of the owned rows and one halo row on each side
+	int width = info.width;
+	int first = haloAbove > 0 ? haloAbove - 1 : 0;
+	int end = std::min(info.height, haloAbove + endRow - firstRow + 1);
+	size_t count = size_t(end - first) * width;
+	rows.resize(2 * count);
+	CHECK(cuMemcpyDtoH(rows.data(), d_fields[EnsembleStep::PRESSURE] + first * width * sizeof(float), count * sizeof(float)));
+	CHECK(cuMemcpyDtoH(rows.data() + count, d_fields[EnsembleStep::TEMP1] + first * width * sizeof(float), count * sizeof(float)));
+	const float* p = rows.data();
+	const float* b = rows.data() + count;
+
+	// as the residual kernel, over the interior of the whole grid
+	float alpha = -dx * dx;
+	float rbeta = 0.25f;
+	double sums[2] = { 0.0, 0.0 };
+	for (int j = haloAbove; j < haloAbove + endRow - firstRow; ++j)
+	{
+		int row = firstRow + j - haloAbove;
+		if (row == 0 || row == options.height - 1)
+			continue;
+		for (int i = 1; i < width - 1; ++i)
+		{
+			size_t c = i + size_t(width) * (j - first);
+			float rhs = rbeta * alpha * b[c];
+			float r = rhs + rbeta * (p[c + 1] + p[c - 1] + p[c + width] + p[c - width]) - p[c];
+			sums[0] += r * r;
+			sums[1] += rhs * rhs;
+		}
+	}
+	double residual = reduceSum(sums[0]);
+	double rhs = reduceSum(sums[1]);
+	if (rhs > 0.0)
+		maxResidual = std::max(maxResidual, std::sqrt(residual / rhs));
+	++checks;
+}
+
+void Decomposition::checkSpeed()
+{
+	int width = info.width;
+	size_t count = size_t(endRow - firstRow) * width;
+	rows.resize(2 * count);
+	CHECK(cuMemcpyDtoH(rows.data(), d_fields[EnsembleStep::VELOCITY_U] + haloAbove * width * sizeof(float), count * sizeof(float)));
+	CHECK(cuMemcpyDtoH(rows.data() + count, d_fields[EnsembleStep::VELOCITY_V] + haloAbove * width * sizeof(float), count * sizeof(float)));
+	double speed = 0.0;
+	for (size_t c = 0; c < count; ++c)
+		speed = std::max(speed, static_cast<double>(std::fabs(rows[c]) + std::fabs(rows[count + c])));
+	maxSpeed = std::max(maxSpeed, reduceMax(speed));
+}
+
+void Decomposition::dumpFields(int frame)
+{
+	// every rank writes its rows of the same files as FluidSimulation, run() truncated them
+	int width = info.width;
+	size_t count = size_t(endRow - firstRow) * width;
+	rows.resize(count);
+	for (int f = 0; f < dumpFieldCount; ++f)
+	{
+		CHECK(cuMemcpyDtoH(rows.data(), d_fields[f] + haloAbove * width * sizeof(float), count * sizeof(float)));
+
+		// raw float32, row-major, width*height values
+		std::string path = dumpPath(options, f, frame);
+		int file = open(path.c_str(), O_WRONLY);
+		ssize_t bytes = static_cast<ssize_t>(count * sizeof(float));
+		if (file < 0 || pwrite(file, rows.data(), bytes, off_t(firstRow) * width * sizeof(float)) != bytes)
+		{
+			fprintf(stderr, "Error writing field dump %s\n", path.c_str());
+			exit(-1);
+		}
+		close(file);
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "fluidSimKernel.h"
+#include "eventscript.h"
+#include "ensemblestep.h"
+
+struct DecompositionShared;
+
+// One stable-fluids simulation split into horizontal strips, each owned by a
+// separate local process (rank) with its own context, on device rank % devices.
+//
+// A strip holds its rows and halo rows copied from its neighbours above and
+// below; it is simulated with the ensemble kernels as an ensemble of one
+// member, the halo rows included. The halos are exchanged through an anonymous
+// shared mapping, double-buffered, with one process-shared barrier per
+// exchange. A stencil pass makes one more halo row stale, so the Jacobi sweeps
+// exchange only every halo - 1 sweeps, and advection may reach halo - 1 rows
+// across a strip edge (|v| * dt / dx cells, flow faster than that is cut off
+// at the edge). Reductions sum or max one value per rank in rank order, so
+// every rank gets the same, deterministic result.
+class Decomposition
+{
+public:
+	struct Options
+	{
+		int width = 512;
+		int height = 512;
+		int ranks = 2;
+		// threads per 1D block
+		int threads = 256;
+		const char* inputFile = "";
+		float diffusionTolerance = 1e-4f;
+		// p, u, v and ink are written to dumpDir after each of these frames,
+		// every rank writes its rows
+		std::vector<int> dumpFrames;
+		const char* dumpDir = "";
+	};
+
+	// halo rows on each side of a strip
+	static const int halo = 8;
+	static const int maxRanks = 64;
+
+	// forks the ranks, waits for them and returns false if one failed
+	static bool run(const Options& options);
+
+private:
+	Decomposition(const Options& options, DecompositionShared* shared, int rank);
+	~Decomposition();
+
+	void runRank();
+	void update(int frame);
+	// refreshes the halo rows of the fields from the neighbours
+	void exchange(CUdeviceptr* fields, int count);
+	void barrier();
+	double reduceSum(double value);
+	double reduceMax(double value);
+	// relative residual of the pressure solve and max(|u| + |v|), over all ranks
+	void checkResidual();
+	void checkSpeed();
+	void dumpFields(int frame);
+
+	const Options& options;
+	DecompositionShared* shared;
+	int rank;
+	// global rows [firstRow, endRow) are strip rows [haloAbove, haloAbove + endRow - firstRow)
+	int firstRow, endRow;
+	int haloAbove, haloBelow;
+
+	FluidSim::ensembleInfo info;
+	CUcontext context;
+	CUdeviceptr d_fields[EnsembleStep::FIELD_COUNT];
+	EnsembleStep stepper;
+
+	EventScript events;
+	std::vector<uint32_t> activeEvents;
+
+	unsigned long long exchanges;
+	unsigned long long reductions;
+	double waitMs;
+	double maxResidual;
+	double maxSpeed;
+	int checks;
+	std::vector<float> rows;
+};
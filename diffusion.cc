@@ -0,0 +1,57 @@
+#include "diffusion.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace Diffusion
+{
+	const char* methodName(int method)
+	{
+		static const char* names[METHOD_COUNT] = { "skip", "explicit", "sweeps", "full" };
+		return method >= 0 && method < METHOD_COUNT ? names[method] : "?";
+	}
+
+	double contraction(double alpha)
+	{
+		return 4.0 / (4.0 + alpha);
+	}
+
+	Plan choose(double alpha, double tolerance, int fewSweeps)
+	{
+		double d = 1.0 / alpha;
+		double q = contraction(alpha);
+		Plan plan;
+
+		if (tolerance <= 0.0)
+		{
+			plan.method = SWEEPS;
+			plan.sweeps = fewSweeps;
+			plan.bound = 8.0 * d * std::pow(q, fewSweeps);
+			return plan;
+		}
+
+		if (8.0 * d <= tolerance)
+		{
+			plan.method = SKIP;
+			plan.sweeps = 0;
+			plan.bound = 8.0 * d;
+			return plan;
+		}
+		// explicit steps are stable up to d = 1/4, which this implies
+		if (64.0 * d * d <= tolerance)
+		{
+			plan.method = EXPLICIT;
+			plan.sweeps = 0;
+			plan.bound = 64.0 * d * d;
+			return plan;
+		}
+
+		// smallest k with 8d q^k <= tolerance
+		int k = static_cast<int>(std::ceil(std::log(tolerance / (8.0 * d)) / std::log(q)));
+		k = std::min(std::max(k, 1), maxSweeps);
+		plan.method = k <= fewSweeps ? SWEEPS : FULL;
+		plan.sweeps = k;
+		plan.bound = 8.0 * d * std::pow(q, k);
+		return plan;
+	}
+}
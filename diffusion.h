@@ -0,0 +1,42 @@
+#pragma once
+
+// Choice of the viscous diffusion solver from the diffusion number.
+//
+// One implicit step solves (1 + 4d) x - d (sum of the 4 neighbours of x) = b
+// with d = viscosity * dt / dx^2 = 1 / alpha. Jacobi sweeps started at x = b
+// contract the error by q = 4d / (1 + 4d) each, and |x* - b| <= 8d |b| (the
+// Laplacian stencil is bounded by 8), so after k sweeps
+//     |x_k - x*| <= 8d q^k |b|
+// in the max and the RMS norm. One explicit step b + d L b differs from x* by
+// d L (b - x*), i.e. at most 64 d^2 |b|. The cheapest method whose bound is
+// within the tolerance (relative to |b|) is used.
+namespace Diffusion
+{
+	enum Method
+	{
+		SKIP,		// x = b
+		EXPLICIT,	// one stencil pass
+		SWEEPS,		// a few Jacobi sweeps
+		FULL,		// Jacobi sweeps beyond the usual count
+		METHOD_COUNT
+	};
+
+	const char* methodName(int method);
+
+	struct Plan
+	{
+		Method method;
+		int sweeps;		// Jacobi sweeps, 0 for SKIP and EXPLICIT
+		double bound;	// guaranteed error relative to |b|
+	};
+
+	// maximum sweeps of a full solve
+	const int maxSweeps = 1000;
+
+	// fewSweeps is the most a SWEEPS plan uses; tolerance <= 0 always plans
+	// fewSweeps sweeps, the fixed solve
+	Plan choose(double alpha, double tolerance, int fewSweeps);
+
+	// Jacobi contraction factor 4 / (4 + alpha)
+	double contraction(double alpha);
+}
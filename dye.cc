@@ -0,0 +1,86 @@
+#include "dye.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <sstream>
+
+namespace Dye
+{
+	const char* layoutName(int layout)
+	{
+		static const char* names[LAYOUT_COUNT] = { "interleaved", "aosoa" };
+		return layout >= 0 && layout < LAYOUT_COUNT ? names[layout] : "?";
+	}
+
+	bool parseLayout(const std::string& name, Layout& layout)
+	{
+		for (int l = 0; l < LAYOUT_COUNT; ++l)
+			if (name == layoutName(l))
+			{
+				layout = static_cast<Layout>(l);
+				return true;
+			}
+		return false;
+	}
+
+	size_t size(Layout layout, int species, size_t cells)
+	{
+		if (layout == AOSOA)
+			cells = (cells + lanes - 1) / lanes * lanes;
+		return cells * species;
+	}
+
+	std::string name(int s)
+	{
+		static const char* names[3] = { "ink_r", "ink_g", "ink_b" };
+		return s >= 0 && s < 3 ? names[s] : "ink_" + std::to_string(s);
+	}
+
+	std::vector<float> defaultPalette(int species)
+	{
+		std::vector<float> palette(3 * species, 0.f);
+		for (int s = 0; s < species; ++s)
+		{
+			if (s < 3)
+			{
+				palette[3 * s + s] = 1.f;
+				continue;
+			}
+			// fully saturated hue, between the primaries
+			float hue = std::fmod((s - 3) * 0.618034f + 1.f / 12.f, 1.f) * 6.f;
+			int sector = static_cast<int>(hue);
+			float f = hue - sector;
+			float rgb[6][3] = { { 1, f, 0 }, { 1 - f, 1, 0 }, { 0, 1, f }, { 0, 1 - f, 1 }, { f, 0, 1 }, { 1, 0, 1 - f } };
+			for (int c = 0; c < 3; ++c)
+				palette[3 * s + c] = rgb[sector % 6][c];
+		}
+		return palette;
+	}
+
+	bool parsePalette(const std::string& text, int species, std::vector<float>& palette)
+	{
+		palette = defaultPalette(species);
+		std::stringstream in(text);
+		std::string item;
+		for (int s = 0; std::getline(in, item, ','); ++s)
+		{
+			char* end = nullptr;
+			unsigned long rgb = strtoul(item.c_str(), &end, 16);
+			if (item.size() != 6 || *end != '\0')
+			{
+				fprintf(stderr, "Error: palette entry \"%s\" is not RRGGBB\n", item.c_str());
+				return false;
+			}
+			if (s >= species)
+			{
+				fprintf(stderr, "Error: palette has more than %d colours\n", species);
+				return false;
+			}
+			palette[3 * s] = ((rgb >> 16) & 0xff) / 255.f;
+			palette[3 * s + 1] = ((rgb >> 8) & 0xff) / 255.f;
+			palette[3 * s + 2] = (rgb & 0xff) / 255.f;
+		}
+		return true;
+	}
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+// Storage of the passive dye species in one multi-channel buffer.
+//
+// All species of a cell are advected, injected and coloured by the same
+// thread, so they are stored next to each other:
+//   INTERLEAVED  cell-major, the species of a cell are contiguous
+//   AOSOA        blocks of 32 cells (one warp), species-major inside a block,
+//                so a warp reads and writes each species with one coalesced
+//                128-byte access; the buffer is padded to whole blocks
+// fluidSimKernel.cu computes the same index.
+namespace Dye
+{
+	enum Layout
+	{
+		INTERLEAVED,
+		AOSOA,
+		LAYOUT_COUNT
+	};
+
+	// cells per AoSoA block
+	const int lanes = 32;
+
+	const char* layoutName(int layout);
+	// "interleaved" or "aosoa", false otherwise
+	bool parseLayout(const std::string& name, Layout& layout);
+
+	inline size_t index(Layout layout, int species, size_t cell, int s)
+	{
+		if (layout == AOSOA)
+			return ((cell / lanes) * species + s) * lanes + cell % lanes;
+		return cell * species + s;
+	}
+
+	// floats of a buffer with species values for each of cells
+	size_t size(Layout layout, int species, size_t cells);
+
+	// "ink_r", "ink_g", "ink_b" for the first three species, then "ink_<s>"
+	std::string name(int s);
+
+	// weights of each species for red, green and blue (3 floats per species),
+	// colour = min(255, sum of dye * weight); red, green and blue for the first
+	// three species, then evenly spaced hues
+	std::vector<float> defaultPalette(int species);
+	// comma-separated RRGGBB hex colours, one per species; missing entries are
+	// taken from the default palette
+	bool parsePalette(const std::string& text, int species, std::vector<float>& palette);
+}
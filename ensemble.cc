@@ -0,0 +1,320 @@
+#include "ensemble.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+
+#include "common.h"
+#include "timer.h"
+
+bool Ensemble::loadManifest(const std::string& path, Manifest& manifest)
+{
+	std::ifstream in(path.c_str());
+	if (!in)
+	{
+		fprintf(stderr, "Error opening ensemble %s\n", path.c_str());
+		return false;
+	}
+
+	size_t slash = path.rfind('/');
+	std::string directory = slash == std::string::npos ? "." : path.substr(0, slash);
+	manifest.trunk.viscosity = FluidSim::viscosity;
+	std::string line;
+	int lineNumber = 0;
+	while (std::getline(in, line))
+	{
+		++lineNumber;
+		std::istringstream fields(line);
+		Member member;
+		if (!(fields >> member.script) || member.script[0] == '#')
+			continue;
+
+		bool ok = true;
+		bool isFork = member.script == "fork";
+		if (isFork)
+			ok = manifest.trunk.script.empty() && static_cast<bool>(fields >> member.script >> manifest.forkFrame) && manifest.forkFrame >= 0;
+		if (!(fields >> member.viscosity))
+			member.viscosity = FluidSim::viscosity;
+		if (!ok || member.viscosity <= 0.f)
+		{
+			fprintf(stderr, "Error in ensemble %s, line %d: %s\n", path.c_str(), lineNumber, line.c_str());
+			return false;
+		}
+		if (member.script[0] != '/')
+			member.script = directory + "/" + member.script;
+		if (isFork)
+			manifest.trunk = member;
+		else
+			manifest.members.push_back(member);
+	}
+	if (manifest.members.empty())
+	{
+		fprintf(stderr, "Error: ensemble %s has no members\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+Ensemble::Ensemble(const Options& options, const Manifest& manifest)
+	: d_map(0)
+	, diffusionTolerance(options.diffusionTolerance)
+	, memberLane(manifest.members.size(), -1)
+	, memberOptions(manifest.members)
+	, trunkOptions(manifest.trunk)
+	, forkFrame(manifest.forkFrame)
+	, frameIndex(0)
+	, endFrame(0)
+	, laneFrames(0)
+	, peakLanes(0)
+	, dumpFrames(options.dumpFrames)
+	, dumpDir(options.dumpDir)
+{
+	info.width = options.width;
+	info.height = options.height;
+	info.members = 0;
+	info.threads = options.threads;
+	info.tracer = nullptr;
+	for (int f = 0; f < EnsembleStep::FIELD_COUNT; ++f)
+		d_fields[f] = 0;
+	initCUDA();
+
+	for (const Member& member : memberOptions)
+	{
+		scripts.emplace_back(new EventScript());
+		if (!scripts.back()->load(member.script.c_str()))
+			exit(-1);
+		endFrame = std::max(endFrame, forkFrame + scripts.back()->endFrame());
+	}
+	if (!trunkOptions.script.empty())
+	{
+		trunk.reset(new EventScript());
+		if (!trunk->load(trunkOptions.script.c_str()))
+			exit(-1);
+	}
+
+	// everything starts as the trunk, in one lane
+	relayout(std::vector<int>(1, 0), std::vector<int>(1, -1));
+}
+
+Ensemble::~Ensemble()
+{
+	for (int f = 0; f < EnsembleStep::FIELD_COUNT; ++f)
+		cuMemFree(d_fields[f]);
+	cuMemFree(d_map);
+	stepper.release();
+	cuModuleUnload(info.module);
+	cuCtxDestroy(context);
+}
+
+float Ensemble::viscosityOf(int owner) const
+{
+	return owner < 0 ? trunkOptions.viscosity : memberOptions[owner].viscosity;
+}
+
+int Ensemble::laneOf(int member) const
+{
+	if (memberLane[member] >= 0)
+		return memberLane[member];
+	return static_cast<int>(std::find(laneOwner.begin(), laneOwner.end(), -1) - laneOwner.begin());
+}
+
+void Ensemble::fork(int frame)
+{
+	if (frame < forkFrame)
+		return;
+
+	std::vector<int> diverging;
+	bool shared = false;
+	for (int m = 0; m < members(); ++m)
+	{
+		if (memberLane[m] >= 0)
+			continue;
+		scripts[m]->active(frame - forkFrame, activeEvents);
+		if (!activeEvents.empty() || memberOptions[m].viscosity != trunkOptions.viscosity)
+			diverging.push_back(m);
+		else
+			shared = true;
+	}
+	if (diverging.empty())
+		return;
+
+	// the trunk's lane is kept while members still share it
+	std::vector<int> map, owners;
+	int trunkLane = -1;
+	for (int l = 0; l < info.members; ++l)
+	{
+		if (laneOwner[l] < 0)
+			trunkLane = l;
+		if (laneOwner[l] >= 0 || shared)
+		{
+			map.push_back(l);
+			owners.push_back(laneOwner[l]);
+		}
+	}
+	for (int m : diverging)
+	{
+		map.push_back(trunkLane);
+		owners.push_back(m);
+	}
+	relayout(map, owners);
+}
+
+void Ensemble::relayout(const std::vector<int>& map, const std::vector<int>& owners)
+{
+	int srcLanes = info.members;
+	int lanes = static_cast<int>(map.size());
+	size_t cells = size_t(info.width) * info.height * lanes;
+
+	// the temporaries are rewritten by every phase, they are only resized
+	CUdeviceptr& d_temp1 = d_fields[EnsembleStep::TEMP1];
+	CUdeviceptr& d_temp2 = d_fields[EnsembleStep::TEMP2];
+	if (d_temp1)
+	{
+		CHECK(cuMemFree(d_temp1));
+		CHECK(cuMemFree(d_temp2));
+		CHECK(cuMemFree(d_map));
+	}
+	CHECK(cuMemAlloc(&d_map, lanes * sizeof(int)));
+	CHECK(cuMemcpyHtoD(d_map, map.data(), lanes * sizeof(int)));
+	info.members = lanes;
+	for (int f = 0; f < FIELD_COUNT; ++f)
+	{
+		CUdeviceptr field;
+		CHECK(cuMemAlloc(&field, cells * sizeof(float)));
+		if (srcLanes == 0)
+			CHECK(cuMemsetD32(field, 0, cells));
+		else
+		{
+			FluidSim::ensembleRelayout(info, d_fields[f], field, srcLanes, d_map);
+			CHECK(cuMemFree(d_fields[f]));
+		}
+		d_fields[f] = field;
+	}
+	CHECK(cuMemAlloc(&d_temp1, cells * sizeof(float)));
+	CHECK(cuMemAlloc(&d_temp2, cells * sizeof(float)));
+
+	laneOwner = owners;
+	for (int l = 0; l < lanes; ++l)
+		if (owners[l] >= 0)
+			memberLane[owners[l]] = l;
+	peakLanes = std::max(peakLanes, lanes);
+
+	// per-lane implicit diffusion
+	std::vector<float> viscosities(lanes);
+	for (int l = 0; l < lanes; ++l)
+		viscosities[l] = viscosityOf(owners[l]);
+	stepper.setViscosities(viscosities, diffusionTolerance);
+}
+
+void Ensemble::initCUDA()
+{
+	int deviceCount = 0;
+	if (cuInit(0) == CUDA_SUCCESS)
+		CHECK(cuDeviceGetCount(&deviceCount));
+	if (deviceCount == 0)
+	{
+		fprintf(stderr, "Error: no devices supporting CUDA\n");
+		exit(-1);
+	}
+
+	CHECK(cuDeviceGet(&device, 0));
+	char name[100];
+	cuDeviceGetName(name, 100, device);
+	printf("> Using device 0: %s\n", name);
+
+	CHECK(cuCtxCreate(&context, 0, device));
+	FluidSim::loadEnsembleKernels(info);
+}
+
+void Ensemble::run()
+{
+	Timer timer;
+	timer.reset();
+	timer.tic();
+
+	while (frameIndex < std::max(endFrame, forkFrame))
+		step();
+
+	cuCtxSynchronize();
+	timer.toc();
+	long long ms = timer.getTotalTime();
+	printf("- Ensemble of %d members (%dx%d): %d frames in %lld ms, %.1f member-frames/s\n",
+		members(), info.width, info.height, frameIndex, ms, 1000.0 * members() * frameIndex / std::max(ms, 1ll));
+	// separate runs would each simulate every frame, the spin-up included
+	printf("- Copy-on-write: %llu lane-frames instead of %llu (%.0f%%), up to %d lanes, fork after frame %d\n",
+		laneFrames, (unsigned long long)members() * frameIndex, 100.0 * laneFrames / std::max(members() * frameIndex, 1), peakLanes, forkFrame);
+	printf("- Diffusion: %d Jacobi sweeps per step, pressure: %d sweeps\n", stepper.diffusionSweeps(), stepper.pressureSweeps());
+}
+
+void Ensemble::step()
+{
+	fork(frameIndex);
+	inject(frameIndex);
+	stepper.frame(info, d_fields);
+	laneFrames += info.members;
+	if (std::find(dumpFrames.begin(), dumpFrames.end(), frameIndex) != dumpFrames.end())
+		dumpFields(frameIndex);
+	++frameIndex;
+}
+
+// the trunk follows its script up to the fork and has no events after it
+void Ensemble::inject(int frame)
+{
+	for (int l = 0; l < info.members; ++l)
+	{
+		int owner = laneOwner[l];
+		const EventScript* script = owner >= 0 ? scripts[owner].get() : frame < forkFrame ? trunk.get() : nullptr;
+		if (!script)
+			continue;
+		int local = owner >= 0 ? frame - forkFrame : frame;
+		script->active(local, activeEvents);
+		for (uint32_t id : activeEvents)
+			stepper.addInjection((*script)[id], local, l, info.width, info.height);
+	}
+}
+
+void Ensemble::read(Field field, int member, std::vector<float>& data)
+{
+	size_t cells = size_t(info.width) * info.height;
+	host.resize(cells * info.members);
+	CHECK(cuMemcpyDtoH(host.data(), d_fields[field], host.size() * sizeof(float)));
+	int lane = laneOf(member);
+	data.resize(cells);
+	for (size_t c = 0; c < cells; ++c)
+		data[c] = host[c * info.members + lane];
+}
+
+const char* Ensemble::fieldName(Field field)
+{
+	static const char* names[FIELD_COUNT] = { "p", "u", "v", "ink" };
+	return field >= 0 && field < FIELD_COUNT ? names[field] : "?";
+}
+
+void Ensemble::dumpFields(int frame)
+{
+	size_t cells = size_t(info.width) * info.height;
+	std::vector<float> data(cells);
+	for (int f = 0; f < FIELD_COUNT; ++f)
+	{
+		host.resize(cells * info.members);
+		CHECK(cuMemcpyDtoH(host.data(), d_fields[f], host.size() * sizeof(float)));
+		for (int m = 0; m < members(); ++m)
+		{
+			int lane = laneOf(m);
+			for (size_t c = 0; c < cells; ++c)
+				data[c] = host[c * info.members + lane];
+
+			// raw float32, row-major, width*height values
+			std::string path = dumpDir + "/m" + std::to_string(m) + "_" + fieldName(static_cast<Field>(f)) + "_" + std::to_string(frame) + ".f32";
+			FILE* file = fopen(path.c_str(), "wb");
+			if (!file || fwrite(data.data(), sizeof(float), cells, file) != cells)
+			{
+				fprintf(stderr, "Error writing field dump %s\n", path.c_str());
+				exit(-1);
+			}
+			fclose(file);
+		}
+	}
+}
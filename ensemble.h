@@ -0,0 +1,130 @@
+#pragma once
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "fluidSimKernel.h"
+#include "eventscript.h"
+#include "ensemblestep.h"
+
+// Many independent stable-fluids simulations advanced together, e.g. for
+// parameter sweeps.
+//
+// The members share the grid size and the time step; each has its own
+// viscosity and event script. Every field of all members is one buffer,
+// lane-interleaved (member m of cell c at c * members + m), so each phase of a
+// frame is a single launch over cells x members instead of one small launch
+// per simulation, and a warp reads the same stencil point of consecutive
+// members with one coalesced access. Fields are p, u, v and one ink species;
+// the members run without images or streams, results are read back or dumped.
+//
+// Members are branches of a trunk: the state after the trunk script's spin-up
+// frames (or the empty state). A member shares the trunk's lane copy-on-write
+// until it diverges, at its first event or at once if its viscosity differs;
+// then the trunk's lane is copied into a lane of its own. The trunk is only
+// simulated while members still share it, so the spin-up runs once and
+// members that have not diverged cost neither memory nor compute.
+class Ensemble
+{
+public:
+	// the first fields of EnsembleStep
+	enum Field
+	{
+		PRESSURE = EnsembleStep::PRESSURE,
+		VELOCITY_U = EnsembleStep::VELOCITY_U,
+		VELOCITY_V = EnsembleStep::VELOCITY_V,
+		INK = EnsembleStep::INK,
+		FIELD_COUNT
+	};
+
+	struct Member
+	{
+		std::string script;
+		float viscosity;
+	};
+
+	struct Manifest
+	{
+		std::vector<Member> members;
+		// frames of the trunk script before the members fork; member scripts
+		// count frames from the fork
+		Member trunk;
+		int forkFrame = 0;
+	};
+
+	struct Options
+	{
+		int width = 256;
+		int height = 256;
+		// threads per 1D block
+		int threads = 256;
+		// as FluidSimulation::Options::diffusionTolerance, planned for the lane
+		// with the largest viscosity and applied to all
+		float diffusionTolerance = 1e-4f;
+		// every field of every member is written to dumpDir after each of these frames
+		std::vector<int> dumpFrames;
+		const char* dumpDir = "";
+	};
+
+	// one member per line, "<script> [viscosity]", and at most one
+	// "fork <script> <frames> [viscosity]" line for the trunk; '#' starts a
+	// comment, scripts are relative to the manifest, viscosities default to 0.001
+	static bool loadManifest(const std::string& path, Manifest& manifest);
+
+	Ensemble(const Options& options, const Manifest& manifest);
+	~Ensemble();
+
+	// steps until the last script ends and prints the throughput
+	void run();
+	void step();
+	int frame() const { return frameIndex; }
+	int members() const { return static_cast<int>(memberLane.size()); }
+
+	// width x height floats of one member, row-major
+	void read(Field field, int member, std::vector<float>& data);
+	static const char* fieldName(Field field);
+
+private:
+	void initCUDA();
+	// members that diverge in this frame get their own lane
+	void fork(int frame);
+	// lane l of the new layout is lane map[l] of the current one
+	void relayout(const std::vector<int>& map, const std::vector<int>& owners);
+	// queues the active events of all lanes
+	void inject(int frame);
+	void dumpFields(int frame);
+
+	float viscosityOf(int owner) const;
+	int laneOf(int member) const;
+
+	FluidSim::ensembleInfo info;
+	CUdevice device;
+	CUcontext context;
+
+	// the fields and the temporaries
+	CUdeviceptr d_fields[EnsembleStep::FIELD_COUNT];
+	CUdeviceptr d_map;
+	EnsembleStep stepper;
+	float diffusionTolerance;
+
+	// member of each lane, -1 for the trunk; lane of each member, -1 while it
+	// shares the trunk
+	std::vector<int> laneOwner;
+	std::vector<int> memberLane;
+	std::vector<Member> memberOptions;
+	std::vector<std::unique_ptr<EventScript>> scripts;
+	Member trunkOptions;
+	std::unique_ptr<EventScript> trunk;
+	int forkFrame;
+
+	std::vector<uint32_t> activeEvents;
+	std::vector<float> host;
+	int frameIndex;
+	int endFrame;
+	unsigned long long laneFrames;
+	int peakLanes;
+
+	std::vector<int> dumpFrames;
+	std::string dumpDir;
+};
@@ -0,0 +1,182 @@
+#include "ensemblestep.h"
+
+#include <algorithm>
+
+#include "common.h"
+#include "diffusion.h"
+
+using namespace FluidSim;
+
+EnsembleStep::EnsembleStep()
+	: exchangeSweeps(0)
+	, members(0)
+	, diffusion(0)
+	, pressure(35)
+	, d_alphaD(0)
+	, d_rbetaD(0)
+	, d_alphaP(0)
+	, d_rbetaP(0)
+	, d_injections(0)
+	, injectionCapacity(0)
+{
+}
+
+void EnsembleStep::release()
+{
+	CUdeviceptr* buffers[5] = { &d_alphaD, &d_rbetaD, &d_alphaP, &d_rbetaP, &d_injections };
+	for (CUdeviceptr* buffer : buffers)
+	{
+		if (*buffer)
+			cuMemFree(*buffer);
+		*buffer = 0;
+	}
+	members = 0;
+	injectionCapacity = 0;
+}
+
+void EnsembleStep::setViscosities(const std::vector<float>& viscosities, float diffusionTolerance)
+{
+	int count = static_cast<int>(viscosities.size());
+	std::vector<float> alphaD(count), rbetaD(count);
+	diffusion = 0;
+	for (int m = 0; m < count; ++m)
+	{
+		alphaD[m] = dx * dx / (viscosities[m] * frameTime);
+		rbetaD[m] = 1.f / (4.f + alphaD[m]);
+		// at least one sweep unless skipped
+		Diffusion::Plan plan = Diffusion::choose(alphaD[m], diffusionTolerance, 35);
+		diffusion = std::max(diffusion, plan.method == Diffusion::SKIP ? 0 : std::max(plan.sweeps, 1));
+	}
+	std::vector<float> alphaP(count, -dx * dx), rbetaP(count, 0.25f);
+
+	CUdeviceptr* coefficients[4] = { &d_alphaD, &d_rbetaD, &d_alphaP, &d_rbetaP };
+	const std::vector<float>* values[4] = { &alphaD, &rbetaD, &alphaP, &rbetaP };
+	for (int k = 0; k < 4; ++k)
+	{
+		if (count != members)
+		{
+			if (*coefficients[k])
+				CHECK(cuMemFree(*coefficients[k]));
+			CHECK(cuMemAlloc(coefficients[k], count * sizeof(float)));
+		}
+		CHECK(cuMemcpyHtoD(*coefficients[k], values[k]->data(), count * sizeof(float)));
+	}
+	members = count;
+}
+
+void EnsembleStep::addInjection(const EventScript::Event& e, int frame, int member, int width, int height, int rowOffset)
+{
+	EventScript::Injection data = EventScript::injection(e, frame, width, height);
+	float record[6] = {
+		static_cast<float>(member),
+		static_cast<float>(data.x),
+		static_cast<float>(data.y - rowOffset),
+		data.u,
+		data.v,
+		static_cast<float>(data.amount)
+	};
+	injections.insert(injections.end(), record, record + 6);
+}
+
+// the phases of FluidSimulation::update
+void EnsembleStep::frame(ensembleInfo& info, CUdeviceptr* fields)
+{
+	float rdx = 1.f / dx;
+	float halfrdx = 0.5f * rdx;
+	float dt = frameTime;
+	CUdeviceptr& u = fields[VELOCITY_U];
+	CUdeviceptr& v = fields[VELOCITY_V];
+	CUdeviceptr& p = fields[PRESSURE];
+	CUdeviceptr& ink = fields[INK];
+	CUdeviceptr& temp1 = fields[TEMP1];
+	CUdeviceptr& temp2 = fields[TEMP2];
+
+	// with halo rows the outermost one gets the wall condition, it is stale until the next exchange
+	ensembleBoundary(info, u, -1);
+	ensembleBoundary(info, v, -1);
+	ensembleBoundary(info, ink, 0);
+
+	ensembleAdvect(info, u, temp1, u, v, dt, rdx);
+	ensembleAdvect(info, v, temp2, u, v, dt, rdx);
+	std::swap(u, temp1);
+	std::swap(v, temp2);
+	CUdeviceptr velocity[2] = { u, v };
+	exchanged(velocity, 2);
+	ensembleAdvect(info, p, temp1, u, v, dt, rdx);
+	std::swap(p, temp1);
+	ensembleAdvect(info, ink, temp1, u, v, dt, rdx);
+	std::swap(ink, temp1);
+	CUdeviceptr advected[2] = { p, ink };
+	exchanged(advected, 2);
+
+	// pointwise, applied to the halo rows as well
+	inject(info, fields);
+
+	diffuse(info, fields, u);
+	diffuse(info, fields, v);
+
+	ensembleDivergence(info, u, v, temp1, halfrdx);
+	for (int k = 0; k < pressure; ++k)
+	{
+		ensembleBoundary(info, p, 1);
+		ensembleJacobi(info, p, temp2, temp1, d_alphaP, d_rbetaP);
+		std::swap(p, temp2);
+		if (exchange && ((k + 1) % exchangeSweeps == 0 || k + 1 == pressure))
+			exchange(&p, 1);
+	}
+	if (pressureSolved)
+		pressureSolved();
+
+	ensembleBoundary(info, u, -1);
+	ensembleBoundary(info, v, -1);
+	ensembleSubtractGradient(info, p, u, v, temp1, temp2, halfrdx);
+	std::swap(u, temp1);
+	std::swap(v, temp2);
+	velocity[0] = u;
+	velocity[1] = v;
+	exchanged(velocity, 2);
+}
+
+void EnsembleStep::exchanged(CUdeviceptr* buffers, int count)
+{
+	if (exchange)
+		exchange(buffers, count);
+}
+
+void EnsembleStep::inject(ensembleInfo& info, CUdeviceptr* fields)
+{
+	if (injections.empty())
+		return;
+
+	if (injections.size() > injectionCapacity)
+	{
+		if (d_injections)
+			CHECK(cuMemFree(d_injections));
+		injectionCapacity = injections.size() * 2;
+		CHECK(cuMemAlloc(&d_injections, injectionCapacity * sizeof(float)));
+	}
+	CHECK(cuMemcpyHtoD(d_injections, injections.data(), injections.size() * sizeof(float)));
+	ensembleAddInk(info, fields[VELOCITY_U], fields[VELOCITY_V], fields[INK], d_injections, static_cast<int>(injections.size() / 6));
+	injections.clear();
+}
+
+void EnsembleStep::diffuse(ensembleInfo& info, CUdeviceptr* fields, CUdeviceptr& q)
+{
+	// q stays the right-hand side, the iterate alternates between the temporaries
+	CUdeviceptr& temp1 = fields[TEMP1];
+	CUdeviceptr& temp2 = fields[TEMP2];
+	CUdeviceptr x = q;
+	for (int k = 0; k < diffusion; ++k)
+	{
+		CUdeviceptr xNew = x == temp1 ? temp2 : temp1;
+		ensembleJacobi(info, x, xNew, q, d_alphaD, d_rbetaD);
+		x = xNew;
+		if (exchange && ((k + 1) % exchangeSweeps == 0 || k + 1 == diffusion))
+			exchange(&x, 1);
+	}
+
+	if (x == temp1)
+		std::swap(q, temp1);
+	else if (x == temp2)
+		std::swap(q, temp2);
+}
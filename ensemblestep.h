@@ -0,0 +1,71 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+
+#include "fluidSimKernel.h"
+#include "eventscript.h"
+
+// One frame of FluidSimulation::update on the ensemble kernels, each phase one
+// launch for all members of an ensembleInfo. Ensemble steps its lanes with it,
+// Decomposition a strip and OutOfCore a tile, both as an ensemble of one
+// member with halo rows.
+//
+// The fields belong to the caller and are swapped in place with the
+// temporaries. A caller with halo rows refreshes them in exchange(), which is
+// called after each pass whose result a later pass reads across rows, and
+// every exchangeSweeps Jacobi sweeps. The Jacobi coefficients are per member;
+// the diffusion sweeps are planned for the most viscous member and applied to
+// all (a single sweep from x = b is at least as accurate as the explicit step,
+// extra sweeps only reduce the error).
+class EnsembleStep
+{
+public:
+	enum Field
+	{
+		PRESSURE,
+		VELOCITY_U,
+		VELOCITY_V,
+		INK,
+		TEMP1,
+		TEMP2,
+		FIELD_COUNT
+	};
+
+	EnsembleStep();
+	// frees the device buffers, the context must still be current
+	void release();
+
+	// one viscosity per member
+	void setViscosities(const std::vector<float>& viscosities, float diffusionTolerance);
+	int diffusionSweeps() const { return diffusion; }
+	int pressureSweeps() const { return pressure; }
+
+	// the injection of event e in frame into member's lane of the next frame(),
+	// on a width x height grid whose row rowOffset is the first one of info
+	void addInjection(const EventScript::Event& e, int frame, int member, int width, int height, int rowOffset = 0);
+
+	// fields holds FIELD_COUNT buffers of info's size; the injections are applied and cleared
+	void frame(FluidSim::ensembleInfo& info, CUdeviceptr* fields);
+
+	// count buffers whose halo rows are stale, unset without halos
+	std::function<void(CUdeviceptr* buffers, int count)> exchange;
+	int exchangeSweeps;
+	// after the pressure solve, with the divergence in TEMP1
+	std::function<void()> pressureSolved;
+
+private:
+	void exchanged(CUdeviceptr* buffers, int count);
+	void inject(FluidSim::ensembleInfo& info, CUdeviceptr* fields);
+	void diffuse(FluidSim::ensembleInfo& info, CUdeviceptr* fields, CUdeviceptr& q);
+
+	int members;
+	int diffusion;
+	int pressure;
+	CUdeviceptr d_alphaD, d_rbetaD, d_alphaP, d_rbetaP;
+
+	// 6 floats per injection (member, x, y, u, v, ink)
+	std::vector<float> injections;
+	CUdeviceptr d_injections;
+	size_t injectionCapacity;
+};
@@ -0,0 +1,518 @@
+#include "eventscript.h"
+
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace
+{
+	const char MAGIC[8] = { 'F', 'S', 'E', 'V', 'E', 'N', 'T', 'S' };
+	const uint32_t VERSION = 1;
+
+	// compiled script layout, all sections 8-byte aligned, native byte order:
+	// FileHeader | Event[eventCount] | Node[nodeCount] | byStart[eventCount] | byEnd[eventCount]
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t version;
+		int32_t lastFrame;
+		uint64_t eventCount;
+		uint64_t nodeCount;
+		uint64_t eventsOffset;
+		uint64_t nodesOffset;
+		uint64_t byStartOffset;
+		uint64_t byEndOffset;
+		uint64_t fileSize;
+	};
+
+	uint64_t align8(uint64_t x)
+	{
+		return (x + 7) & ~uint64_t(7);
+	}
+
+	// count elements of size bytes at offset, 8-byte aligned, after the header and within the file
+	bool sectionFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t fileSize)
+	{
+		return offset % 8 == 0 && offset >= sizeof(FileHeader) && offset <= fileSize && count <= (fileSize - offset) / size;
+	}
+
+	inline float clamp01(float x)
+	{
+		return std::max(0.f, std::min(1.f, x));
+	}
+
+	// skips blanks, newlines and '#' comments, counting lines
+	inline const char* skipSpace(const char* p, const char* end, int& line)
+	{
+		while (p < end)
+		{
+			if (*p == '\n')
+				++line;
+			else if (*p == '#')
+			{
+				while (p < end && *p != '\n')
+					++p;
+				continue;
+			}
+			else if (*p != ' ' && *p != '\t' && *p != '\r')
+				break;
+			++p;
+		}
+		return p;
+	}
+
+	inline bool parseInt(const char*& p, const char* end, int32_t& value)
+	{
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		if (p >= end || *p < '0' || *p > '9')
+			return false;
+		int64_t v = 0;
+		while (p < end && *p >= '0' && *p <= '9')
+			v = v * 10 + (*p++ - '0');
+		value = static_cast<int32_t>(negative ? -v : v);
+		return true;
+	}
+
+	// plain decimals are parsed inline, anything unusual falls back to strtof on
+	// a NUL-terminated copy, the mapped script has no terminator
+	inline bool parseFloat(const char*& p, const char* end, float& value)
+	{
+		const char* start = p;
+		bool negative = false;
+		if (p < end && (*p == '-' || *p == '+'))
+			negative = *p++ == '-';
+		double v = 0.0, scale = 1.0;
+		bool digits = false;
+		while (p < end && *p >= '0' && *p <= '9')
+		{
+			v = v * 10.0 + (*p++ - '0');
+			digits = true;
+		}
+		if (p < end && *p == '.')
+		{
+			++p;
+			while (p < end && *p >= '0' && *p <= '9')
+			{
+				v = v * 10.0 + (*p++ - '0');
+				scale *= 10.0;
+				digits = true;
+			}
+		}
+		if (p < end && (*p == 'e' || *p == 'E' || *p == 'n' || *p == 'N' || *p == 'i' || *p == 'I'))
+		{
+			char token[64];
+			size_t length = 0;
+			while (start + length < end && length + 1 < sizeof(token) && !isspace(static_cast<unsigned char>(start[length])))
+			{
+				token[length] = start[length];
+				++length;
+			}
+			token[length] = '\0';
+			char* next;
+			value = strtof(token, &next);
+			p = start + (next - token);
+			return next != token;
+		}
+		value = static_cast<float>((negative ? -v : v) / scale);
+		return digits;
+	}
+}
+
+EventScript::EventScript()
+	: events(nullptr)
+	, nodes(nullptr)
+	, byStart(nullptr)
+	, byEnd(nullptr)
+	, eventCount(0)
+	, nodeCount(0)
+	, lastFrame(0)
+	, mapping(nullptr)
+	, mappingSize(0)
+{
+}
+
+EventScript::~EventScript()
+{
+	unmap();
+}
+
+EventScript::Injection EventScript::injection(const Event& e, int frame, int width, int height)
+{
+	// event positions are stored relative to the grid
+	float x_start = e.x_start * width;
+	float x_end = e.x_end * width;
+	float y_start = e.y_start * height;
+	float y_end = e.y_end * height;
+	float frames = static_cast<float>(e.frame_end - e.frame_start);
+
+	Injection data;
+	float t = (frame - e.frame_start) / frames;
+	data.x = static_cast<int>(x_start * (1 - t) + x_end * t);
+	data.y = static_cast<int>(y_start * (1 - t) + y_end * t);
+	data.u = 10 * (x_end - x_start) / frames;
+	data.v = 10 * (y_end - y_start) / frames;
+	data.amount = static_cast<int>(e.amount);
+	return data;
+}
+
+void EventScript::clear()
+{
+	unmap();
+	ownedEvents.clear();
+	ownedNodes.clear();
+	ownedByStart.clear();
+	ownedByEnd.clear();
+	events = nullptr;
+	nodes = nullptr;
+	byStart = nullptr;
+	byEnd = nullptr;
+	eventCount = 0;
+	nodeCount = 0;
+	lastFrame = 0;
+}
+
+void EventScript::unmap()
+{
+	if (mapping)
+		munmap(mapping, mappingSize);
+	mapping = nullptr;
+	mappingSize = 0;
+}
+
+bool EventScript::load(const char* path)
+{
+	FILE* f = fopen(path, "rb");
+	if (!f)
+	{
+		fprintf(stderr, "Error opening event script %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	char magic[sizeof(MAGIC)] = { 0 };
+	size_t n = fread(magic, 1, sizeof(magic), f);
+	fclose(f);
+
+	if (n == sizeof(MAGIC) && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0)
+		return loadCompiled(path);
+	return loadText(path);
+}
+
+bool EventScript::loadText(const char* path)
+{
+	clear();
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Error opening event script %s: %s\n", path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	const char* text = nullptr;
+	void* view = MAP_FAILED;
+	if (st.st_size > 0)
+	{
+		view = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (view != MAP_FAILED)
+		{
+			madvise(view, st.st_size, MADV_SEQUENTIAL);
+			text = static_cast<const char*>(view);
+		}
+	}
+	close(fd);
+	if (st.st_size > 0 && !text)
+	{
+		fprintf(stderr, "Error mapping event script %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	const char* p = text;
+	const char* end = text + st.st_size;
+	int line = 1;
+	bool ok = true;
+
+	// roughly 40 bytes per line in the text format
+	ownedEvents.reserve(st.st_size / 32 + 1);
+
+	while ((p = skipSpace(p, end, line)) < end)
+	{
+		Event e;
+		float* coords[5] = { &e.x_start, &e.x_end, &e.y_start, &e.y_end, &e.amount };
+		ok = parseInt(p, end, e.frame_start);
+		p = skipSpace(p, end, line);
+		ok = ok && parseInt(p, end, e.frame_end);
+		for (int c = 0; ok && c < 5; ++c)
+		{
+			p = skipSpace(p, end, line);
+			ok = parseFloat(p, end, *coords[c]);
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "Error parsing event script %s, line %d\n", path, line);
+			break;
+		}
+
+		e.x_start = clamp01(e.x_start);
+		e.x_end = clamp01(e.x_end);
+		e.y_start = clamp01(e.y_start);
+		e.y_end = clamp01(e.y_end);
+
+		// empty intervals are never active
+		if (e.frame_end > e.frame_start)
+			ownedEvents.push_back(e);
+	}
+
+	if (view != MAP_FAILED)
+		munmap(view, st.st_size);
+
+	if (!ok)
+	{
+		clear();
+		return false;
+	}
+
+	events = ownedEvents.data();
+	eventCount = ownedEvents.size();
+	buildIndex();
+	return true;
+}
+
+bool EventScript::loadCompiled(const char* path)
+{
+	clear();
+
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(FileHeader)))
+	{
+		fprintf(stderr, "Error opening compiled event script %s\n", path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	void* view = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (view == MAP_FAILED)
+	{
+		fprintf(stderr, "Error mapping compiled event script %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	mapping = view;
+	mappingSize = st.st_size;
+
+	const FileHeader* h = static_cast<const FileHeader*>(view);
+	const uint8_t* base = static_cast<const uint8_t*>(view);
+	if (memcmp(h->magic, MAGIC, sizeof(MAGIC)) != 0 || h->version != VERSION || h->fileSize != static_cast<uint64_t>(st.st_size)
+		|| !sectionFits(h->eventsOffset, h->eventCount, sizeof(Event), h->fileSize)
+		|| !sectionFits(h->nodesOffset, h->nodeCount, sizeof(Node), h->fileSize)
+		|| !sectionFits(h->byStartOffset, h->eventCount, sizeof(uint32_t), h->fileSize)
+		|| !sectionFits(h->byEndOffset, h->eventCount, sizeof(uint32_t), h->fileSize))
+	{
+		fprintf(stderr, "Error: %s is not a compatible compiled event script\n", path);
+		clear();
+		return false;
+	}
+
+	const Node* fileNodes = reinterpret_cast<const Node*>(base + h->nodesOffset);
+	const uint32_t* fileByStart = reinterpret_cast<const uint32_t*>(base + h->byStartOffset);
+	const uint32_t* fileByEnd = reinterpret_cast<const uint32_t*>(base + h->byEndOffset);
+	// active() follows these without checks: children come after their parent
+	// (the nodes are stored in pre-order, so the walk ends) and ranges and ids
+	// stay within the event lists
+	bool valid = true;
+	for (uint64_t n = 0; n < h->nodeCount && valid; ++n)
+	{
+		const Node& node = fileNodes[n];
+		valid = node.first <= h->eventCount && node.count <= h->eventCount - node.first
+			&& (node.left == -1 || (node.left > static_cast<int64_t>(n) && static_cast<uint64_t>(node.left) < h->nodeCount))
+			&& (node.right == -1 || (node.right > static_cast<int64_t>(n) && static_cast<uint64_t>(node.right) < h->nodeCount));
+	}
+	for (uint64_t i = 0; i < h->eventCount && valid; ++i)
+		valid = fileByStart[i] < h->eventCount && fileByEnd[i] < h->eventCount;
+	if (!valid)
+	{
+		fprintf(stderr, "Error: the interval tree of %s is corrupt\n", path);
+		clear();
+		return false;
+	}
+
+	events = reinterpret_cast<const Event*>(base + h->eventsOffset);
+	nodes = fileNodes;
+	byStart = fileByStart;
+	byEnd = fileByEnd;
+	eventCount = h->eventCount;
+	nodeCount = h->nodeCount;
+	lastFrame = h->lastFrame;
+	return true;
+}
+
+bool EventScript::save(const char* path) const
+{
+	FileHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MAGIC, sizeof(MAGIC));
+	h.version = VERSION;
+	h.lastFrame = lastFrame;
+	h.eventCount = eventCount;
+	h.nodeCount = nodeCount;
+	h.eventsOffset = align8(sizeof(FileHeader));
+	h.nodesOffset = align8(h.eventsOffset + eventCount * sizeof(Event));
+	h.byStartOffset = align8(h.nodesOffset + nodeCount * sizeof(Node));
+	h.byEndOffset = align8(h.byStartOffset + eventCount * sizeof(uint32_t));
+	h.fileSize = h.byEndOffset + eventCount * sizeof(uint32_t);
+
+	FILE* f = fopen(path, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Error writing %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	struct Section { uint64_t offset; const void* data; size_t bytes; };
+	Section sections[] = {
+		{ 0, &h, sizeof(h) },
+		{ h.eventsOffset, events, eventCount * sizeof(Event) },
+		{ h.nodesOffset, nodes, nodeCount * sizeof(Node) },
+		{ h.byStartOffset, byStart, eventCount * sizeof(uint32_t) },
+		{ h.byEndOffset, byEnd, eventCount * sizeof(uint32_t) },
+	};
+
+	static const char padding[8] = { 0 };
+	uint64_t written = 0;
+	bool ok = true;
+	for (auto& s : sections)
+	{
+		ok = ok && fwrite(padding, 1, s.offset - written, f) == s.offset - written;
+		ok = ok && (s.bytes == 0 || fwrite(s.data, 1, s.bytes, f) == s.bytes);
+		written = s.offset + s.bytes;
+	}
+	ok = (fclose(f) == 0) && ok;
+
+	if (!ok)
+		fprintf(stderr, "Error writing %s\n", path);
+	return ok;
+}
+
+void EventScript::buildIndex()
+{
+	lastFrame = 0;
+	for (size_t i = 0; i < eventCount; ++i)
+		lastFrame = std::max(lastFrame, events[i].frame_end);
+
+	ownedNodes.clear();
+	ownedByStart.clear();
+	ownedByEnd.clear();
+	ownedByStart.reserve(eventCount);
+	ownedByEnd.reserve(eventCount);
+
+	// spans are copied out of the events so the recursion stays cache friendly,
+	// and stay sorted by (start, id) throughout
+	std::vector<Span> spans(eventCount);
+	for (size_t i = 0; i < eventCount; ++i)
+	{
+		spans[i].start = events[i].frame_start;
+		spans[i].end = events[i].frame_end;
+		spans[i].id = static_cast<uint32_t>(i);
+	}
+	std::sort(spans.begin(), spans.end(), [](const Span& a, const Span& b) {
+		return a.start < b.start || (a.start == b.start && a.id < b.id);
+	});
+	if (!spans.empty())
+		buildNode(spans);
+
+	nodes = ownedNodes.data();
+	nodeCount = ownedNodes.size();
+	byStart = ownedByStart.data();
+	byEnd = ownedByEnd.data();
+}
+
+int32_t EventScript::buildNode(std::vector<Span>& spans)
+{
+	// the median start frame is covered by at least one (non-empty) interval,
+	// so every node takes at least one event and the recursion terminates
+	int32_t center = spans[spans.size() / 2].start;
+
+	std::vector<Span> left, right, here;
+	for (const Span& s : spans)
+	{
+		if (s.end <= center)
+			left.push_back(s);
+		else if (s.start > center)
+			right.push_back(s);
+		else
+			here.push_back(s);
+	}
+	std::vector<Span>().swap(spans);
+
+	Node node;
+	node.center = center;
+	node.first = static_cast<uint32_t>(ownedByStart.size());
+	node.count = static_cast<uint32_t>(here.size());
+
+	for (const Span& s : here)
+		ownedByStart.push_back(s.id);
+	std::sort(here.begin(), here.end(), [](const Span& a, const Span& b) {
+		return a.end > b.end || (a.end == b.end && a.id < b.id);
+	});
+	for (const Span& s : here)
+		ownedByEnd.push_back(s.id);
+
+	int32_t index = static_cast<int32_t>(ownedNodes.size());
+	ownedNodes.push_back(node);
+
+	int32_t l = left.empty() ? -1 : buildNode(left);
+	int32_t r = right.empty() ? -1 : buildNode(right);
+	ownedNodes[index].left = l;
+	ownedNodes[index].right = r;
+	return index;
+}
+
+void EventScript::active(int32_t frame, std::vector<uint32_t>& result) const
+{
+	result.clear();
+
+	int32_t n = nodeCount > 0 ? 0 : -1;
+	while (n >= 0)
+	{
+		const Node& node = nodes[n];
+		// all intervals of a node contain its center
+		if (frame < node.center)
+		{
+			for (uint32_t k = 0; k < node.count; ++k)
+			{
+				uint32_t id = byStart[node.first + k];
+				if (events[id].frame_start > frame)
+					break;
+				result.push_back(id);
+			}
+			n = node.left;
+		}
+		else
+		{
+			for (uint32_t k = 0; k < node.count; ++k)
+			{
+				uint32_t id = byEnd[node.first + k];
+				if (events[id].frame_end <= frame)
+					break;
+				result.push_back(id);
+			}
+			n = node.right;
+		}
+	}
+
+	// injection order matters once ink saturates, keep it deterministic
+	std::sort(result.begin(), result.end());
+}
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+// Predefined user interaction, either parsed from the text format described in
+// readme.txt or mapped from a compiled binary script (see save()).
+//
+// Events are half-open frame intervals [frame_start, frame_end) and may overlap.
+// A static centered interval tree answers "which events are active in frame t"
+// in O(log n + k). The tree is part of the compiled format, so a mapped script
+// is usable without any parsing or sorting.
+class EventScript
+{
+public:
+	struct Event
+	{
+		int32_t frame_start;
+		int32_t frame_end;
+		float x_start;		// positions are relative to the grid, in [0,1]
+		float x_end;
+		float y_start;
+		float y_end;
+		float amount;
+	};
+
+	// what an event injects in a frame on a width x height grid: the position
+	// moves from start to end over the event's frames, the force follows it
+	struct Injection
+	{
+		int x;
+		int y;
+		float u;
+		float v;
+		int amount;
+	};
+	static Injection injection(const Event& e, int frame, int width, int height);
+
+	EventScript();
+	~EventScript();
+
+	// detects the compiled format by its magic number, otherwise parses text
+	bool load(const char* path);
+	bool loadText(const char* path);
+	bool loadCompiled(const char* path);
+
+	// writes the compiled binary format
+	bool save(const char* path) const;
+
+	void clear();
+
+	size_t size() const { return eventCount; }
+	bool empty() const { return eventCount == 0; }
+	const Event& operator[](size_t i) const { return events[i]; }
+
+	// first frame after the last event ended
+	int32_t endFrame() const { return lastFrame; }
+
+	// indices of all events active in frame, in script order
+	void active(int32_t frame, std::vector<uint32_t>& result) const;
+
+private:
+	struct Node
+	{
+		int32_t center;
+		uint32_t first;		// range of this node's intervals in byStart/byEnd
+		uint32_t count;
+		int32_t left;
+		int32_t right;
+	};
+
+	struct Span
+	{
+		int32_t start;
+		int32_t end;
+		uint32_t id;
+	};
+
+	void buildIndex();
+	int32_t buildNode(std::vector<Span>& spans);
+	void unmap();
+
+	// views into either the owned vectors or the mapped file
+	const Event* events;
+	const Node* nodes;
+	const uint32_t* byStart;
+	const uint32_t* byEnd;
+	size_t eventCount;
+	size_t nodeCount;
+	int32_t lastFrame;
+
+	std::vector<Event> ownedEvents;
+	std::vector<Node> ownedNodes;
+	std::vector<uint32_t> ownedByStart, ownedByEnd;
+
+	void* mapping;
+	size_t mappingSize;
+};
@@ -5,77 +5,271 @@
 #include "fluidSimKernel.h"
 #include "common.h"
 
+const char *module_file = (char*) "fluidSimKernel.cu";
+const char *advection_kernel_name = (char*) "advect";
+const char *jacobi_kernel_name = (char*) "jacobi";
+const char *divergence_kernel_name = (char*) "divergence";
+const char *subtractGradient_kernel_name = (char*) "subtractGradient";
+const char *boundary_kernel_name = (char*) "boundary";
+const char *addInk_kernel_name = (char*) "addInk";
+const char *convertToColor_kernel_name = (char*) "convertToColor";
+const char *convertToColor2_kernel_name = (char*) "convertToColor2";
+const char *residual_kernel_name = (char*) "residual";
+const char *streamCollide_kernel_name = (char*) "streamCollide";
+const char *splat_kernel_name = (char*) "splat";
+const char *advectDye_kernel_name = (char*) "advectDye";
+const char *addDye_kernel_name = (char*) "addDye";
+const char *dyeToColor_kernel_name = (char*) "dyeToColor";
+const char *ensembleAdvect_kernel_name = (char*) "ensembleAdvect";
+const char *ensembleJacobi_kernel_name = (char*) "ensembleJacobi";
+const char *ensembleDivergence_kernel_name = (char*) "ensembleDivergence";
+const char *ensembleSubtractGradient_kernel_name = (char*) "ensembleSubtractGradient";
+const char *ensembleBoundary_kernel_name = (char*) "ensembleBoundary";
+const char *ensembleAddInk_kernel_name = (char*) "ensembleAddInk";
+const char *ensembleRelayout_kernel_name = (char*) "ensembleRelayout";
+
 namespace FluidSim
 {
+	namespace
+	{
+		// one thread per cell with the kernel's block shape
+		void launch(cudaInfo & info, Kernel kernel, CUfunction function, void **args)
+		{
+			int threads_x = info.blocks[kernel].x > 0 ? info.blocks[kernel].x : info.threads_x;
+			int threads_y = info.blocks[kernel].y > 0 ? info.blocks[kernel].y : info.threads_y;
+			CHECK(cuLaunchKernel(function, div_up(info.width, threads_x), div_up(info.height, threads_y), 1,
+				threads_x, threads_y, 1,
+				0, 0, args, 0));
+		}
+
+		// one thread per cell and member
+		void launch(ensembleInfo & info, CUfunction function, void **args)
+		{
+			unsigned int threads = static_cast<unsigned int>(info.width) * info.height * info.members;
+			CHECK(cuLaunchKernel(function, div_up(threads, info.threads), 1, 1,
+				info.threads, 1, 1,
+				0, 0, args, 0));
+		}
+	}
+
+	const char* kernelName(int kernel)
+	{
+		static const char* names[KERNEL_COUNT] = {
+			"advect", "jacobi", "divergence", "subtractGradient", "boundary", "addInk", "convertToColor", "convertToColor2", "residual", "streamCollide",
+			"splat", "advectDye", "addDye", "dyeToColor"
+		};
+		return kernel >= 0 && kernel < KERNEL_COUNT ? names[kernel] : "?";
+	}
+
+	void resetBlockShapes(cudaInfo & info)
+	{
+		for (int k = 0; k < KERNEL_COUNT; ++k)
+		{
+			info.blocks[k].x = 0;
+			info.blocks[k].y = 0;
+		}
+	}
+
+	void loadKernels(cudaInfo & info)
+	{
+		auto& module = info.module;
+		CHECK(cuModuleLoad(&module, module_file));
+		CHECK(cuModuleGetFunction(&info.advection_function, module, advection_kernel_name));
+		CHECK(cuModuleGetFunction(&info.jacobi_function, module, jacobi_kernel_name));
+		CHECK(cuModuleGetFunction(&info.divergence_function, module, divergence_kernel_name));
+		CHECK(cuModuleGetFunction(&info.subtractGradient_function, module, subtractGradient_kernel_name));
+		CHECK(cuModuleGetFunction(&info.boundary_function, module, boundary_kernel_name));
+		CHECK(cuModuleGetFunction(&info.addInk_function, module, addInk_kernel_name));
+		CHECK(cuModuleGetFunction(&info.convertToColor_function, module, convertToColor_kernel_name));
+		CHECK(cuModuleGetFunction(&info.convertToColor2_function, module, convertToColor2_kernel_name));
+		CHECK(cuModuleGetFunction(&info.residual_function, module, residual_kernel_name));
+		CHECK(cuModuleGetFunction(&info.streamCollide_function, module, streamCollide_kernel_name));
+		CHECK(cuModuleGetFunction(&info.splat_function, module, splat_kernel_name));
+		CHECK(cuModuleGetFunction(&info.advectDye_function, module, advectDye_kernel_name));
+		CHECK(cuModuleGetFunction(&info.addDye_function, module, addDye_kernel_name));
+		CHECK(cuModuleGetFunction(&info.dyeToColor_function, module, dyeToColor_kernel_name));
+	}
+
 	void advect(cudaInfo & info, Array2D::Device *q, Array2D::Device *qNew, Array2D::Device *u, Array2D::Device *v, float dt, float rdx)
 	{
+		Tracer::Scope trace(info.tracer, "advect", "kernel");
 		void *args[7] = { q, qNew, u, v, &dt, &rdx, 0 };
 
-		CHECK(cuLaunchKernel(info.advection_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, ADVECTION, info.advection_function, args);
 	}
 
 	void jacobi(cudaInfo & info, Array2D::Device *x, Array2D::Device *xNew, Array2D::Device *b, float alpha, float rbeta)
 	{
+		Tracer::Scope trace(info.tracer, "jacobi", "kernel");
 		void *args[6] = { x, xNew, b, &alpha, &rbeta, 0 };
 
-		CHECK(cuLaunchKernel(info.jacobi_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, JACOBI, info.jacobi_function, args);
 	}
 
 	void divergence(cudaInfo & info, Array2D::Device *u, Array2D::Device *v, Array2D::Device *div, float halfrdx)
 	{
+		Tracer::Scope trace(info.tracer, "divergence", "kernel");
 		void *args[5] = { u, v, div, &halfrdx, 0 };
 
-		CHECK(cuLaunchKernel(info.divergence_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, DIVERGENCE, info.divergence_function, args);
 	}
 
-	void subtractGradient(cudaInfo & info, Array2D::Device *p, Array2D::Device *u, Array2D::Device *v, Array2D::Device *uNew, Array2D::Device *vNew, float halfrdx)
+	void subtractGradient(cudaInfo & info, Array2D::Device *p, Array2D::Device *u, Array2D::Device *v, Array2D::Device *uNew, Array2D::Device *vNew, float halfrdx, CUdeviceptr maxSpeed)
 	{
-		void *args[7] = { p, u, v, uNew, vNew, &halfrdx, 0 };
+		Tracer::Scope trace(info.tracer, "subtractGradient", "kernel");
+		void *args[8] = { p, u, v, uNew, vNew, &halfrdx, &maxSpeed, 0 };
 
-		CHECK(cuLaunchKernel(info.subtractGradient_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, SUBTRACT_GRADIENT, info.subtractGradient_function, args);
 	}
 
 	void boundary(cudaInfo & info, Array2D::Device *x, float scale)
 	{
+		Tracer::Scope trace(info.tracer, "boundary", "kernel");
 		void *args[3] = { x, &scale, 0 };
 
-		CHECK(cuLaunchKernel(info.boundary_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, BOUNDARY, info.boundary_function, args);
 	}
 
 	void addInk(cudaInfo & info, Array2D::Device *u, Array2D::Device *v, Array2D::Device *ink, int x, int y, float u_, float v_, float ink_)
 	{
+		Tracer::Scope trace(info.tracer, "addInk", "kernel");
 		void *args[9] = { u, v, ink, &x, &y, &u_, &v_, &ink_, 0 };
 
-		CHECK(cuLaunchKernel(info.addInk_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, ADD_INK, info.addInk_function, args);
+	}
+
+	void splat(cudaInfo & info, Array2D::Device *q, int x, int y, float value, float cellSize, float lo, float hi)
+	{
+		Tracer::Scope trace(info.tracer, "splat", "kernel");
+		void *args[8] = { q, &x, &y, &value, &cellSize, &lo, &hi, 0 };
+
+		launch(info, SPLAT, info.splat_function, args);
+	}
+
+	void advectDye(cudaInfo & info, CUdeviceptr dye, CUdeviceptr dyeNew, Array2D::Device *u, Array2D::Device *v, int species, int layout,
+		float dt, float rdx, float cellSize)
+	{
+		Tracer::Scope trace(info.tracer, "advectDye", "kernel");
+		void *args[12] = { &dye, &dyeNew, u, v, &info.width, &info.height, &species, &layout, &dt, &rdx, &cellSize, 0 };
+
+		launch(info, ADVECT_DYE, info.advectDye_function, args);
+	}
+
+	void addDye(cudaInfo & info, CUdeviceptr dye, int species, int layout, int s, int x, int y, float amount)
+	{
+		Tracer::Scope trace(info.tracer, "addDye", "kernel");
+		void *args[10] = { &dye, &info.width, &info.height, &species, &layout, &s, &x, &y, &amount, 0 };
+
+		launch(info, ADD_DYE, info.addDye_function, args);
+	}
+
+	void dyeToColor(cudaInfo & info, CUdeviceptr color, CUdeviceptr dye, int species, int layout, CUdeviceptr palette)
+	{
+		Tracer::Scope trace(info.tracer, "dyeToColor", "kernel");
+		void *args[8] = { &color, &dye, &info.width, &info.height, &species, &layout, &palette, 0 };
+
+		launch(info, DYE_TO_COLOR, info.dyeToColor_function, args);
 	}
 
 	void convertToColor(cudaInfo & info, CUdeviceptr color, Array2D::Device *x)
 	{
+		Tracer::Scope trace(info.tracer, "convertToColor", "kernel");
 		void *args[3] = { &color, &x, 0 };
 
-		CHECK(cuLaunchKernel(info.convertToColor_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, CONVERT_TO_COLOR, info.convertToColor_function, args);
 	}
 
 	void convertToColor2(cudaInfo & info, CUdeviceptr color, Array2D::Device *r, Array2D::Device *g, Array2D::Device *b)
 	{
+		Tracer::Scope trace(info.tracer, "convertToColor2", "kernel");
 		void *args[5] = { &color, &r, &g, &b, 0 };
 
-		CHECK(cuLaunchKernel(info.convertToColor2_function, div_up(info.width, info.threads_x), div_up(info.height, info.threads_y), 1,
-			info.threads_x, info.threads_y, 1,
-			0, 0, args, 0));
+		launch(info, CONVERT_TO_COLOR2, info.convertToColor2_function, args);
+	}
+
+	void residual(cudaInfo & info, Array2D::Device *x, Array2D::Device *b, CUdeviceptr sums, float alpha, float rbeta)
+	{
+		Tracer::Scope trace(info.tracer, "residual", "kernel");
+		void *args[6] = { x, b, &sums, &alpha, &rbeta, 0 };
+
+		launch(info, RESIDUAL, info.residual_function, args);
+	}
+
+	void streamCollide(cudaInfo & info, CUdeviceptr lattice, Array2D::Device *forceU, Array2D::Device *forceV,
+		Array2D::Device *u, Array2D::Device *v, Array2D::Device *p, int odd, float omega, float velocityScale, float pressureScale)
+	{
+		Tracer::Scope trace(info.tracer, "streamCollide", "kernel");
+		void *args[11] = { &lattice, forceU, forceV, u, v, p, &odd, &omega, &velocityScale, &pressureScale, 0 };
+
+		launch(info, STREAM_COLLIDE, info.streamCollide_function, args);
+	}
+
+	void loadEnsembleKernels(ensembleInfo & info)
+	{
+		auto& module = info.module;
+		CHECK(cuModuleLoad(&module, module_file));
+		CHECK(cuModuleGetFunction(&info.advect_function, module, ensembleAdvect_kernel_name));
+		CHECK(cuModuleGetFunction(&info.jacobi_function, module, ensembleJacobi_kernel_name));
+		CHECK(cuModuleGetFunction(&info.divergence_function, module, ensembleDivergence_kernel_name));
+		CHECK(cuModuleGetFunction(&info.subtractGradient_function, module, ensembleSubtractGradient_kernel_name));
+		CHECK(cuModuleGetFunction(&info.boundary_function, module, ensembleBoundary_kernel_name));
+		CHECK(cuModuleGetFunction(&info.addInk_function, module, ensembleAddInk_kernel_name));
+		CHECK(cuModuleGetFunction(&info.relayout_function, module, ensembleRelayout_kernel_name));
+	}
+
+	void ensembleAdvect(ensembleInfo & info, CUdeviceptr q, CUdeviceptr qNew, CUdeviceptr u, CUdeviceptr v, float dt, float rdx)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleAdvect", "kernel");
+		void *args[10] = { &q, &qNew, &u, &v, &info.width, &info.height, &info.members, &dt, &rdx, 0 };
+
+		launch(info, info.advect_function, args);
+	}
+
+	void ensembleJacobi(ensembleInfo & info, CUdeviceptr x, CUdeviceptr xNew, CUdeviceptr b, CUdeviceptr alpha, CUdeviceptr rbeta)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleJacobi", "kernel");
+		void *args[9] = { &x, &xNew, &b, &info.width, &info.height, &info.members, &alpha, &rbeta, 0 };
+
+		launch(info, info.jacobi_function, args);
+	}
+
+	void ensembleDivergence(ensembleInfo & info, CUdeviceptr u, CUdeviceptr v, CUdeviceptr div, float halfrdx)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleDivergence", "kernel");
+		void *args[8] = { &u, &v, &div, &info.width, &info.height, &info.members, &halfrdx, 0 };
+
+		launch(info, info.divergence_function, args);
+	}
+
+	void ensembleSubtractGradient(ensembleInfo & info, CUdeviceptr p, CUdeviceptr u, CUdeviceptr v, CUdeviceptr uNew, CUdeviceptr vNew, float halfrdx)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleSubtractGradient", "kernel");
+		void *args[10] = { &p, &u, &v, &uNew, &vNew, &info.width, &info.height, &info.members, &halfrdx, 0 };
+
+		launch(info, info.subtractGradient_function, args);
+	}
+
+	void ensembleBoundary(ensembleInfo & info, CUdeviceptr x, float scale)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleBoundary", "kernel");
+		void *args[6] = { &x, &info.width, &info.height, &info.members, &scale, 0 };
+
+		launch(info, info.boundary_function, args);
+	}
+
+	void ensembleAddInk(ensembleInfo & info, CUdeviceptr u, CUdeviceptr v, CUdeviceptr ink, CUdeviceptr injections, int count)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleAddInk", "kernel");
+		void *args[9] = { &u, &v, &ink, &info.width, &info.height, &info.members, &injections, &count, 0 };
+
+		launch(info, info.addInk_function, args);
+	}
+
+	void ensembleRelayout(ensembleInfo & info, CUdeviceptr src, CUdeviceptr dst, int srcMembers, CUdeviceptr map)
+	{
+		Tracer::Scope trace(info.tracer, "ensembleRelayout", "kernel");
+		void *args[8] = { &src, &dst, &info.width, &info.height, &info.members, &srcMembers, &map, 0 };
+
+		launch(info, info.relayout_function, args);
 	}
-}
\ No newline at end of file
+}
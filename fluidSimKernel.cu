@@ -54,6 +54,41 @@ extern "C" __global__ void jacobi(Array2D<0> x, Array2D<1> xNew, Array2D<2> b, c
 		+ x[clamp((j - 1), 0, height - 1)][i]);
 }
 
+// Jacobi update (rbeta * (alpha * b + neighbours) - x) and the right-hand side
+// term of the interior, squared and summed into sums[0] and sums[1]
+extern "C" __global__ void residual(Array2D<0> x, Array2D<1> b, float *sums, const float alpha, const float rbeta)
+{
+	__shared__ float blockSums[2];
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	int j = blockIdx.y * blockDim.y + threadIdx.y;
+	int height = x.getCount(0);
+	int width = x.getCount(1);
+	bool first = threadIdx.x == 0 && threadIdx.y == 0;
+
+	if (first)
+	{
+		blockSums[0] = 0.f;
+		blockSums[1] = 0.f;
+	}
+	__syncthreads();
+
+	if (i > 0 && j > 0 && i < width - 1 && j < height - 1)
+	{
+		float rhs = rbeta * alpha * b[j][i];
+		float r = rhs + rbeta * (x[j][i + 1] + x[j][i - 1] + x[j + 1][i] + x[j - 1][i]) - x[j][i];
+		atomicAdd(&blockSums[0], r * r);
+		atomicAdd(&blockSums[1], rhs * rhs);
+	}
+	__syncthreads();
+
+	// one global atomic per block
+	if (first)
+	{
+		atomicAdd(&sums[0], blockSums[0]);
+		atomicAdd(&sums[1], blockSums[1]);
+	}
+}
+
 extern "C" __global__ void divergence(Array2D<0> u, Array2D<1> v, Array2D<2> div, const float halfrdx)
 {
 	size_t i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -70,20 +105,39 @@ extern "C" __global__ void divergence(Array2D<0> u, Array2D<1> v, Array2D<2> div
 		- v[clamp(j - 1, 0, height - 1)][i]);
 }
 
-extern "C" __global__ void subtractGradient(Array2D<0> p, Array2D<1> u, Array2D<2> v, Array2D<3> uNew, Array2D<4> vNew, const float halfrdx)
+// with maxSpeed set, max(|uNew| + |vNew|) is reduced into it in the same pass
+// (non-negative floats order like their bit patterns)
+extern "C" __global__ void subtractGradient(Array2D<0> p, Array2D<1> u, Array2D<2> v, Array2D<3> uNew, Array2D<4> vNew, const float halfrdx, unsigned int *maxSpeed)
 {
+	__shared__ unsigned int blockMax;
 	size_t i = blockIdx.x * blockDim.x + threadIdx.x;
 	size_t j = blockIdx.y * blockDim.y + threadIdx.y;
 	int height = uNew.getCount(0);
 	int width = uNew.getCount(1);
+	bool first = threadIdx.x == 0 && threadIdx.y == 0;
+	float speed = 0.f;
 
-	if (i >= width || j >= height || i < 0 || j < 0)
-		return;
+	if (i < width && j < height)
+	{
+		float un = u[j][i] - halfrdx * (p[j][clamp(i + 1, 0, width - 1)]
+			- p[j][clamp(i - 1, 0, width - 1)]);
+		float vn = v[j][i] - halfrdx * (p[clamp(j + 1, 0, height - 1)][i]
+			- p[clamp(j - 1, 0, height - 1)][i]);
+		uNew[j][i] = un;
+		vNew[j][i] = vn;
+		speed = fabsf(un) + fabsf(vn);
+	}
 
-	uNew[j][i] = u[j][i] - halfrdx * (p[j][clamp(i + 1, 0, width - 1)]
-		- p[j][clamp(i - 1, 0, width - 1)]);
-	vNew[j][i] = v[j][i] - halfrdx * (p[clamp(j + 1, 0, height - 1)][i]
-		- p[clamp(j - 1, 0, height - 1)][i]);
+	// the same for the whole grid, so all threads reach the barriers
+	if (!maxSpeed)
+		return;
+	if (first)
+		blockMax = 0;
+	__syncthreads();
+	atomicMax(&blockMax, __float_as_uint(speed));
+	__syncthreads();
+	if (first)
+		atomicMax(maxSpeed, blockMax);
 }
 
 
@@ -127,6 +181,25 @@ extern "C" __global__ void addInk(Array2D<0> u, Array2D<1> v, Array2D<2> ink, co
 	ink[j][i] = clamp(ink[j][i], 0.0, 255.0);
 }
 
+// the falloff of addInk for a single field whose cells are cellSize cells of the
+// grid that x and y refer to, clamped to [lo, hi]
+extern "C" __global__ void splat(Array2D<0> q, const int x, const int y, const float value, const float cellSize, const float lo, const float hi)
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	int j = blockIdx.y * blockDim.y + threadIdx.y;
+	int height = q.getCount(0);
+	int width = q.getCount(1);
+
+	if (i >= width || j >= height)
+		return;
+
+	float dx = (i + 0.5f) * cellSize - 0.5f - x;
+	float dy = (j + 0.5f) * cellSize - 0.5f - y;
+	float s = 1.f / pow(2., static_cast<double>(dx*dx + dy*dy) / 200.);
+
+	q[j][i] = clamp(q[j][i] + value * s, lo, hi);
+}
+
 extern "C" __global__ void convertToColor(uint8_t *color, Array2D<0> x)
 {
 	size_t i = blockIdx.x * blockDim.x + threadIdx.x;
@@ -160,4 +233,332 @@ extern "C" __global__ void convertToColor2(uint8_t *color, Array2D<0> r, Array2D
 	color[4 * index + 1] = static_cast<uint8_t>(g[j][i]);
 	color[4 * index + 2] = static_cast<uint8_t>(b[j][i]);
 	color[4 * index + 3] = 0;
-}
\ No newline at end of file
+}
+
+// D2Q9 lattice: velocities, opposite directions and weights
+__constant__ int latticeX[9] = { 0, 1, 0, -1, 0, 1, -1, -1, 1 };
+__constant__ int latticeY[9] = { 0, 0, 1, 0, -1, 1, 1, -1, -1 };
+__constant__ int latticeOpposite[9] = { 0, 3, 4, 1, 2, 7, 8, 5, 6 };
+__constant__ float latticeWeight[9] = { 4.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f };
+
+extern __device__ float equilibrium(int q, float rho, float ux, float uy)
+{
+	float cu = 3.f * (latticeX[q] * ux + latticeY[q] * uy);
+	return latticeWeight[q] * rho * (1.f + cu + 0.5f * cu * cu - 1.5f * (ux * ux + uy * uy));
+}
+
+// One fused stream and BGK collide step of a D2Q9 lattice, in place with the
+// AA pattern: f holds 9 planes of width x height. Even steps read and write the
+// cell's own distributions (written to the opposite slots); odd steps pull from
+// and push to the neighbours. Each location is read and written by one thread
+// only, and walls bounce back. The velocity added to forceU/forceV (by addInk)
+// is applied with the exact difference method and cleared; u, v and p receive
+// the macroscopic fields in simulation units.
+extern "C" __global__ void streamCollide(float *f, Array2D<0> forceU, Array2D<1> forceV, Array2D<2> u, Array2D<3> v, Array2D<4> p,
+	const int odd, const float omega, const float velocityScale, const float pressureScale)
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	int j = blockIdx.y * blockDim.y + threadIdx.y;
+	int height = u.getCount(0);
+	int width = u.getCount(1);
+
+	if (i >= width || j >= height)
+		return;
+
+	size_t plane = size_t(width) * height;
+	size_t cell = i + size_t(width) * j;
+	float fq[9];
+	for (int q = 0; q < 9; ++q)
+	{
+		int x = i - latticeX[q];
+		int y = j - latticeY[q];
+		if (!odd)
+			fq[q] = f[q * plane + cell];
+		else if (x >= 0 && x < width && y >= 0 && y < height)
+			fq[q] = f[latticeOpposite[q] * plane + x + size_t(width) * y];
+		else
+			fq[q] = f[q * plane + cell];	// bounced back at the wall in the last step
+	}
+
+	float rho = 0.f, mx = 0.f, my = 0.f;
+	for (int q = 0; q < 9; ++q)
+	{
+		rho += fq[q];
+		mx += latticeX[q] * fq[q];
+		my += latticeY[q] * fq[q];
+	}
+	float ux = mx / rho;
+	float uy = my / rho;
+
+	// injected velocity, limited to keep the lattice Mach number low
+	float du = forceU[j][i] * velocityScale;
+	float dv = forceV[j][i] * velocityScale;
+	forceU[j][i] = 0.f;
+	forceV[j][i] = 0.f;
+	float vx = ux + du, vy = uy + dv;
+	float speed = sqrtf(vx * vx + vy * vy);
+	if (speed > 0.3f)
+	{
+		vx *= 0.3f / speed;
+		vy *= 0.3f / speed;
+	}
+
+	for (int q = 0; q < 9; ++q)
+	{
+		float feq = equilibrium(q, rho, ux, uy);
+		float g = fq[q] - omega * (fq[q] - feq) + equilibrium(q, rho, vx, vy) - feq;
+		int x = i + latticeX[q];
+		int y = j + latticeY[q];
+		if (!odd)
+			f[latticeOpposite[q] * plane + cell] = g;
+		else if (x >= 0 && x < width && y >= 0 && y < height)
+			f[q * plane + x + size_t(width) * y] = g;
+		else
+			f[latticeOpposite[q] * plane + cell] = g;	// bounce back
+	}
+
+	u[j][i] = vx / velocityScale;
+	v[j][i] = vy / velocityScale;
+	p[j][i] = pressureScale * (rho - 1.f) / 3.f;
+}
+
+// position of species s of a cell in the dye buffer, see dye.h
+extern __device__ size_t dyeIndex(int layout, int species, size_t cell, int s)
+{
+	if (layout == 1)	// AoSoA, blocks of 32 cells
+		return ((cell / 32) * species + s) * 32 + cell % 32;
+	return cell * species + s;
+}
+
+// Advects all species of the dye (width x height cells) with one read of the
+// velocity, which lives on a grid cellSize times coarser and is interpolated at
+// the cell centres. The border reads as zero, as the ink boundary condition.
+extern "C" __global__ void advectDye(const float *dye, float *dyeNew, Array2D<0> u, Array2D<1> v, const int width, const int height,
+	const int species, const int layout, const float dt, const float rdx, const float cellSize)
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	int j = blockIdx.y * blockDim.y + threadIdx.y;
+	int coarseHeight = u.getCount(0);
+	int coarseWidth = u.getCount(1);
+
+	if (i >= width || j >= height)
+		return;
+
+	float cx = clamp((i + 0.5f) / cellSize - 0.5f, 0.0, (float)coarseWidth - 1);
+	float cy = clamp((j + 0.5f) / cellSize - 0.5f, 0.0, (float)coarseHeight - 1);
+	int x0 = (int) floor(cx);
+	int y0 = (int) floor(cy);
+	int x1 = clamp(x0 + 1, 0, coarseWidth - 1);
+	int y1 = clamp(y0 + 1, 0, coarseHeight - 1);
+	float s_x = cx - x0;
+	float s_y = cy - y0;
+	float u_ = (1.f - s_y)*((1.f - s_x)*u[y0][x0] + s_x*u[y0][x1]) + s_y*((1.f - s_x)*u[y1][x0] + s_x*u[y1][x1]);
+	float v_ = (1.f - s_y)*((1.f - s_x)*v[y0][x0] + s_x*v[y0][x1]) + s_y*((1.f - s_x)*v[y1][x0] + s_x*v[y1][x1]);
+
+	float pos_x = clamp(i - u_ * dt * rdx, 0.0, (float)width - 1);
+	float pos_y = clamp(j - v_ * dt * rdx, 0.0, (float)height - 1);
+	int x = (int) floor(pos_x);
+	int y = (int) floor(pos_y);
+	int xn = clamp(x + 1, 0, width - 1);
+	int yn = clamp(y + 1, 0, height - 1);
+	float t_x = pos_x - x;
+	float t_y = pos_y - y;
+
+	// border cells contribute nothing
+	bool innerX = x > 0 && x < width - 1, innerXn = xn > 0 && xn < width - 1;
+	bool innerY = y > 0 && y < height - 1, innerYn = yn > 0 && yn < height - 1;
+	size_t c00 = x + size_t(width) * y, c10 = xn + size_t(width) * y;
+	size_t c01 = x + size_t(width) * yn, c11 = xn + size_t(width) * yn;
+	size_t cell = i + size_t(width) * j;
+	for (int s = 0; s < species; ++s)
+	{
+		float pixel00 = innerX && innerY ? dye[dyeIndex(layout, species, c00, s)] : 0.f;
+		float pixel10 = innerXn && innerY ? dye[dyeIndex(layout, species, c10, s)] : 0.f;
+		float pixel01 = innerX && innerYn ? dye[dyeIndex(layout, species, c01, s)] : 0.f;
+		float pixel11 = innerXn && innerYn ? dye[dyeIndex(layout, species, c11, s)] : 0.f;
+		dyeNew[dyeIndex(layout, species, cell, s)] = (1.f - t_y)*((1.f - t_x)*pixel00 + t_x*pixel10) + t_y*((1.f - t_x)*pixel01 + t_x*pixel11);
+	}
+}
+
+// the ink of addInk for species s of the dye
+extern "C" __global__ void addDye(float *dye, const int width, const int height, const int species, const int layout, const int s,
+	const int x, const int y, const float amount)
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	int j = blockIdx.y * blockDim.y + threadIdx.y;
+
+	if (i >= width || j >= height)
+		return;
+
+	int dx = i - x;
+	int dy = j - y;
+	float f = 1.f / pow(2., static_cast<double>(dx*dx + dy*dy) / 200.);
+
+	size_t index = dyeIndex(layout, species, i + size_t(width) * j, s);
+	dye[index] = clamp(dye[index] + amount * f, 0.0, 255.0);
+}
+
+// RGBA8 from the dye, each channel the palette-weighted sum of all species
+extern "C" __global__ void dyeToColor(uint8_t *color, const float *dye, const int width, const int height, const int species, const int layout,
+	const float *palette)
+{
+	int i = blockIdx.x * blockDim.x + threadIdx.x;
+	int j = blockIdx.y * blockDim.y + threadIdx.y;
+
+	if (i >= width || j >= height)
+		return;
+
+	size_t cell = i + size_t(width) * j;
+	float r = 0.f, g = 0.f, b = 0.f;
+	for (int s = 0; s < species; ++s)
+	{
+		float d = dye[dyeIndex(layout, species, cell, s)];
+		r += d * palette[3 * s];
+		g += d * palette[3 * s + 1];
+		b += d * palette[3 * s + 2];
+	}
+	color[4 * cell] = static_cast<uint8_t>(min(r, 255.f));
+	color[4 * cell + 1] = static_cast<uint8_t>(min(g, 255.f));
+	color[4 * cell + 2] = static_cast<uint8_t>(min(b, 255.f));
+	color[4 * cell + 3] = 0;
+}
+
+// Ensemble kernels: members independent simulations of width x height cells in
+// one buffer per field, lane-interleaved (member m of cell c at c * members + m).
+// One thread per cell and member, so a warp handles consecutive members of the
+// same cells and every access of the stencil is coalesced across the warp.
+__device__ bool ensembleThread(const int width, const int height, const int members, int& i, int& j, int& m)
+{
+	size_t t = blockIdx.x * size_t(blockDim.x) + threadIdx.x;
+	m = t % members;
+	size_t cell = t / members;
+	i = cell % width;
+	j = cell / width;
+	return j < height;
+}
+
+__device__ size_t ensembleIndex(const int width, const int members, int i, int j, int m)
+{
+	return (i + size_t(width) * j) * members + m;
+}
+
+extern "C" __global__ void ensembleAdvect(const float *q, float *qNew, const float *u, const float *v, const int width, const int height,
+	const int members, const float dt, const float rdx)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	size_t c = ensembleIndex(width, members, i, j, m);
+	float pos_x = clamp(i - u[c] * dt * rdx, 0.0, (float)width - 1);
+	float pos_y = clamp(j - v[c] * dt * rdx, 0.0, (float)height - 1);
+	int x = (int) floor(pos_x);
+	int y = (int) floor(pos_y);
+	int xn = clamp(x + 1, 0, width - 1);
+	int yn = clamp(y + 1, 0, height - 1);
+	float t_x = pos_x - x;
+	float t_y = pos_y - y;
+
+	float pixel00 = q[ensembleIndex(width, members, x, y, m)];
+	float pixel10 = q[ensembleIndex(width, members, xn, y, m)];
+	float pixel01 = q[ensembleIndex(width, members, x, yn, m)];
+	float pixel11 = q[ensembleIndex(width, members, xn, yn, m)];
+	qNew[c] = (1.f - t_y)*((1.f - t_x)*pixel00 + t_x*pixel10) + t_y*((1.f - t_x)*pixel01 + t_x*pixel11);
+}
+
+// alpha and rbeta hold one value per member
+extern "C" __global__ void ensembleJacobi(const float *x, float *xNew, const float *b, const int width, const int height, const int members,
+	const float *alpha, const float *rbeta)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	size_t c = ensembleIndex(width, members, i, j, m);
+	xNew[c] = rbeta[m] * (alpha[m] * b[c]
+		+ x[ensembleIndex(width, members, clamp(i + 1, 0, width - 1), j, m)]
+		+ x[ensembleIndex(width, members, clamp(i - 1, 0, width - 1), j, m)]
+		+ x[ensembleIndex(width, members, i, clamp(j + 1, 0, height - 1), m)]
+		+ x[ensembleIndex(width, members, i, clamp(j - 1, 0, height - 1), m)]);
+}
+
+extern "C" __global__ void ensembleDivergence(const float *u, const float *v, float *div, const int width, const int height, const int members,
+	const float halfrdx)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	div[ensembleIndex(width, members, i, j, m)] = halfrdx * (u[ensembleIndex(width, members, clamp(i + 1, 0, width - 1), j, m)]
+		- u[ensembleIndex(width, members, clamp(i - 1, 0, width - 1), j, m)]
+		+ v[ensembleIndex(width, members, i, clamp(j + 1, 0, height - 1), m)]
+		- v[ensembleIndex(width, members, i, clamp(j - 1, 0, height - 1), m)]);
+}
+
+extern "C" __global__ void ensembleSubtractGradient(const float *p, const float *u, const float *v, float *uNew, float *vNew,
+	const int width, const int height, const int members, const float halfrdx)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	size_t c = ensembleIndex(width, members, i, j, m);
+	uNew[c] = u[c] - halfrdx * (p[ensembleIndex(width, members, clamp(i + 1, 0, width - 1), j, m)]
+		- p[ensembleIndex(width, members, clamp(i - 1, 0, width - 1), j, m)]);
+	vNew[c] = v[c] - halfrdx * (p[ensembleIndex(width, members, i, clamp(j + 1, 0, height - 1), m)]
+		- p[ensembleIndex(width, members, i, clamp(j - 1, 0, height - 1), m)]);
+}
+
+extern "C" __global__ void ensembleBoundary(float *x, const int width, const int height, const int members, const float scale)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	size_t c = ensembleIndex(width, members, i, j, m);
+	if (i == 0)
+		x[c] = scale*x[ensembleIndex(width, members, i + 1, j, m)];
+	else if (i == width - 1)
+		x[c] = scale*x[ensembleIndex(width, members, i - 1, j, m)];
+	else if (j == 0)
+		x[c] = scale*x[ensembleIndex(width, members, i, j + 1, m)];
+	else if (j == height - 1)
+		x[c] = scale*x[ensembleIndex(width, members, i, j - 1, m)];
+}
+
+// all injections of a frame in one launch: count records of 6 floats
+// (member, x, y, u, v, ink), applied in order as addInk does
+extern "C" __global__ void ensembleAddInk(float *u, float *v, float *ink, const int width, const int height, const int members,
+	const float *injections, const int count)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	size_t c = ensembleIndex(width, members, i, j, m);
+	for (int k = 0; k < count; ++k)
+	{
+		const float *in = injections + 6 * k;
+		if (static_cast<int>(in[0]) != m)
+			continue;
+		int dx = i - static_cast<int>(in[1]);
+		int dy = j - static_cast<int>(in[2]);
+		float s = 1.f / pow(2., static_cast<double>(dx*dx + dy*dy) / 200.);
+
+		u[c] += in[3] * s;
+		v[c] += in[4] * s;
+		ink[c] = clamp(ink[c] + in[5] * s, 0.0, 255.0);
+	}
+}
+
+// lane m of dst (members lanes) is lane map[m] of src (srcMembers lanes)
+extern "C" __global__ void ensembleRelayout(const float *src, float *dst, const int width, const int height, const int members,
+	const int srcMembers, const int *map)
+{
+	int i, j, m;
+	if (!ensembleThread(width, height, members, i, j, m))
+		return;
+
+	size_t cell = i + size_t(width) * j;
+	dst[cell * members + m] = src[cell * srcMembers + map[m]];
+}
@@ -2,9 +2,42 @@
 
 #include <Matog.h>
 #include "matog_gen/Array2D.h"
+#include "tracer.h"
 
 namespace FluidSim
 {
+	// simulated time of one frame (the time step without --cfl), cell size and
+	// viscosity of every engine
+	const float frameTime = 0.001f;
+	const float dx = 0.1f;
+	const float viscosity = 0.001f;
+
+	enum Kernel
+	{
+		ADVECTION,
+		JACOBI,
+		DIVERGENCE,
+		SUBTRACT_GRADIENT,
+		BOUNDARY,
+		ADD_INK,
+		CONVERT_TO_COLOR,
+		CONVERT_TO_COLOR2,
+		RESIDUAL,
+		STREAM_COLLIDE,
+		SPLAT,
+		ADVECT_DYE,
+		ADD_DYE,
+		DYE_TO_COLOR,
+		KERNEL_COUNT
+	};
+
+	const char* kernelName(int kernel);
+
+	struct BlockShape
+	{
+		int x, y;
+	};
+
 	struct cudaInfo
 	{
 		CUdevice   device;
@@ -18,18 +51,84 @@ namespace FluidSim
 		CUfunction addInk_function;
 		CUfunction convertToColor_function;
 		CUfunction convertToColor2_function;
+		CUfunction residual_function;
+		CUfunction streamCollide_function;
+		CUfunction splat_function;
+		CUfunction advectDye_function;
+		CUfunction addDye_function;
+		CUfunction dyeToColor_function;
 		size_t     totalGlobalMem;
 
 		int height, width;
         int threads_x, threads_y;
+		// per-kernel block shape, e.g. from the auto-tuner; 0 uses threads_x/threads_y
+		BlockShape blocks[KERNEL_COUNT];
+
+		// kernel launches are traced while this tracer is open, may be null
+		Tracer* tracer;
 	};
 
+	// all kernels use threads_x x threads_y
+	void resetBlockShapes(cudaInfo & info);
+
+	// loads fluidSimKernel.cu into info.module, requires a current context
+	void loadKernels(cudaInfo & info);
+
 	void advect(cudaInfo & info, Array2D::Device *q, Array2D::Device *qNew, Array2D::Device *u, Array2D::Device *v, float dt, float rdx);
 	void jacobi(cudaInfo & info, Array2D::Device *x, Array2D::Device *xNew, Array2D::Device *b, float alpha, float rbeta);
 	void divergence(cudaInfo & info, Array2D::Device *u, Array2D::Device *v, Array2D::Device *div, float halfrdx);
-	void subtractGradient(cudaInfo & info, Array2D::Device *p, Array2D::Device *u, Array2D::Device *v, Array2D::Device *uNew, Array2D::Device *vNew, float halfrdx);
+	// maxSpeed, if set, is an unsigned int that receives the bits of max(|uNew| + |vNew|) (atomic max, zero it first)
+	void subtractGradient(cudaInfo & info, Array2D::Device *p, Array2D::Device *u, Array2D::Device *v, Array2D::Device *uNew, Array2D::Device *vNew, float halfrdx, CUdeviceptr maxSpeed = 0);
 	void boundary(cudaInfo & info, Array2D::Device *x, float scale);
 	void addInk(cudaInfo & info, Array2D::Device *u, Array2D::Device *v, Array2D::Device *ink, int x, int y, float u_, float v_, float ink_);
+	// addInk for one field of cellSize x cellSize cells of the x, y grid, clamped to [lo, hi]
+	void splat(cudaInfo & info, Array2D::Device *q, int x, int y, float value, float cellSize, float lo, float hi);
 	void convertToColor(cudaInfo & info, CUdeviceptr color, Array2D::Device *x);
 	void convertToColor2(cudaInfo & info, CUdeviceptr color, Array2D::Device *r, Array2D::Device *g, Array2D::Device *b);
+	// adds the squared Jacobi update of x and the squared right-hand side to the two floats at sums
+	void residual(cudaInfo & info, Array2D::Device *x, Array2D::Device *b, CUdeviceptr sums, float alpha, float rbeta);
+	// dye buffers of info.width x info.height cells with species values each in layout (dye.h);
+	// u and v on a grid cellSize times coarser, rdx in dye cells
+	void advectDye(cudaInfo & info, CUdeviceptr dye, CUdeviceptr dyeNew, Array2D::Device *u, Array2D::Device *v, int species, int layout,
+		float dt, float rdx, float cellSize);
+	void addDye(cudaInfo & info, CUdeviceptr dye, int species, int layout, int s, int x, int y, float amount);
+	// palette holds 3 floats per species
+	void dyeToColor(cudaInfo & info, CUdeviceptr color, CUdeviceptr dye, int species, int layout, CUdeviceptr palette);
+	// one D2Q9 lattice Boltzmann step on the 9 distribution planes at lattice; odd alternates every step
+	void streamCollide(cudaInfo & info, CUdeviceptr lattice, Array2D::Device *forceU, Array2D::Device *forceV,
+		Array2D::Device *u, Array2D::Device *v, Array2D::Device *p, int odd, float omega, float velocityScale, float pressureScale);
+
+	// Batched kernels of an ensemble (ensemble.h): every field is one buffer of
+	// width x height x members floats, member m of cell c at c * members + m,
+	// launched with one thread per cell and member in 1D blocks of threads.
+	struct ensembleInfo
+	{
+		CUmodule   module;
+		CUfunction advect_function;
+		CUfunction jacobi_function;
+		CUfunction divergence_function;
+		CUfunction subtractGradient_function;
+		CUfunction boundary_function;
+		CUfunction addInk_function;
+		CUfunction relayout_function;
+
+		int width, height, members;
+		int threads;
+
+		Tracer* tracer;
+	};
+
+	// loads fluidSimKernel.cu into info.module, requires a current context
+	void loadEnsembleKernels(ensembleInfo & info);
+
+	void ensembleAdvect(ensembleInfo & info, CUdeviceptr q, CUdeviceptr qNew, CUdeviceptr u, CUdeviceptr v, float dt, float rdx);
+	// alpha and rbeta hold one float per member
+	void ensembleJacobi(ensembleInfo & info, CUdeviceptr x, CUdeviceptr xNew, CUdeviceptr b, CUdeviceptr alpha, CUdeviceptr rbeta);
+	void ensembleDivergence(ensembleInfo & info, CUdeviceptr u, CUdeviceptr v, CUdeviceptr div, float halfrdx);
+	void ensembleSubtractGradient(ensembleInfo & info, CUdeviceptr p, CUdeviceptr u, CUdeviceptr v, CUdeviceptr uNew, CUdeviceptr vNew, float halfrdx);
+	void ensembleBoundary(ensembleInfo & info, CUdeviceptr x, float scale);
+	// count injections of 6 floats (member, x, y, u, v, ink) in one launch
+	void ensembleAddInk(ensembleInfo & info, CUdeviceptr u, CUdeviceptr v, CUdeviceptr ink, CUdeviceptr injections, int count);
+	// lane l of dst (info.members lanes) from lane map[l] of src (srcMembers lanes); map holds info.members ints
+	void ensembleRelayout(ensembleInfo & info, CUdeviceptr src, CUdeviceptr dst, int srcMembers, CUdeviceptr map);
 };
\ No newline at end of file
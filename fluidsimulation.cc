@@ -7,7 +7,10 @@
 #include <cstdlib>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <chrono>
 #include <fstream>
+#include <limits>
 
 #include "fluidsimulation.h"
 #include "gif.h"
@@ -20,74 +23,301 @@
 #endif
 
 
-const char *module_file = (char*) "fluidSimKernel.cu";
-const char *advection_kernel_name = (char*) "advect";
-const char *jacobi_kernel_name = (char*) "jacobi";
-const char *divergence_kernel_name = (char*) "divergence";
-const char *subtractGradient_kernel_name = (char*) "subtractGradient";
-const char *boundary_kernel_name = (char*) "boundary";
-const char *addInk_kernel_name = (char*) "addInk";
-const char *convertToColor_kernel_name = (char*) "convertToColor";
-const char *convertToColor2_kernel_name = (char*) "convertToColor2";
-
 const char *fileP = "p.gif";
 const char *fileInk = "ink.gif";
 
+// limits of CFL time stepping
+const int maxFramesPerStep = 64;
+const int maxSubstepsPerFrame = 16;
+// smallest BGK relaxation time; below it the lattice goes unstable at the injected speeds
+const float minRelaxationTime = 0.55f;
+
 using namespace FluidSim;
 
-FluidSimulation::FluidSimulation(int width /*= 512*/, int height /*= 512*/, int threads_x /*= 16*/, int threads_y /*= 16*/, bool saveImages_ /*= false*/, const char * inputFile /*= ""*/)
-	: gifWriterP(new GifWriter)
-	, gifWriterInk(new GifWriter)
+FluidSimulation::FluidSimulation()
+	: coarsening(1)
+	, species(3)
+	, dyeLayout(Dye::INTERLEAVED)
+	, d_dye(0)
+	, d_dyeTemp(0)
+	, d_palette(0)
+	, d_lattice(0)
+	, d_forceU(nullptr)
+	, d_forceV(nullptr)
 	, lastPosX(-1)
 	, lastPosY(-1)
-	, currentColor(RED)
-	, saveImages(saveImages_)
-	, eventIndex(0)
+	, saveImages(false)
+	, predefined(false)
+	, demoScenario(true)
+	, outputInterval(10)
+	, diffusionIterations(35)
+	, pressureIterations(35)
+	, injections(0)
+	, cfl(0.f)
+	, maxSpeed(0.f)
+	, diffusionTolerance(1e-4f)
+	, engine(STABLE_FLUIDS)
+	, latticeSubsteps(10)
+	, latticeParity(0)
+	, spectralPressure(false)
+	, comparePressure(false)
+	, frameIndex(0)
+	, initialized(false)
+	, outputsOpen(false)
+	, selectedSpecies(0)
+	, dyeHostFrame(-1)
+	, gifWriterP(new GifWriter)
+	, gifWriterInk(new GifWriter)
+{
+	std::fill(fieldFrame, fieldFrame + FIELD_COUNT, -1);
+}
+
+FluidSimulation::FluidSimulation(const Options& options)
+	: FluidSimulation()
+{
+	init(options);
+}
+
+FluidSimulation::~FluidSimulation()
 {
+	shutdown();
+}
+
+void FluidSimulation::init(const Options& options)
+{
+	if (initialized)
+		shutdown();
+
 	printf("- Initializing...\n");
 
-	info.width = width;
-	info.height = height;
-    info.threads_x = threads_x;
-    info.threads_y = threads_y;
+	saveImages = options.saveImages;
+	demoScenario = options.demoScenario;
+	outputInterval = std::max(options.outputInterval, 1);
+	dumpFrames = options.dumpFrames;
+	dumpDir = options.dumpDir ? options.dumpDir : "";
+	std::sort(dumpFrames.begin(), dumpFrames.end());
+	injections = 0;
+	cfl = std::max(options.cfl, 0.f);
+	maxSpeed = 0.f;
+	solverSteps = 0;
+	maxSubsteps = maxStepFrames = 0;
+	minDt = maxDt = frameTime;
+	diffusionTolerance = options.diffusionTolerance;
+	std::fill(diffusionSteps, diffusionSteps + Diffusion::METHOD_COUNT, 0ull);
+	diffusionPasses = 0;
+	pressurePasses = 0;
+	diffusionBound = 0.0;
+	diffusionError = 0.f;
+	diffusionChecks = 0;
+	comparePressure = options.comparePressure;
+	spectralPressure = options.spectralPressure || comparePressure;
+	pressureComparisons.clear();
+	engine = options.engine;
+	latticeSubsteps = std::max(options.latticeSubsteps, 1);
+	float frameBudgetMs = options.frameBudgetMs;
+	if (engine == LATTICE_BOLTZMANN)
+	{
+		if (cfl > 0.f || spectralPressure || frameBudgetMs > 0.f)
+			printf("> --cfl, --realtime and --pressure do not apply to the lattice Boltzmann engine\n");
+		cfl = 0.f;
+		spectralPressure = comparePressure = false;
+		frameBudgetMs = 0.f;
+	}
+	if (cfl > 0.f && frameBudgetMs > 0.f)
+	{
+		// a step may span several frames or be one of several substeps
+		printf("> --realtime does not apply with --cfl\n");
+		frameBudgetMs = 0.f;
+	}
+	frameIndex = 0;
+	selectedSpecies = 0;
+	awaitingOutput.clear();
+	latencyMs.clear();
+	species = options.species;
+	dyeLayout = options.dyeLayout;
+	if (species < 1)
+	{
+		fprintf(stderr, "Error: at least one dye species is required\n");
+		exit(-1);
+	}
+	if (!Dye::parsePalette(options.palette ? options.palette : "", species, palette))
+		exit(-1);
+	dyeData.assign(species, std::vector<float>());
+	dyeFrame.assign(species, -1);
+	invalidateFields();
+
+	info.tracer = &tracer;
+	info.width = options.width;
+	info.height = options.height;
+    info.threads_x = options.threads_x;
+    info.threads_y = options.threads_y;
+	resetBlockShapes(info);
+	coarsening = options.coarsening;
+	if ((coarsening != 1 && coarsening != 2 && coarsening != 4) || info.width % coarsening != 0 || info.height % coarsening != 0)
+	{
+		fprintf(stderr, "Error: the solver grid must be 1, 2 or 4 times coarser and divide %dx%d\n", info.width, info.height);
+		exit(-1);
+	}
+
+	const char* inputFile = options.inputFile;
     
 	// check for empty string
 	predefined = (inputFile && inputFile[0] != '\0');
 
-	if (predefined);
+	if (predefined)
 		loadEventsFromFile(inputFile);
 
 	initCUDA();
 	initGL();
 
+	// same device and kernels, only the launch size differs
+	grid = info;
+	grid.width = info.width / coarsening;
+	grid.height = info.height / coarsening;
+
 	setupDeviceMemory();
+	// before the host memory, whose rows the solver's threads touch first
+	if (spectralPressure)
+	{
+		poisson.init(grid.width, grid.height, options.hostThreads, options.affinity);
+		poissonRhs.reset(new float[size_t(grid.width) * grid.height]);
+		poissonSolution.reset(new float[size_t(grid.width) * grid.height]);
+		poisson.firstTouch(poissonRhs.get());
+		poisson.firstTouch(poissonSolution.get());
+		printf("> Spectral pressure solve on %d threads, affinity %s\n", poisson.threadCount(), Numa::affinityName(options.affinity));
+	}
+
 	setupHostMemory();
+	if (spectralPressure)
+		printPlacement();
 
 	copyAllHtoD();
 
+	if (options.tune)
+	{
+		AutoTuner::Arrays scratch = { d_u, d_v, d_temp1, d_temp2, d_p, d_image, d_lattice, d_dye, d_dyeTemp, d_palette, species, dyeLayout };
+		// at the size of the solver grid, where the time goes
+		AutoTuner::tune(options.tuningDatabase, grid, scratch);
+		// the tuning runs overwrote the scratch arrays
+		copyAllHtoD();
+	}
+	else if (options.tunedBlocks && !AutoTuner::load(options.tuningDatabase, grid))
+		printf("> No tuned block shapes for %dx%d, using %dx%d (tune with --tune)\n", grid.width, grid.height, info.threads_x, info.threads_y);
+	std::copy(grid.blocks, grid.blocks + KERNEL_COUNT, info.blocks);
+	if (coarsening > 1)
+		printf("> Velocity and pressure on %dx%d, ink on %dx%d\n", grid.width, grid.height, info.width, info.height);
+	if (species != 3 || dyeLayout != Dye::INTERLEAVED)
+		printf("> %d dye species, %s layout\n", species, Dye::layoutName(dyeLayout));
+
 	cuCtxSynchronize();
 
-	int i = 0;
+	if (options.traceFile && options.traceFile[0] != '\0')
+	{
+		tracer.open(options.traceFile, options.traceCapacity, options.traceRing);
+		tracer.setThreadName("simulation");
+	}
+
+	// the profiler is always set up so SIGUSR1 can switch it on later
+	profiler.open(options.profileReport, options.profileFormat, options.profile);
+	if (options.perfCounters)
+		profiler.openCounters();
+	profiler.setTracer(&tracer);
+	if (options.profileSignal)
+		PhaseProfiler::installSignalToggle();
+	rawStream.setProfiler(&profiler);
+
+	RealtimeController::Settings realtimeSettings;
+	realtimeSettings.budgetMs = frameBudgetMs;
+	realtimeSettings.maxIterations[RealtimeController::DIFFUSION] = diffusionIterations;
+	realtimeSettings.maxIterations[RealtimeController::PRESSURE] = pressureIterations;
+	realtime.open(realtimeSettings, stdout);
+
+	if (options.rawStreamPath && options.rawStreamPath[0] != '\0')
+		rawStream.open(options.rawStreamPath, options.rawStreamFormat, info.width, info.height, 25, options.rawStreamQueue);
+	if (options.sharedMemoryName && options.sharedMemoryName[0] != '\0')
+		frameServer.open(options.sharedMemoryName, info.width, info.height, options.sharedMemorySlots, options.controlSocket);
+
 #ifndef WITH_GUI
 	gifWriterP.reset(new GifWriter);
 	gifWriterInk.reset(new GifWriter);
     startWritingToImage();
-    
-	for(; true; i++){
-		if (predefined && eventIndex >= events.size()){
-            break;
-        }
-        update(i);        
-    }		
+#endif
+	outputsOpen = true;
+	initialized = true;
+}
 
-	stopWritingToImage();
+void FluidSimulation::run()
+{
+#ifndef WITH_GUI
+	Timer timer;
+	timer.reset();
+	timer.tic();
+
+	makeCurrent();
+	int first = frameIndex;
+	int end = predefined ? events.endFrame() : std::numeric_limits<int>::max();
+	while (frameIndex < end)
+	{
+		advance(end);
+		realtime.pace();
+	}
+	int frames = frameIndex - first;
+
+	finishOutputs();
+
+	cuCtxSynchronize();
+	timer.toc();
+	printf("- Simulated %d frames in %lld ms\n", frames, timer.getTotalTime());
+	if (cfl > 0.f)
+		printf("- CFL %.2f: %llu solver steps, dt %.3g..%.3g s, up to %d frames per step, up to %d substeps per frame\n",
+			cfl, solverSteps, minDt, maxDt, maxStepFrames, maxSubsteps);
+	profiler.printSummary(stdout);
+	printLatency(stdout);
+	realtime.printSummary(stdout);
+	if (engine == LATTICE_BOLTZMANN)
+		printf("- Lattice Boltzmann: %d stream-collide steps per frame\n", latticeSubsteps);
+	else
+	{
+		printf("- Diffusion:");
+		for (int m = 0; m < Diffusion::METHOD_COUNT; ++m)
+			if (diffusionSteps[m] > 0)
+				printf(" %s %llu steps,", Diffusion::methodName(m), diffusionSteps[m]);
+		printf(" error bound %.2e of |u|", diffusionBound);
+		if (diffusionChecks > 0)
+			printf(", measured <= %.2e (%d checks)", diffusionError, diffusionChecks);
+		printf("\n");
+	}
+	if (!pressureComparisons.empty())
+	{
+		PressureComparison mean = { 0.f, 0.f, 0.f, 0.f };
+		for (const PressureComparison& c : pressureComparisons)
+		{
+			mean.jacobiMs += c.jacobiMs;
+			mean.jacobiResidual += c.jacobiResidual;
+			mean.spectralMs += c.spectralMs;
+			mean.spectralResidual += c.spectralResidual;
+		}
+		float n = static_cast<float>(pressureComparisons.size());
+		printf("- Pressure over %zu frames: %d Jacobi sweeps %.3f ms, residual %.2e; DCT %.3f ms (with transfers), residual %.2e\n",
+			pressureComparisons.size(), pressureIterations, mean.jacobiMs / n, mean.jacobiResidual / n, mean.spectralMs / n, mean.spectralResidual / n);
+	}
+	if (profiler.profiledFrames() > 0)
+	{
+		double steps = static_cast<double>(std::max(solverSteps, 1ull));
+		TrafficModel::Step step = { info.width, info.height, diffusionPasses / steps, pressurePasses / steps,
+			double(injections) / std::max(frames, 1), engine == LATTICE_BOLTZMANN ? latticeSubsteps : 0, coarsening, species,
+			spectralPressure };
+		TrafficModel::printRoofline(stdout, profiler, step, TrafficModel::devicePeak(info.device));
+	}
+	tracer.close();
 #else
 	// rendering loop
 	do
 	{
 		glClear(GL_COLOR_BUFFER_BIT);
 
-		update(i++);
+		checkForUserInput();
+		step(1);
 
 		glfwSwapBuffers(window);
 		glfwPollEvents();
@@ -97,10 +327,174 @@ FluidSimulation::FluidSimulation(int width /*= 512*/, int height /*= 512*/, int
 #endif
 }
 
-FluidSimulation::~FluidSimulation()
+void FluidSimulation::step(int n)
+{
+	makeCurrent();
+	int end = frameIndex + n;
+	while (frameIndex < end)
+		advance(end);
+}
+
+void FluidSimulation::advance(int end)
 {
+	int frames = 1, substeps = 1;
+	if (cfl > 0.f)
+		planStep(end - frameIndex, frames, substeps);
+	float dt = frames * frameTime / substeps;
+	// one profiled frame per step, its substeps add up
+	profiler.beginFrame(frameIndex);
+	for (int s = 0; s < substeps; ++s)
+		update(frameIndex, frames, dt, s == 0, s == substeps - 1);
+	profiler.endFrame();
+
+	solverSteps += substeps;
+	maxSubsteps = std::max(maxSubsteps, substeps);
+	maxStepFrames = std::max(maxStepFrames, frames);
+	minDt = std::min(minDt, dt);
+	maxDt = std::max(maxDt, dt);
+
+	frameIndex += frames - 1;
+	if (!dumpDir.empty() && std::binary_search(dumpFrames.begin(), dumpFrames.end(), frameIndex))
+		dumpFields(frameIndex);
+	++frameIndex;
+}
+
+bool FluidSimulation::injectsAt(int frame)
+{
+#ifdef WITH_GUI
+	return false;
+#else
+	if (predefined)
+	{
+		events.active(frame, activeEvents);
+		return !activeEvents.empty();
+	}
+	return demoScenario && frame % 10 == 0;
+#endif
+}
+
+float FluidSimulation::injectedSpeed(int frame)
+{
+#ifdef WITH_GUI
+	return 0.f;
+#else
+	// splats of overlapping injections add up
+	float speed = 0.f;
+	if (predefined)
+	{
+		events.active(frame, activeEvents);
+		for (uint32_t id : activeEvents)
+		{
+			EventScript::Injection data = EventScript::injection(events[id], frame, info.width, info.height);
+			speed += std::fabs(data.u) + std::fabs(data.v);
+		}
+	}
+	else if (demoScenario && frame % 10 == 0)
+		speed = 200.f;	// predefinedScenario(ALTERNATING): u = 100, |v| <= 100
+	return speed;
+#endif
+}
+
+void FluidSimulation::planStep(int remaining, int& frames, int& substeps)
+{
+	// the step's first substep injects before it is over, so its speed counts;
+	// queued commands have an unknown speed and get a step of one frame
+	float speed = maxSpeed + injectedSpeed(frameIndex);
+	bool commandsPending = !commands.empty();
+	// advection moves by at most cfl cells per step
+	float dtMax = speed > 0.f ? cfl * dx / speed : frameTime * maxFramesPerStep;
+	if (dtMax < frameTime || commandsPending)
+	{
+		frames = 1;
+		substeps = dtMax < frameTime ? std::min(static_cast<int>(std::ceil(frameTime / dtMax)), maxSubstepsPerFrame) : 1;
+		return;
+	}
+
+	// input happens at the start of a step and outputs at its end, as with fixed steps
+	int limit = std::min(std::min(static_cast<int>(dtMax / frameTime), maxFramesPerStep), remaining);
+	int interval = outputInterval * realtime.decimation();
+	frames = 1;
+	substeps = 1;
+	for (int f = frameIndex; frames < limit; ++frames, ++f)
+	{
+		bool ends = f % interval == 0 || std::binary_search(dumpFrames.begin(), dumpFrames.end(), f);
+		if (ends || injectsAt(f + 1))
+			break;
+	}
+}
+
+bool FluidSimulation::inject(float x, float y, float u_, float v_, float amount)
+{
+	CommandQueue::Command command = { CommandQueue::INJECT, x, y, u_, v_, amount, -1, 0 };
+	return commands.push(command);
+}
+
+bool FluidSimulation::inject(float x, float y, float u_, float v_, float amount, Field ink)
+{
+	return inject(x, y, u_, v_, amount, static_cast<int>(ink) - INK_R);
+}
+
+bool FluidSimulation::inject(float x, float y, float u_, float v_, float amount, int species_)
+{
+	CommandQueue::Command command = { CommandQueue::INJECT, x, y, u_, v_, amount, species_, 0 };
+	return commands.push(command);
+}
+
+bool FluidSimulation::selectInk(Field ink)
+{
+	return selectInk(static_cast<int>(ink) - INK_R);
+}
+
+bool FluidSimulation::selectInk(int species_)
+{
+	CommandQueue::Command command = { CommandQueue::SELECT_INK, 0.f, 0.f, 0.f, 0.f, 0.f, species_, 0 };
+	return commands.push(command);
+}
+
+bool FluidSimulation::requestReset()
+{
+	CommandQueue::Command command = { CommandQueue::RESET, 0.f, 0.f, 0.f, 0.f, 0.f, -1, 0 };
+	return commands.push(command);
+}
+
+void FluidSimulation::reset()
+{
+	makeCurrent();
+	cuCtxSynchronize();
+	initHostMemory();
+	copyAllHtoD();
+	frameIndex = 0;
+	maxSpeed = 0.f;
+	lastPosX = -1;
+	lastPosY = -1;
+	CommandQueue::Command discarded;
+	while (commands.pop(discarded))
+		;
+	awaitingOutput.clear();
+	invalidateFields();
+}
+
+void FluidSimulation::invalidateFields()
+{
+	std::fill(fieldFrame, fieldFrame + FIELD_COUNT, -1);
+	std::fill(dyeFrame.begin(), dyeFrame.end(), -1);
+	dyeHostFrame = -1;
+}
+
+void FluidSimulation::shutdown()
+{
+	if (!initialized)
+		return;
+	initialized = false;
+
 	printf("- Finalizing...\n");
 
+	makeCurrent();
+	finishOutputs();
+	tracer.close();
+	profiler.close();
+	realtime.close();
+
 	releaseDeviceMemory();
 	releaseHostMemory();
 	
@@ -112,29 +506,181 @@ FluidSimulation::~FluidSimulation()
 #endif
 }
 
-void FluidSimulation::loadEventsFromFile(const char* path)
+FluidSimulation::FieldView FluidSimulation::readField(Field field)
+{
+	if (field >= INK_R && field <= INK_B)
+		return readDye(field - INK_R);
+
+	Array2D::Host<>* host;
+	Array2D::Device* device;
+	fieldArrays(field, host, device);
+	int width = grid.width;
+	int height = grid.height;
+
+	// copied at most once per frame, the view points into the cache
+	std::vector<float>& data = fieldData[field];
+	if (fieldFrame[field] != frameIndex)
+	{
+		makeCurrent();
+		cuCtxSynchronize();
+		CHECK(cuMemcpyDtoH(host, device, 0));
+		data.resize(size_t(width) * height);
+		for (int y = 0; y < height; ++y) for (int x = 0; x < width; ++x)
+			data[x + y*width] = (*host)[y][x];
+		fieldFrame[field] = frameIndex;
+		markVisible();
+	}
+
+	FieldView view;
+	view.data = data.data();
+	view.stride = width;
+	view.width = width;
+	view.height = height;
+	view.frame = frameIndex;
+	view.device = device;
+	return view;
+}
+
+FluidSimulation::FieldView FluidSimulation::readDye(int s)
 {
-	std::ifstream infile(path);
-	for (std::string line; std::getline(infile, line);)
+	if (s < 0 || s >= species)
 	{
-		std::istringstream in(line);
+		fprintf(stderr, "Error: no dye species %d (%d species)\n", s, species);
+		exit(-1);
+	}
 
-		int frame_start, frame_end;
-		float x_start, x_end, y_start, y_end, amount;
-		in >> frame_start >> frame_end >> x_start >> x_end >> y_start >> y_end >> amount;
+	std::vector<float>& data = dyeData[s];
+	size_t cells = size_t(info.width) * info.height;
+	if (dyeFrame[s] != frameIndex)
+	{
+		// one copy of the buffer serves all species of the frame
+		if (dyeHostFrame != frameIndex)
+		{
+			makeCurrent();
+			cuCtxSynchronize();
+			dyeHost.resize(Dye::size(dyeLayout, species, cells));
+			CHECK(cuMemcpyDtoH(dyeHost.data(), d_dye, dyeHost.size() * sizeof(float)));
+			dyeHostFrame = frameIndex;
+		}
+		data.resize(cells);
+		for (size_t c = 0; c < cells; ++c)
+			data[c] = dyeHost[Dye::index(dyeLayout, species, c, s)];
+		dyeFrame[s] = frameIndex;
+		markVisible();
+	}
 
-		UserEvent event;
-		event.frame_start = frame_start;
-		event.frame_end = frame_end;
-		event.x_start = clamp(x_start, 0.0, 1.0)*info.width;
-		event.x_end = clamp(x_end, 0.0, 1.0)*info.width;
-		event.y_start = clamp(y_start, 0.0, 1.0)*info.height;
-		event.y_end = clamp(y_end, 0.0, 1.0)*info.height;
-		event.amount = amount;
-		events.push_back(event);
+	FieldView view;
+	view.data = data.data();
+	view.stride = info.width;
+	view.width = info.width;
+	view.height = info.height;
+	view.frame = frameIndex;
+	view.device = nullptr;
+	return view;
+}
+
+const char* FluidSimulation::fieldName(Field field)
+{
+	static const char* names[FIELD_COUNT] = { "p", "u", "v", "ink_r", "ink_g", "ink_b" };
+	return field >= 0 && field < FIELD_COUNT ? names[field] : "?";
+}
+
+void FluidSimulation::fieldArrays(Field field, Array2D::Host<>*& host, Array2D::Device*& device)
+{
+	switch (field)
+	{
+	case VELOCITY_U: host = u; device = d_u; break;
+	case VELOCITY_V: host = v; device = d_v; break;
+	default: host = p; device = d_p; break;
 	}
 }
 
+void FluidSimulation::makeCurrent()
+{
+	CHECK(cuCtxSetCurrent(info.context));
+}
+
+void FluidSimulation::finishOutputs()
+{
+	if (!outputsOpen)
+		return;
+	outputsOpen = false;
+
+#ifndef WITH_GUI
+	stopWritingToImage();
+#endif
+	// later steps must not write to the finished gifs
+	saveImages = false;
+	rawStream.close();
+	frameServer.close();
+}
+
+void FluidSimulation::applyCommands()
+{
+	// at most 4096 commands per step, so producers that keep pushing cannot stall it; the
+	// rest waits for the next step
+	CommandQueue::Command command;
+	for (size_t n = 0; n < 4096 && commands.pop(command); ++n)
+	{
+		switch (command.type)
+		{
+		case CommandQueue::INJECT:
+		{
+			int s = command.ink >= 0 && command.ink < species ? command.ink : selectedSpecies;
+			int x = static_cast<int>(command.x * info.width);
+			int y = static_cast<int>(command.y * info.height);
+			injectInk(s, x, y, command.u, command.v, command.amount);
+			++injections;
+			break;
+		}
+		case CommandQueue::SELECT_INK:
+			if (command.ink >= 0 && command.ink < species)
+				selectedSpecies = command.ink;
+			break;
+		case CommandQueue::RESET:
+			initHostMemory();
+			copyAllHtoD();
+			maxSpeed = 0.f;
+			invalidateFields();
+			break;
+		}
+		awaitingOutput.push_back(command.submitted);
+	}
+}
+
+void FluidSimulation::markVisible()
+{
+	if (awaitingOutput.empty())
+		return;
+	// the frame is only visible once the device has finished it
+	cuCtxSynchronize();
+	uint64_t now = CommandQueue::now();
+	for (uint64_t submitted : awaitingOutput)
+		latencyMs.push_back(static_cast<float>((now - submitted) * 1e-6));
+	awaitingOutput.clear();
+}
+
+void FluidSimulation::printLatency(FILE* out) const
+{
+	if (latencyMs.empty())
+		return;
+	std::vector<float> sorted(latencyMs);
+	std::sort(sorted.begin(), sorted.end());
+	auto percentile = [&](double q) { return sorted[std::min(sorted.size() - 1, static_cast<size_t>(q * (sorted.size() - 1) + 0.5))]; };
+	fprintf(out, "- Input to visible frame latency over %zu commands: p50 %.2f ms, p95 %.2f ms, p99 %.2f ms, max %.2f ms",
+		sorted.size(), percentile(0.5), percentile(0.95), percentile(0.99), sorted.back());
+	if (commands.dropped() > 0)
+		fprintf(out, " (%llu dropped, queue full)", commands.dropped());
+	fprintf(out, "\n");
+}
+
+void FluidSimulation::loadEventsFromFile(const char* path)
+{
+	if (!events.load(path))
+		exit(-1);
+	printf("> Loaded %zu events for %d frames from %s\n", events.size(), events.endFrame(), path);
+}
+
 void FluidSimulation::initGL()
 {
 #ifdef WITH_GUI
@@ -195,7 +741,6 @@ void FluidSimulation::initCUDA()
 	auto& device = info.device;
 	auto& totalGlobalMem = info.totalGlobalMem;
 	auto& context = info.context;
-	auto& module = info.module;
 
 	// get first CUDA device
 	CHECK(cuDeviceGet(&device, 0));
@@ -215,62 +760,68 @@ void FluidSimulation::initCUDA()
 		"YES" : "NO");
 
 	CHECK(cuCtxCreate(&context, 0, device));
-	CHECK(cuModuleLoad(&module, module_file));
-	CHECK(cuModuleGetFunction(&info.advection_function, module, advection_kernel_name));
-	CHECK(cuModuleGetFunction(&info.jacobi_function, module, jacobi_kernel_name));
-	CHECK(cuModuleGetFunction(&info.divergence_function, module, divergence_kernel_name));
-	CHECK(cuModuleGetFunction(&info.subtractGradient_function, module, subtractGradient_kernel_name));
-	CHECK(cuModuleGetFunction(&info.boundary_function, module, boundary_kernel_name));
-	CHECK(cuModuleGetFunction(&info.addInk_function, module, addInk_kernel_name));
-	CHECK(cuModuleGetFunction(&info.convertToColor_function, module, convertToColor_kernel_name));
-	CHECK(cuModuleGetFunction(&info.convertToColor2_function, module, convertToColor2_kernel_name));
+	loadKernels(info);
 }
 
 void FluidSimulation::setupDeviceMemory()
 {
 	auto height = info.height;
 	auto width = info.width;
-	d_u = new Array2D::Device(height, width, _fl);
-	d_v = new Array2D::Device(height, width, _fl);
-	d_temp1 = new Array2D::Device(height, width, _fl);
-	d_temp2 = new Array2D::Device(height, width, _fl);
-	d_p = new Array2D::Device(height, width, _fl);
-	d_ink_r = new Array2D::Device(height, width, _fl);
-	d_ink_g = new Array2D::Device(height, width, _fl);
-	d_ink_b = new Array2D::Device(height, width, _fl);
+	d_u = new Array2D::Device(grid.height, grid.width, _fl);
+	d_v = new Array2D::Device(grid.height, grid.width, _fl);
+	d_temp1 = new Array2D::Device(grid.height, grid.width, _fl);
+	d_temp2 = new Array2D::Device(grid.height, grid.width, _fl);
+	d_p = new Array2D::Device(grid.height, grid.width, _fl);
+	size_t dyeBytes = Dye::size(dyeLayout, species, size_t(width) * height) * sizeof(float);
+	CHECK(cuMemAlloc(&d_dye, dyeBytes));
+	CHECK(cuMemAlloc(&d_dyeTemp, dyeBytes));
+	CHECK(cuMemAlloc(&d_palette, palette.size() * sizeof(float)));
+	CHECK(cuMemcpyHtoD(d_palette, palette.data(), palette.size() * sizeof(float)));
 	CHECK(cuMemAlloc(&d_image, 4*sizeof(uint8_t) * info.height*info.width));
+	// residual sums, max speed
+	CHECK(cuMemAlloc(&d_sums, 3 * sizeof(float)));
+	if (engine == LATTICE_BOLTZMANN)
+	{
+		CHECK(cuMemAlloc(&d_lattice, 9 * sizeof(float) * grid.height*grid.width));
+		d_forceU = new Array2D::Device(grid.height, grid.width, _fl);
+		d_forceV = new Array2D::Device(grid.height, grid.width, _fl);
+	}
 }
 
 void FluidSimulation::setupHostMemory()
 {
-	auto height = info.height;
-	auto width = info.width;
-	u = new Array2D::Host<>(height, width, _fl);
-	v = new Array2D::Host<>(height, width, _fl);
-	temp1 = new Array2D::Host<>(height, width, _fl);
-	temp2 = new Array2D::Host<>(height, width, _fl);
-	p = new Array2D::Host<>(height, width, _fl);
-	ink_r = new Array2D::Host<>(height, width, _fl);
-	ink_g = new Array2D::Host<>(height, width, _fl);
-	ink_b = new Array2D::Host<>(height, width, _fl);
+	u = new Array2D::Host<>(grid.height, grid.width, _fl);
+	v = new Array2D::Host<>(grid.height, grid.width, _fl);
+	temp1 = new Array2D::Host<>(grid.height, grid.width, _fl);
+	temp2 = new Array2D::Host<>(grid.height, grid.width, _fl);
+	p = new Array2D::Host<>(grid.height, grid.width, _fl);
 	image.resize(4 * info.height * info.width, 0);
+	initHostMemory();
 }
 
 void FluidSimulation:: initHostMemory()
 {
 	auto height = info.height;
 	auto width = info.width;
-	// initialize host arrays
+	// initialize host arrays, by the rows of the spectral solver's threads,
+	// which copy them; the first touch places a row on its thread's node
+	auto zero = [&](int first, int last) {
+		for (int y = first; y < last; ++y) {
+			for (int x = 0; x < grid.width; ++x){
+				(*u)[y][x] = 0.f;
+				(*v)[y][x] = 0.f;
+				(*temp1)[y][x] = 0.f;
+				(*temp2)[y][x] = 0.f;
+				(*p)[y][x] = 0.f;
+			}
+		}
+	};
+	if (poisson.ready())
+		poisson.workers().run(grid.height, zero);
+	else
+		zero(0, grid.height);
 	for (int y = 0; y < height; ++y) {
 		for (int x = 0; x < width; ++x){
-			(*u)[y][x] = 0.f;
-			(*v)[y][x] = 0.f;
-			(*temp1)[y][x] = 0.f;
-			(*temp2)[y][x] = 0.f;
-			(*p)[y][x] = 0.f;
-			(*ink_r)[y][x] = 0.f;
-			(*ink_g)[y][x] = 0.f;
-			(*ink_b)[y][x] = 0.f;
 			image[4 * (x + y*width)] = 0;
 			image[4 * (x + y*width) + 1] = 0;
 			image[4 * (x + y*width) + 2] = 0;
@@ -279,9 +830,40 @@ void FluidSimulation:: initHostMemory()
 	}
 }
 
+void FluidSimulation::printPlacement()
+{
+	std::vector<size_t> fields, buffers = poisson.placement();
+	Array2D::Host<>* hosts[5] = { u, v, temp1, temp2, p };
+	for (Array2D::Host<>* host : hosts)
+		for (int y = 0; y < grid.height; ++y)
+			Numa::countPages((*host)[y], grid.width * sizeof(float), fields);
+	size_t bytes = size_t(grid.width) * grid.height * sizeof(float);
+	Numa::countPages(poissonRhs.get(), bytes, buffers);
+	Numa::countPages(poissonSolution.get(), bytes, buffers);
+	printf("> NUMA: %d nodes, pages per node: host fields %s, solver buffers %s\n",
+		Numa::nodeCount(), Numa::placement(fields).c_str(), Numa::placement(buffers).c_str());
+}
+
 void FluidSimulation::releaseDeviceMemory()
 {
+	delete d_u;
+	delete d_v;
+	delete d_temp1;
+	delete d_temp2;
+	delete d_p;
+	CHECK(cuMemfree(d_dye));
+	CHECK(cuMemfree(d_dyeTemp));
+	CHECK(cuMemfree(d_palette));
 	CHECK(cuMemfree(d_image));
+	CHECK(cuMemfree(d_sums));
+	if (d_lattice)
+	{
+		CHECK(cuMemfree(d_lattice));
+		delete d_forceU;
+		delete d_forceV;
+		d_lattice = 0;
+		d_forceU = d_forceV = nullptr;
+	}
 }
 
 void FluidSimulation::releaseHostMemory()
@@ -291,9 +873,6 @@ void FluidSimulation::releaseHostMemory()
 	delete temp1;
 	delete temp2;
 	delete p;
-	delete ink_r;
-	delete ink_g;
-	delete ink_b;
 }
 
 void FluidSimulation::copyAllHtoD()
@@ -303,9 +882,26 @@ void FluidSimulation::copyAllHtoD()
 	CHECK(cuMemcpyHtoD(d_temp1, temp1, 0));
 	CHECK(cuMemcpyHtoD(d_temp2, temp2, 0));
 	CHECK(cuMemcpyHtoD(d_p, p, 0));
-	CHECK(cuMemcpyHtoD(d_ink_r, ink_r, 0));
-	CHECK(cuMemcpyHtoD(d_ink_g, ink_g, 0));
-	CHECK(cuMemcpyHtoD(d_ink_b, ink_b, 0));
+	CHECK(cuMemsetD32(d_dye, 0, Dye::size(dyeLayout, species, size_t(info.width) * info.height)));
+	if (d_lattice)
+		initLattice();
+}
+
+void FluidSimulation::initLattice()
+{
+	// f_q = w_q: density 1 at rest
+	const float weights[9] = { 4.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 9.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f, 1.f / 36.f };
+	size_t cells = size_t(grid.width) * grid.height;
+	for (int q = 0; q < 9; ++q)
+	{
+		uint32_t bits;
+		memcpy(&bits, &weights[q], sizeof(bits));
+		CHECK(cuMemsetD32(d_lattice + q * cells * sizeof(float), bits, cells));
+	}
+	// u is zero after initHostMemory()
+	CHECK(cuMemcpyHtoD(d_forceU, u, 0));
+	CHECK(cuMemcpyHtoD(d_forceV, u, 0));
+	latticeParity = 0;
 }
 
 void FluidSimulation::copyAllDtoH()
@@ -315,9 +911,6 @@ void FluidSimulation::copyAllDtoH()
 	CHECK(cuMemcpyHtoD(d_temp1, temp1, 0));
 	CHECK(cuMemcpyHtoD(d_temp2, temp2, 0));
 	CHECK(cuMemcpyHtoD(d_p, p, 0));
-	CHECK(cuMemcpyHtoD(d_ink_r, ink_r, 0));
-	CHECK(cuMemcpyHtoD(d_ink_g, ink_g, 0));
-	CHECK(cuMemcpyHtoD(d_ink_b, ink_b, 0));
 }
 
 void FluidSimulation::renderImage()
@@ -331,8 +924,7 @@ void FluidSimulation::renderImage()
 	CHECK(cuGraphicsSubResourceGetMappedArray(&textureArray, outputTextureResource, 0, 0));
 
 	// write color value of ink to image
-	//convertToColor(info, d_image, d_ink);
-	convertToColor2(info, d_image, d_ink_r, d_ink_g, d_ink_b);
+	dyeToColor(info, d_image, d_dye, species, dyeLayout, d_palette);
 
 	CUDA_MEMCPY2D memcpy;
 	memcpy.srcMemoryType = CU_MEMORYTYPE_DEVICE;
@@ -373,20 +965,115 @@ void FluidSimulation::saveImagesAsGif()
 	if (!saveImages)
 		return;
 
-	cuCtxSynchronize();
-	CHECK(cuMemcpyDtoH(p, d_p, 0));
-	CHECK(cuMemcpyDtoH(ink_r, d_ink_r, 0));
-	CHECK(cuMemcpyDtoH(ink_g, d_ink_g, 0));
-	CHECK(cuMemcpyDtoH(ink_b, d_ink_b, 0));
-	cuCtxSynchronize();
+	PhaseProfiler::HostScope scope(&profiler, PhaseProfiler::OUTPUT_GIF);
+	{
+		Tracer::Scope trace(&tracer, "copy fields DtoH", "gif");
+		cuCtxSynchronize();
+		CHECK(cuMemcpyDtoH(p, d_p, 0));
+		cuCtxSynchronize();
+	}
+
+	{
+		Tracer::Scope trace(&tracer, "writePressureToImage", "gif");
+		writePressureToImage();
+	}
+	{
+		Tracer::Scope trace(&tracer, "GifWriteFrame p", "gif");
+		if (!GifWriteFrame(gifWriterP.get(), image.data(), info.width, info.height, 4))
+			fprintf(stderr, "Error writing %s!\n", fileP);
+	}
+
+	{
+		Tracer::Scope trace(&tracer, "writeInkToImage", "gif");
+		writeInkToImage();
+	}
+	{
+		Tracer::Scope trace(&tracer, "GifWriteFrame ink", "gif");
+		if (!GifWriteFrame(gifWriterInk.get(), image.data(), info.width, info.width, 4))
+			fprintf(stderr, "Error writing %s!\n", fileInk);
+	}
+}
 
-	writePressureToImage();
-	if (!GifWriteFrame(gifWriterP.get(), image.data(), info.width, info.height, 4))
-		fprintf(stderr, "Error writing %s!\n", fileP);
+void FluidSimulation::streamFrame()
+{
+	if (!rawStream.isOpen())
+		return;
 
-	writeInkToImage();
-	if (!GifWriteFrame(gifWriterInk.get(), image.data(), info.width, info.width, 4))
-		fprintf(stderr, "Error writing %s!\n", fileInk);
+	PhaseProfiler::HostScope scope(&profiler, PhaseProfiler::OUTPUT_STREAM);
+	// colour conversion happens on the device, the host only copies the finished frame
+	dyeToColor(info, d_image, d_dye, species, dyeLayout, d_palette);
+	uint8_t* frame;
+	{
+		// waits here when the consumer applies back-pressure
+		Tracer::Scope trace(&tracer, "acquire frame buffer", "stream");
+		frame = rawStream.acquire();
+	}
+	{
+		Tracer::Scope trace(&tracer, "copy frame DtoH", "stream");
+		CHECK(cuMemcpyDtoH(frame, d_image, rawStream.frameSize()));
+	}
+	rawStream.submit(frame);
+}
+
+void FluidSimulation::publishFrame(int iteration)
+{
+	if (!frameServer.isOpen())
+		return;
+
+	PhaseProfiler::HostScope scope(&profiler, PhaseProfiler::OUTPUT_SHM);
+	using namespace SharedFrame;
+	SharedFrame::Field field = frameServer.requestedField();
+
+	if (field == INK)
+	{
+		dyeToColor(info, d_image, d_dye, species, dyeLayout, d_palette);
+		uint8_t* slot = frameServer.beginFrame(INK, RGBA8, iteration);
+		CHECK(cuMemcpyDtoH(slot, d_image, 4 * sizeof(uint8_t) * info.width * info.height));
+		frameServer.endFrame();
+		return;
+	}
+
+	Array2D::Host<>* host = p;
+	Array2D::Device* device = d_p;
+	if (field == SharedFrame::VELOCITY_U)
+	{
+		host = u;
+		device = d_u;
+	}
+	else if (field == SharedFrame::VELOCITY_V)
+	{
+		host = v;
+		device = d_v;
+	}
+
+	cuCtxSynchronize();
+	CHECK(cuMemcpyDtoH(host, device, 0));
+	// viewers get the full size, a coarser solver grid is repeated
+	float* slot = reinterpret_cast<float*>(frameServer.beginFrame(field, FLOAT32, iteration));
+	for (int y = 0; y < info.height; ++y) for (int x = 0; x < info.width; ++x)
+		slot[x + y*info.width] = (*host)[y / coarsening][x / coarsening];
+	frameServer.endFrame();
+}
+
+void FluidSimulation::dumpFields(int iteration)
+{
+	// p, u, v, then every dye species
+	for (int f = 0; f < INK_R + species; ++f)
+	{
+		FieldView view = f < INK_R ? readField(static_cast<Field>(f)) : readDye(f - INK_R);
+
+		// raw float32, row-major, width*height values
+		std::string name = f < INK_R ? fieldName(static_cast<Field>(f)) : Dye::name(f - INK_R);
+		std::string path = dumpDir + "/" + name + "_" + std::to_string(iteration) + ".f32";
+		FILE* file = fopen(path.c_str(), "wb");
+		size_t count = size_t(view.width) * view.height;
+		if (!file || fwrite(view.data, sizeof(float), count, file) != count)
+		{
+			fprintf(stderr, "Error writing field dump %s\n", path.c_str());
+			exit(-1);
+		}
+		fclose(file);
+	}
 }
 
 void FluidSimulation::checkForUserInput()
@@ -395,19 +1082,17 @@ void FluidSimulation::checkForUserInput()
 	bool leftClick = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS;
 	bool rightClick = glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_RIGHT) == GLFW_PRESS;
 
+	// submitted like any other client's commands, applied by the next step
 	if (glfwGetKey(window, GLFW_KEY_R) == GLFW_PRESS)
-		currentColor = RED;
+		selectInk(INK_R);
 	else if (glfwGetKey(window, GLFW_KEY_G) == GLFW_PRESS)
-		currentColor = GREEN;
+		selectInk(INK_G);
 	else if (glfwGetKey(window, GLFW_KEY_B) == GLFW_PRESS)
-		currentColor = BLUE;
+		selectInk(INK_B);
 
 	// reset
 	if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-	{
-		setupHostMemory();
-		copyAllHtoD();
-	}
+		requestReset();
 
 	if (leftClick || rightClick)
 	{
@@ -424,22 +1109,8 @@ void FluidSimulation::checkForUserInput()
 			float velocityY = static_cast<float>(currentPosY - lastPosY) * factor;
 			float inkToAdd = leftClick ? 100.f : 0.f;
 
-			// determine color choice
-			Array2D::Device* d_ink;
-			switch (currentColor)
-			{
-			case RED:
-				d_ink = d_ink_r;
-				break;
-			case GREEN:
-				d_ink = d_ink_g;
-				break;
-			case BLUE:
-				d_ink = d_ink_b;
-				break;
-			}
-
-			addInk(info, d_u, d_v, d_ink, currentPosX, HEIGHT - currentPosY, velocityX, -velocityY, inkToAdd);
+			inject(static_cast<float>(currentPosX) / info.width, static_cast<float>(HEIGHT - currentPosY) / info.height,
+				velocityX, -velocityY, inkToAdd);
 		}
 
 		lastPosX = currentPosX;
@@ -455,15 +1126,12 @@ void FluidSimulation::checkForUserInput()
 
 void FluidSimulation::predefinedInput(int iteration)
 {
-	auto & e = events[eventIndex];
-	if (iteration >= e.frame_start)
+	events.active(iteration, activeEvents);
+	injections += activeEvents.size();
+	for (uint32_t id : activeEvents)
 	{
-		if (iteration < e.frame_end){
-			InkData data = getInkData(e, iteration);
-            addInk(info, d_u, d_v, d_ink_r, data.x, data.y, data.u, data.v, data.amount);
-        }
-		else
-			eventIndex++;
+		EventScript::Injection data = EventScript::injection(events[id], iteration, info.width, info.height);
+		injectInk(0, data.x, data.y, data.u, data.v, data.amount);
 	}
 }
 
@@ -474,6 +1142,7 @@ void FluidSimulation::predefinedScenario(int iteration, Scenario s)
 
 	if (iteration % 10 != 0)
 		return;
+	injections += 3;
 
 	int x = width / 2;
 	int y = height / 2;
@@ -483,113 +1152,304 @@ void FluidSimulation::predefinedScenario(int iteration, Scenario s)
 	case CONSTANT:
 		if (iteration % 10 != 0)
 			return;
-		addInk(info, d_u, d_v, d_ink_r, x, y, 100.f, 0.f, 50.f);
-		addInk(info, d_u, d_v, d_ink_g, x, y, 0.f, 0.f, 30.f);
-		addInk(info, d_u, d_v, d_ink_b, x, y, 0.f, 0.f, 10.f);
+		injectInk(0, x, y, 100.f, 0.f, 50.f);
+		injectInk(1 % species, x, y, 0.f, 0.f, 30.f);
+		injectInk(2 % species, x, y, 0.f, 0.f, 10.f);
 		break;
 	case RANDOM:
-		addInk(info, d_u, d_v, d_ink_r, rand() % width, rand() % height, (rand() % 400) - 200, (rand() % 400) - 200, 100.f);
-		addInk(info, d_u, d_v, d_ink_g, rand() % width, rand() % height, (rand() % 400) - 200, (rand() % 400) - 200, 100.f);
-		addInk(info, d_u, d_v, d_ink_b, rand() % width, rand() % height, (rand() % 400) - 200, (rand() % 400) - 200, 100.f);
+		injectInk(0, rand() % width, rand() % height, (rand() % 400) - 200, (rand() % 400) - 200, 100.f);
+		injectInk(1 % species, rand() % width, rand() % height, (rand() % 400) - 200, (rand() % 400) - 200, 100.f);
+		injectInk(2 % species, rand() % width, rand() % height, (rand() % 400) - 200, (rand() % 400) - 200, 100.f);
 		break;
 	case ALTERNATING:
-		addInk(info, d_u, d_v, d_ink_r, x, y, 100.f, 100.f*sin(static_cast<float>(iteration) / 300.f * M_PI), 50.f);
-		addInk(info, d_u, d_v, d_ink_g, x, y, 0.f, 0.f, 30.f);
-		addInk(info, d_u, d_v, d_ink_b, x, y, 0.f, 0.f, 10.f);
+		injectInk(0, x, y, 100.f, 100.f*sin(static_cast<float>(iteration) / 300.f * M_PI), 50.f);
+		injectInk(1 % species, x, y, 0.f, 0.f, 30.f);
+		injectInk(2 % species, x, y, 0.f, 0.f, 10.f);
 		break;
 	}
 }
 
-FluidSimulation::InkData FluidSimulation::getInkData(UserEvent & e, int frame)
-{
-	InkData data;
-	float t = (frame - e.frame_start) / (e.frame_end - e.frame_start);
-	data.x = e.x_start * (1 - t) + (e.x_end) * t;
-	data.y = e.y_start * (1 - t) + (e.y_end) * t;
-	data.u = 10*(e.x_end - e.x_start) / (e.frame_end - e.frame_start);
-	data.v = 10*(e.y_end - e.y_start) / (e.frame_end - e.frame_start);
-	data.amount = e.amount;
-	return data;
-}
-
-void FluidSimulation::update(int i)
+void FluidSimulation::update(int i, int frames, float dt, bool firstSubstep, bool lastSubstep)
 {
 	// constants
-	int poissonSteps = 35;
-	float dt = 0.001f;
-	float dx = 0.1f;
-	float viscosity = 0.001f;
 	float ink_longevity = 0.001f;
 
-	float rdx = 1.f / dx;
+	// cell size of the solver grid
+	float h = dx * coarsening;
+	float rdx = 1.f / h;
 	float halfrdx = 0.5f*rdx;
-	float alpha_d = dx*dx / (viscosity*dt);
+	float alpha_d = h*h / (viscosity*dt);
 	float rbeta_d = 1.f / (4.f + alpha_d);
-	float alpha_p = -dx*dx;
+	float alpha_p = -h*h;
 	float rbeta_p = 1.f / 4.f;
 
+	int last = i + frames - 1;
+#ifdef WITH_GUI
+	bool outputFrame = lastSubstep;
+#else
+	bool outputFrame = lastSubstep && last % (outputInterval * realtime.decimation()) == 0;
+#endif
+	realtime.beginFrame(i, outputFrame);
+	int diffusionSweeps = realtime.enabled() ? realtime.iterations(RealtimeController::DIFFUSION) : diffusionIterations;
+	int pressureSweeps = realtime.enabled() ? realtime.iterations(RealtimeController::PRESSURE) : pressureIterations;
+
 	// no-slip velocity boundary condition
-	boundary(info, d_u, -1);
-	boundary(info, d_v, -1);
-	boundary(info, d_ink_r, 0);
-	boundary(info, d_ink_g, 0);
-	boundary(info, d_ink_b, 0);
+	{
+		// the dye border is cleared by advectDye
+		PhaseProfiler::Scope scope(profiler, PhaseProfiler::BOUNDARY);
+		if (engine == STABLE_FLUIDS)
+		{
+			boundary(grid, d_u, -1);
+			boundary(grid, d_v, -1);
+		}
+	}
 
 	// advection
-	advect(info, d_u, d_temp1, d_u, d_v, dt, rdx);
-	advect(info, d_v, d_temp2, d_u, d_v, dt, rdx);
-	std::swap(d_u, d_temp1);
-	std::swap(d_v, d_temp2);
-	advect(info, d_p, d_temp1, d_u, d_v, dt, rdx);
-	std::swap(d_p, d_temp1);
-	advect(info, d_ink_r, d_temp1, d_u, d_v, dt, rdx);
-	std::swap(d_ink_r, d_temp1);
-	advect(info, d_ink_g, d_temp1, d_u, d_v, dt, rdx);
-	std::swap(d_ink_g, d_temp1);
-	advect(info, d_ink_b, d_temp1, d_u, d_v, dt, rdx);
-	std::swap(d_ink_b, d_temp1);
+	{
+		PhaseProfiler::Scope scope(profiler, PhaseProfiler::ADVECTION);
+		// the lattice carries its own momentum, only the ink is advected
+		if (engine == STABLE_FLUIDS)
+		{
+			advect(grid, d_u, d_temp1, d_u, d_v, dt, rdx);
+			advect(grid, d_v, d_temp2, d_u, d_v, dt, rdx);
+			std::swap(d_u, d_temp1);
+			std::swap(d_v, d_temp2);
+			advect(grid, d_p, d_temp1, d_u, d_v, dt, rdx);
+			std::swap(d_p, d_temp1);
+		}
+		// all species at full resolution in one pass, with the velocity interpolated
+		advectDye(info, d_dye, d_dyeTemp, d_u, d_v, species, dyeLayout, dt, 1.f / dx, static_cast<float>(coarsening));
+		std::swap(d_dye, d_dyeTemp);
+	}
 
 	// apply force and add ink
-#ifdef WITH_GUI
-	checkForUserInput();
-#else
-	if (predefined && eventIndex < events.size())
-		predefinedInput(i);
-	else
-		predefinedScenario(i, ALTERNATING);
-#endif
-
-	// diffusion
-	for (int i = 0; i < poissonSteps; ++i)
 	{
-		jacobi(info, d_u, d_temp1, d_u, alpha_d, rbeta_d);
-		jacobi(info, d_v, d_temp2, d_v, alpha_d, rbeta_d);
-		std::swap(d_u, d_temp1);
-		std::swap(d_v, d_temp2);
+		PhaseProfiler::Scope scope(profiler, PhaseProfiler::INJECTION);
+		if (firstSubstep)
+		{
+			applyCommands();
+#ifndef WITH_GUI
+			if (predefined)
+				predefinedInput(i);
+			else if (demoScenario)
+				predefinedScenario(i, ALTERNATING);
+#endif
+		}
 	}
 
-	// projection into divergence-free field
-	divergence(info, d_u, d_v, d_temp1, halfrdx);
-	for (int i = 0; i < poissonSteps; ++i)
+	if (engine == LATTICE_BOLTZMANN)
 	{
-		boundary(info, d_p, 1);
-		jacobi(info, d_p, d_temp2, d_temp1, alpha_p, rbeta_p);
-		std::swap(d_p, d_temp2);
+		PhaseProfiler::Scope scope(profiler, PhaseProfiler::STREAM_COLLIDE);
+		streamCollideFrame();
 	}
+	else
+	{
+		// diffusion
+		{
+			PhaseProfiler::Scope scope(profiler, PhaseProfiler::DIFFUSION);
+			realtime.beginSolve(RealtimeController::DIFFUSION);
+			Diffusion::Plan plan = Diffusion::choose(alpha_d, diffusionTolerance, diffusionIterations);
+			int sweeps = realtime.enabled() ? std::min(plan.sweeps, diffusionSweeps) : plan.sweeps;
+			bool check = firstSubstep && i % 100 == 0;
+			diffuse(d_u, plan, sweeps, alpha_d, rbeta_d, check);
+			diffuse(d_v, plan, sweeps, alpha_d, rbeta_d, check);
+			int passes = plan.method == Diffusion::EXPLICIT ? 1 : sweeps;
+			realtime.endSolve(RealtimeController::DIFFUSION, passes);
+
+			++diffusionSteps[plan.method];
+			diffusionPasses += passes;
+			diffusionBound = std::max(diffusionBound, sweeps == plan.sweeps ? plan.bound
+				: 8.0 / alpha_d * std::pow(Diffusion::contraction(alpha_d), sweeps));
+		}
 
-	boundary(info, d_u, -1);
-	boundary(info, d_v, -1);
+		// projection into divergence-free field
+		{
+			PhaseProfiler::Scope scope(profiler, PhaseProfiler::DIVERGENCE);
+			divergence(grid, d_u, d_v, d_temp1, halfrdx);
+		}
+		{
+			PhaseProfiler::Scope scope(profiler, PhaseProfiler::PRESSURE);
+			realtime.beginSolve(RealtimeController::PRESSURE);
+			if (spectralPressure && comparePressure && firstSubstep && i % 100 == 0)
+				comparePressureSolvers(alpha_p, rbeta_p, pressureIterations);
+			else if (spectralPressure)
+				solvePressureSpectral(alpha_p);
+			else
+			{
+				for (int i = 0; i < pressureSweeps; ++i)
+				{
+					boundary(grid, d_p, 1);
+					jacobi(grid, d_p, d_temp2, d_temp1, alpha_p, rbeta_p);
+					std::swap(d_p, d_temp2);
+				}
+			}
+			// the DCT result is used even when compared, it has no sweeps
+			realtime.endSolve(RealtimeController::PRESSURE, spectralPressure ? 0 : pressureSweeps);
+			pressurePasses += spectralPressure ? 0 : pressureSweeps;
+		}
+		if (realtime.residualDue(i))
+			realtime.recordResidual(solveResidual(d_p, d_temp1, alpha_p, rbeta_p));
+		{
+			PhaseProfiler::Scope scope(profiler, PhaseProfiler::GRADIENT);
+			boundary(grid, d_u, -1);
+			boundary(grid, d_v, -1);
 
-	subtractGradient(info, d_p, d_u, d_v, d_temp1, d_temp2, halfrdx);
-	std::swap(d_u, d_temp1);
-	std::swap(d_v, d_temp2);
+			// the next step is planned from the velocity this step ends with
+			CUdeviceptr d_maxSpeed = 0;
+			if (cfl > 0.f && lastSubstep)
+			{
+				d_maxSpeed = d_sums + 2 * sizeof(float);
+				CHECK(cuMemsetD32(d_maxSpeed, 0, 1));
+			}
+			subtractGradient(grid, d_p, d_u, d_v, d_temp1, d_temp2, halfrdx, d_maxSpeed);
+			std::swap(d_u, d_temp1);
+			std::swap(d_v, d_temp2);
+			if (d_maxSpeed)
+				CHECK(cuMemcpyDtoH(&maxSpeed, d_maxSpeed, sizeof(maxSpeed)));
+		}
+	}
 
 #ifdef WITH_GUI
-	renderImage();
+	if (outputFrame)
+	{
+		PhaseProfiler::Scope scope(profiler, PhaseProfiler::RENDER);
+		renderImage();
+	}
+	markVisible();
 #else
-	if (i % 10 == 0)
+	if (outputFrame)
+	{
 		saveImagesAsGif();
+		streamFrame();
+		publishFrame(last);
+		markVisible();
+	}
 #endif
+
+	realtime.endFrame();
+}
+
+void FluidSimulation::injectInk(int s, int x, int y, float u_, float v_, float amount)
+{
+	// the same falloff in ink cells on both grids
+	if (u_ != 0.f || v_ != 0.f)
+	{
+		Array2D::Device* forceU = engine == LATTICE_BOLTZMANN ? d_forceU : d_u;
+		Array2D::Device* forceV = engine == LATTICE_BOLTZMANN ? d_forceV : d_v;
+		float cellSize = static_cast<float>(coarsening);
+		float unbounded = std::numeric_limits<float>::max();
+		splat(grid, forceU, x, y, u_, cellSize, -unbounded, unbounded);
+		splat(grid, forceV, x, y, v_, cellSize, -unbounded, unbounded);
+	}
+	addDye(info, d_dye, species, dyeLayout, s, x, y, amount);
+}
+
+void FluidSimulation::streamCollideFrame()
+{
+	// lattice units: dx and the step dt of one substep are 1
+	float dt = frameTime / latticeSubsteps;
+	float h = dx * coarsening;
+	float velocityScale = dt / h;
+	float tau = std::max(0.5f + 3.f * viscosity * dt / (h*h), minRelaxationTime);
+	// c_s^2 (rho - 1) in physical units times the frame time, the scale of the projection pressure
+	float pressureScale = h*h / (dt*dt) * frameTime;
+	for (int s = 0; s < latticeSubsteps; ++s)
+	{
+		streamCollide(grid, d_lattice, d_forceU, d_forceV, d_u, d_v, d_p, latticeParity, 1.f / tau, velocityScale, pressureScale);
+		latticeParity ^= 1;
+	}
+}
+
+void FluidSimulation::diffuse(Array2D::Device*& q, const Diffusion::Plan& plan, int sweeps, float alpha, float rbeta, bool check)
+{
+	Array2D::Device* result = q;
+	if (plan.method == Diffusion::EXPLICIT)
+	{
+		// q + (sum of neighbours - 4q) / alpha
+		jacobi(grid, q, d_temp1, q, alpha - 4.f, 1.f / alpha);
+		result = d_temp1;
+	}
+	else if (plan.method != Diffusion::SKIP)
+	{
+		// q stays the right-hand side, the iterate alternates between the temporaries
+		Array2D::Device* x = q;
+		for (int k = 0; k < sweeps; ++k)
+		{
+			Array2D::Device* xNew = x == d_temp1 ? d_temp2 : d_temp1;
+			jacobi(grid, x, xNew, q, alpha, rbeta);
+			x = xNew;
+		}
+		result = x;
+	}
+
+	// the relative Jacobi update bounds the relative error, as 1 - q = alpha * rbeta
+	if (check)
+	{
+		diffusionError = std::max(diffusionError, solveResidual(result, q, alpha, rbeta));
+		++diffusionChecks;
+	}
+
+	if (result == d_temp1)
+		std::swap(q, d_temp1);
+	else if (result == d_temp2)
+		std::swap(q, d_temp2);
+}
+
+void FluidSimulation::solvePressureSpectral(float alpha)
+{
+	CHECK(cuMemcpyDtoH(temp1, d_temp1, 0));
+	poisson.workers().run(grid.height, [&](int first, int last) {
+		for (int y = first; y < last; ++y) for (int x = 0; x < grid.width; ++x)
+			poissonRhs[x + y*grid.width] = (*temp1)[y][x];
+	});
+
+	// 4p - neighbours = alpha * div
+	poisson.solve(poissonRhs.get(), poissonSolution.get(), -alpha);
+
+	poisson.workers().run(grid.height, [&](int first, int last) {
+		for (int y = first; y < last; ++y) for (int x = 0; x < grid.width; ++x)
+			(*p)[y][x] = poissonSolution[x + y*grid.width];
+	});
+	CHECK(cuMemcpyHtoD(d_p, p, 0));
+}
+
+void FluidSimulation::comparePressureSolvers(float alpha, float rbeta, int sweeps)
+{
+	PressureComparison c;
+	CUevent start, stop;
+	CHECK(cuEventCreate(&start, CU_EVENT_DEFAULT));
+	CHECK(cuEventCreate(&stop, CU_EVENT_DEFAULT));
+
+	// the sweeps first, from the previous pressure; the spectral solve does not need it
+	CHECK(cuEventRecord(start, 0));
+	for (int k = 0; k < sweeps; ++k)
+	{
+		boundary(grid, d_p, 1);
+		jacobi(grid, d_p, d_temp2, d_temp1, alpha, rbeta);
+		std::swap(d_p, d_temp2);
+	}
+	CHECK(cuEventRecord(stop, 0));
+	CHECK(cuEventSynchronize(stop));
+	CHECK(cuEventElapsedTime(&c.jacobiMs, start, stop));
+	c.jacobiResidual = solveResidual(d_p, d_temp1, alpha, rbeta);
+
+	auto t0 = std::chrono::steady_clock::now();
+	solvePressureSpectral(alpha);
+	c.spectralMs = std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - t0).count();
+	c.spectralResidual = solveResidual(d_p, d_temp1, alpha, rbeta);
+
+	cuEventDestroy(start);
+	cuEventDestroy(stop);
+	pressureComparisons.push_back(c);
+}
+
+float FluidSimulation::solveResidual(Array2D::Device* x, Array2D::Device* b, float alpha, float rbeta)
+{
+	float sums[2];
+	CHECK(cuMemsetD32(d_sums, 0, 2));
+	residual(grid, x, b, d_sums, alpha, rbeta);
+	CHECK(cuMemcpyDtoH(sums, d_sums, sizeof(sums)));
+	return sums[1] > 0.f ? std::sqrt(sums[0] / sums[1]) : 0.f;
 }
 
 void FluidSimulation::startWritingToImage()
@@ -606,6 +1466,7 @@ void FluidSimulation::stopWritingToImage()
 	if (!saveImages)
 		return;
 
+	Tracer::Scope trace(&tracer, "GifEnd", "gif");
 	GifEnd(gifWriterP.get());
 	GifEnd(gifWriterInk.get());
 }
@@ -614,7 +1475,7 @@ void FluidSimulation::writePressureToImage()
 {
 	for (int y = 0; y < info.height; ++y) for (int x = 0; x < info.width; ++x)
 	{
-		float p_ = (*p)[y][x];
+		float p_ = (*p)[y / coarsening][x / coarsening];
 		int j = x + y*info.width;
 
 		if (p_ < 0) // negative values are blue
@@ -638,13 +1499,7 @@ void FluidSimulation::writePressureToImage()
 
 void FluidSimulation::writeInkToImage()
 {
-	for (int y = 0; y < info.height; ++y) for (int x = 0; x < info.width; ++x)
-	{
-		int j = x + y*info.width;
-		
-		image[4 * j] = static_cast<uint8_t>((*ink_r)[y][x]);
-		image[4 * j + 1] = static_cast<uint8_t>((*ink_g)[y][x]);
-		image[4 * j + 2] = static_cast<uint8_t>((*ink_b)[y][x]);
-		image[4 * j + 3] = 0;
-	}
+	// mixed through the palette on the device
+	dyeToColor(info, d_image, d_dye, species, dyeLayout, d_palette);
+	CHECK(cuMemcpyDtoH(image.data(), d_image, image.size()));
 }
\ No newline at end of file
@@ -4,6 +4,7 @@
 #include <cstdint>
 #include <vector>
 #include <memory>
+#include <string>
 
 #ifdef WITH_GUI
 #include <GL/glew.h>
@@ -13,6 +14,18 @@
 #include "matog_gen/Array2D.h"
 
 #include "fluidSimKernel.h"
+#include "framestream.h"
+#include "frameserver.h"
+#include "eventscript.h"
+#include "profiler.h"
+#include "tracer.h"
+#include "trafficmodel.h"
+#include "autotuner.h"
+#include "commandqueue.h"
+#include "realtime.h"
+#include "diffusion.h"
+#include "poissondct.h"
+#include "dye.h"
 
 struct GifWriter;
 
@@ -25,42 +38,211 @@ class FluidSimulation
 		ALTERNATING	// ink gets shot from the center of the image to the right, alternating up and down
 	};
 
-	enum ColorMode
+public:
+
+	// INK_R, INK_G and INK_B are the dye species 0, 1 and 2
+	enum Field
 	{
-		RED,
-		GREEN,
-		BLUE
+		PRESSURE,
+		VELOCITY_U,
+		VELOCITY_V,
+		INK_R,
+		INK_G,
+		INK_B,
+		FIELD_COUNT
 	};
 
-	struct InkData
+	enum Engine
 	{
-		int x;
-		int y;
-		float u;
-		float v;
-		int amount;
+		STABLE_FLUIDS,		// semi-Lagrangian advection, implicit diffusion, pressure projection
+		LATTICE_BOLTZMANN	// D2Q9 BGK lattice, ink advected with its velocity
 	};
 
-	struct UserEvent
+	// read-only view of a field, row-major with stride floats per row; u, v and
+	// p have the size of the solver grid (Options::coarsening), valid until the
+	// next step(), reset() or shutdown()
+	struct FieldView
 	{
-		int frame_start;
-		int frame_end;
-		float x_start;
-		float x_end;
-		float y_start;
-		float y_end;
-		float amount;
+		const float* data;
+		size_t stride;
+		int width, height;
+		int frame;
+		// the same field on the device, for consumers that stay on the GPU;
+		// null for dye species, which share one buffer
+		const Array2D::Device* device;
 	};
 
-public:
+	struct Options
+	{
+		int width = 512;
+		int height = 512;
+		int threads_x = 16;
+		int threads_y = 16;
+		// u, v and p on a grid 1, 2 or 4 times coarser along each axis; the ink
+		// stays at width x height and is advected with the interpolated velocity
+		int coarsening = 1;
+
+		// passive dye species in one buffer with this layout (dye.h), coloured
+		// by the palette: comma-separated RRGGBB per species, empty for red,
+		// green, blue and then evenly spaced hues
+		int species = 3;
+		Dye::Layout dyeLayout = Dye::INTERLEAVED;
+		const char* palette = "";
+
+		// per-kernel block shapes from the tuning database instead of threads_x/threads_y;
+		// tune benchmarks them (and updates the database) instead of reading it
+		bool tunedBlocks = true;
+		bool tune = false;
+		const char* tuningDatabase = "fluidsim_tuning.db";
+		bool saveImages = false;
+		const char* inputFile = "";
+		// without an input file ink is shot from the center; disable when only inject() is used
+		bool demoScenario = true;
+
+		// frames are written every outputInterval iterations
+		int outputInterval = 10;
+
+		// wall-clock budget per frame in ms; the solver sweeps and the output
+		// interval are adapted to meet it, disabled if 0
+		float frameBudgetMs = 0.f;
+
+		// time step from this CFL number and the maximum velocity instead of the
+		// fixed step of one frame: quiet stretches are covered by one step over
+		// several frames, fast flow is split into substeps; disabled if 0
+		float cfl = 0.f;
+
+		// error of the viscous diffusion step relative to |u|; picks skipping, one
+		// explicit step or Jacobi sweeps (diffusion.h); <= 0 always does 35 sweeps
+		float diffusionTolerance = 1e-4f;
+
+		// exact DCT pressure solve on the host instead of Jacobi sweeps (poissondct.h);
+		// comparePressure also runs the sweeps every 100th frame and reports both
+		bool spectralPressure = false;
+		bool comparePressure = false;
+		// threads of the spectral solve (0 for all CPUs) and their pinning; the
+		// host fields and solver buffers are first touched by the thread that
+		// owns their rows (numa.h)
+		int hostThreads = 0;
+		Numa::Affinity affinity = Numa::NONE;
 
-	FluidSimulation(int width = 512, int height = 512, int threads_x = 16, int threads_y = 16, bool saveImages_ = false, const char * inputFile = "");
+		// the lattice Boltzmann engine takes the same input and writes the same
+		// fields, with latticeSubsteps stream-collide steps per frame; cfl,
+		// frameBudgetMs and the pressure options only apply to stable fluids
+		Engine engine = STABLE_FLUIDS;
+		int latticeSubsteps = 10;
+
+		// raw frame stream for external encoders, disabled if empty
+		const char* rawStreamPath = "";
+		FrameStream::Format rawStreamFormat = FrameStream::RAW_RGBA;
+		int rawStreamQueue = 4;
+
+		// shared-memory frame ring for live viewers, disabled if empty
+		const char* sharedMemoryName = "";
+		const char* controlSocket = "";
+		int sharedMemorySlots = 4;
+
+		// per-phase timings; profileSignal lets SIGUSR1 toggle them at runtime,
+		// which takes over the process's handler of that signal
+		bool profile = false;
+		bool profileSignal = false;
+		const char* profileReport = "";
+		PhaseProfiler::ReportFormat profileFormat = PhaseProfiler::CSV;
+		// hardware counters per phase (perf_event_open), skipped when unavailable
+		bool perfCounters = false;
+
+		// Chrome trace-event timeline, disabled if empty
+		const char* traceFile = "";
+		int traceCapacity = 1 << 20;
+		bool traceRing = false;
+
+		// p, u, v and ink are written to dumpDir after each of these frames
+		std::vector<int> dumpFrames;
+		const char* dumpDir = "";
+	};
+
+	// An uninitialized simulation; init() sets up the device, the memory and the
+	// outputs, which stay alive across step() and reset() until shutdown().
+	FluidSimulation();
+	// init(options)
+	explicit FluidSimulation(const Options& options);
 	~FluidSimulation();
 
+	void init(const Options& options);
+	void shutdown();
+
+	// command line mode: steps until the input file ends (or the window is
+	// closed), finishes the outputs and prints the timings
+	void run();
+
+	// advances n frames
+	void step(int n = 1);
+
+	// Commands may be submitted from any thread. They are queued lock-free and
+	// applied at the start of the injection phase of the next step; false if
+	// the queue is full.
+	// ink and force at a normalized position, into the selected species
+	bool inject(float x, float y, float u, float v, float amount);
+	bool inject(float x, float y, float u, float v, float amount, Field ink);
+	bool inject(float x, float y, float u, float v, float amount, int species);
+	// species of later injections without an explicit species
+	bool selectInk(Field ink);
+	bool selectInk(int species);
+	// clears all fields at the next step, the frame counter keeps running
+	bool requestReset();
+
+	// the fields are copied from the device at most once per frame
+	FieldView readField(Field field);
+	FieldView readDye(int species);
+
+	// clears all fields and restarts at frame 0, keeping device, kernels and outputs;
+	// pending commands are discarded
+	void reset();
+
+	// time from submitting a command to the end of the first output frame
+	// (or readField()) that shows it
+	void printLatency(FILE* out) const;
+
+	int frame() const { return frameIndex; }
+	int width() const { return info.width; }
+	int height() const { return info.height; }
+	int speciesCount() const { return species; }
+
+	static const char* fieldName(Field field);
+
 private:
+	void makeCurrent();
+	void finishOutputs();
+	void applyCommands();
+	void markVisible();
+	void fieldArrays(Field field, Array2D::Host<>*& host, Array2D::Device*& device);
+	// addInk into the velocity, or the lattice forcing under LATTICE_BOLTZMANN, and species s
+	void injectInk(int s, int x, int y, float u, float v, float amount);
+	// the cached host copies are stale
+	void invalidateFields();
+	// equilibrium at rest, no pending force
+	void initLattice();
+	// the fluid step of the lattice Boltzmann engine over one frame
+	void streamCollideFrame();
+	// one implicit diffusion step of q with the planned method
+	void diffuse(Array2D::Device*& q, const Diffusion::Plan& plan, int sweeps, float alpha, float rbeta, bool check);
+	// exact pressure from the divergence in d_temp1 into d_p
+	void solvePressureSpectral(float alpha);
+	// Jacobi sweeps and the spectral solve on the same divergence, times and residuals
+	void comparePressureSolvers(float alpha, float rbeta, int sweeps);
+	// |update of one Jacobi sweep| / |right-hand side term| of the interior
+	float solveResidual(Array2D::Device* x, Array2D::Device* b, float alpha, float rbeta);
 
-	// main iteration function
-	void update(int i);
+	// main iteration function: one solver step of dt covering frames i .. i+frames-1,
+	// or one of several substeps of frame i (frames == 1); input is applied in the
+	// first substep, outputs are written after the last
+	void update(int i, int frames, float dt, bool firstSubstep, bool lastSubstep);
+	// one solver step (with its substeps), not beyond frame end
+	void advance(int end);
+	// frames and substeps of the next solver step from the CFL condition
+	void planStep(int remaining, int& frames, int& substeps);
+	bool injectsAt(int frame);
+	// upper bound of the |u| + |v| the script or demo injects in frame
+	float injectedSpeed(int frame);
 
 	void initGL();
 	void initCUDA();
@@ -68,6 +250,8 @@ private:
 	void setupDeviceMemory();
 	void setupHostMemory();
 	void initHostMemory();
+	// pages per NUMA node of the host fields and the spectral solver
+	void printPlacement();
 	void releaseDeviceMemory();
 	void releaseHostMemory();
 
@@ -81,6 +265,9 @@ private:
 	void stopWritingToImage();
 	void writePressureToImage();
 	void writeInkToImage();
+	void streamFrame();
+	void publishFrame(int iteration);
+	void dumpFields(int iteration);
 
 	// input functions
 	void checkForUserInput();
@@ -89,19 +276,33 @@ private:
 	
 	// load predefined input sequence from file
 	void loadEventsFromFile(const char* path);
-	InkData getInkData(UserEvent & e, int frame);
 
 	// struct containing all necessary information about the device and the data
 	FluidSim::cudaInfo info;
+	// the same for the launches on the velocity and pressure grid, which is
+	// coarsening times smaller than info along each axis
+	FluidSim::cudaInfo grid;
+	int coarsening;
 
 	// host pointers to data
-	Array2D::Host<>* u, * v, * temp1, * temp2, * p, * ink_r, * ink_g, * ink_b;
+	Array2D::Host<>* u, * v, * temp1, * temp2, * p;
 	// device pointers to data
-	Array2D::Device* d_u, * d_v, * d_temp1, * d_temp2, * d_p, * d_ink_r, * d_ink_g, * d_ink_b;
+	Array2D::Device* d_u, * d_v, * d_temp1, * d_temp2, * d_p;
+
+	// dye of all species and its advection target, palette of 3 floats per species
+	int species;
+	Dye::Layout dyeLayout;
+	std::vector<float> palette;
+	CUdeviceptr d_dye, d_dyeTemp, d_palette;
 
 	// image data
 	std::vector<uint8_t> image;
 	CUdeviceptr d_image;
+	// results of reduction kernels
+	CUdeviceptr d_sums;
+	// lattice Boltzmann engine: 9 distribution planes and the velocity injected since the last step
+	CUdeviceptr d_lattice;
+	Array2D::Device* d_forceU, * d_forceV;
 
 #ifdef WITH_GUI
 	GLFWwindow* window;
@@ -110,15 +311,86 @@ private:
 #endif
 
 	// events from predefined input sequence
-	std::vector<UserEvent> events;
-	int eventIndex;
+	EventScript events;
+	std::vector<uint32_t> activeEvents;
 
 	int lastPosX, lastPosY;
 
-	ColorMode currentColor;
-
 	bool saveImages;
 	bool predefined;
+	bool demoScenario;
+	int outputInterval;
+
+	// Jacobi sweeps per frame
+	int diffusionIterations;
+	int pressureIterations;
+
+	// addInk launches, for the traffic model
+	unsigned long long injections;
+
+	// CFL time stepping
+	float cfl;
+	// max(|u| + |v|) after the last solver step
+	float maxSpeed;
+	unsigned long long solverSteps;
+	int maxSubsteps, maxStepFrames;
+	float minDt, maxDt;
+
+	// diffusion solver choice
+	float diffusionTolerance;
+	unsigned long long diffusionSteps[Diffusion::METHOD_COUNT];
+	// Jacobi or explicit passes per field, for the traffic model
+	unsigned long long diffusionPasses;
+	// Jacobi pressure sweeps, for the traffic model
+	unsigned long long pressurePasses;
+	double diffusionBound;
+	// sampled a-posteriori error estimates
+	float diffusionError;
+	int diffusionChecks;
+
+	Engine engine;
+	int latticeSubsteps;
+	// alternates every stream-collide step (AA pattern)
+	int latticeParity;
+
+	// spectral pressure solve
+	bool spectralPressure;
+	bool comparePressure;
+	PoissonDCT poisson;
+	std::unique_ptr<float[]> poissonRhs, poissonSolution;
+	// per compared frame: ms and residual of the sweeps and of the spectral solve
+	struct PressureComparison
+	{
+		float jacobiMs, jacobiResidual;
+		float spectralMs, spectralResidual;
+	};
+	std::vector<PressureComparison> pressureComparisons;
+
+	std::vector<int> dumpFrames;
+	std::string dumpDir;
+
+	int frameIndex;
+	bool initialized;
+	bool outputsOpen;
+
+	CommandQueue commands;
+	int selectedSpecies;
+	// submit times of applied commands that are not visible yet
+	std::vector<uint64_t> awaitingOutput;
+	std::vector<float> latencyMs;
+
+	// host copies behind readField() and readDye() and the frame they were taken at
+	std::vector<float> fieldData[FIELD_COUNT];
+	int fieldFrame[FIELD_COUNT];
+	std::vector<float> dyeHost;
+	int dyeHostFrame;
+	std::vector<std::vector<float>> dyeData;
+	std::vector<int> dyeFrame;
 
 	std::unique_ptr<GifWriter> gifWriterP, gifWriterInk;
+	FrameStream rawStream;
+	FrameServer frameServer;
+	Tracer tracer;
+	PhaseProfiler profiler;
+	RealtimeController realtime;
 };
\ No newline at end of file
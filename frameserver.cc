@@ -0,0 +1,240 @@
+#include "frameserver.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+using namespace SharedFrame;
+
+FrameServer::FrameServer()
+	: header(nullptr)
+	, size(0)
+	, currentSlot(0)
+	, listenFd(-1)
+	, stopping(false)
+	, field(INK)
+{
+}
+
+FrameServer::~FrameServer()
+{
+	close();
+}
+
+bool FrameServer::open(const char* name_, int width, int height, int slotCount, const char* controlSocket)
+{
+	close();
+
+	name = name_;
+	if (name.empty() || name[0] != '/')
+		name = "/" + name;
+
+	slotCount = std::max(2, std::min(slotCount, static_cast<int>(MAX_SLOTS)));
+	uint64_t slotBytes = 4ull * width * height;
+	uint64_t pageSize = sysconf(_SC_PAGESIZE);
+	uint64_t dataOffset = (sizeof(Header) + pageSize - 1) / pageSize * pageSize;
+	size = segmentSize(dataOffset, slotBytes, slotCount);
+
+	int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error creating shared memory %s: %s\n", name.c_str(), strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, size) != 0)
+	{
+		fprintf(stderr, "Error resizing shared memory %s: %s\n", name.c_str(), strerror(errno));
+		::close(fd);
+		shm_unlink(name.c_str());
+		return false;
+	}
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr, "Error mapping shared memory %s: %s\n", name.c_str(), strerror(errno));
+		shm_unlink(name.c_str());
+		return false;
+	}
+
+	header = static_cast<Header*>(p);
+	// invalidate the magic first so readers of a stale segment detach
+	header->magic = 0;
+	std::atomic_thread_fence(std::memory_order_release);
+	header->version = VERSION;
+	header->width = width;
+	header->height = height;
+	header->slotCount = slotCount;
+	header->reserved = 0;
+	header->slotBytes = slotBytes;
+	header->dataOffset = dataOffset;
+	header->generation.store(0, std::memory_order_relaxed);
+	for (uint32_t s = 0; s < MAX_SLOTS; ++s)
+	{
+		header->slots[s].sequence.store(0, std::memory_order_relaxed);
+		header->slots[s].field = INK;
+		header->slots[s].format = RGBA8;
+		header->slots[s].iteration = -1;
+		header->slots[s].generation = 0;
+	}
+	header->writerAlive.store(1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	header->magic = MAGIC;
+
+	printf("> Publishing frames to shared memory %s (%d slots)\n", name.c_str(), slotCount);
+
+	if (controlSocket && controlSocket[0] != '\0')
+	{
+		socketPath = controlSocket;
+		listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, controlSocket, sizeof(addr.sun_path) - 1);
+		unlink(controlSocket);
+		if (listenFd < 0 || bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listenFd, 4) != 0)
+		{
+			fprintf(stderr, "Error creating control socket %s: %s\n", controlSocket, strerror(errno));
+			if (listenFd >= 0)
+				::close(listenFd);
+			listenFd = -1;
+		}
+		else
+		{
+			stopping = false;
+			control = std::thread(&FrameServer::controlLoop, this);
+		}
+	}
+
+	return true;
+}
+
+void FrameServer::close()
+{
+	if (listenFd >= 0)
+	{
+		stopping = true;
+		if (control.joinable())
+			control.join();
+		::close(listenFd);
+		unlink(socketPath.c_str());
+		listenFd = -1;
+	}
+
+	if (header)
+	{
+		header->writerAlive.store(0, std::memory_order_release);
+		munmap(header, size);
+		shm_unlink(name.c_str());
+		header = nullptr;
+	}
+}
+
+uint8_t* FrameServer::beginFrame(Field field_, Format format, int iteration)
+{
+	uint64_t g = header->generation.load(std::memory_order_relaxed) + 1;
+	currentSlot = static_cast<uint32_t>(g % header->slotCount);
+	Slot& s = header->slots[currentSlot];
+
+	// odd sequence: readers of this slot retry or skip it
+	s.sequence.store(s.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	s.field = field_;
+	s.format = format;
+	s.iteration = iteration;
+	s.generation = g;
+	return slotData(header, currentSlot);
+}
+
+void FrameServer::endFrame()
+{
+	Slot& s = header->slots[currentSlot];
+	s.sequence.store(s.sequence.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	header->generation.store(s.generation, std::memory_order_release);
+}
+
+void FrameServer::controlLoop()
+{
+	std::vector<pollfd> fds;
+	std::vector<std::string> buffers;
+	fds.push_back({ listenFd, POLLIN, 0 });
+	buffers.push_back(std::string());
+
+	while (!stopping)
+	{
+		if (poll(fds.data(), fds.size(), 100) <= 0)
+			continue;
+
+		if (fds[0].revents & POLLIN)
+		{
+			int client = accept(listenFd, nullptr, nullptr);
+			if (client >= 0)
+			{
+				fds.push_back({ client, POLLIN, 0 });
+				buffers.push_back(std::string());
+			}
+		}
+
+		for (size_t c = fds.size() - 1; c > 0; --c)
+		{
+			if (!(fds[c].revents & (POLLIN | POLLHUP | POLLERR)))
+				continue;
+
+			char chunk[256];
+			ssize_t n = read(fds[c].fd, chunk, sizeof(chunk));
+			if (n > 0)
+			{
+				buffers[c].append(chunk, n);
+				size_t eol;
+				while ((eol = buffers[c].find('\n')) != std::string::npos)
+				{
+					std::string reply = handleCommand(buffers[c].substr(0, eol));
+					buffers[c].erase(0, eol + 1);
+					if (write(fds[c].fd, reply.data(), reply.size()) < 0)
+						break;
+				}
+			}
+			if (n <= 0 || buffers[c].size() > 4096)
+			{
+				::close(fds[c].fd);
+				fds.erase(fds.begin() + c);
+				buffers.erase(buffers.begin() + c);
+			}
+		}
+	}
+
+	for (size_t c = 1; c < fds.size(); ++c)
+		::close(fds[c].fd);
+}
+
+std::string FrameServer::handleCommand(const std::string& line)
+{
+	std::string command = line;
+	if (!command.empty() && command.back() == '\r')
+		command.pop_back();
+
+	if (command.compare(0, 6, "field ") == 0)
+	{
+		Field f;
+		if (!parseField(command.substr(6), f))
+			return "error unknown field (ink, p, u, v)\n";
+		field.store(f, std::memory_order_relaxed);
+		return "ok\n";
+	}
+	if (command == "status")
+	{
+		char reply[160];
+		snprintf(reply, sizeof(reply), "ok %ux%u field %s generation %llu\n",
+			header->width, header->height, fieldName(field.load()),
+			(unsigned long long)header->generation.load(std::memory_order_relaxed));
+		return reply;
+	}
+	return "error unknown command (field, status)\n";
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+
+#include "sharedframe.h"
+
+// Publishes simulation frames into a POSIX shared-memory ring (see sharedframe.h)
+// so local viewers can watch a headless run. A Unix socket accepts text commands
+// selecting which field is published:
+//   field ink|p|u|v    switch the published field
+//   status             print size, field and generation
+class FrameServer
+{
+public:
+	FrameServer();
+	~FrameServer();
+
+	bool open(const char* name, int width, int height, int slotCount = 4, const char* controlSocket = "");
+	void close();
+
+	bool isOpen() const { return header != nullptr; }
+
+	// field selected by the control channel, read once per published frame
+	SharedFrame::Field requestedField() const { return static_cast<SharedFrame::Field>(field.load(std::memory_order_relaxed)); }
+
+	// Publishing is two-phase so the caller can copy straight into shared memory:
+	// beginFrame() returns the slot to fill, endFrame() makes it visible.
+	uint8_t* beginFrame(SharedFrame::Field field, SharedFrame::Format format, int iteration);
+	void endFrame();
+
+private:
+	void controlLoop();
+	std::string handleCommand(const std::string& line);
+
+	std::string name;
+	SharedFrame::Header* header;
+	size_t size;
+	uint32_t currentSlot;
+
+	std::string socketPath;
+	int listenFd;
+	std::thread control;
+	std::atomic<bool> stopping;
+	std::atomic<uint32_t> field;
+};
@@ -0,0 +1,281 @@
+#include "framestream.h"
+
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+FrameStream::FrameStream()
+	: fd(-1)
+	, process(nullptr)
+	, format(RAW_RGBA)
+	, width(0)
+	, height(0)
+	, useSplice(false)
+	, splicedFrame(nullptr)
+	, closing(false)
+	, failed(false)
+	, stallCount(0)
+	, profiler(nullptr)
+{
+}
+
+FrameStream::~FrameStream()
+{
+	close();
+}
+
+bool FrameStream::open(const char* path, Format format_, int width_, int height_, int fps, int queueDepth)
+{
+	close();
+
+	format = format_;
+	width = width_;
+	height = height_;
+
+	if (strcmp(path, "-") == 0)
+	{
+		// keep the real stdout for frames and send the console log to stderr
+		fflush(stdout);
+		fd = dup(STDOUT_FILENO);
+		if (fd >= 0)
+			dup2(STDERR_FILENO, STDOUT_FILENO);
+	}
+	else if (path[0] == '|')
+	{
+		process = popen(path + 1, "w");
+		if (process)
+			fd = fileno(process);
+	}
+	else
+	{
+		fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error opening frame stream %s: %s\n", path, strerror(errno));
+		return false;
+	}
+
+	// a vanished consumer must surface as a write error, not kill the simulation
+	signal(SIGPIPE, SIG_IGN);
+
+	useSplice = false;
+#ifdef __linux__
+	// vmsplice hands our pages to the pipe instead of copying them, so the pipe
+	// still reads a spliced buffer after vmsplice returns. The writer releases it
+	// only once the next frame is spliced completely: a frame is at least the
+	// pipe capacity, so by then the consumer has read all of the previous one.
+	struct stat st;
+	if (format == RAW_RGBA && queueDepth > 1 && fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode))
+	{
+		fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+		int pipeSize = fcntl(fd, F_GETPIPE_SZ);
+		useSplice = pipeSize > 0 && frameSize() >= static_cast<size_t>(pipeSize);
+	}
+#endif
+
+	buffers.assign(std::max(queueDepth, 1), std::vector<uint8_t>(frameSize()));
+	freeBuffers.clear();
+	for (auto& b : buffers)
+		freeBuffers.push_back(b.data());
+	pending.clear();
+	splicedFrame = nullptr;
+	closing = false;
+	failed = false;
+	stallCount = 0;
+
+	if (format == Y4M)
+	{
+		planes.resize(3 * size_t(width) * height);
+		char header[128];
+		int n = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n", width, height, fps);
+		if (!writeAll(reinterpret_cast<const uint8_t*>(header), n))
+			failed = true;
+	}
+
+	writer = std::thread(&FrameStream::writerLoop, this);
+	return true;
+}
+
+void FrameStream::close()
+{
+	if (fd < 0)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		closing = true;
+	}
+	frameQueued.notify_all();
+	if (writer.joinable())
+		writer.join();
+
+	if (process)
+		pclose(process);
+	else
+		::close(fd);
+
+	fd = -1;
+	process = nullptr;
+	// a consumer that has not read the last spliced frame yet still sees its pages
+	for (auto& b : buffers)
+		if (b.data() == splicedFrame)
+			retired.push_back(std::move(b));
+	splicedFrame = nullptr;
+	buffers.clear();
+	freeBuffers.clear();
+	planes.clear();
+}
+
+uint8_t* FrameStream::acquire()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (freeBuffers.empty())
+	{
+		++stallCount;
+		bufferReleased.wait(lock, [this] { return !freeBuffers.empty(); });
+	}
+	uint8_t* frame = freeBuffers.front();
+	freeBuffers.pop_front();
+	return frame;
+}
+
+void FrameStream::submit(uint8_t* frame)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending.push_back(frame);
+	}
+	frameQueued.notify_one();
+}
+
+void FrameStream::writerLoop()
+{
+	if (profiler)
+		profiler->setThreadName("frame stream");
+
+	for (;;)
+	{
+		uint8_t* frame;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			frameQueued.wait(lock, [this] { return closing || !pending.empty(); });
+			if (pending.empty())
+				return;
+			frame = pending.front();
+			pending.pop_front();
+		}
+
+		// after a write error frames are dropped so the simulation keeps going
+		uint8_t* released = frame;
+		if (!failed)
+		{
+			PhaseProfiler::HostScope scope(profiler, PhaseProfiler::STREAM_WRITE);
+			bool ok;
+			if (format == Y4M)
+			{
+				convertToYUV444(frame);
+				static const uint8_t tag[] = { 'F', 'R', 'A', 'M', 'E', '\n' };
+				ok = writeAll(tag, sizeof(tag)) && writeAll(planes.data(), planes.size());
+			}
+			else if (useSplice)
+				ok = spliceAll(frame, frameSize());
+			else
+				ok = writeAll(frame, frameSize());
+
+			if (!ok)
+			{
+				fprintf(stderr, "Error writing frame stream: %s\n", strerror(errno));
+				failed = true;
+			}
+			else if (useSplice && format != Y4M)
+			{
+				// this frame pushed the previous one out of the pipe
+				released = splicedFrame;
+				splicedFrame = frame;
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (released)
+				freeBuffers.push_back(released);
+			// the consumer is gone, nothing reads the spliced pages anymore
+			if (failed && splicedFrame)
+			{
+				freeBuffers.push_back(splicedFrame);
+				splicedFrame = nullptr;
+			}
+		}
+		bufferReleased.notify_one();
+	}
+}
+
+bool FrameStream::writeAll(const uint8_t* data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t n = ::write(fd, data, size);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+}
+
+bool FrameStream::spliceAll(const uint8_t* data, size_t size)
+{
+#ifdef __linux__
+	while (size > 0)
+	{
+		struct iovec iov;
+		iov.iov_base = const_cast<uint8_t*>(data);
+		iov.iov_len = size;
+		ssize_t n = vmsplice(fd, &iov, 1, 0);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		data += n;
+		size -= n;
+	}
+	return true;
+#else
+	return writeAll(data, size);
+#endif
+}
+
+void FrameStream::convertToYUV444(const uint8_t* rgba)
+{
+	size_t n = size_t(width) * height;
+	uint8_t* Y = planes.data();
+	uint8_t* U = Y + n;
+	uint8_t* V = U + n;
+
+	// BT.601 limited range in 8.8 fixed point
+	for (size_t i = 0; i < n; ++i)
+	{
+		int r = rgba[4 * i];
+		int g = rgba[4 * i + 1];
+		int b = rgba[4 * i + 2];
+		Y[i] = static_cast<uint8_t>(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+		U[i] = static_cast<uint8_t>(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+		V[i] = static_cast<uint8_t>(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+	}
+}
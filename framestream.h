@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#include "profiler.h"
+
+// Streams uncompressed frames to a file descriptor (stdout, a file, a FIFO or
+// the stdin of a spawned process) for external encoders such as ffmpeg.
+//
+// Frames are handed over through a fixed pool of buffers. acquire() blocks while
+// every buffer is queued or being written, so a slow consumer throttles the
+// simulation instead of growing memory.
+class FrameStream
+{
+public:
+	enum Format
+	{
+		RAW_RGBA,	// packed RGBA8, no header (ffmpeg: -f rawvideo -pix_fmt rgb0 -s WxH)
+		Y4M			// YUV4MPEG2 with 4:4:4 planar BT.601 frames
+	};
+
+	FrameStream();
+	~FrameStream();
+
+	// path is "-" for stdout, "|command" to pipe into a shell command,
+	// otherwise a regular file or FIFO
+	bool open(const char* path, Format format, int width, int height, int fps = 25, int queueDepth = 4);
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+	size_t frameSize() const { return 4 * size_t(width) * height; }
+
+	// returns a free RGBA8 buffer of frameSize() bytes, blocking under back-pressure
+	uint8_t* acquire();
+	// queues a buffer obtained from acquire() for writing
+	void submit(uint8_t* frame);
+
+	// number of times acquire() had to wait for the consumer
+	unsigned long long stalls() const { return stallCount; }
+
+	// times and traces the writer thread under PhaseProfiler::STREAM_WRITE
+	void setProfiler(PhaseProfiler* profiler_) { profiler = profiler_; }
+
+private:
+	void writerLoop();
+	bool writeAll(const uint8_t* data, size_t size);
+	bool spliceAll(const uint8_t* data, size_t size);
+	void convertToYUV444(const uint8_t* rgba);
+
+	int fd;
+	FILE* process;
+	Format format;
+	int width, height;
+	bool useSplice;
+
+	std::vector<std::vector<uint8_t>> buffers;
+	// reused oldest first
+	std::deque<uint8_t*> freeBuffers;
+	// the last spliced frame, still referenced by the pipe when the writer
+	// stops; close() keeps it in retired instead of freeing it
+	uint8_t* splicedFrame;
+	std::vector<std::vector<uint8_t>> retired;
+	std::deque<uint8_t*> pending;
+	std::vector<uint8_t> planes;
+
+	std::mutex mutex;
+	std::condition_variable frameQueued, bufferReleased;
+	std::thread writer;
+	bool closing;
+	bool failed;
+	unsigned long long stallCount;
+	PhaseProfiler* profiler;
+};
@@ -4,8 +4,16 @@
  */
 
 #include <iostream>
+#include <cstdio>
+#include <string>
+#include <sstream>
+#include <cstdlib>
 
 #include "fluidsimulation.h"
+#include "eventscript.h"
+#include "ensemble.h"
+#include "decomposition.h"
+#include "outofcore.h"
 
 static void show_usage(std::string name)
 {
@@ -14,20 +22,88 @@ static void show_usage(std::string name)
 		<< "\t-h,--help\t\t\tShow this help message\n"
 		<< "\t-g,--gif\t\t\tSave simulation as gif\n"
 		<< "\t-s,--size\tWIDTH HEIGHT\tSpecify simulation size\n"
+		<< "\t--coarse\tN\t\tSolve velocity and pressure on a grid N = 2 or 4 times coarser than the ink\n"
+		<< "\t--species\tN\t\tNumber of dye species (default 3)\n"
+		<< "\t--dye-layout\tinterleaved|aosoa\tStorage of the dye species (default interleaved)\n"
+		<< "\t--palette\tRRGGBB,...\tColour of every dye species (default red, green, blue, then hues)\n"
 		<< "\t-p,--pre\tPATH\t\tSpecify predefined user interaction, disables GUI\n"
         << "\t-t,--threads\tTHREADS_X THREADS_Y\tSpecfiy the number of threads per block\n"
+		<< "\t--tune\t\t\t\tBenchmark the block shape of every kernel and store the winners\n"
+		<< "\t--tune-db\tPATH\t\tTuning database (default fluidsim_tuning.db, \"\" to disable)\n"
+		<< "\t-c,--compile\tPATH\t\tCompile the predefined user interaction to PATH and exit\n"
+		<< "\t-i,--interval\tN\t\tWrite an output frame every N iterations (default 10)\n"
+		<< "\t--realtime\tMS\t\tHold every frame to MS milliseconds by adapting solver sweeps and output\n"
+		<< "\t--cfl\t\tC\t\tAdapt the time step to CFL number C instead of one step per frame\n"
+		<< "\t--diffusion-tol\tE\t\tRelative error of the diffusion step (default 1e-4, 0 for 35 sweeps)\n"
+		<< "\t--pressure\tjacobi|dct\tPressure solver (default jacobi)\n"
+		<< "\t--pressure-compare\t\tSolve with both every 100th frame and compare time and residual (implies dct)\n"
+		<< "\t--host-threads\tN\t\tThreads of the dct solve (default all CPUs)\n"
+		<< "\t--affinity\tnone|compact|scatter\tPin the dct threads, filling one NUMA node first or round-robin\n"
+		<< "\t--engine\tstable|lbm\tFluid solver: stable fluids or D2Q9 lattice Boltzmann (default stable)\n"
+		<< "\t--lbm-substeps\tN\t\tLattice Boltzmann steps per frame (default 10)\n"
+		<< "\t--ensemble\tPATH\t\tRun the members listed in PATH (script [viscosity] per line, fork SCRIPT N) batched\n"
+		<< "\t--ranks\t\tN\t\tSplit the grid into N strips simulated by N processes (requires -p)\n"
+		<< "\t--out-of-core\tDIR\t\tKeep the fields in files in DIR and stream them through memory by tiles (requires -p)\n"
+		<< "\t--tile-rows\tN\t\tRows of an out-of-core tile (default 512)\n"
+		<< "\t--pass-frames\tN\t\tFrames simulated per out-of-core tile load (default 1)\n"
+		<< "\t--cache-tiles\tN\t\tOut-of-core tiles held in memory (default 4)\n"
+		<< "\t--io-threads\tN\t\tThreads reading and writing out-of-core tiles (default 4)\n"
+		<< "\t--advection-rows\tN\tRows advection may reach across an out-of-core halo (default 8)\n"
+		<< "\t-r,--raw\tPATH\t\tStream raw frames to PATH (\"-\" for stdout, \"|cmd\" for a pipe)\n"
+		<< "\t--raw-format\trgba|y4m\tFormat of the raw frame stream (default rgba)\n"
+		<< "\t--raw-queue\tN\t\tFrames buffered before the stream applies back-pressure (default 4)\n"
+		<< "\t--shm\t\tNAME\t\tPublish frames to the POSIX shared-memory ring NAME\n"
+		<< "\t--shm-control\tPATH\t\tUnix socket for selecting the published field\n"
+		<< "\t--shm-slots\tN\t\tNumber of frame slots in the ring (default 4)\n"
+		<< "\t--profile\t\t\tTime every phase of the simulation (toggle at runtime with SIGUSR1)\n"
+		<< "\t--perf-counters\t\t\tAlso count cycles, instructions, cache/TLB misses per phase (implies --profile)\n"
+		<< "\t--profile-report\tPATH\tWrite per-frame phase timings to PATH (.csv or .json)\n"
+		<< "\t--trace\t\tPATH\t\tWrite a Chrome trace-event timeline (Perfetto) to PATH\n"
+		<< "\t--trace-capacity\tN\tEvents kept per thread (default 1048576)\n"
+		<< "\t--trace-ring\t\t\tKeep the most recent events instead of the first ones\n"
+		<< "\t--dump\t\tN,N,... DIR\tWrite p, u, v and ink as raw float32 to DIR after frames N\n"
 		<< std::endl;
 }
 
+// the options given that a batch mode (--ensemble, --ranks, --out-of-core)
+// does not take, comma-separated; they only apply to the single simulation
+static std::string ignoredOptions(const FluidSimulation::Options& options, bool usesScript)
+{
+	FluidSimulation::Options defaults;
+	std::string names;
+	auto check = [&names](bool given, const char* name) {
+		if (given)
+			names += (names.empty() ? "" : ", ") + std::string(name);
+	};
+	check(!usesScript && options.inputFile[0] != '\0', "--predefined");
+	check(options.saveImages, "--gif");
+	check(options.coarsening != defaults.coarsening, "--coarse");
+	check(options.species != defaults.species || options.dyeLayout != defaults.dyeLayout || options.palette[0] != '\0',
+		"--species/--dye-layout/--palette");
+	check(options.tune || std::string(options.tuningDatabase) != defaults.tuningDatabase, "--tune/--tune-db");
+	check(options.outputInterval != defaults.outputInterval, "--interval");
+	check(options.frameBudgetMs > 0.f, "--realtime");
+	check(options.cfl > 0.f, "--cfl");
+	check(options.spectralPressure || options.comparePressure, "--pressure/--pressure-compare");
+	check(options.hostThreads != defaults.hostThreads || options.affinity != defaults.affinity, "--host-threads/--affinity");
+	check(options.engine != defaults.engine || options.latticeSubsteps != defaults.latticeSubsteps, "--engine/--lbm-substeps");
+	check(options.rawStreamPath[0] != '\0' || options.rawStreamFormat != defaults.rawStreamFormat
+		|| options.rawStreamQueue != defaults.rawStreamQueue, "--raw");
+	check(options.sharedMemoryName[0] != '\0' || options.controlSocket[0] != '\0'
+		|| options.sharedMemorySlots != defaults.sharedMemorySlots, "--shm");
+	check(options.profile || options.profileReport[0] != '\0', "--profile");
+	check(options.traceFile[0] != '\0' || options.traceCapacity != defaults.traceCapacity || options.traceRing, "--trace");
+	return names;
+}
+
 int main(int argc, char **argv)
 {
-	int width = 512;
-	int height = 512;
-    int threads_x = 16;
-    int threads_y = 16;
-	bool saveImages = false;
-	bool predefined = false;
-	const char* userdata_path = "";
+	FluidSimulation::Options options;
+	const char* compiledScriptPath = "";
+	const char* ensemblePath = "";
+	int ranks = 0;
+	OutOfCore::Options outOfCore;
+	bool outOfCoreOptions = false;
 
 	for (int i = 1; i < argc; ++i) {
 		std::string arg = argv[i];
@@ -36,22 +112,172 @@ int main(int argc, char **argv)
 			return 0;
 		}
 		else if ((arg == "-g") || (arg == "--gif")) {
-			saveImages = true;
+			options.saveImages = true;
 		}
         else if ((arg == "-t") || (arg == "--threads")) {
 			if (i + 2 < argc) {
-				sscanf(argv[++i], "%i", &threads_x);
-				sscanf(argv[++i], "%i", &threads_y);
+				sscanf(argv[++i], "%i", &options.threads_x);
+				sscanf(argv[++i], "%i", &options.threads_y);
+				options.tunedBlocks = false;
 			}
 			else {
 				std::cout << "--threads option requires two arguments." << std::endl;
 				return 1;
 			}
 		}
+		else if (arg == "--coarse") {
+			if (i + 1 < argc) {
+				options.coarsening = atoi(argv[++i]);
+			}
+			else {
+				std::cout << "--coarse option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--species") {
+			if (i + 1 < argc) {
+				options.species = atoi(argv[++i]);
+			}
+			else {
+				std::cout << "--species option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--dye-layout") {
+			if (i + 1 < argc) {
+				if (!Dye::parseLayout(argv[++i], options.dyeLayout)) {
+					std::cout << "--dye-layout must be interleaved or aosoa." << std::endl;
+					return 1;
+				}
+			}
+			else {
+				std::cout << "--dye-layout option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--palette") {
+			if (i + 1 < argc) {
+				options.palette = argv[++i];
+			}
+			else {
+				std::cout << "--palette option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--ensemble") {
+			if (i + 1 < argc) {
+				ensemblePath = argv[++i];
+			}
+			else {
+				std::cout << "--ensemble option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--ranks") {
+			if (i + 1 < argc) {
+				ranks = atoi(argv[++i]);
+			}
+			else {
+				std::cout << "--ranks option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--out-of-core") {
+			if (i + 1 < argc) {
+				outOfCore.directory = argv[++i];
+			}
+			else {
+				std::cout << "--out-of-core option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--tile-rows") {
+			if (i + 1 < argc) {
+				outOfCore.tileRows = atoi(argv[++i]);
+				outOfCoreOptions = true;
+			}
+			else {
+				std::cout << "--tile-rows option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--pass-frames") {
+			if (i + 1 < argc) {
+				outOfCore.passFrames = atoi(argv[++i]);
+				outOfCoreOptions = true;
+			}
+			else {
+				std::cout << "--pass-frames option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--cache-tiles") {
+			if (i + 1 < argc) {
+				outOfCore.cacheTiles = atoi(argv[++i]);
+				outOfCoreOptions = true;
+			}
+			else {
+				std::cout << "--cache-tiles option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--io-threads") {
+			if (i + 1 < argc) {
+				outOfCore.ioThreads = atoi(argv[++i]);
+				outOfCoreOptions = true;
+			}
+			else {
+				std::cout << "--io-threads option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--advection-rows") {
+			if (i + 1 < argc) {
+				outOfCore.advectionReach = atoi(argv[++i]);
+				outOfCoreOptions = true;
+			}
+			else {
+				std::cout << "--advection-rows option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--host-threads") {
+			if (i + 1 < argc) {
+				options.hostThreads = atoi(argv[++i]);
+			}
+			else {
+				std::cout << "--host-threads option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--affinity") {
+			if (i + 1 < argc) {
+				if (!Numa::parseAffinity(argv[++i], options.affinity)) {
+					std::cout << "--affinity must be none, compact or scatter." << std::endl;
+					return 1;
+				}
+			}
+			else {
+				std::cout << "--affinity option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--tune") {
+			options.tune = true;
+		}
+		else if (arg == "--tune-db") {
+			if (i + 1 < argc) {
+				options.tuningDatabase = argv[++i];
+			}
+			else {
+				std::cout << "--tune-db option requires one argument." << std::endl;
+				return 1;
+			}
+		}
 		else if ((arg == "-s") || (arg == "--size")) {
 			if (i + 2 < argc) {
-				sscanf(argv[++i], "%i", &width);
-				sscanf(argv[++i], "%i", &height);
+				sscanf(argv[++i], "%i", &options.width);
+				sscanf(argv[++i], "%i", &options.height);
 			}
 			else {
 				std::cout << "--size option requires two arguments." << std::endl;
@@ -60,21 +286,295 @@ int main(int argc, char **argv)
 		}
 		else if ((arg == "-p") || (arg == "--predefined")) {
 			if (i + 1 < argc) {
-				userdata_path = argv[++i];
-				predefined = true;
+				options.inputFile = argv[++i];
 			}
 			else {
 				std::cout << "--predefined option requires one argument." << std::endl;
 				return 1;
 			}
 		}
+		else if ((arg == "-c") || (arg == "--compile")) {
+			if (i + 1 < argc) {
+				compiledScriptPath = argv[++i];
+			}
+			else {
+				std::cout << "--compile option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if ((arg == "-i") || (arg == "--interval")) {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%i", &options.outputInterval);
+			}
+			else {
+				std::cout << "--interval option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--realtime") {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%f", &options.frameBudgetMs);
+			}
+			else {
+				std::cout << "--realtime option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--cfl") {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%f", &options.cfl);
+			}
+			else {
+				std::cout << "--cfl option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--diffusion-tol") {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%f", &options.diffusionTolerance);
+			}
+			else {
+				std::cout << "--diffusion-tol option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--pressure") {
+			if (i + 1 < argc) {
+				std::string solver = argv[++i];
+				if (solver == "jacobi")
+					options.spectralPressure = false;
+				else if (solver == "dct")
+					options.spectralPressure = true;
+				else {
+					std::cout << "--pressure must be jacobi or dct." << std::endl;
+					return 1;
+				}
+			}
+			else {
+				std::cout << "--pressure option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--pressure-compare") {
+			options.comparePressure = true;
+		}
+		else if (arg == "--engine") {
+			if (i + 1 < argc) {
+				std::string engine = argv[++i];
+				if (engine == "stable")
+					options.engine = FluidSimulation::STABLE_FLUIDS;
+				else if (engine == "lbm")
+					options.engine = FluidSimulation::LATTICE_BOLTZMANN;
+				else {
+					std::cout << "--engine must be stable or lbm." << std::endl;
+					return 1;
+				}
+			}
+			else {
+				std::cout << "--engine option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--lbm-substeps") {
+			if (i + 1 < argc) {
+				options.latticeSubsteps = atoi(argv[++i]);
+			}
+			else {
+				std::cout << "--lbm-substeps option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if ((arg == "-r") || (arg == "--raw")) {
+			if (i + 1 < argc) {
+				options.rawStreamPath = argv[++i];
+			}
+			else {
+				std::cout << "--raw option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--raw-format") {
+			if (i + 1 < argc) {
+				std::string format = argv[++i];
+				if (format == "rgba")
+					options.rawStreamFormat = FrameStream::RAW_RGBA;
+				else if (format == "y4m")
+					options.rawStreamFormat = FrameStream::Y4M;
+				else {
+					std::cout << "--raw-format must be rgba or y4m." << std::endl;
+					return 1;
+				}
+			}
+			else {
+				std::cout << "--raw-format option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--raw-queue") {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%i", &options.rawStreamQueue);
+			}
+			else {
+				std::cout << "--raw-queue option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--shm") {
+			if (i + 1 < argc) {
+				options.sharedMemoryName = argv[++i];
+			}
+			else {
+				std::cout << "--shm option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--shm-control") {
+			if (i + 1 < argc) {
+				options.controlSocket = argv[++i];
+			}
+			else {
+				std::cout << "--shm-control option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--shm-slots") {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%i", &options.sharedMemorySlots);
+			}
+			else {
+				std::cout << "--shm-slots option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--profile") {
+			options.profile = true;
+		}
+		else if (arg == "--perf-counters") {
+			options.profile = true;
+			options.perfCounters = true;
+		}
+		else if (arg == "--profile-report") {
+			if (i + 1 < argc) {
+				options.profileReport = argv[++i];
+				std::string path = options.profileReport;
+				if (path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0)
+					options.profileFormat = PhaseProfiler::JSON;
+			}
+			else {
+				std::cout << "--profile-report option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--trace") {
+			if (i + 1 < argc) {
+				options.traceFile = argv[++i];
+			}
+			else {
+				std::cout << "--trace option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--trace-capacity") {
+			if (i + 1 < argc) {
+				sscanf(argv[++i], "%i", &options.traceCapacity);
+			}
+			else {
+				std::cout << "--trace-capacity option requires one argument." << std::endl;
+				return 1;
+			}
+		}
+		else if (arg == "--trace-ring") {
+			options.traceRing = true;
+		}
+		else if (arg == "--dump") {
+			if (i + 2 < argc) {
+				std::stringstream frames(argv[++i]);
+				std::string frame;
+				while (std::getline(frames, frame, ','))
+					options.dumpFrames.push_back(atoi(frame.c_str()));
+				options.dumpDir = argv[++i];
+			}
+			else {
+				std::cout << "--dump option requires two arguments." << std::endl;
+				return 1;
+			}
+		}
 		else {
 			show_usage(argv[0]);
 			return 1;
 		}
 	}
 
-	FluidSimulation fluidSim(width, height, threads_x, threads_y, saveImages, userdata_path);
+	if (compiledScriptPath[0] != '\0') {
+		if (options.inputFile[0] == '\0') {
+			std::cout << "--compile requires --predefined." << std::endl;
+			return 1;
+		}
+		EventScript script;
+		if (!script.load(options.inputFile) || !script.save(compiledScriptPath))
+			return 1;
+		std::cout << "Compiled " << script.size() << " events to " << compiledScriptPath << std::endl;
+		return 0;
+	}
+
+	bool outOfCoreMode = outOfCore.directory[0] != '\0';
+	if ((ensemblePath[0] != '\0') + (ranks > 0) + outOfCoreMode > 1) {
+		std::cout << "--ensemble, --ranks and --out-of-core exclude each other." << std::endl;
+		return 1;
+	}
+	if (outOfCoreOptions && !outOfCoreMode)
+		std::cout << "> --tile-rows, --pass-frames, --cache-tiles, --io-threads and --advection-rows only apply to --out-of-core" << std::endl;
+	const char* batchMode = ensemblePath[0] != '\0' ? "--ensemble" : ranks > 0 ? "--ranks" : outOfCoreMode ? "--out-of-core" : "";
+	if (batchMode[0] != '\0') {
+		std::string ignored = ignoredOptions(options, ensemblePath[0] == '\0');
+		if (!ignored.empty())
+			std::cout << "> " << ignored << " do not apply to " << batchMode << std::endl;
+	}
+
+	if (ensemblePath[0] != '\0') {
+		Ensemble::Manifest manifest;
+		if (!Ensemble::loadManifest(ensemblePath, manifest))
+			return 1;
+		Ensemble::Options ensembleOptions;
+		ensembleOptions.width = options.width;
+		ensembleOptions.height = options.height;
+		ensembleOptions.threads = options.threads_x * options.threads_y;
+		ensembleOptions.diffusionTolerance = options.diffusionTolerance;
+		ensembleOptions.dumpFrames = options.dumpFrames;
+		ensembleOptions.dumpDir = options.dumpDir;
+		Ensemble ensemble(ensembleOptions, manifest);
+		ensemble.run();
+		return 0;
+	}
+
+	if (ranks > 0) {
+		Decomposition::Options decompositionOptions;
+		decompositionOptions.width = options.width;
+		decompositionOptions.height = options.height;
+		decompositionOptions.ranks = ranks;
+		decompositionOptions.threads = options.threads_x * options.threads_y;
+		decompositionOptions.inputFile = options.inputFile;
+		decompositionOptions.diffusionTolerance = options.diffusionTolerance;
+		decompositionOptions.dumpFrames = options.dumpFrames;
+		decompositionOptions.dumpDir = options.dumpDir;
+		return Decomposition::run(decompositionOptions) ? 0 : 1;
+	}
+
+	if (outOfCoreMode) {
+		outOfCore.width = options.width;
+		outOfCore.height = options.height;
+		outOfCore.threads = options.threads_x * options.threads_y;
+		outOfCore.inputFile = options.inputFile;
+		outOfCore.diffusionTolerance = options.diffusionTolerance;
+		outOfCore.dumpFrames = options.dumpFrames;
+		outOfCore.dumpDir = options.dumpDir;
+		return OutOfCore::run(outOfCore) ? 0 : 1;
+	}
+
+	// the command line owns the process, so SIGUSR1 may toggle profiling
+	options.profileSignal = true;
+	FluidSimulation fluidSim(options);
+	fluidSim.run();
 
     return 0;
 }
@@ -0,0 +1,291 @@
+#include "numa.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace Numa
+{
+	namespace
+	{
+		struct Topology
+		{
+			std::vector<int> nodeIds;
+			std::vector<std::vector<int>> nodeCpus;
+		};
+
+		// "0-3,8,10-11"
+		std::vector<int> parseCpuList(const std::string& text)
+		{
+			std::vector<int> cpus;
+			std::stringstream in(text);
+			std::string range;
+			while (std::getline(in, range, ','))
+			{
+				int first = 0, last = 0;
+				int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+				if (fields < 1)
+					continue;
+				if (fields == 1)
+					last = first;
+				for (int cpu = first; cpu <= last; ++cpu)
+					cpus.push_back(cpu);
+			}
+			return cpus;
+		}
+
+		Topology readTopology()
+		{
+			cpu_set_t allowed;
+			CPU_ZERO(&allowed);
+			bool restricted = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+			Topology topology;
+			std::vector<int> nodeIds;
+			if (DIR* dir = opendir("/sys/devices/system/node"))
+			{
+				while (dirent* entry = readdir(dir))
+				{
+					int id;
+					char tail;
+					if (sscanf(entry->d_name, "node%d%c", &id, &tail) == 1)
+						nodeIds.push_back(id);
+				}
+				closedir(dir);
+			}
+			std::sort(nodeIds.begin(), nodeIds.end());
+
+			for (int id : nodeIds)
+			{
+				std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+				std::string text;
+				std::getline(file, text);
+				std::vector<int> cpus;
+				for (int cpu : parseCpuList(text))
+					if (!restricted || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed)))
+						cpus.push_back(cpu);
+				// nodes without CPUs (memory only) take no workers
+				if (cpus.empty())
+					continue;
+				topology.nodeIds.push_back(id);
+				topology.nodeCpus.push_back(cpus);
+			}
+
+			if (topology.nodeCpus.empty())
+			{
+				std::vector<int> cpus;
+				for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+					if (restricted ? CPU_ISSET(cpu, &allowed) : cpu < static_cast<int>(std::thread::hardware_concurrency()))
+						cpus.push_back(cpu);
+				if (cpus.empty())
+					cpus.push_back(0);
+				topology.nodeIds.push_back(0);
+				topology.nodeCpus.push_back(cpus);
+			}
+			return topology;
+		}
+
+		const Topology& topology()
+		{
+			static Topology t = readTopology();
+			return t;
+		}
+
+		int allowedCpus()
+		{
+			int count = 0;
+			for (const std::vector<int>& cpus : topology().nodeCpus)
+				count += static_cast<int>(cpus.size());
+			return count;
+		}
+	}
+
+	const char* affinityName(int affinity)
+	{
+		static const char* names[AFFINITY_COUNT] = { "none", "compact", "scatter" };
+		return affinity >= 0 && affinity < AFFINITY_COUNT ? names[affinity] : "?";
+	}
+
+	bool parseAffinity(const std::string& name, Affinity& affinity)
+	{
+		for (int a = 0; a < AFFINITY_COUNT; ++a)
+			if (name == affinityName(a))
+			{
+				affinity = static_cast<Affinity>(a);
+				return true;
+			}
+		return false;
+	}
+
+	int nodeCount()
+	{
+		return static_cast<int>(topology().nodeCpus.size());
+	}
+
+	std::vector<int> workerCpus(Affinity affinity, int threads)
+	{
+		std::vector<int> cpus;
+		if (affinity == NONE)
+			return cpus;
+
+		const std::vector<std::vector<int>>& nodes = topology().nodeCpus;
+		std::vector<int> all;
+		for (const std::vector<int>& node : nodes)
+			all.insert(all.end(), node.begin(), node.end());
+
+		for (int w = 0; w < threads; ++w)
+		{
+			if (affinity == COMPACT)
+				cpus.push_back(all[w % all.size()]);
+			else
+			{
+				const std::vector<int>& node = nodes[w % nodes.size()];
+				cpus.push_back(node[(w / nodes.size()) % node.size()]);
+			}
+		}
+		return cpus;
+	}
+
+	bool pinCurrentThread(int cpu)
+	{
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+	}
+
+	void countPages(const void* data, size_t bytes, std::vector<size_t>& pages)
+	{
+		const Topology& t = topology();
+		pages.resize(t.nodeIds.size() + 1, 0);
+		if (bytes == 0)
+			return;
+
+		size_t pageSize = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+		uintptr_t first = reinterpret_cast<uintptr_t>(data) / pageSize * pageSize;
+		uintptr_t end = reinterpret_cast<uintptr_t>(data) + bytes;
+		std::vector<void*> addresses;
+		for (uintptr_t page = first; page < end; page += pageSize)
+			addresses.push_back(reinterpret_cast<void*>(page));
+		std::vector<int> status(addresses.size(), -1);
+
+#ifdef SYS_move_pages
+		// without target nodes move_pages only reports where each page is
+		if (syscall(SYS_move_pages, 0, addresses.size(), addresses.data(), nullptr, status.data(), 0) != 0)
+			std::fill(status.begin(), status.end(), -1);
+#endif
+		for (int node : status)
+		{
+			auto found = std::find(t.nodeIds.begin(), t.nodeIds.end(), node);
+			++pages[found == t.nodeIds.end() ? t.nodeIds.size() : found - t.nodeIds.begin()];
+		}
+	}
+
+	std::string placement(const std::vector<size_t>& pages)
+	{
+		std::string text;
+		for (size_t n = 0; n + 1 < pages.size(); ++n)
+			text += (n > 0 ? "/" : "") + std::to_string(pages[n]);
+		if (!pages.empty() && pages.back() > 0)
+			text += " +" + std::to_string(pages.back()) + " untouched";
+		return text;
+	}
+
+	Workers::Workers()
+		: threadCount(1)
+		, pinning(NONE)
+		, job(nullptr)
+		, jobRows(0)
+		, generation(0)
+		, pending(0)
+		, stopping(false)
+	{
+	}
+
+	Workers::~Workers()
+	{
+		stop();
+	}
+
+	void Workers::init(int threads_, Affinity affinity)
+	{
+		stop();
+		threadCount = threads_ > 0 ? threads_ : std::max(1, allowedCpus());
+		pinning = affinity;
+		cpus = workerCpus(affinity, threadCount);
+		if (!cpus.empty() && !pinCurrentThread(cpus[0]))
+			fprintf(stderr, "Warning: could not pin the main thread to CPU %d\n", cpus[0]);
+		for (int w = 1; w < threadCount; ++w)
+			threads.emplace_back(&Workers::loop, this, w, generation);
+	}
+
+	void Workers::stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		started.notify_all();
+		for (std::thread& thread : threads)
+			thread.join();
+		threads.clear();
+		stopping = false;
+	}
+
+	void Workers::run(int rows, const std::function<void(int, int)>& work)
+	{
+		if (threadCount > 1)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			job = &work;
+			jobRows = rows;
+			pending = threadCount - 1;
+			++generation;
+		}
+		started.notify_all();
+
+		work(0, rows / threadCount);
+
+		if (threadCount > 1)
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			finished.wait(lock, [this] { return pending == 0; });
+			job = nullptr;
+		}
+	}
+
+	void Workers::loop(int worker, unsigned long long seen)
+	{
+		if (!cpus.empty())
+			pinCurrentThread(cpus[worker]);
+
+		for (;;)
+		{
+			const std::function<void(int, int)>* work;
+			int rows;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				started.wait(lock, [&] { return stopping || generation != seen; });
+				if (stopping)
+					return;
+				seen = generation;
+				work = job;
+				rows = jobRows;
+			}
+
+			(*work)(int64_t(rows) * worker / threadCount, int64_t(rows) * (worker + 1) / threadCount);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (--pending == 0)
+				finished.notify_one();
+		}
+	}
+}
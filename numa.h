@@ -0,0 +1,81 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// NUMA topology and page placement for the host-side parallel work.
+//
+// The topology comes from /sys/devices/system/node, restricted to the CPUs
+// this process may run on; without it the machine is one node. Page placement
+// is queried with move_pages(2). Neither needs libnuma.
+//
+// Linux places a page on the node of the thread that first touches it. Workers
+// run the same rows on the same thread every time, so buffers that the workers
+// first touch by rows (instead of one thread zeroing them all) are local to
+// the thread that later reads and writes them.
+namespace Numa
+{
+	enum Affinity
+	{
+		NONE,		// threads are not pinned
+		COMPACT,	// worker w on the w-th CPU, filling node 0 first
+		SCATTER,	// workers round-robin over the nodes
+		AFFINITY_COUNT
+	};
+
+	const char* affinityName(int affinity);
+	// "none", "compact" or "scatter", false otherwise
+	bool parseAffinity(const std::string& name, Affinity& affinity);
+
+	int nodeCount();
+	// CPU of each of threads workers, empty for NONE
+	std::vector<int> workerCpus(Affinity affinity, int threads);
+	bool pinCurrentThread(int cpu);
+
+	// pages of [data, data + bytes) per node, added to pages (nodeCount() + 1
+	// entries, the last for pages not yet touched or of unknown node)
+	void countPages(const void* data, size_t bytes, std::vector<size_t>& pages);
+	// "a/b/..." pages per node, with "+n untouched" if any
+	std::string placement(const std::vector<size_t>& pages);
+
+	// A fixed pool of threads that splits row ranges: worker w always gets
+	// rows [rows * w / count, rows * (w + 1) / count). Worker 0 is the calling
+	// thread; with an affinity it is pinned as well.
+	class Workers
+	{
+	public:
+		Workers();
+		~Workers();
+
+		// threads 0 uses all CPUs this process may run on
+		void init(int threads, Affinity affinity);
+		int count() const { return threadCount; }
+		Affinity affinity() const { return pinning; }
+
+		// work(first, last) on every worker, returns when all are done
+		void run(int rows, const std::function<void(int, int)>& work);
+
+	private:
+		// seen is the last job generation before the worker started
+		void loop(int worker, unsigned long long seen);
+		void stop();
+
+		int threadCount;
+		Affinity pinning;
+		std::vector<int> cpus;
+		std::vector<std::thread> threads;
+
+		std::mutex mutex;
+		std::condition_variable started, finished;
+		const std::function<void(int, int)>* job;
+		int jobRows;
+		unsigned long long generation;
+		int pending;
+		bool stopping;
+	};
+}
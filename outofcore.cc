@@ -0,0 +1,549 @@
+#include "outofcore.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "common.h"
+#include "timer.h"
+
+using namespace FluidSim;
+
+namespace
+{
+	const char* fieldNames[4] = { "p", "u", "v", "ink_r" };
+
+	double elapsedMs(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	bool preadFully(int file, void* data, size_t bytes, off_t offset)
+	{
+		char* out = static_cast<char*>(data);
+		while (bytes > 0)
+		{
+			ssize_t done = pread(file, out, bytes, offset);
+			if (done <= 0)
+				return false;
+			out += done;
+			bytes -= done;
+			offset += done;
+		}
+		return true;
+	}
+
+	bool pwriteFully(int file, const void* data, size_t bytes, off_t offset)
+	{
+		const char* in = static_cast<const char*>(data);
+		while (bytes > 0)
+		{
+			ssize_t done = pwrite(file, in, bytes, offset);
+			if (done <= 0)
+				return false;
+			in += done;
+			bytes -= done;
+			offset += done;
+		}
+		return true;
+	}
+}
+
+bool OutOfCore::run(const Options& options)
+{
+	if (options.inputFile[0] == '\0')
+	{
+		fprintf(stderr, "Error: --out-of-core requires --predefined\n");
+		return false;
+	}
+	if (options.tileRows < 1 || options.passFrames < 1 || options.cacheTiles < 1 || options.ioThreads < 1 || options.advectionReach < 2)
+	{
+		fprintf(stderr, "Error: --tile-rows, --pass-frames, --cache-tiles and --io-threads must be positive, --advection-rows at least 2\n");
+		return false;
+	}
+
+	OutOfCore simulation(options);
+	if (simulation.tiles > 1 && simulation.halo > options.tileRows)
+	{
+		fprintf(stderr, "Error: %d frames per pass need %d halo rows, more than the %d rows of a tile\n",
+			options.passFrames, simulation.halo, options.tileRows);
+		return false;
+	}
+	if (!simulation.createFiles())
+		return false;
+	simulation.simulate();
+	simulation.removeFiles();
+	return true;
+}
+
+OutOfCore::OutOfCore(const Options& options)
+	: options(options)
+	, stopping(false)
+	, nextRead(0)
+	, computed(-1)
+	, bytesRead(0)
+	, bytesWritten(0)
+	, haloBytes(0)
+	, ioMs(0.0)
+	, readWaitMs(0.0)
+	, slotWaitMs(0.0)
+	, computeMs(0.0)
+	, computedRows(0)
+	, speed(0.0)
+	, verticalSpeed(0.0)
+{
+	if (!events.load(options.inputFile))
+		exit(-1);
+
+	info.width = options.width;
+	info.members = 1;
+	info.threads = options.threads;
+	info.tracer = nullptr;
+
+	int deviceCount = 0;
+	if (cuInit(0) == CUDA_SUCCESS)
+		CHECK(cuDeviceGetCount(&deviceCount));
+	if (deviceCount == 0)
+	{
+		fprintf(stderr, "Error: no devices supporting CUDA\n");
+		exit(-1);
+	}
+	CUdevice device;
+	CHECK(cuDeviceGet(&device, 0));
+	CHECK(cuCtxCreate(&context, 0, device));
+	FluidSim::loadEnsembleKernels(info);
+
+	// the halo depends on the sweep counts
+	stepper.setViscosities(std::vector<float>(1, viscosity), options.diffusionTolerance);
+	tiles = (options.height + options.tileRows - 1) / options.tileRows;
+	halo = haloRows(options.passFrames);
+	maxRows = std::min(options.height, options.tileRows + 2 * halo);
+
+	// a pass ends early after a dump frame
+	int end = events.endFrame();
+	for (int frame = 0; frame < end;)
+	{
+		int last = std::min(end, frame + options.passFrames);
+		for (int dump : options.dumpFrames)
+			if (dump >= frame && dump < last)
+				last = dump + 1;
+		Pass pass = { frame, last };
+		passes.push_back(pass);
+		frame = last;
+	}
+
+	info.height = maxRows;
+	size_t cells = size_t(info.width) * maxRows;
+	for (CUdeviceptr& field : d_fields)
+		CHECK(cuMemAlloc(&field, cells * sizeof(float)));
+}
+
+OutOfCore::~OutOfCore()
+{
+	for (CUdeviceptr field : d_fields)
+		cuMemFree(field);
+	stepper.release();
+	cuModuleUnload(info.module);
+	cuCtxDestroy(context);
+}
+
+// rows from the edge of a tile's region whose values are wrong after frames
+// frames, following what each phase of EnsembleStep::frame reads: advection
+// up to advectionReach rows away and the velocity in place, stencils one row
+// away
+int OutOfCore::haloRows(int frames) const
+{
+	int advectionReach = options.advectionReach;
+	int velocity = 0, pressure = 0, ink = 0;
+	for (int f = 0; f < frames; ++f)
+	{
+		velocity += advectionReach;
+		pressure = std::max(pressure + advectionReach, velocity);
+		ink = std::max(ink + advectionReach, velocity);
+		velocity += stepper.diffusionSweeps();
+		int divergence = velocity + 1;
+		for (int k = 0; k < stepper.pressureSweeps(); ++k)
+			pressure = std::max(pressure + 1, divergence);
+		velocity = std::max(velocity, pressure + 1);
+	}
+	// the wall condition at the region's edge overwrites its outermost row once
+	return std::max(velocity, std::max(pressure, ink)) + 1;
+}
+
+bool OutOfCore::createFiles()
+{
+	// sparse files read as zeros, the initial state
+	off_t bytes = off_t(options.width) * options.height * sizeof(float);
+	for (int g = 0; g < 2; ++g)
+	{
+		for (int f = 0; f < FIELD_COUNT; ++f)
+		{
+			std::string path = std::string(options.directory) + "/" + fieldNames[f] + "." + std::to_string(g) + ".f32";
+			int file = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+			if (file < 0 || ftruncate(file, bytes) != 0)
+			{
+				fprintf(stderr, "Error creating the field file %s: %s\n", path.c_str(), strerror(errno));
+				if (file >= 0)
+					close(file);
+				removeFiles();
+				return false;
+			}
+			paths[g].push_back(path);
+			files[g].push_back(file);
+		}
+	}
+	return true;
+}
+
+void OutOfCore::removeFiles()
+{
+	for (int g = 0; g < 2; ++g)
+	{
+		for (size_t f = 0; f < files[g].size(); ++f)
+		{
+			close(files[g][f]);
+			unlink(paths[g][f].c_str());
+		}
+		files[g].clear();
+		paths[g].clear();
+	}
+}
+
+void OutOfCore::tileRows(int tile, int& first, int& end) const
+{
+	first = tile * options.tileRows;
+	end = std::min(options.height, first + options.tileRows);
+}
+
+void OutOfCore::regionRows(int tile, int& first, int& end) const
+{
+	tileRows(tile, first, end);
+	first = std::max(0, first - halo);
+	end = std::min(options.height, end + halo);
+}
+
+void OutOfCore::simulate()
+{
+	size_t slotBytes = FIELD_COUNT * size_t(maxRows) * options.width * sizeof(float);
+	slots.resize(options.cacheTiles);
+	for (Slot& slot : slots)
+	{
+		void* data = nullptr;
+		CHECK(cuMemAllocHost(&data, slotBytes));
+		slot.data = static_cast<float*>(data);
+		slot.state = FREE;
+		slot.sequence = -1;
+	}
+	writtenPass.assign(tiles, -1);
+	for (int t = 0; t < options.ioThreads; ++t)
+		ioThreads.emplace_back(&OutOfCore::ioLoop, this);
+
+	Timer timer;
+	timer.reset();
+	timer.tic();
+
+	for (size_t g = 0; g < passes.size(); ++g)
+	{
+		for (int t = 0; t < tiles; ++t)
+		{
+			int sequence = static_cast<int>(g) * tiles + t;
+			int index = waitReady(sequence);
+			compute(slots[index], t, passes[g]);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				slots[index].state = WRITING;
+				Job job = { true, index };
+				jobs.push_back(job);
+				computed = sequence;
+			}
+			queued.notify_one();
+		}
+
+		int last = passes[g].endFrame - 1;
+		if (std::find(options.dumpFrames.begin(), options.dumpFrames.end(), last) != options.dumpFrames.end())
+		{
+			waitWritten(static_cast<int>(g));
+			dumpFields(static_cast<int>(g), last);
+		}
+	}
+	waitWritten(static_cast<int>(passes.size()) - 1);
+
+	timer.toc();
+	double ms = timer.getTotalTime();
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	queued.notify_all();
+	for (std::thread& thread : ioThreads)
+		thread.join();
+	ioThreads.clear();
+	for (Slot& slot : slots)
+		cuMemFreeHost(slot.data);
+	slots.clear();
+
+	int frames = events.endFrame();
+	double gb = 1024.0 * 1024.0 * 1024.0;
+	double mb = 1024.0 * 1024.0;
+	double cells = double(options.height) * frames;
+	double exposedMs = readWaitMs + slotWaitMs;
+	double ioWallMs = ioMs / options.ioThreads;
+	double hidden = ioWallMs > 0.0 ? std::max(0.0, 1.0 - exposedMs / ioWallMs) : 1.0;
+	printf("- Out-of-core: %dx%d in %d tiles of %d rows + %d halo rows, %d frames in %zu passes, %.0f ms\n",
+		options.width, options.height, tiles, options.tileRows, halo, frames, passes.size(), ms);
+	printf("- Cache: %d slots of %.1f MB, %d I/O threads\n", options.cacheTiles, slotBytes / mb, options.ioThreads);
+	printf("- I/O volume: %.2f GB read (%.0f%% halo rows), %.2f GB written, %.0f MB/s; %.0f ms busy per I/O thread\n",
+		bytesRead / gb, 100.0 * haloBytes / std::max(bytesRead, 1ULL), bytesWritten / gb,
+		(bytesRead + bytesWritten) / mb / std::max(ms / 1000.0, 1e-9), ioWallMs);
+	printf("- Overlap: compute %.0f ms (%.0f%%), waiting %.0f ms for reads and %.0f ms for writes; %.0f%% of the I/O hidden\n",
+		computeMs, 100.0 * computeMs / std::max(ms, 1.0), readWaitMs, slotWaitMs, 100.0 * hidden);
+	printf("- Temporal blocking: frames per tile load up to %d, %.0f%% of the cell updates recompute halo rows; max |u| + |v| %.3g\n",
+		options.passFrames, 100.0 * (computedRows - cells) / std::max(double(computedRows), 1.0), speed);
+	int crossed = static_cast<int>(std::ceil(verticalSpeed * frameTime / dx));
+	if (crossed > options.advectionReach - 1)
+		printf("Warning: the flow crossed up to %d rows per frame, more than --advection-rows %d allows; tile edges were cut off\n",
+			crossed, options.advectionReach);
+}
+
+void OutOfCore::prefetch()
+{
+	int total = static_cast<int>(passes.size()) * tiles;
+	while (nextRead < total)
+	{
+		// the writes of the previous pass that it overlaps must be queued
+		// ahead of it, it waits for them
+		int g = nextRead / tiles;
+		int t = nextRead % tiles;
+		if (g > 0 && computed < (g - 1) * tiles + std::min(t + 1, tiles - 1))
+			break;
+
+		auto free = std::find_if(slots.begin(), slots.end(), [](const Slot& slot) { return slot.state == FREE; });
+		if (free == slots.end())
+			break;
+		free->state = READING;
+		free->sequence = nextRead++;
+		Job job = { false, static_cast<int>(free - slots.begin()) };
+		jobs.push_back(job);
+		queued.notify_one();
+	}
+}
+
+int OutOfCore::waitReady(int sequence)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	for (;;)
+	{
+		prefetch();
+		for (size_t i = 0; i < slots.size(); ++i)
+			if (slots[i].sequence == sequence && slots[i].state == READY)
+				return static_cast<int>(i);
+
+		// without a slot for its read the tile waits for a write to finish
+		bool reading = nextRead > sequence;
+		auto start = std::chrono::steady_clock::now();
+		changed.wait(lock);
+		(reading ? readWaitMs : slotWaitMs) += elapsedMs(start);
+	}
+}
+
+void OutOfCore::waitWritten(int pass)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	auto start = std::chrono::steady_clock::now();
+	changed.wait(lock, [&] {
+		return std::all_of(writtenPass.begin(), writtenPass.end(), [&](int written) { return written >= pass; });
+	});
+	slotWaitMs += elapsedMs(start);
+}
+
+void OutOfCore::compute(Slot& slot, int tile, const Pass& pass)
+{
+	auto start = std::chrono::steady_clock::now();
+	int first, end, regionFirst, regionEnd;
+	tileRows(tile, first, end);
+	regionRows(tile, regionFirst, regionEnd);
+	info.height = regionEnd - regionFirst;
+
+	int width = options.width;
+	size_t rowBytes = width * sizeof(float);
+	size_t block = size_t(maxRows) * width;
+	for (int f = 0; f < FIELD_COUNT; ++f)
+		CHECK(cuMemcpyHtoD(d_fields[f], slot.data + f * block, info.height * rowBytes));
+
+	// the script's events at global positions
+	for (int frame = pass.firstFrame; frame < pass.endFrame; ++frame)
+	{
+		events.active(frame, activeEvents);
+		for (uint32_t id : activeEvents)
+			stepper.addInjection(events[id], frame, 0, options.width, options.height, regionFirst);
+		stepper.frame(info, d_fields);
+	}
+
+	// only the tile's rows are valid, they go back in place
+	size_t offset = size_t(first - regionFirst) * width;
+	for (int f = 0; f < FIELD_COUNT; ++f)
+		CHECK(cuMemcpyDtoH(slot.data + f * block + offset, d_fields[f] + offset * sizeof(float), (end - first) * rowBytes));
+
+	computedRows += static_cast<unsigned long long>(info.height) * (pass.endFrame - pass.firstFrame);
+	// at the end of passes with a 100th frame and of the last one
+	bool checkDue = pass.endFrame == events.endFrame();
+	for (int frame = pass.firstFrame; frame < pass.endFrame; ++frame)
+		checkDue = checkDue || frame % 100 == 0;
+	if (checkDue)
+		measureSpeed(slot, tile);
+	computeMs += elapsedMs(start);
+}
+
+void OutOfCore::measureSpeed(const Slot& slot, int tile)
+{
+	int first, end, regionFirst, regionEnd;
+	tileRows(tile, first, end);
+	regionRows(tile, regionFirst, regionEnd);
+	size_t block = size_t(maxRows) * options.width;
+	size_t offset = size_t(first - regionFirst) * options.width;
+	const float* u = slot.data + VELOCITY_U * block + offset;
+	const float* v = slot.data + VELOCITY_V * block + offset;
+	for (size_t c = 0; c < size_t(end - first) * options.width; ++c)
+	{
+		speed = std::max(speed, static_cast<double>(std::fabs(u[c]) + std::fabs(v[c])));
+		verticalSpeed = std::max(verticalSpeed, static_cast<double>(std::fabs(v[c])));
+	}
+}
+
+void OutOfCore::dumpFields(int pass, int frame)
+{
+	// the field files already have the dump format, they are copied by tiles
+	std::vector<float> rows(size_t(options.tileRows) * options.width);
+	size_t rowBytes = options.width * sizeof(float);
+	const std::vector<int>& written = files[(pass + 1) % 2];
+	for (int f = 0; f < FIELD_COUNT; ++f)
+	{
+		std::string path = std::string(options.dumpDir) + "/" + fieldNames[f] + "_" + std::to_string(frame) + ".f32";
+		int file = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		bool ok = file >= 0;
+		for (int t = 0; t < tiles && ok; ++t)
+		{
+			int first, end;
+			tileRows(t, first, end);
+			size_t bytes = (end - first) * rowBytes;
+			ok = preadFully(written[f], rows.data(), bytes, off_t(first) * rowBytes)
+				&& pwriteFully(file, rows.data(), bytes, off_t(first) * rowBytes);
+		}
+		if (!ok)
+		{
+			fprintf(stderr, "Error writing field dump %s\n", path.c_str());
+			exit(-1);
+		}
+		close(file);
+	}
+}
+
+void OutOfCore::ioLoop()
+{
+	for (;;)
+	{
+		Job job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			queued.wait(lock, [this] { return stopping || !jobs.empty(); });
+			if (jobs.empty())
+				return;
+			job = jobs.front();
+			jobs.pop_front();
+		}
+
+		if (job.write)
+			write(slots[job.slot]);
+		else
+			read(slots[job.slot]);
+	}
+}
+
+void OutOfCore::read(Slot& slot)
+{
+	int pass = slot.sequence / tiles;
+	int tile = slot.sequence % tiles;
+	int first, end, regionFirst, regionEnd;
+	tileRows(tile, first, end);
+	regionRows(tile, regionFirst, regionEnd);
+
+	// the rows of the previous pass must be written; those writes were queued
+	// before this read, so they are already running on other threads
+	if (pass > 0)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		changed.wait(lock, [&] {
+			for (int t = std::max(0, tile - 1); t <= std::min(tiles - 1, tile + 1); ++t)
+				if (writtenPass[t] < pass - 1)
+					return false;
+			return true;
+		});
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	size_t rowBytes = options.width * sizeof(float);
+	size_t bytes = (regionEnd - regionFirst) * rowBytes;
+	size_t block = size_t(maxRows) * options.width;
+	const std::vector<int>& source = files[pass % 2];
+	for (int f = 0; f < FIELD_COUNT; ++f)
+	{
+		if (!preadFully(source[f], slot.data + f * block, bytes, off_t(regionFirst) * rowBytes))
+		{
+			fprintf(stderr, "Error reading the field file %s\n", paths[pass % 2][f].c_str());
+			exit(-1);
+		}
+	}
+	double ms = elapsedMs(start);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slot.state = READY;
+		bytesRead += FIELD_COUNT * bytes;
+		haloBytes += FIELD_COUNT * (bytes - (end - first) * rowBytes);
+		ioMs += ms;
+	}
+	changed.notify_all();
+}
+
+void OutOfCore::write(Slot& slot)
+{
+	int pass = slot.sequence / tiles;
+	int tile = slot.sequence % tiles;
+	int first, end, regionFirst, regionEnd;
+	tileRows(tile, first, end);
+	regionRows(tile, regionFirst, regionEnd);
+
+	auto start = std::chrono::steady_clock::now();
+	size_t rowBytes = options.width * sizeof(float);
+	size_t bytes = (end - first) * rowBytes;
+	size_t block = size_t(maxRows) * options.width;
+	size_t offset = size_t(first - regionFirst) * options.width;
+	const std::vector<int>& target = files[(pass + 1) % 2];
+	for (int f = 0; f < FIELD_COUNT; ++f)
+	{
+		if (!pwriteFully(target[f], slot.data + f * block + offset, bytes, off_t(first) * rowBytes))
+		{
+			fprintf(stderr, "Error writing the field file %s\n", paths[(pass + 1) % 2][f].c_str());
+			exit(-1);
+		}
+	}
+	double ms = elapsedMs(start);
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		slot.state = FREE;
+		slot.sequence = -1;
+		writtenPass[tile] = pass;
+		bytesWritten += FIELD_COUNT * bytes;
+		ioMs += ms;
+	}
+	changed.notify_all();
+}
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "fluidSimKernel.h"
+#include "eventscript.h"
+#include "ensemblestep.h"
+
+// One stable-fluids simulation whose fields live in files, for grids larger
+// than host and device memory.
+//
+// p, u, v and ink are raw row-major float32 files (the format of the field
+// dumps) in two generations: a pass reads one and writes the other. The grid
+// is cut into tiles of tileRows full-width rows; a tile is loaded with halo
+// rows of its neighbours, so every load is one contiguous pread per field.
+// The tile is simulated for several frames at once with the ensemble kernels,
+// as an ensemble of one member, the way a strip of Decomposition is, except
+// that the halo is deep enough for the whole pass instead of being exchanged:
+// each stencil pass makes one more halo row stale, and the halo is the number
+// of rows that go stale in passFrames frames. Then only the tile's own rows
+// are written back. A tile load thus carries passFrames frames of sweeps, at
+// the price of recomputing the halo rows.
+//
+// Tiles pass through a bounded cache of pinned slots. A pool of I/O threads
+// reads the next tiles and writes the finished ones back while the device
+// works on the current one; a read of the next pass waits only for the writes
+// of the tiles it overlaps.
+class OutOfCore
+{
+public:
+	struct Options
+	{
+		int width = 512;
+		int height = 512;
+		// threads per 1D block
+		int threads = 256;
+		const char* inputFile = "";
+		float diffusionTolerance = 1e-4f;
+		// directory of the field files, which are removed at the end
+		const char* directory = "";
+		int tileRows = 512;
+		// frames simulated per tile load
+		int passFrames = 1;
+		// slots of the cache, each one tile with its halo
+		int cacheTiles = 4;
+		int ioThreads = 4;
+		// rows advection may reach across the halo's edge, displacements up
+		// to advectionReach - 1 cells (|v| * dt / dx) plus the interpolation
+		int advectionReach = 8;
+		// a pass ends after each of these frames, p, u, v and ink are then
+		// copied to dumpDir
+		std::vector<int> dumpFrames;
+		const char* dumpDir = "";
+	};
+
+	static bool run(const Options& options);
+
+private:
+	// the first fields of EnsembleStep
+	enum Field
+	{
+		PRESSURE = EnsembleStep::PRESSURE,
+		VELOCITY_U = EnsembleStep::VELOCITY_U,
+		VELOCITY_V = EnsembleStep::VELOCITY_V,
+		INK = EnsembleStep::INK,
+		FIELD_COUNT
+	};
+
+	enum SlotState
+	{
+		FREE,
+		READING,
+		READY,
+		WRITING
+	};
+
+	struct Slot
+	{
+		// FIELD_COUNT blocks of maxRows rows
+		float* data;
+		SlotState state;
+		// pass * tiles + tile
+		int sequence;
+	};
+
+	struct Job
+	{
+		bool write;
+		int slot;
+	};
+
+	struct Pass
+	{
+		int firstFrame, endFrame;
+	};
+
+	explicit OutOfCore(const Options& options);
+	~OutOfCore();
+
+	bool createFiles();
+	void removeFiles();
+	// rows that go stale in frames frames
+	int haloRows(int frames) const;
+	void simulate();
+
+	// tile rows [first, end) and the loaded rows [regionFirst, regionEnd)
+	void tileRows(int tile, int& first, int& end) const;
+	void regionRows(int tile, int& first, int& end) const;
+
+	// with the mutex held: starts the reads the cache has room for
+	void prefetch();
+	int waitReady(int sequence);
+	void compute(Slot& slot, int tile, const Pass& pass);
+	// max |u| + |v| and max |v| of the tile's rows
+	void measureSpeed(const Slot& slot, int tile);
+	void waitWritten(int pass);
+	void dumpFields(int pass, int frame);
+
+	void ioLoop();
+	void read(Slot& slot);
+	void write(Slot& slot);
+
+	const Options& options;
+	int tiles;
+	int halo;
+	int maxRows;
+	std::vector<Pass> passes;
+	std::vector<std::string> paths[2];
+	std::vector<int> files[2];
+
+	FluidSim::ensembleInfo info;
+	CUcontext context;
+	CUdeviceptr d_fields[EnsembleStep::FIELD_COUNT];
+	EnsembleStep stepper;
+
+	EventScript events;
+	std::vector<uint32_t> activeEvents;
+
+	std::vector<Slot> slots;
+	std::vector<std::thread> ioThreads;
+	std::deque<Job> jobs;
+	std::mutex mutex;
+	std::condition_variable queued, changed;
+	bool stopping;
+	// next sequence to read, last one computed, last pass written per tile
+	int nextRead;
+	int computed;
+	std::vector<int> writtenPass;
+
+	// statistics, the I/O ones under the mutex
+	unsigned long long bytesRead, bytesWritten, haloBytes;
+	double ioMs, readWaitMs, slotWaitMs, computeMs;
+	unsigned long long computedRows;
+	double speed, verticalSpeed;
+};
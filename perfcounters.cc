@@ -0,0 +1,242 @@
+#include "perfcounters.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef __linux__
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+namespace
+{
+#ifdef __linux__
+	int perfEventOpen(perf_event_attr& attr, pid_t pid, int cpu)
+	{
+		return static_cast<int>(syscall(__NR_perf_event_open, &attr, pid, cpu, -1, 0));
+	}
+
+	perf_event_attr makeAttr(uint32_t type, uint64_t config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// user space only, which unprivileged processes and most containers allow
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return attr;
+	}
+
+	std::string readLine(const std::string& path)
+	{
+		std::ifstream in(path.c_str());
+		std::string line;
+		std::getline(in, line);
+		return line;
+	}
+
+	// Encodes an event description such as "event=0x04,umask=0x03" with the bit
+	// layout from the PMU's format directory ("config:0-7"), false if unsupported.
+	bool encodeEvent(const std::string& pmu, const std::string& description, uint64_t& config)
+	{
+		config = 0;
+		std::stringstream terms(description);
+		std::string term;
+		while (std::getline(terms, term, ','))
+		{
+			size_t eq = term.find('=');
+			std::string name = term.substr(0, eq);
+			uint64_t value = eq == std::string::npos ? 1 : strtoull(term.c_str() + eq + 1, nullptr, 0);
+
+			std::string format = readLine(pmu + "/format/" + name);
+			unsigned low = 0, high = 0;
+			int n = sscanf(format.c_str(), "config:%u-%u", &low, &high);
+			if (n == 1)
+				high = low;
+			else if (n != 2)
+				return false;
+			uint64_t mask = high - low >= 63 ? ~0ull : ((1ull << (high - low + 1)) - 1);
+			config |= (value & mask) << low;
+		}
+		return true;
+	}
+#endif
+}
+
+const char* PerfCounters::counterName(int counter)
+{
+	static const char* names[COUNTER_COUNT] = {
+		"cycles", "instructions", "llc_misses", "dtlb_misses", "dram_read_bytes", "dram_write_bytes"
+	};
+	return counter >= 0 && counter < COUNTER_COUNT ? names[counter] : "?";
+}
+
+PerfCounters::PerfCounters()
+	: opened(false)
+{
+}
+
+PerfCounters::~PerfCounters()
+{
+	close();
+}
+
+bool PerfCounters::open()
+{
+	close();
+
+#ifdef __linux__
+	struct Config
+	{
+		Counter counter;
+		uint32_t type;
+		uint64_t config;
+	};
+	const Config configs[] = {
+		{ CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+		{ INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+		{ LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES },
+		{ DTLB_MISSES, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+			| (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16) },
+	};
+
+	int lastError = 0;
+	for (const Config& c : configs)
+	{
+		perf_event_attr attr = makeAttr(c.type, c.config);
+		int fd = perfEventOpen(attr, 0, -1);
+		if (fd < 0)
+		{
+			lastError = errno;
+			continue;
+		}
+		Event e = { fd, 1.0 };
+		events[c.counter].push_back(e);
+	}
+	openDramCounters();
+
+	int count = 0;
+	for (int c = 0; c < COUNTER_COUNT; ++c)
+		count += available(static_cast<Counter>(c)) ? 1 : 0;
+	if (count == 0)
+	{
+		fprintf(stderr, "- Performance counters unavailable (%s), see /proc/sys/kernel/perf_event_paranoid\n",
+			lastError ? strerror(lastError) : "no supported events");
+		return false;
+	}
+
+	printf("> Performance counters:");
+	for (int c = 0; c < COUNTER_COUNT; ++c)
+		printf(" %s%s", counterName(c), available(static_cast<Counter>(c)) ? "" : " (unavailable)");
+	printf("\n");
+
+	owner = std::this_thread::get_id();
+	opened = true;
+	return true;
+#else
+	fprintf(stderr, "- Performance counters are only supported on Linux\n");
+	return false;
+#endif
+}
+
+void PerfCounters::openDramCounters()
+{
+#ifdef __linux__
+	// Intel client and server memory controllers: uncore_imc, uncore_imc_0, ...
+	const std::string root = "/sys/bus/event_source/devices";
+	DIR* dir = opendir(root.c_str());
+	if (!dir)
+		return;
+
+	struct Source
+	{
+		Counter counter;
+		const char* event;
+	};
+	const Source sources[] = {
+		{ DRAM_READ_BYTES, "cas_count_read" },
+		{ DRAM_WRITE_BYTES, "cas_count_write" },
+		{ DRAM_READ_BYTES, "data_reads" },		// client parts name them differently
+		{ DRAM_WRITE_BYTES, "data_writes" },
+	};
+
+	while (dirent* entry = readdir(dir))
+	{
+		std::string name = entry->d_name;
+		if (name.compare(0, 10, "uncore_imc") != 0)
+			continue;
+		std::string pmu = root + "/" + name;
+		uint32_t type = static_cast<uint32_t>(atoi(readLine(pmu + "/type").c_str()));
+		int cpu = atoi(readLine(pmu + "/cpumask").c_str());
+
+		for (const Source& s : sources)
+		{
+			std::string description = readLine(pmu + "/events/" + s.event);
+			uint64_t config;
+			if (description.empty() || !encodeEvent(pmu, description, config))
+				continue;
+
+			// the scale converts counts into the unit, usually MiB
+			std::string scale = readLine(pmu + "/events/" + s.event + ".scale");
+			std::string unit = readLine(pmu + "/events/" + s.event + ".unit");
+			double bytes = scale.empty() ? 64.0 : atof(scale.c_str());
+			if (unit == "MiB")
+				bytes *= 1024.0 * 1024.0;
+
+			perf_event_attr attr = makeAttr(type, config);
+			attr.exclude_kernel = 0;	// uncore PMUs reject exclusion bits
+			attr.exclude_hv = 0;
+			int fd = perfEventOpen(attr, -1, cpu);
+			if (fd < 0)
+				continue;
+			Event e = { fd, bytes };
+			events[s.counter].push_back(e);
+		}
+	}
+	closedir(dir);
+#endif
+}
+
+void PerfCounters::close()
+{
+#ifdef __linux__
+	for (int c = 0; c < COUNTER_COUNT; ++c)
+	{
+		for (const Event& e : events[c])
+			::close(e.fd);
+		events[c].clear();
+	}
+#endif
+	opened = false;
+}
+
+void PerfCounters::read(double* values) const
+{
+	for (int c = 0; c < COUNTER_COUNT; ++c)
+	{
+		values[c] = 0.0;
+#ifdef __linux__
+		for (const Event& e : events[c])
+		{
+			uint64_t data[3];	// value, time enabled, time running
+			if (::read(e.fd, data, sizeof(data)) != sizeof(data) || data[2] == 0)
+				continue;
+			double value = double(data[0]);
+			if (data[2] < data[1])
+				value *= double(data[1]) / data[2];
+			values[c] += value * e.scale;
+		}
+#endif
+	}
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+// Hardware performance counters of one thread via perf_event_open (Linux).
+//
+// Every counter is opened on its own so that a counter the CPU, kernel or
+// container does not allow is simply reported as unavailable. Values are
+// scaled by time_enabled/time_running when the kernel multiplexes counters.
+// DRAM traffic comes from the uncore memory controller PMUs where they exist;
+// those count system-wide and usually need perf_event_paranoid <= 0.
+class PerfCounters
+{
+public:
+	enum Counter
+	{
+		CYCLES,
+		INSTRUCTIONS,
+		LLC_MISSES,
+		DTLB_MISSES,
+		DRAM_READ_BYTES,
+		DRAM_WRITE_BYTES,
+		COUNTER_COUNT
+	};
+
+	static const char* counterName(int counter);
+
+	PerfCounters();
+	~PerfCounters();
+
+	// opens the counters for the calling thread, false if none is available
+	bool open();
+	void close();
+
+	bool isOpen() const { return opened; }
+	bool available(Counter counter) const { return !events[counter].empty(); }
+	bool onOwnerThread() const { return opened && std::this_thread::get_id() == owner; }
+
+	// current counts; counters that are not available read as 0
+	void read(double* values) const;
+
+private:
+	struct Event
+	{
+		int fd;
+		double scale;
+	};
+
+	void openDramCounters();
+
+	std::vector<Event> events[COUNTER_COUNT];
+	std::thread::id owner;
+	bool opened;
+};
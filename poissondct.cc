@@ -0,0 +1,240 @@
+#include "poissondct.h"
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+
+namespace
+{
+	const double pi = 3.14159265358979323846;
+	// transpose tile, 32x32 doubles = 8 KB per tile
+	const int tile = 32;
+
+	bool powerOfTwo(int n)
+	{
+		return n > 0 && (n & (n - 1)) == 0;
+	}
+}
+
+void PoissonDCT::Transform::init(int length)
+{
+	n = length;
+	fft = powerOfTwo(n) && n >= 2;
+	twiddles.clear();
+	shift.resize(n);
+	bitReverse.clear();
+	cosines.clear();
+
+	for (int k = 0; k < n; ++k)
+		shift[k] = std::polar(1.0, -pi * k / (2.0 * n));
+
+	if (!fft)
+	{
+		cosines.resize(size_t(n) * n);
+		for (int k = 0; k < n; ++k)
+			for (int j = 0; j < n; ++j)
+				cosines[size_t(k) * n + j] = std::cos(pi * k * (2 * j + 1) / (2.0 * n));
+		return;
+	}
+
+	twiddles.resize(n / 2);
+	for (int j = 0; j < n / 2; ++j)
+		twiddles[j] = std::polar(1.0, -2.0 * pi * j / n);
+	int bits = 0;
+	while ((1 << bits) < n)
+		++bits;
+	bitReverse.resize(n);
+	for (int i = 0; i < n; ++i)
+	{
+		int r = 0;
+		for (int b = 0; b < bits; ++b)
+			r |= ((i >> b) & 1) << (bits - 1 - b);
+		bitReverse[i] = r;
+	}
+}
+
+void PoissonDCT::Transform::fftInPlace(std::complex<double>* a, bool inverse) const
+{
+	for (int i = 0; i < n; ++i)
+		if (i < bitReverse[i])
+			std::swap(a[i], a[bitReverse[i]]);
+
+	for (int size = 2; size <= n; size *= 2)
+	{
+		int half = size / 2;
+		int step = n / size;
+		for (int start = 0; start < n; start += size)
+			for (int j = 0; j < half; ++j)
+			{
+				std::complex<double> w = inverse ? std::conj(twiddles[j * step]) : twiddles[j * step];
+				std::complex<double> t = w * a[start + j + half];
+				a[start + j + half] = a[start + j] - t;
+				a[start + j] += t;
+			}
+	}
+}
+
+// X[k] = sum x[j] cos(pi k (2j + 1) / (2n)); with an FFT by reordering the even
+// and odd samples (Makhoul), X[k] = Re(exp(-i pi k / (2n)) FFT(v)[k])
+void PoissonDCT::Transform::forward(double* x, std::complex<double>* scratch) const
+{
+	if (!fft)
+	{
+		double* out = reinterpret_cast<double*>(scratch);
+		for (int k = 0; k < n; ++k)
+		{
+			const double* c = &cosines[size_t(k) * n];
+			double sum = 0.0;
+			for (int j = 0; j < n; ++j)
+				sum += x[j] * c[j];
+			out[k] = sum;
+		}
+		std::copy(out, out + n, x);
+		return;
+	}
+
+	for (int j = 0; j < n / 2; ++j)
+	{
+		scratch[j] = x[2 * j];
+		scratch[n - 1 - j] = x[2 * j + 1];
+	}
+	fftInPlace(scratch, false);
+	for (int k = 0; k < n; ++k)
+		x[k] = (shift[k] * scratch[k]).real();
+}
+
+// exact inverse of forward(): x[j] = (X[0] + 2 sum_k>0 X[k] cos(pi k (2j + 1) / (2n))) / n
+void PoissonDCT::Transform::inverse(double* x, std::complex<double>* scratch) const
+{
+	if (!fft)
+	{
+		double* out = reinterpret_cast<double*>(scratch);
+		std::fill(out, out + n, 0.0);
+		for (int k = 0; k < n; ++k)
+		{
+			const double* c = &cosines[size_t(k) * n];
+			double weight = (k == 0 ? 1.0 : 2.0) * x[k] / n;
+			for (int j = 0; j < n; ++j)
+				out[j] += weight * c[j];
+		}
+		std::copy(out, out + n, x);
+		return;
+	}
+
+	scratch[0] = x[0];
+	for (int k = 1; k < n; ++k)
+		scratch[k] = std::conj(shift[k]) * std::complex<double>(x[k], -x[n - k]);
+	fftInPlace(scratch, true);
+	for (int j = 0; j < n / 2; ++j)
+	{
+		x[2 * j] = scratch[j].real() / n;
+		x[2 * j + 1] = scratch[n - 1 - j].real() / n;
+	}
+}
+
+PoissonDCT::PoissonDCT()
+	: width(0)
+	, height(0)
+{
+}
+
+void PoissonDCT::init(int width_, int height_, int threads, Numa::Affinity affinity)
+{
+	width = width_;
+	height = height_;
+	pool.init(threads, affinity);
+
+	rowTransform.init(width);
+	columnTransform.init(height);
+
+	// data has height rows, transposed and the eigenvalues width rows
+	size_t cells = size_t(width) * height;
+	inverseEigenvalues.reset(new double[cells]);
+	data.reset(new double[cells]);
+	transposed.reset(new double[cells]);
+	pool.run(width, [&](int first, int last) {
+		for (int k = first; k < last; ++k)
+			for (int l = 0; l < height; ++l)
+			{
+				double lambda = 2.0 * std::cos(pi * k / width) + 2.0 * std::cos(pi * l / height) - 4.0;
+				inverseEigenvalues[size_t(k) * height + l] = k == 0 && l == 0 ? 0.0 : 1.0 / lambda;
+				transposed[size_t(k) * height + l] = 0.0;
+			}
+	});
+	pool.run(height, [&](int first, int last) {
+		std::fill(&data[size_t(first) * width], &data[size_t(last) * width], 0.0);
+	});
+}
+
+void PoissonDCT::firstTouch(float* buffer)
+{
+	pool.run(height, [&](int first, int last) {
+		std::fill(buffer + size_t(first) * width, buffer + size_t(last) * width, 0.f);
+	});
+}
+
+std::vector<size_t> PoissonDCT::placement() const
+{
+	std::vector<size_t> pages;
+	size_t bytes = size_t(width) * height * sizeof(double);
+	Numa::countPages(data.get(), bytes, pages);
+	Numa::countPages(transposed.get(), bytes, pages);
+	Numa::countPages(inverseEigenvalues.get(), bytes, pages);
+	return pages;
+}
+
+void PoissonDCT::transformRows(double* values, int rows, const Transform& t, bool inverse)
+{
+	pool.run(rows, [&](int first, int last) {
+		std::vector<std::complex<double>> scratch(t.n);
+		for (int r = first; r < last; ++r)
+		{
+			double* row = &values[size_t(r) * t.n];
+			if (inverse)
+				t.inverse(row, scratch.data());
+			else
+				t.forward(row, scratch.data());
+		}
+	});
+}
+
+void PoissonDCT::transpose(const double* in, double* out, int rows, int cols)
+{
+	pool.run(cols, [&](int first, int last) {
+		for (int r0 = 0; r0 < rows; r0 += tile)
+			for (int c0 = first; c0 < last; c0 += tile)
+			{
+				int r1 = std::min(r0 + tile, rows), c1 = std::min(c0 + tile, last);
+				for (int r = r0; r < r1; ++r)
+					for (int c = c0; c < c1; ++c)
+						out[size_t(c) * rows + r] = in[size_t(r) * cols + c];
+			}
+	});
+}
+
+void PoissonDCT::solve(const float* b, float* p, float scale)
+{
+	// each pass on the rows a worker owns
+	pool.run(height, [&](int first, int last) {
+		for (size_t i = size_t(first) * width; i < size_t(last) * width; ++i)
+			data[i] = b[i];
+	});
+
+	transformRows(data.get(), height, rowTransform, false);
+	transpose(data.get(), transposed.get(), height, width);
+	transformRows(transposed.get(), width, columnTransform, false);
+
+	pool.run(width, [&](int first, int last) {
+		for (size_t i = size_t(first) * height; i < size_t(last) * height; ++i)
+			transposed[i] *= scale * inverseEigenvalues[i];
+	});
+
+	transformRows(transposed.get(), width, columnTransform, true);
+	transpose(transposed.get(), data.get(), width, height);
+	transformRows(data.get(), height, rowTransform, true);
+
+	pool.run(height, [&](int first, int last) {
+		for (size_t i = size_t(first) * width; i < size_t(last) * width; ++i)
+			p[i] = static_cast<float>(data[i]);
+	});
+}
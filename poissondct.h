@@ -0,0 +1,76 @@
+#pragma once
+
+#include <complex>
+#include <memory>
+#include <vector>
+
+#include "numa.h"
+
+// Exact pressure solve on a rectangle with Neumann boundaries.
+//
+// The Jacobi kernel clamps neighbour indices at the border, i.e. mirrors the
+// grid half a cell outside it. That operator is diagonalized by the 2D DCT-II:
+// the cosine mode (k, l) is an eigenvector of
+//     (sum of the 4 clamped neighbours) - 4 p
+// with eigenvalue 2 cos(pi k / W) + 2 cos(pi l / H) - 4. solve() transforms the
+// right-hand side, divides by the eigenvalues and transforms back, which gives
+// the exact solution (up to rounding) in O(N log N). The constant mode has
+// eigenvalue 0; the solution is the one with zero mean, and the mean of the
+// right-hand side (which has no solution) is dropped.
+//
+// Transforms run in double precision, rows in parallel on a pool of threads.
+// Every worker first touches the rows of the work buffers it transforms, so
+// with pinned workers they are on its NUMA node (numa.h).
+// Power-of-two lengths use a radix-2 FFT, other lengths a direct O(N^2)
+// transform. Columns are transformed as rows of a transposed copy, transposed
+// in cache-sized tiles.
+class PoissonDCT
+{
+public:
+	PoissonDCT();
+
+	// plans the transforms for a width x height grid; threads 0 uses all cores
+	void init(int width, int height, int threads = 0, Numa::Affinity affinity = Numa::NONE);
+	bool ready() const { return width > 0; }
+
+	// (sum of neighbours) - 4 p = scale * b, row-major, b and p may alias
+	void solve(const float* b, float* p, float scale);
+
+	int threadCount() const { return pool.count(); }
+	// the solver's threads, for row-parallel work on the solver's row split
+	Numa::Workers& workers() { return pool; }
+	// zeroes a width x height buffer for solve() by the workers' rows
+	void firstTouch(float* buffer);
+	// pages of the work buffers per node (Numa::countPages)
+	std::vector<size_t> placement() const;
+
+private:
+	// unnormalized DCT-II of one length and its inverse
+	struct Transform
+	{
+		int n;
+		bool fft;
+		std::vector<std::complex<double>> twiddles;	// exp(-2 pi i j / n), j < n/2
+		std::vector<std::complex<double>> shift;	// exp(-i pi k / (2n))
+		std::vector<int> bitReverse;
+		std::vector<double> cosines;				// cos(pi k (2j + 1) / (2n)), direct only
+
+		void init(int length);
+		// in place, scratch holds n complex values
+		void forward(double* x, std::complex<double>* scratch) const;
+		void inverse(double* x, std::complex<double>* scratch) const;
+		void fftInPlace(std::complex<double>* a, bool inverse) const;
+	};
+
+	void transformRows(double* data, int rows, const Transform& t, bool inverse);
+	// by output rows, so each worker writes the rows it owns
+	void transpose(const double* in, double* out, int rows, int cols);
+
+	int width, height;
+	Numa::Workers pool;
+	Transform rowTransform, columnTransform;
+	// 1 / eigenvalue in the transposed (column-major) layout, 0 for the constant mode;
+	// left uninitialized by the allocation and first touched by the workers
+	std::unique_ptr<double[]> inverseEigenvalues;
+	std::unique_ptr<double[]> data, transposed;
+};
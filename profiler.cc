@@ -0,0 +1,501 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstring>
+#include <sstream>
+#include <thread>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <Matog.h>
+#include "common.h"
+
+namespace
+{
+	std::atomic<bool> toggleRequested(false);
+	// numbers every open(), so cached thread records of an earlier run (or of a
+	// profiler that lived at the same address) are not reused
+	std::atomic<unsigned long long> sessions(0);
+
+	void toggleHandler(int)
+	{
+		toggleRequested.store(true);
+	}
+
+	float percentile(const std::vector<float>& sorted, double q)
+	{
+		if (sorted.empty())
+			return 0.f;
+		size_t i = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+		return sorted[std::min(i, sorted.size() - 1)];
+	}
+
+	void printStatistics(FILE* out, const char* name, std::vector<float> samples)
+	{
+		if (samples.empty())
+			return;
+		std::sort(samples.begin(), samples.end());
+		double total = 0.0;
+		for (float s : samples)
+			total += s;
+		fprintf(out, "  %-14s %8zu %11.2f %9.4f %9.4f %9.4f %9.4f %9.4f\n", name, samples.size(), total,
+			total / samples.size(), percentile(samples, 0.5), percentile(samples, 0.95),
+			percentile(samples, 0.99), samples.back());
+	}
+
+	// log2 buckets of microseconds
+	void printHistogram(FILE* out, const char* name, const std::vector<float>& samples)
+	{
+		if (samples.empty())
+			return;
+		const int buckets = 24;
+		size_t counts[buckets] = { 0 };
+		for (float ms : samples)
+		{
+			double us = std::max(1.0, ms * 1000.0);
+			int b = std::min(buckets - 1, static_cast<int>(std::log2(us)));
+			++counts[b];
+		}
+		size_t peak = *std::max_element(counts, counts + buckets);
+		fprintf(out, "  %s\n", name);
+		for (int b = 0; b < buckets; ++b)
+		{
+			if (counts[b] == 0)
+				continue;
+			int bar = static_cast<int>(40.0 * counts[b] / peak + 0.5);
+			fprintf(out, "    >= %9.0f us %8zu %s\n", std::ldexp(1.0, b), counts[b], std::string(std::max(bar, 1), '#').c_str());
+		}
+	}
+}
+
+const char* PhaseProfiler::phaseName(int phase)
+{
+	static const char* names[PHASE_COUNT] = {
+		"boundary", "advection", "injection", "diffusion", "divergence", "pressure", "gradient",
+		"stream_collide", "render", "output_gif", "output_stream", "output_shm", "stream_write"
+	};
+	return phase >= 0 && phase < PHASE_COUNT ? names[phase] : "?";
+}
+
+PhaseProfiler::PhaseProfiler()
+	: active(false)
+	, frameActive(false)
+	, frameTraced(false)
+	, isOpen(false)
+	, ticksPerMs(1.0)
+	, frame(0)
+	, frameStart(0)
+	, simulationThread(nullptr)
+	, report(nullptr)
+	, reportFormat(CSV)
+	, tracer(nullptr)
+	, gpuTrack(nullptr)
+	, session(0)
+{
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		deviceUsed[p] = false;
+		hostUsed[p] = false;
+		hostMs[p] = 0.f;
+		startEvents[p] = 0;
+		stopEvents[p] = 0;
+		counterSamples[p] = 0;
+		for (int c = 0; c < PerfCounters::COUNTER_COUNT; ++c)
+		{
+			counterStart[p][c] = 0.0;
+			counterTotal[p][c] = 0.0;
+		}
+	}
+}
+
+PhaseProfiler::~PhaseProfiler()
+{
+	close();
+}
+
+uint64_t PhaseProfiler::ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+void PhaseProfiler::installSignalToggle()
+{
+	signal(SIGUSR1, toggleHandler);
+}
+
+bool PhaseProfiler::open(const char* reportPath, ReportFormat format, bool enabled)
+{
+	close();
+
+	// calibrate the tick rate against the steady clock
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t c0 = ticks();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	auto t1 = std::chrono::steady_clock::now();
+	uint64_t c1 = ticks();
+	ticksPerMs = (c1 - c0) / std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		CHECK(cuEventCreate(&startEvents[p], CU_EVENT_DEFAULT));
+		CHECK(cuEventCreate(&stopEvents[p], CU_EVENT_DEFAULT));
+	}
+
+	// a profiler that is opened again starts a new profile
+	frameTimes.clear();
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		counterSamples[p] = 0;
+		std::fill(counterTotal[p], counterTotal[p] + PerfCounters::COUNTER_COUNT, 0.0);
+	}
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		threads.clear();
+		session.store(++sessions, std::memory_order_release);
+	}
+
+	reportFormat = format;
+	if (reportPath && reportPath[0] != '\0')
+	{
+		report = fopen(reportPath, "w");
+		if (!report)
+			fprintf(stderr, "Error opening profile report %s\n", reportPath);
+		else if (format == CSV)
+		{
+			fprintf(report, "frame,wall_ms");
+			for (int p = 0; p < PHASE_COUNT; ++p)
+				fprintf(report, ",%s_ms", phaseName(p));
+			fprintf(report, "\n");
+		}
+	}
+
+	// the simulation thread registers first
+	simulationThread = threadRecord();
+	simulationThread->name = "simulation";
+
+	isOpen = true;
+	active = enabled;
+	return true;
+}
+
+void PhaseProfiler::close()
+{
+	if (!isOpen)
+		return;
+
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		cuEventDestroy(startEvents[p]);
+		cuEventDestroy(stopEvents[p]);
+	}
+	if (report)
+		fclose(report);
+	report = nullptr;
+	counters.close();
+	isOpen = false;
+	frameActive = false;
+	active = false;
+}
+
+bool PhaseProfiler::openCounters()
+{
+	return isOpen && counters.open();
+}
+
+void PhaseProfiler::beginCounters(Phase phase)
+{
+	counters.read(counterStart[phase]);
+}
+
+void PhaseProfiler::endCounters(Phase phase)
+{
+	double values[PerfCounters::COUNTER_COUNT];
+	counters.read(values);
+	for (int c = 0; c < PerfCounters::COUNTER_COUNT; ++c)
+		counterTotal[phase][c] += values[c] - counterStart[phase][c];
+	++counterSamples[phase];
+}
+
+PhaseProfiler::ThreadRecord* PhaseProfiler::threadRecord()
+{
+	static thread_local unsigned long long owner = ~0ull;
+	static thread_local ThreadRecord* record = nullptr;
+	if (owner != session.load(std::memory_order_acquire))
+	{
+		std::lock_guard<std::mutex> lock(threadsMutex);
+		threads.emplace_back(new ThreadRecord);
+		std::ostringstream name;
+		name << "thread " << std::this_thread::get_id();
+		threads.back()->name = name.str();
+		record = threads.back().get();
+		owner = session;
+	}
+	return record;
+}
+
+void PhaseProfiler::setThreadName(const char* name)
+{
+	if (tracing())
+		tracer->setThreadName(name);
+
+	ThreadRecord* record = threadRecord();
+	std::lock_guard<std::mutex> lock(threadsMutex);
+	record->name = name;
+}
+
+void PhaseProfiler::beginFrame(int frame_)
+{
+	if (!isOpen)
+		return;
+	if (toggleRequested.exchange(false))
+	{
+		active = !active;
+		fprintf(stderr, "- Profiling %s\n", active ? "enabled" : "disabled");
+	}
+
+	frame = frame_;
+	frameActive = active.load(std::memory_order_relaxed);
+	frameTraced = tracing();
+	if (!frameActive && !frameTraced)
+		return;
+
+	frameStart = ticks();
+	std::fill(deviceUsed, deviceUsed + PHASE_COUNT, false);
+	std::fill(deviceMs, deviceMs + PHASE_COUNT, 0.f);
+	std::fill(hostUsed, hostUsed + PHASE_COUNT, false);
+	std::fill(hostMs, hostMs + PHASE_COUNT, 0.f);
+}
+
+void PhaseProfiler::begin(Phase phase)
+{
+	// the events are reused, the earlier run is collected first
+	if (deviceUsed[phase])
+	{
+		float ms = 0.f;
+		CHECK(cuEventSynchronize(stopEvents[phase]));
+		CHECK(cuEventElapsedTime(&ms, startEvents[phase], stopEvents[phase]));
+		deviceMs[phase] += ms;
+	}
+	deviceUsed[phase] = true;
+	CHECK(cuEventRecord(startEvents[phase], 0));
+	if (counters.isOpen())
+		beginCounters(phase);
+}
+
+void PhaseProfiler::end(Phase phase)
+{
+	if (counters.isOpen())
+		endCounters(phase);
+	CHECK(cuEventRecord(stopEvents[phase], 0));
+}
+
+void PhaseProfiler::record(Phase phase, uint64_t startTicks, uint64_t endTicks)
+{
+	float ms = static_cast<float>((endTicks - startTicks) / ticksPerMs);
+	ThreadRecord* record = threadRecord();
+	record->samples[phase].push_back(ms);
+
+	// host phases of the simulation thread also go into the per-frame report
+	if (record == simulationThread && frameActive)
+	{
+		hostMs[phase] += ms;
+		hostUsed[phase] = true;
+	}
+}
+
+void PhaseProfiler::setTracer(Tracer* tracer_)
+{
+	tracer = tracer_;
+	gpuTrack = tracing() ? tracer->virtualTrack("GPU (stream 0)") : nullptr;
+}
+
+void PhaseProfiler::endFrame()
+{
+	if (frameTraced)
+		tracer->record("frame", "frame", frameStart, ticks(), frame);
+	frameTraced = false;
+
+	if (!frameActive)
+		return;
+	frameActive = false;
+
+	ThreadRecord* record = simulationThread;
+	float phaseMs[PHASE_COUNT] = { 0 };
+	bool used[PHASE_COUNT] = { false };
+
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		if (!deviceUsed[p])
+			continue;
+		CHECK(cuEventSynchronize(stopEvents[p]));
+		CHECK(cuEventElapsedTime(&phaseMs[p], startEvents[p], stopEvents[p]));
+		phaseMs[p] += deviceMs[p];
+		record->samples[p].push_back(phaseMs[p]);
+		used[p] = true;
+	}
+
+	if (gpuTrack && tracing())
+		traceDevicePhases(phaseMs);
+
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		if (hostUsed[p])
+		{
+			phaseMs[p] += hostMs[p];
+			used[p] = true;
+		}
+	}
+
+	float wallMs = static_cast<float>((ticks() - frameStart) / ticksPerMs);
+	frameTimes.push_back(wallMs);
+
+	if (report)
+		writeFrame(frame, wallMs, phaseMs, used);
+}
+
+void PhaseProfiler::traceDevicePhases(const float* phaseMs)
+{
+	// The GPU clock is not visible to the host. All phases are placed relative to
+	// the first one, and the timeline is anchored so that the last phase ends
+	// when cuEventSynchronize returned, which is an upper bound.
+	int first = -1;
+	for (int p = 0; p < PHASE_COUNT && first < 0; ++p)
+		if (deviceUsed[p])
+			first = p;
+	if (first < 0)
+		return;
+
+	float startOffset[PHASE_COUNT] = { 0 };
+	float lastEnd = 0.f;
+	for (int p = first; p < PHASE_COUNT; ++p)
+	{
+		if (!deviceUsed[p])
+			continue;
+		CHECK(cuEventElapsedTime(&startOffset[p], startEvents[first], startEvents[p]));
+		lastEnd = std::max(lastEnd, startOffset[p] + phaseMs[p]);
+	}
+
+	uint64_t now = ticks();
+	double origin = now - lastEnd * ticksPerMs;
+	for (int p = first; p < PHASE_COUNT; ++p)
+	{
+		if (!deviceUsed[p])
+			continue;
+		uint64_t start = static_cast<uint64_t>(origin + startOffset[p] * ticksPerMs);
+		uint64_t stop = static_cast<uint64_t>(origin + (startOffset[p] + phaseMs[p]) * ticksPerMs);
+		tracer->recordOn(gpuTrack, phaseName(p), "gpu", start, stop, frame);
+	}
+}
+
+void PhaseProfiler::writeFrame(int frame_, float wallMs, const float* phaseMs, const bool* used)
+{
+	if (reportFormat == CSV)
+	{
+		fprintf(report, "%d,%.4f", frame_, wallMs);
+		for (int p = 0; p < PHASE_COUNT; ++p)
+		{
+			if (used[p])
+				fprintf(report, ",%.4f", phaseMs[p]);
+			else
+				fprintf(report, ",");
+		}
+		fprintf(report, "\n");
+	}
+	else
+	{
+		fprintf(report, "{\"frame\":%d,\"wall_ms\":%.4f", frame_, wallMs);
+		for (int p = 0; p < PHASE_COUNT; ++p)
+			if (used[p])
+				fprintf(report, ",\"%s_ms\":%.4f", phaseName(p), phaseMs[p]);
+		fprintf(report, "}\n");
+	}
+}
+
+bool PhaseProfiler::phaseMean(Phase phase, size_t& count, double& meanMs) const
+{
+	std::lock_guard<std::mutex> lock(threadsMutex);
+	if (!simulationThread || simulationThread->samples[phase].empty())
+		return false;
+	const std::vector<float>& samples = simulationThread->samples[phase];
+	double total = 0.0;
+	for (float s : samples)
+		total += s;
+	count = samples.size();
+	meanMs = total / count;
+	return true;
+}
+
+void PhaseProfiler::printSummary(FILE* out) const
+{
+	if (frameTimes.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(threadsMutex);
+	fprintf(out, "- Phase timings over %zu profiled frames (ms)\n", frameTimes.size());
+	fprintf(out, "  %-14s %8s %11s %9s %9s %9s %9s %9s\n", "phase", "count", "total", "mean", "p50", "p95", "p99", "max");
+	printStatistics(out, "frame (wall)", frameTimes);
+	for (auto& t : threads)
+	{
+		bool any = false;
+		for (int p = 0; p < PHASE_COUNT; ++p)
+			any = any || !t->samples[p].empty();
+		if (!any)
+			continue;
+		fprintf(out, " [%s]\n", t->name.c_str());
+		for (int p = 0; p < PHASE_COUNT; ++p)
+			printStatistics(out, phaseName(p), t->samples[p]);
+	}
+
+	printCounters(out);
+
+	fprintf(out, "- Phase histograms\n");
+	printHistogram(out, "frame (wall)", frameTimes);
+	for (auto& t : threads)
+		for (int p = 0; p < PHASE_COUNT; ++p)
+			printHistogram(out, (t->name + " " + phaseName(p)).c_str(), t->samples[p]);
+}
+
+void PhaseProfiler::printCounters(FILE* out) const
+{
+	if (!counters.isOpen())
+		return;
+
+	typedef PerfCounters PC;
+	auto column = [&](int phase, PC::Counter c, double divisor, const char* format) {
+		if (counters.available(c))
+			fprintf(out, format, counterTotal[phase][c] / counterSamples[phase] / divisor);
+		else
+			fprintf(out, " %12s", "-");
+	};
+
+	fprintf(out, "- Performance counters of the simulation thread, mean per phase call\n");
+	fprintf(out, "  %-14s %8s %12s %12s %6s %12s %12s %12s %12s\n", "phase", "count", "Mcycles", "Minstr", "IPC",
+		"LLC miss/k", "dTLB miss/k", "DRAM rd MB", "DRAM wr MB");
+	for (int p = 0; p < PHASE_COUNT; ++p)
+	{
+		if (counterSamples[p] == 0)
+			continue;
+		fprintf(out, "  %-14s %8zu", phaseName(p), counterSamples[p]);
+		column(p, PC::CYCLES, 1e6, " %12.3f");
+		column(p, PC::INSTRUCTIONS, 1e6, " %12.3f");
+		if (counters.available(PC::CYCLES) && counters.available(PC::INSTRUCTIONS) && counterTotal[p][PC::CYCLES] > 0.0)
+			fprintf(out, " %6.2f", counterTotal[p][PC::INSTRUCTIONS] / counterTotal[p][PC::CYCLES]);
+		else
+			fprintf(out, " %6s", "-");
+		column(p, PC::LLC_MISSES, 1e3, " %12.3f");
+		column(p, PC::DTLB_MISSES, 1e3, " %12.3f");
+		// the memory controllers count system-wide, including the GPU's DMA traffic
+		column(p, PC::DRAM_READ_BYTES, 1e6, " %12.3f");
+		column(p, PC::DRAM_WRITE_BYTES, 1e6, " %12.3f");
+		fprintf(out, "\n");
+	}
+}
@@ -0,0 +1,206 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <cuda.h>
+
+#include "perfcounters.h"
+#include "tracer.h"
+
+// Per-phase timing of the simulation loop.
+//
+// Kernel launches are asynchronous, so phases of update() are timed on the
+// device with a pair of CUDA events each; host-side work (image conversion,
+// gif encoding, frame streaming) is timed with the TSC. Every thread records
+// into its own sample buffers. When the profiler is disabled a Scope costs a
+// single branch; enabling/disabling takes effect at the next frame.
+// Optionally, hardware counters of the simulation thread are accumulated per
+// phase; for the device phases they show the host cost of launching kernels.
+class PhaseProfiler
+{
+public:
+	enum Phase
+	{
+		BOUNDARY,
+		ADVECTION,
+		INJECTION,
+		DIFFUSION,
+		DIVERGENCE,
+		PRESSURE,
+		GRADIENT,
+		STREAM_COLLIDE,
+		RENDER,
+		OUTPUT_GIF,
+		OUTPUT_STREAM,
+		OUTPUT_SHM,
+		STREAM_WRITE,
+		PHASE_COUNT
+	};
+
+	enum ReportFormat
+	{
+		CSV,
+		JSON	// one JSON object per line
+	};
+
+	static const char* phaseName(int phase);
+
+	PhaseProfiler();
+	~PhaseProfiler();
+
+	// creates the CUDA events, requires a current context;
+	// reportPath receives one line per frame and may be empty
+	bool open(const char* reportPath, ReportFormat format, bool enabled = true);
+	void close();
+
+	// opens hardware counters for the calling (simulation) thread after open(),
+	// false if no counter is available
+	bool openCounters();
+
+	void setEnabled(bool enabled) { active.store(enabled, std::memory_order_relaxed); }
+	bool enabled() const { return frameActive; }
+
+	// SIGUSR1 toggles all profilers at the next frame boundary
+	static void installSignalToggle();
+
+	void beginFrame(int frame);
+	void endFrame();
+
+	// device phases, simulation thread only; a phase that runs again in the
+	// same frame (CFL substeps) adds up
+	void begin(Phase phase);
+	void end(Phase phase);
+
+	// host time, any thread
+	static uint64_t ticks();
+	void record(Phase phase, uint64_t startTicks, uint64_t endTicks);
+	// label of the calling thread in the summary
+	void setThreadName(const char* name);
+
+	void printSummary(FILE* out) const;
+
+	size_t profiledFrames() const { return frameTimes.size(); }
+	// mean time of a phase on the simulation thread, false without samples
+	bool phaseMean(Phase phase, size_t& count, double& meanMs) const;
+
+	// phases and frames are also emitted to this tracer while it is open;
+	// with profiling enabled the GPU phase timeline is added as its own track
+	void setTracer(Tracer* tracer);
+	bool tracing() const { return tracer && tracer->enabled(); }
+
+	class Scope
+	{
+	public:
+		Scope(PhaseProfiler& profiler_, Phase phase_)
+			: profiler(profiler_)
+			, phase(phase_)
+			, on(profiler_.frameActive)
+			, traceStart(profiler_.tracing() ? ticks() : 0)
+		{
+			if (on)
+				profiler.begin(phase);
+		}
+		~Scope()
+		{
+			if (on)
+				profiler.end(phase);
+			if (traceStart)
+				profiler.tracer->record(phaseName(phase), "phase", traceStart, ticks(), profiler.frame);
+		}
+	private:
+		PhaseProfiler& profiler;
+		Phase phase;
+		bool on;
+		uint64_t traceStart;
+	};
+
+	class HostScope
+	{
+	public:
+		HostScope(PhaseProfiler* profiler_, Phase phase_)
+			: profiler(profiler_)
+			, phase(phase_)
+			, on(profiler_ && profiler_->active.load(std::memory_order_relaxed))
+			, traced(profiler_ && profiler_->tracing())
+			, counted(on && profiler_->counters.onOwnerThread())
+			, start(on || traced ? ticks() : 0)
+		{
+			if (counted)
+				profiler->beginCounters(phase);
+		}
+		~HostScope()
+		{
+			if (counted)
+				profiler->endCounters(phase);
+			if (!on && !traced)
+				return;
+			uint64_t stop = ticks();
+			if (on)
+				profiler->record(phase, start, stop);
+			if (traced)
+				profiler->tracer->record(phaseName(phase), "output", start, stop);
+		}
+	private:
+		PhaseProfiler* profiler;
+		Phase phase;
+		bool on;
+		bool traced;
+		bool counted;
+		uint64_t start;
+	};
+
+private:
+	struct ThreadRecord
+	{
+		std::string name;
+		std::vector<float> samples[PHASE_COUNT];
+	};
+
+	ThreadRecord* threadRecord();
+	void writeFrame(int frame, float wallMs, const float* phaseMs, const bool* used);
+	void traceDevicePhases(const float* phaseMs);
+	void beginCounters(Phase phase);
+	void endCounters(Phase phase);
+	void printCounters(FILE* out) const;
+
+	std::atomic<bool> active;
+	bool frameActive;
+	bool frameTraced;
+	bool isOpen;
+	double ticksPerMs;
+
+	// state of the current frame, simulation thread only
+	int frame;
+	uint64_t frameStart;
+	bool deviceUsed[PHASE_COUNT];
+	// device time of the earlier runs of a phase in this frame
+	float deviceMs[PHASE_COUNT];
+	bool hostUsed[PHASE_COUNT];
+	float hostMs[PHASE_COUNT];
+	CUevent startEvents[PHASE_COUNT], stopEvents[PHASE_COUNT];
+	std::vector<float> frameTimes;
+	ThreadRecord* simulationThread;
+
+	FILE* report;
+	ReportFormat reportFormat;
+
+	Tracer* tracer;
+	Tracer::Track* gpuTrack;
+
+	// hardware counters of the simulation thread, summed over the run
+	PerfCounters counters;
+	double counterStart[PHASE_COUNT][PerfCounters::COUNTER_COUNT];
+	double counterTotal[PHASE_COUNT][PerfCounters::COUNTER_COUNT];
+	size_t counterSamples[PHASE_COUNT];
+
+	mutable std::mutex threadsMutex;
+	std::vector<std::unique_ptr<ThreadRecord>> threads;
+	// number of the last open()
+	std::atomic<unsigned long long> session;
+};
@@ -0,0 +1,275 @@
+#include "realtime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <thread>
+
+#include <Matog.h>
+#include "common.h"
+
+namespace
+{
+	uint64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	// exponential moving average, seeded by the first sample
+	void smooth(double& average, double sample)
+	{
+		average = average < 0.0 ? sample : 0.8 * average + 0.2 * sample;
+	}
+
+	float percentile(const std::vector<float>& sorted, double q)
+	{
+		if (sorted.empty())
+			return 0.f;
+		size_t i = static_cast<size_t>(q * (sorted.size() - 1) + 0.5);
+		return sorted[std::min(i, sorted.size() - 1)];
+	}
+}
+
+RealtimeController::RealtimeController()
+	: isOpen(false)
+	, log(nullptr)
+	, frame(0)
+	, output(false)
+	, frameStart(0)
+{
+	close();
+}
+
+RealtimeController::~RealtimeController()
+{
+	close();
+}
+
+void RealtimeController::open(const Settings& settings_, FILE* log_)
+{
+	close();
+	if (settings_.budgetMs <= 0.f)
+		return;
+
+	settings = settings_;
+	settings.residualInterval = std::max(settings.residualInterval, 1);
+	settings.maxDecimation = std::max(settings.maxDecimation, 1);
+	for (int s = 0; s < SOLVE_COUNT; ++s)
+		settings.minIterations[s] = std::min(std::max(settings.minIterations[s], 1), settings.maxIterations[s]);
+	log = log_;
+
+	for (int s = 0; s < SOLVE_COUNT; ++s)
+	{
+		CHECK(cuEventCreate(&startEvents[s], CU_EVENT_DEFAULT));
+		CHECK(cuEventCreate(&stopEvents[s], CU_EVENT_DEFAULT));
+	}
+	CHECK(cuEventCreate(&frameStop, CU_EVENT_BLOCKING_SYNC));
+	lastLog = now();
+	isOpen = true;
+	printf("> Real-time mode: %.2f ms per frame\n", settings.budgetMs);
+}
+
+void RealtimeController::close()
+{
+	if (isOpen)
+	{
+		logMisses(true);
+		for (int s = 0; s < SOLVE_COUNT; ++s)
+		{
+			cuEventDestroy(startEvents[s]);
+			cuEventDestroy(stopEvents[s]);
+		}
+		cuEventDestroy(frameStop);
+	}
+	isOpen = false;
+
+	for (int s = 0; s < SOLVE_COUNT; ++s)
+	{
+		planned[s] = settings.maxIterations[s];
+		executed[s] = 0;
+		sweepMs[s] = -1.0;
+		scales[s] = true;
+		sweeps[s] = 0;
+	}
+	fixedMs[0] = fixedMs[1] = -1.0;
+	correction = 0.0;
+	outputDecimation = 1;
+	outputFramesMet = 0;
+	missesSinceLog = framesSinceLog = 0;
+	worstMs = 0.f;
+	worstFrame = 0;
+	frameMs.clear();
+	residuals.clear();
+	misses = 0;
+	maxDecimationUsed = 1;
+}
+
+void RealtimeController::plan(bool outputFrame)
+{
+	// keep a tenth of the budget as headroom for jitter
+	double target = 0.9 * settings.budgetMs;
+	double fixed = fixedMs[outputFrame ? 1 : 0];
+	if (fixed < 0.0)
+		fixed = fixedMs[outputFrame ? 0 : 1];
+	if (fixed < 0.0)
+		return;
+	double fullMs = 0.0;
+	for (int s = 0; s < SOLVE_COUNT; ++s)
+	{
+		if (!scales[s])
+			continue;
+		if (sweepMs[s] < 0.0)
+			return;
+		fullMs += settings.maxIterations[s] * sweepMs[s];
+	}
+
+	// the solves are scaled together so their ratio stays that of the full settings
+	double solveBudget = target - fixed + correction;
+	double scale = fullMs > 0.0 ? std::min(1.0, std::max(0.0, solveBudget / fullMs)) : 1.0;
+	for (int s = 0; s < SOLVE_COUNT; ++s)
+		planned[s] = scales[s] ? std::max(settings.minIterations[s], static_cast<int>(scale * settings.maxIterations[s]))
+			: settings.maxIterations[s];
+}
+
+void RealtimeController::beginFrame(int frame_, bool outputFrame)
+{
+	if (!isOpen)
+		return;
+	frame = frame_;
+	output = outputFrame;
+	frameStart = now();
+	plan(outputFrame);
+}
+
+void RealtimeController::beginSolve(Solve solve)
+{
+	if (isOpen)
+		CHECK(cuEventRecord(startEvents[solve], 0));
+}
+
+void RealtimeController::endSolve(Solve solve, int passes)
+{
+	if (!isOpen)
+		return;
+	CHECK(cuEventRecord(stopEvents[solve], 0));
+	executed[solve] = passes;
+}
+
+void RealtimeController::endFrame()
+{
+	if (!isOpen)
+		return;
+
+	// the frame is done when the device is
+	CHECK(cuEventRecord(frameStop, 0));
+	CHECK(cuEventSynchronize(frameStop));
+	double wallMs = (now() - frameStart) * 1e-6;
+
+	double solveMs = 0.0;
+	for (int s = 0; s < SOLVE_COUNT; ++s)
+	{
+		float ms = 0.f;
+		CHECK(cuEventElapsedTime(&ms, startEvents[s], stopEvents[s]));
+		sweeps[s] += executed[s];
+		// a solve that ran other than the planned sweeps stays in the fixed cost
+		scales[s] = executed[s] > 0 && executed[s] == planned[s];
+		if (!scales[s])
+			continue;
+		smooth(sweepMs[s], ms / executed[s]);
+		solveMs += ms;
+	}
+	smooth(fixedMs[output ? 1 : 0], std::max(0.0, wallMs - solveMs));
+
+	// integral action on the deadline error, bounded to avoid wind-up while
+	// the sweeps are pinned at their limits
+	double target = 0.9 * settings.budgetMs;
+	correction = std::min(0.5 * target, std::max(-0.5 * target, correction + 0.1 * (target - wallMs)));
+
+	bool missed = wallMs > settings.budgetMs;
+	frameMs.push_back(static_cast<float>(wallMs));
+	++framesSinceLog;
+	if (missed)
+	{
+		++misses;
+		++missesSinceLog;
+		if (wallMs > worstMs)
+		{
+			worstMs = static_cast<float>(wallMs);
+			worstFrame = frame;
+		}
+	}
+
+	// output frames that miss with the fewest sweeps are written less often;
+	// decimation is relaxed again after a run of output frames with headroom
+	if (output)
+	{
+		bool atMinimum = true;
+		for (int s = 0; s < SOLVE_COUNT; ++s)
+			atMinimum = atMinimum && (!scales[s] || planned[s] == settings.minIterations[s]);
+		if (missed && atMinimum && outputDecimation < settings.maxDecimation)
+		{
+			outputDecimation *= 2;
+			outputFramesMet = 0;
+			maxDecimationUsed = std::max(maxDecimationUsed, outputDecimation);
+		}
+		else if (!missed && wallMs < 0.75 * settings.budgetMs && outputDecimation > 1 && ++outputFramesMet >= 8)
+		{
+			outputDecimation /= 2;
+			outputFramesMet = 0;
+		}
+	}
+
+	logMisses(false);
+}
+
+void RealtimeController::logMisses(bool force)
+{
+	uint64_t t = now();
+	if (missesSinceLog == 0 || (!force && t - lastLog < 1000000000ull))
+		return;
+	if (log)
+		fprintf(log, "! %d of %d frames missed the %.2f ms budget (worst %.2f ms at frame %d; %d diffusion, %d pressure sweeps, output every %d)\n",
+			missesSinceLog, framesSinceLog, settings.budgetMs, worstMs, worstFrame, planned[DIFFUSION], planned[PRESSURE], outputDecimation);
+	lastLog = t;
+	missesSinceLog = framesSinceLog = 0;
+	worstMs = 0.f;
+}
+
+void RealtimeController::pace() const
+{
+	if (!isOpen)
+		return;
+	uint64_t deadline = frameStart + static_cast<uint64_t>(settings.budgetMs * 1e6);
+	uint64_t t = now();
+	if (t < deadline)
+		std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - t));
+}
+
+void RealtimeController::recordResidual(float residual)
+{
+	residuals.push_back(residual);
+}
+
+void RealtimeController::printSummary(FILE* out)
+{
+	logMisses(true);
+	if (frameMs.empty())
+		return;
+
+	std::vector<float> sorted(frameMs);
+	std::sort(sorted.begin(), sorted.end());
+	fprintf(out, "- Real-time: %zu of %zu frames missed the %.2f ms budget (%.1f%%), frame p50 %.2f ms, p99 %.2f ms, max %.2f ms\n",
+		misses, sorted.size(), settings.budgetMs, 100.0 * misses / sorted.size(),
+		percentile(sorted, 0.5), percentile(sorted, 0.99), sorted.back());
+	fprintf(out, "  mean sweeps run: diffusion %.1f of %d, pressure %.1f of %d; output decimated up to %dx\n",
+		double(sweeps[DIFFUSION]) / sorted.size(), settings.maxIterations[DIFFUSION],
+		double(sweeps[PRESSURE]) / sorted.size(), settings.maxIterations[PRESSURE], maxDecimationUsed);
+
+	if (!residuals.empty())
+	{
+		std::vector<float> r(residuals);
+		std::sort(r.begin(), r.end());
+		fprintf(out, "  pressure residual |r|/|b| over %zu samples: p50 %.3e, p95 %.3e, max %.3e\n",
+			r.size(), percentile(r, 0.5), percentile(r, 0.95), r.back());
+	}
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include <cuda.h>
+
+// Real-time mode: keeps every frame within a wall-clock budget.
+//
+// The diffusion and pressure solves are timed on the device with CUDA events,
+// giving the cost of one sweep; everything else in the frame is the fixed cost,
+// tracked separately for frames with and without output. A solve that did not
+// run the planned sweeps (explicit or skipped diffusion, the DCT pressure
+// solve) does not scale with them and counts as fixed. Before each frame the
+// sweeps that fit into the budget are planned from these costs (feed-forward),
+// and an integral term on the deadline error corrects what the model misses
+// (launch overhead, host work). Output frames are decimated while they cannot
+// meet the budget even with the fewest sweeps. Missed deadlines are logged at
+// most once per second; the residual of the pressure solve is sampled so the
+// quality actually reached is reported alongside.
+class RealtimeController
+{
+public:
+	enum Solve
+	{
+		DIFFUSION,
+		PRESSURE,
+		SOLVE_COUNT
+	};
+
+	struct Settings
+	{
+		float budgetMs = 0.f;	// disabled if 0
+		int maxIterations[SOLVE_COUNT] = { 35, 35 };
+		int minIterations[SOLVE_COUNT] = { 2, 4 };
+		int maxDecimation = 16;
+		// frames between residual samples
+		int residualInterval = 10;
+	};
+
+	RealtimeController();
+	~RealtimeController();
+
+	// creates the CUDA events, requires a current context
+	void open(const Settings& settings, FILE* log);
+	void close();
+	bool enabled() const { return isOpen; }
+
+	// plans the sweeps of the frame
+	void beginFrame(int frame, bool outputFrame);
+	void beginSolve(Solve solve);
+	// passes is the number of sweeps the solve actually ran
+	void endSolve(Solve solve, int passes);
+	// waits for the frame on the device, then updates the costs and the controller
+	void endFrame();
+	// sleeps until the budget of the current frame has passed
+	void pace() const;
+
+	int iterations(Solve solve) const { return planned[solve]; }
+	// output frames are written every decimation() output intervals
+	int decimation() const { return outputDecimation; }
+
+	bool residualDue(int frame) const { return isOpen && frame % settings.residualInterval == 0; }
+	// relative residual of the pressure solve of the current frame
+	void recordResidual(float residual);
+
+	// flushes the pending miss log first
+	void printSummary(FILE* out);
+
+private:
+	void plan(bool outputFrame);
+	void logMisses(bool force);
+
+	bool isOpen;
+	Settings settings;
+	FILE* log;
+
+	CUevent startEvents[SOLVE_COUNT], stopEvents[SOLVE_COUNT], frameStop;
+
+	// state of the current frame
+	int frame;
+	bool output;
+	uint64_t frameStart;
+	int planned[SOLVE_COUNT];
+	int executed[SOLVE_COUNT];
+
+	// smoothed costs in ms, negative until measured
+	double sweepMs[SOLVE_COUNT];
+	// whether the solve ran the planned sweeps in the last frame
+	bool scales[SOLVE_COUNT];
+	double fixedMs[2];
+	// integral of the deadline error in ms
+	double correction;
+	int outputDecimation;
+	int outputFramesMet;
+
+	// misses since the last log line
+	uint64_t lastLog;
+	int missesSinceLog, framesSinceLog;
+	float worstMs;
+	int worstFrame;
+
+	// over the run
+	std::vector<float> frameMs;
+	std::vector<float> residuals;
+	size_t misses;
+	uint64_t sweeps[SOLVE_COUNT];
+	int maxDecimationUsed;
+};
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdarg>
+#include <cstdio>
+
+// Checks of the unit tests: a failed check is printed to stderr and counted,
+// main returns finish(), the exit status (0 passed, 1 failed).
+namespace UnitTest
+{
+	inline int& failures()
+	{
+		static int count = 0;
+		return count;
+	}
+
+	// what is a printf format describing the check
+	inline void check(bool condition, const char* what, ...)
+	{
+		if (condition)
+			return;
+		va_list args;
+		va_start(args, what);
+		fprintf(stderr, "FAILED: ");
+		vfprintf(stderr, what, args);
+		fprintf(stderr, "\n");
+		va_end(args);
+		++failures();
+	}
+
+	inline int finish(const char* test)
+	{
+		if (failures() == 0)
+			return 0;
+		printf("- %s: %d checks failed\n", test, failures());
+		return 1;
+	}
+}
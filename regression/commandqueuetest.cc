@@ -0,0 +1,131 @@
+/*
+ * Unit test of CommandQueue.
+ *
+ * Checks the capacity, FIFO order and the drop count with one thread, then
+ * lets several producers push into a small queue while one consumer pops:
+ * every command must arrive exactly once, whole, and in the order its
+ * producer pushed it, and the rejected pushes must match dropped().
+ *
+ * Exit status: 0 passed, 1 failed.
+ */
+
+#include <cstdio>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "../commandqueue.h"
+#include "check.h"
+
+using namespace UnitTest;
+
+namespace
+{
+	// a command whose fields all derive from producer and index, so a torn read shows
+	CommandQueue::Command make(int producer, int index)
+	{
+		CommandQueue::Command c;
+		c.type = CommandQueue::INJECT;
+		c.x = static_cast<float>(index);
+		c.y = static_cast<float>(producer);
+		c.u = static_cast<float>(index + 1);
+		c.v = static_cast<float>(-producer);
+		c.amount = static_cast<float>(2 * index);
+		c.ink = producer;
+		c.submitted = 0;
+		return c;
+	}
+
+	bool whole(const CommandQueue::Command& c)
+	{
+		int index = static_cast<int>(c.x);
+		return c.type == CommandQueue::INJECT && c.y == static_cast<float>(c.ink) && c.u == static_cast<float>(index + 1)
+			&& c.v == static_cast<float>(-c.ink) && c.amount == static_cast<float>(2 * index) && c.submitted != 0;
+	}
+
+	void singleThread()
+	{
+		// rounded up to 8
+		CommandQueue queue(5);
+		CommandQueue::Command c;
+		check(!queue.pop(c), "pop from an empty queue");
+		for (int i = 0; i < 8; ++i)
+			check(queue.push(make(0, i)), "push into a queue with room");
+		check(!queue.push(make(0, 8)), "push into a full queue");
+		check(queue.dropped() == 1, "dropped count of a full queue");
+		for (int i = 0; i < 8; ++i)
+			check(queue.pop(c) && static_cast<int>(c.x) == i && whole(c), "FIFO order");
+		check(!queue.pop(c), "pop after draining");
+		// wraps around the cells
+		for (int i = 0; i < 20; ++i)
+			check(queue.push(make(0, i)) && queue.pop(c) && static_cast<int>(c.x) == i, "push and pop across the wrap");
+	}
+
+	void producersAndConsumer()
+	{
+		const int producers = 4;
+		const int perProducer = 50000;
+		CommandQueue queue(64);
+		std::atomic<unsigned long long> rejected(0);
+		std::atomic<int> started(0);
+
+		std::vector<std::thread> threads;
+		for (int p = 0; p < producers; ++p)
+		{
+			threads.emplace_back([&, p]() {
+				++started;
+				while (started.load() < producers)
+					std::this_thread::yield();
+				for (int i = 0; i < perProducer; ++i)
+				{
+					while (!queue.push(make(p, i)))
+					{
+						++rejected;
+						std::this_thread::yield();
+					}
+				}
+			});
+		}
+
+		std::vector<int> next(producers, 0);
+		int received = 0;
+		bool torn = false, ordered = true;
+		CommandQueue::Command c;
+		while (received < producers * perProducer)
+		{
+			if (!queue.pop(c))
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			++received;
+			if (!whole(c) || c.ink < 0 || c.ink >= producers)
+			{
+				torn = true;
+				continue;
+			}
+			if (static_cast<int>(c.x) != next[c.ink])
+				ordered = false;
+			next[c.ink] = static_cast<int>(c.x) + 1;
+		}
+		for (std::thread& t : threads)
+			t.join();
+
+		check(!torn, "commands arrive whole");
+		check(ordered, "commands of a producer arrive in order");
+		bool all = true;
+		for (int n : next)
+			all = all && n == perProducer;
+		check(all, "every command arrives once");
+		check(!queue.pop(c), "queue empty after all commands");
+		check(queue.dropped() == rejected.load(), "dropped count matches the rejected pushes");
+		printf("- commandqueue: %d producers, %d commands, %llu rejected while full\n", producers, received, rejected.load());
+	}
+}
+
+int main()
+{
+	singleThread();
+	producersAndConsumer();
+	return finish("commandqueue");
+}
@@ -0,0 +1,178 @@
+/*
+ * Unit test of EventScript.
+ *
+ * Writes a text script of random, heavily overlapping events (and a few empty
+ * ones), loads it and compares active() in every frame against a linear scan.
+ * Then saves the compiled format, maps it again and checks that the events and
+ * the answers of the mapped interval tree are the same, and that truncated or
+ * corrupt compiled files are rejected.
+ *
+ * Exit status: 0 passed, 1 failed.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "../eventscript.h"
+#include "check.h"
+
+using namespace UnitTest;
+
+namespace
+{
+	struct Interval
+	{
+		int start, end;
+	};
+
+	// the script order indices of the non-empty intervals active in frame
+	std::vector<uint32_t> scan(const std::vector<Interval>& intervals, int frame)
+	{
+		std::vector<uint32_t> result;
+		uint32_t id = 0;
+		for (const Interval& i : intervals)
+		{
+			if (i.end <= i.start)
+				continue;
+			if (i.start <= frame && frame < i.end)
+				result.push_back(id);
+			++id;
+		}
+		return result;
+	}
+
+	std::vector<char> readFile(const std::string& path)
+	{
+		std::vector<char> bytes;
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f)
+			return bytes;
+		char buffer[4096];
+		size_t n;
+		while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0)
+			bytes.insert(bytes.end(), buffer, buffer + n);
+		fclose(f);
+		return bytes;
+	}
+
+	// loads bytes written to path, which must be rejected
+	void checkRejected(const std::string& path, const std::vector<char>& bytes, const char* what)
+	{
+		FILE* f = fopen(path.c_str(), "wb");
+		if (!f || fwrite(bytes.data(), 1, bytes.size(), f) != bytes.size())
+			check(false, "writing a corrupt script");
+		if (f)
+			fclose(f);
+		EventScript script;
+		check(!script.load(path.c_str()) && script.empty(), "%s", what);
+	}
+
+	// header fields and node layout of the compiled format (eventscript.cc)
+	const size_t NODE_COUNT = 24, NODES_OFFSET = 40, FILE_SIZE = 64, NODE_SIZE = 20, NODE_LEFT = 12;
+
+	void checkCorrupt(const std::string& compiledPath, const std::string& path)
+	{
+		std::vector<char> good = readFile(compiledPath);
+		check(good.size() > FILE_SIZE + 8, "reading the compiled script");
+		if (good.size() <= FILE_SIZE + 8)
+			return;
+
+		// cut in the middle of the id lists, with and without the header's file size adjusted
+		std::vector<char> truncated(good.begin(), good.end() - good.size() / 4);
+		checkRejected(path, truncated, "truncated compiled script rejected");
+		uint64_t size = truncated.size();
+		memcpy(&truncated[FILE_SIZE], &size, sizeof(size));
+		checkRejected(path, truncated, "truncated compiled script with its size patched rejected");
+
+		// a child pointing back at the root would loop forever
+		uint64_t nodesOffset, nodeCount;
+		memcpy(&nodesOffset, &good[NODES_OFFSET], sizeof(nodesOffset));
+		memcpy(&nodeCount, &good[NODE_COUNT], sizeof(nodeCount));
+		check(nodeCount > 1 && nodesOffset + nodeCount * NODE_SIZE <= good.size(), "node section of the compiled script");
+		if (nodeCount > 1 && nodesOffset + nodeCount * NODE_SIZE <= good.size())
+		{
+			std::vector<char> cycle = good;
+			int32_t root = 0;
+			memcpy(&cycle[nodesOffset + NODE_LEFT], &root, sizeof(root));
+			checkRejected(path, cycle, "node cycle in a compiled script rejected");
+		}
+		unlink(path.c_str());
+	}
+
+	void compareActive(const EventScript& script, const std::vector<Interval>& intervals, int lastFrame, const char* what)
+	{
+		std::vector<uint32_t> active;
+		for (int frame = -2; frame <= lastFrame + 2; ++frame)
+		{
+			script.active(frame, active);
+			check(active == scan(intervals, frame), "%s in frame %d", what, frame);
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string directory = argc > 1 ? argv[1] : ".";
+	std::string textPath = directory + "/eventscripttest.txt";
+	std::string compiledPath = directory + "/eventscripttest.bin";
+
+	// nested, chained and identical intervals around a few hot frames
+	srand(7);
+	std::vector<Interval> intervals = { { 0, 1000 }, { 0, 1000 }, { 10, 20 }, { 20, 30 }, { 15, 16 }, { 500, 500 }, { 40, 39 } };
+	for (int n = 0; n < 2000; ++n)
+	{
+		int start = rand() % 1000;
+		int length = n % 3 == 0 ? rand() % 5 : rand() % 300;
+		intervals.push_back({ start, start + length });
+	}
+	int lastFrame = 0;
+	size_t nonEmpty = 0;
+	for (const Interval& i : intervals)
+	{
+		if (i.end > i.start)
+		{
+			lastFrame = std::max(lastFrame, i.end);
+			++nonEmpty;
+		}
+	}
+
+	FILE* f = fopen(textPath.c_str(), "w");
+	if (!f)
+	{
+		perror("Error writing the test script");
+		return 1;
+	}
+	for (size_t n = 0; n < intervals.size(); ++n)
+		fprintf(f, "%d %d %.4f %.4f %.4f %.4f %.1f\n", intervals[n].start, intervals[n].end,
+			(n % 100) * 0.01f, 0.5f, 0.25f, (n % 7) * 0.1f, 100.f + n);
+	fclose(f);
+
+	EventScript text;
+	check(text.load(textPath.c_str()), "loading the text script");
+	check(text.size() == nonEmpty, "empty events dropped");
+	check(text.endFrame() == lastFrame, "end frame");
+	compareActive(text, intervals, lastFrame, "active events of the text script");
+
+	check(text.save(compiledPath.c_str()), "saving the compiled script");
+	EventScript compiled;
+	check(compiled.load(compiledPath.c_str()), "loading the compiled script");
+	check(compiled.size() == text.size(), "event count after the round trip");
+	check(compiled.endFrame() == text.endFrame(), "end frame after the round trip");
+	for (size_t n = 0; n < text.size() && n < compiled.size(); ++n)
+		check(memcmp(&text[n], &compiled[n], sizeof(EventScript::Event)) == 0, "event %zu after the round trip", n);
+	compareActive(compiled, intervals, lastFrame, "active events of the compiled script");
+	checkCorrupt(compiledPath, directory + "/eventscripttest.bad");
+
+	unlink(textPath.c_str());
+	unlink(compiledPath.c_str());
+
+	if (failures() == 0)
+		printf("- eventscript: %zu events, %d frames passed\n", text.size(), lastFrame);
+	return finish("eventscript");
+}
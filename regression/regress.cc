@@ -0,0 +1,473 @@
+/*
+ * Golden-output regression harness.
+ *
+ * Runs fluidsim on the cases of regression.manifest, dumps the fields at the
+ * chosen frames (fluidsim --dump) and compares them against golden data with a
+ * per-field tolerance. The golden data of a field is its hash, its largest
+ * magnitude, its RMS and a 32x32 grid of block means, which is enough to detect
+ * drift without storing whole fields in the repository. The time per frame is
+ * compared against the baseline stored with the golden data.
+ *
+ * Exit status: 0 passed, 1 failed, 77 skipped because no golden data exists.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <map>
+#include <sstream>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+namespace
+{
+	const int SKIPPED = 77;
+	const int BLOCKS = 32;
+
+	struct Case
+	{
+		std::string name;
+		std::string script;
+		int width, height;
+		std::vector<int> frames;
+		double slowdown;
+		std::map<std::string, double> tolerances;
+	};
+
+	struct FieldSummary
+	{
+		uint64_t hash;
+		double maxAbs;
+		double rms;
+		int blocksX, blocksY;
+		std::vector<double> blocks;
+	};
+
+	// golden data of one case, keyed by "<field> <frame>"
+	struct Golden
+	{
+		double msPerFrame;
+		std::map<std::string, FieldSummary> fields;
+	};
+
+	std::string directoryOf(const std::string& path)
+	{
+		size_t slash = path.rfind('/');
+		return slash == std::string::npos ? "." : path.substr(0, slash);
+	}
+
+	bool loadManifest(const std::string& path, std::vector<Case>& cases)
+	{
+		std::ifstream in(path.c_str());
+		if (!in)
+		{
+			fprintf(stderr, "Error opening manifest %s\n", path.c_str());
+			return false;
+		}
+
+		std::string line;
+		int lineNumber = 0;
+		while (std::getline(in, line))
+		{
+			++lineNumber;
+			std::istringstream fields(line);
+			std::string keyword;
+			if (!(fields >> keyword) || keyword[0] == '#')
+				continue;
+
+			bool ok = false;
+			if (keyword == "case")
+			{
+				Case c;
+				std::string frames, option;
+				c.slowdown = 1.25;
+				ok = static_cast<bool>(fields >> c.name >> c.script >> c.width >> c.height >> frames);
+				std::stringstream list(frames);
+				std::string frame;
+				while (std::getline(list, frame, ','))
+					c.frames.push_back(atoi(frame.c_str()));
+				while (ok && fields >> option)
+				{
+					if (option.compare(0, 9, "slowdown=") == 0)
+						c.slowdown = atof(option.c_str() + 9);
+					else
+						ok = false;
+				}
+				if (c.script[0] != '/')
+					c.script = directoryOf(path) + "/" + c.script;
+				if (ok)
+					cases.push_back(c);
+			}
+			else if (keyword == "tol" && !cases.empty())
+			{
+				std::string field;
+				double tolerance;
+				ok = static_cast<bool>(fields >> field >> tolerance);
+				if (ok)
+					cases.back().tolerances[field] = tolerance;
+			}
+
+			if (!ok)
+			{
+				fprintf(stderr, "Error in manifest %s, line %d: %s\n", path.c_str(), lineNumber, line.c_str());
+				return false;
+			}
+		}
+		return true;
+	}
+
+	FieldSummary summarize(const std::vector<float>& data, int width, int height)
+	{
+		FieldSummary s;
+		s.hash = 1469598103934665603ull;	// FNV-1a over the raw bytes
+		const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data.data());
+		for (size_t i = 0; i < data.size() * sizeof(float); ++i)
+			s.hash = (s.hash ^ bytes[i]) * 1099511628211ull;
+
+		s.maxAbs = 0.0;
+		double sumSquares = 0.0;
+		for (float value : data)
+		{
+			s.maxAbs = std::max(s.maxAbs, std::fabs(double(value)));
+			sumSquares += double(value) * value;
+		}
+		s.rms = std::sqrt(sumSquares / data.size());
+
+		s.blocksX = std::min(BLOCKS, width);
+		s.blocksY = std::min(BLOCKS, height);
+		s.blocks.assign(s.blocksX * s.blocksY, 0.0);
+		for (int by = 0; by < s.blocksY; ++by)
+			for (int bx = 0; bx < s.blocksX; ++bx)
+			{
+				int x0 = bx * width / s.blocksX, x1 = (bx + 1) * width / s.blocksX;
+				int y0 = by * height / s.blocksY, y1 = (by + 1) * height / s.blocksY;
+				double sum = 0.0;
+				for (int y = y0; y < y1; ++y)
+					for (int x = x0; x < x1; ++x)
+						sum += data[x + y * size_t(width)];
+				s.blocks[bx + by * s.blocksX] = sum / ((x1 - x0) * (y1 - y0));
+			}
+		return s;
+	}
+
+	// largest deviation from the golden summary relative to the golden magnitude
+	double relativeError(const FieldSummary& golden, const FieldSummary& current)
+	{
+		double error = std::max(std::fabs(golden.maxAbs - current.maxAbs), std::fabs(golden.rms - current.rms));
+		if (golden.blocks.size() != current.blocks.size())
+			return INFINITY;
+		for (size_t i = 0; i < golden.blocks.size(); ++i)
+			error = std::max(error, std::fabs(golden.blocks[i] - current.blocks[i]));
+		return error / std::max(golden.maxAbs, 1e-30);
+	}
+
+	bool loadGolden(const std::string& path, Golden& golden)
+	{
+		std::ifstream in(path.c_str());
+		if (!in)
+			return false;
+
+		golden.msPerFrame = 0.0;
+		std::string keyword;
+		while (in >> keyword)
+		{
+			if (keyword[0] == '#')
+				std::getline(in, keyword);
+			else if (keyword == "ms_per_frame")
+				in >> golden.msPerFrame;
+			else if (keyword == "field")
+			{
+				std::string name, hash;
+				int frame;
+				FieldSummary s;
+				in >> name >> frame >> hash >> s.maxAbs >> s.rms >> s.blocksX >> s.blocksY;
+				s.hash = strtoull(hash.c_str(), nullptr, 16);
+				s.blocks.resize(s.blocksX * s.blocksY);
+				for (double& b : s.blocks)
+					in >> b;
+				golden.fields[name + " " + std::to_string(frame)] = s;
+			}
+		}
+		if (in.bad() || (!in.eof() && in.fail()))
+		{
+			fprintf(stderr, "Error reading golden data %s\n", path.c_str());
+			exit(1);
+		}
+		return true;
+	}
+
+	bool writeGolden(const std::string& path, const Golden& golden)
+	{
+		FILE* f = fopen(path.c_str(), "w");
+		if (!f)
+		{
+			fprintf(stderr, "Error writing golden data %s\n", path.c_str());
+			return false;
+		}
+		fprintf(f, "# fluidsim golden data, recorded with fluidsim_regress --update\n");
+		fprintf(f, "# field <name> <frame> <hash> <max |x|> <rms> <blocks x> <blocks y>, then the block means\n");
+		fprintf(f, "ms_per_frame %.6f\n", golden.msPerFrame);
+		for (auto& entry : golden.fields)
+		{
+			const FieldSummary& s = entry.second;
+			fprintf(f, "field %s %016llx %.9e %.9e %d %d\n", entry.first.c_str(), (unsigned long long)s.hash,
+				s.maxAbs, s.rms, s.blocksX, s.blocksY);
+			for (int by = 0; by < s.blocksY; ++by)
+			{
+				for (int bx = 0; bx < s.blocksX; ++bx)
+					fprintf(f, bx ? " %.9e" : "%.9e", s.blocks[bx + by * s.blocksX]);
+				fprintf(f, "\n");
+			}
+		}
+		fclose(f);
+		return true;
+	}
+
+	bool readField(const std::string& path, int width, int height, std::vector<float>& data)
+	{
+		data.resize(size_t(width) * height);
+		FILE* f = fopen(path.c_str(), "rb");
+		if (!f)
+			return false;
+		bool ok = fread(data.data(), sizeof(float), data.size(), f) == data.size();
+		fclose(f);
+		return ok;
+	}
+
+	// runs fluidsim and returns the simulation loop time in ms, or -1
+	double runSimulation(const std::string& fluidsim, const Case& c, const std::string& dumpDir)
+	{
+		std::string frames;
+		for (int frame : c.frames)
+			frames += (frames.empty() ? "" : ",") + std::to_string(frame);
+		std::vector<std::string> args = {
+			fluidsim, "-s", std::to_string(c.width), std::to_string(c.height),
+			"-p", c.script, "--dump", frames, dumpDir
+		};
+		std::vector<char*> argv;
+		for (auto& a : args)
+			argv.push_back(const_cast<char*>(a.c_str()));
+		argv.push_back(nullptr);
+
+		std::string logPath = dumpDir + "/fluidsim.log";
+		pid_t pid = fork();
+		if (pid < 0)
+		{
+			perror("fork");
+			return -1.0;
+		}
+		if (pid == 0)
+		{
+			int fd = open(logPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (fd >= 0)
+			{
+				dup2(fd, 1);
+				dup2(fd, 2);
+				close(fd);
+			}
+			execv(argv[0], argv.data());
+			perror("execv");
+			_exit(127);
+		}
+
+		int status = 0;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "  fluidsim failed, see %s\n", logPath.c_str());
+			return -1.0;
+		}
+
+		std::ifstream log(logPath.c_str());
+		std::string line;
+		double ms = -1.0;
+		while (std::getline(log, line))
+		{
+			int n = 0;
+			long long t = 0;
+			if (sscanf(line.c_str(), "- Simulated %d frames in %lld ms", &n, &t) == 2 && n > 0)
+				ms = double(t) / n;
+		}
+		if (ms < 0.0)
+			fprintf(stderr, "  no timing in %s\n", logPath.c_str());
+		return ms;
+	}
+
+	// returns 0, 1 or SKIPPED
+	int runCase(const Case& c, const std::string& fluidsim, const std::string& goldenDir, bool update, bool checkPerf)
+	{
+		printf("> %s: %s, %dx%d\n", c.name.c_str(), c.script.c_str(), c.width, c.height);
+
+		std::string goldenPath = goldenDir + "/" + c.name + ".golden";
+		Golden golden;
+		bool haveGolden = loadGolden(goldenPath, golden);
+		if (!update && !haveGolden)
+		{
+			printf("  skipped, no golden data in %s (record it with --update)\n", goldenPath.c_str());
+			return SKIPPED;
+		}
+
+		std::string dumpDir = "regress_" + c.name;
+		mkdir(dumpDir.c_str(), 0755);
+		double msPerFrame = runSimulation(fluidsim, c, dumpDir);
+		if (msPerFrame < 0.0)
+			return 1;
+
+		static const char* fieldNames[] = { "p", "u", "v", "ink_r", "ink_g", "ink_b" };
+		Golden current;
+		current.msPerFrame = msPerFrame;
+		for (int frame : c.frames)
+			for (const char* field : fieldNames)
+			{
+				std::string path = dumpDir + "/" + field + "_" + std::to_string(frame) + ".f32";
+				std::vector<float> data;
+				if (!readField(path, c.width, c.height, data))
+				{
+					fprintf(stderr, "  missing field dump %s\n", path.c_str());
+					return 1;
+				}
+				current.fields[std::string(field) + " " + std::to_string(frame)] = summarize(data, c.width, c.height);
+				unlink(path.c_str());
+			}
+
+		if (update)
+		{
+			if (!writeGolden(goldenPath, current))
+				return 1;
+			printf("  recorded %zu fields and %.3f ms per frame to %s\n", current.fields.size(), msPerFrame, goldenPath.c_str());
+			return 0;
+		}
+
+		int result = 0;
+		for (int frame : c.frames)
+			for (auto& tolerance : c.tolerances)
+			{
+				std::string key = tolerance.first + " " + std::to_string(frame);
+				auto expected = golden.fields.find(key);
+				auto actual = current.fields.find(key);
+				if (actual == current.fields.end() || expected == golden.fields.end())
+				{
+					printf("  FAIL %-6s frame %4d: no %s data\n", tolerance.first.c_str(), frame,
+						actual == current.fields.end() ? "dumped" : "golden");
+					result = 1;
+					continue;
+				}
+				if (expected->second.hash == actual->second.hash)
+				{
+					printf("  ok   %-6s frame %4d: identical\n", tolerance.first.c_str(), frame);
+					continue;
+				}
+				double error = relativeError(expected->second, actual->second);
+				bool ok = error <= tolerance.second;
+				printf("  %s %-6s frame %4d: relative error %.3e (tolerance %.1e)\n", ok ? "ok  " : "FAIL",
+					tolerance.first.c_str(), frame, error, tolerance.second);
+				if (!ok)
+					result = 1;
+			}
+
+		if (checkPerf && golden.msPerFrame > 0.0)
+		{
+			double ratio = msPerFrame / golden.msPerFrame;
+			bool ok = ratio <= c.slowdown;
+			printf("  %s time: %.3f ms per frame, baseline %.3f ms (x%.2f, limit x%.2f)\n", ok ? "ok  " : "FAIL",
+				msPerFrame, golden.msPerFrame, ratio, c.slowdown);
+			if (!ok)
+				result = 1;
+		}
+		return result;
+	}
+
+	void show_usage(std::string name)
+	{
+		std::cout << "Usage: " << name << " <option(s)>\n"
+			<< "Options:\n"
+			<< "\t-h,--help\t\t\tShow this help message\n"
+			<< "\t-m,--manifest\tPATH\t\tRegression manifest (default regression.manifest)\n"
+			<< "\t-g,--golden-dir\tPATH\t\tGolden data (default golden/ next to the manifest)\n"
+			<< "\t-b,--binary\tPATH\t\tfluidsim executable (default ./fluidsim)\n"
+			<< "\t-c,--case\tNAME\t\tOnly run this case\n"
+			<< "\t--update\t\t\tRecord the golden data and time baseline instead of comparing\n"
+			<< "\t--no-perf\t\t\tDo not compare the time per frame\n"
+			<< std::endl;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::string manifestPath = "regression.manifest";
+	std::string goldenDir;
+	std::string fluidsim = "./fluidsim";
+	std::string only;
+	bool update = false;
+	bool checkPerf = true;
+
+	for (int i = 1; i < argc; ++i) {
+		std::string arg = argv[i];
+		if ((arg == "-h") || (arg == "--help")) {
+			show_usage(argv[0]);
+			return 0;
+		}
+		else if (((arg == "-m") || (arg == "--manifest")) && i + 1 < argc) {
+			manifestPath = argv[++i];
+		}
+		else if (((arg == "-g") || (arg == "--golden-dir")) && i + 1 < argc) {
+			goldenDir = argv[++i];
+		}
+		else if (((arg == "-b") || (arg == "--binary")) && i + 1 < argc) {
+			fluidsim = argv[++i];
+		}
+		else if (((arg == "-c") || (arg == "--case")) && i + 1 < argc) {
+			only = argv[++i];
+		}
+		else if (arg == "--update") {
+			update = true;
+		}
+		else if (arg == "--no-perf") {
+			checkPerf = false;
+		}
+		else {
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+	if (goldenDir.empty())
+		goldenDir = directoryOf(manifestPath) + "/golden";
+	if (update)
+		mkdir(goldenDir.c_str(), 0755);
+
+	std::vector<Case> cases;
+	if (!loadManifest(manifestPath, cases))
+		return 1;
+
+	int failed = 0, skipped = 0, run = 0;
+	for (auto& c : cases)
+	{
+		if (!only.empty() && c.name != only)
+			continue;
+		int result = runCase(c, fluidsim, goldenDir, update, checkPerf);
+		++run;
+		if (result == SKIPPED)
+			++skipped;
+		else if (result != 0)
+			++failed;
+	}
+
+	if (run == 0)
+	{
+		fprintf(stderr, "No case %s in %s\n", only.c_str(), manifestPath.c_str());
+		return 1;
+	}
+	printf("- %d passed, %d failed, %d skipped\n", run - failed - skipped, failed, skipped);
+	if (failed > 0)
+		return 1;
+	return skipped == run ? SKIPPED : 0;
+}
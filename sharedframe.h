@@ -0,0 +1,204 @@
+#pragma once
+
+// Layout of the POSIX shared-memory segment written by FrameServer.
+// This header has no CUDA/MATOG dependencies so viewer tools can include it.
+//
+// The segment holds a small ring of frame slots. Every slot is guarded by a
+// sequence counter (seqlock): odd while the simulation writes it, even when
+// the frame is complete. `generation` is the number of the last published
+// frame, which lives in slot generation % slotCount. Readers never block the
+// writer; they read a slot in place and re-check its sequence afterwards.
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace SharedFrame
+{
+	const uint32_t MAGIC = 0x46534d46; // "FMSF"
+	const uint32_t VERSION = 1;
+	const uint32_t MAX_SLOTS = 8;
+
+	enum Field : uint32_t
+	{
+		INK,
+		PRESSURE,
+		VELOCITY_U,
+		VELOCITY_V,
+		FIELD_COUNT
+	};
+
+	enum Format : uint32_t
+	{
+		RGBA8,		// 4 bytes per cell, as produced by convertToColor2
+		FLOAT32		// raw field values, row-major
+	};
+
+	struct Slot
+	{
+		std::atomic<uint32_t> sequence;
+		uint32_t field;
+		uint32_t format;
+		int32_t iteration;
+		uint64_t generation;
+	};
+
+	struct Header
+	{
+		uint32_t magic;
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		uint32_t slotCount;
+		uint32_t reserved;
+		uint64_t slotBytes;
+		uint64_t dataOffset;
+		std::atomic<uint64_t> generation;
+		std::atomic<uint32_t> writerAlive;
+		Slot slots[MAX_SLOTS];
+	};
+
+	inline const char* fieldName(uint32_t field)
+	{
+		static const char* names[] = { "ink", "p", "u", "v" };
+		return field < FIELD_COUNT ? names[field] : "?";
+	}
+
+	inline bool parseField(const std::string& name, Field& field)
+	{
+		for (uint32_t f = 0; f < FIELD_COUNT; ++f)
+		{
+			if (name == fieldName(f))
+			{
+				field = static_cast<Field>(f);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	inline size_t segmentSize(uint64_t dataOffset, uint64_t slotBytes, uint32_t slotCount)
+	{
+		return static_cast<size_t>(dataOffset + slotBytes * slotCount);
+	}
+
+	inline uint8_t* slotData(Header* h, uint32_t slot)
+	{
+		return reinterpret_cast<uint8_t*>(h) + h->dataOffset + h->slotBytes * slot;
+	}
+
+	// Read-only, zero-copy access to the frames of a running simulation.
+	class Reader
+	{
+	public:
+		struct Frame
+		{
+			const uint8_t* data;
+			uint32_t field;
+			uint32_t format;
+			int32_t iteration;
+			uint64_t generation;
+			uint32_t slot;
+			uint32_t sequence;
+		};
+
+		Reader() : header(nullptr), size(0) {}
+		~Reader() { detach(); }
+
+		bool attach(const char* name)
+		{
+			detach();
+			int fd = shm_open(name, O_RDONLY, 0);
+			if (fd < 0)
+				return false;
+			struct stat st;
+			if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(Header)))
+			{
+				close(fd);
+				return false;
+			}
+			void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+			close(fd);
+			if (p == MAP_FAILED)
+				return false;
+			header = static_cast<Header*>(p);
+			size = st.st_size;
+			if (header->magic != MAGIC || header->version != VERSION)
+			{
+				detach();
+				return false;
+			}
+			return true;
+		}
+
+		void detach()
+		{
+			if (header)
+				munmap(header, size);
+			header = nullptr;
+			size = 0;
+		}
+
+		const Header* info() const { return header; }
+		uint64_t generation() const { return header->generation.load(std::memory_order_acquire); }
+		bool writerAlive() const { return header->writerAlive.load(std::memory_order_acquire) != 0; }
+
+		// Points frame at the newest complete slot. The data stays valid until
+		// the writer wraps around the ring; call validate() after using it.
+		bool latest(Frame& frame) const
+		{
+			uint64_t g = generation();
+			if (g == 0)
+				return false;
+			uint32_t slot = static_cast<uint32_t>(g % header->slotCount);
+			const Slot& s = header->slots[slot];
+			uint32_t seq = s.sequence.load(std::memory_order_acquire);
+			if (seq & 1)
+				return false;
+			frame.data = slotData(header, slot);
+			frame.field = s.field;
+			frame.format = s.format;
+			frame.iteration = s.iteration;
+			frame.generation = s.generation;
+			frame.slot = slot;
+			frame.sequence = seq;
+			return validate(frame);
+		}
+
+		// true if the slot was not rewritten since latest() returned frame
+		bool validate(const Frame& frame) const
+		{
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return header->slots[frame.slot].sequence.load(std::memory_order_relaxed) == frame.sequence;
+		}
+
+		// copies the newest frame, retrying while the writer races with us
+		bool copyLatest(Frame& frame, uint8_t* destination) const
+		{
+			for (int attempt = 0; attempt < 100; ++attempt)
+			{
+				if (!latest(frame))
+					continue;
+				memcpy(destination, frame.data, header->slotBytes);
+				if (validate(frame))
+					return true;
+			}
+			return false;
+		}
+
+	private:
+		Header* header;
+		size_t size;
+
+		static const uint8_t* slotData(const Header* h, uint32_t slot)
+		{
+			return reinterpret_cast<const uint8_t*>(h) + h->dataOffset + h->slotBytes * slot;
+		}
+	};
+}
@@ -0,0 +1,208 @@
+/*
+ * Reference reader for the shared-memory frame ring published by fluidsim --shm.
+ * Prints statistics of every new frame and can dump frames as PPM/PGM images.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "../sharedframe.h"
+
+using namespace SharedFrame;
+
+static void show_usage(std::string name)
+{
+	std::cout << "Usage: " << name << " NAME <option(s)>\n"
+		<< "Options:\n"
+		<< "\t-h,--help\t\t\tShow this help message\n"
+		<< "\t-c,--control\tPATH\t\tControl socket of the simulation\n"
+		<< "\t-f,--field\tink|p|u|v\tSelect the published field (requires --control)\n"
+		<< "\t-d,--dump\tPREFIX\t\tWrite every frame to PREFIX<generation>.ppm/.pgm\n"
+		<< "\t-n,--count\tN\t\tExit after N frames\n"
+		<< std::endl;
+}
+
+static bool sendCommand(const char* path, const std::string& command)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	if (fd < 0 || connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+	{
+		fprintf(stderr, "Error connecting to %s\n", path);
+		if (fd >= 0)
+			close(fd);
+		return false;
+	}
+
+	std::string line = command + "\n";
+	char reply[256] = { 0 };
+	bool ok = write(fd, line.data(), line.size()) == static_cast<ssize_t>(line.size())
+		&& read(fd, reply, sizeof(reply) - 1) > 0;
+	close(fd);
+	printf("%s: %s", command.c_str(), reply);
+	return ok && strncmp(reply, "ok", 2) == 0;
+}
+
+static void dumpFrame(const std::string& prefix, const Header* h, const Reader::Frame& frame, const uint8_t* data)
+{
+	char path[512];
+	bool color = frame.format == RGBA8;
+	snprintf(path, sizeof(path), "%s%06llu.%s", prefix.c_str(), (unsigned long long)frame.generation, color ? "ppm" : "pgm");
+	FILE* f = fopen(path, "wb");
+	if (!f)
+	{
+		fprintf(stderr, "Error writing %s\n", path);
+		return;
+	}
+
+	size_t n = size_t(h->width) * h->height;
+	std::vector<uint8_t> pixels(color ? 3 * n : n);
+	if (color)
+	{
+		for (size_t i = 0; i < n; ++i)
+			std::copy(data + 4 * i, data + 4 * i + 3, pixels.begin() + 3 * i);
+	}
+	else
+	{
+		// signed fields are mapped symmetrically around 128
+		const float* values = reinterpret_cast<const float*>(data);
+		float range = 1e-6f;
+		for (size_t i = 0; i < n; ++i)
+			range = std::max(range, std::fabs(values[i]));
+		for (size_t i = 0; i < n; ++i)
+			pixels[i] = static_cast<uint8_t>(127.5f + 127.5f * values[i] / range);
+	}
+
+	fprintf(f, "P%d\n%u %u\n255\n", color ? 6 : 5, h->width, h->height);
+	fwrite(pixels.data(), 1, pixels.size(), f);
+	fclose(f);
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+	{
+		show_usage(argv[0]);
+		return 1;
+	}
+
+	std::string name = argv[1];
+	const char* control = "";
+	std::string field, dumpPrefix;
+	long count = -1;
+
+	for (int i = 2; i < argc; ++i) {
+		std::string arg = argv[i];
+		if ((arg == "-h") || (arg == "--help")) {
+			show_usage(argv[0]);
+			return 0;
+		}
+		else if (((arg == "-c") || (arg == "--control")) && i + 1 < argc) {
+			control = argv[++i];
+		}
+		else if (((arg == "-f") || (arg == "--field")) && i + 1 < argc) {
+			field = argv[++i];
+		}
+		else if (((arg == "-d") || (arg == "--dump")) && i + 1 < argc) {
+			dumpPrefix = argv[++i];
+		}
+		else if (((arg == "-n") || (arg == "--count")) && i + 1 < argc) {
+			count = atol(argv[++i]);
+		}
+		else {
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!field.empty())
+	{
+		if (control[0] == '\0')
+		{
+			std::cout << "--field requires --control." << std::endl;
+			return 1;
+		}
+		if (!sendCommand(control, "field " + field))
+			return 1;
+	}
+
+	if (name[0] != '/')
+		name = "/" + name;
+
+	Reader reader;
+	while (!reader.attach(name.c_str()))
+		usleep(100000);
+
+	const Header* h = reader.info();
+	printf("Attached to %s: %ux%u, %u slots\n", name.c_str(), h->width, h->height, h->slotCount);
+
+	std::vector<uint8_t> copy(h->slotBytes);
+	uint64_t last = 0;
+	while (count != 0 && reader.writerAlive())
+	{
+		if (reader.generation() == last)
+		{
+			usleep(1000);
+			continue;
+		}
+
+		// statistics are computed in place; dumps work on a validated copy
+		Reader::Frame frame;
+		if (!reader.latest(frame))
+			continue;
+
+		size_t n = size_t(h->width) * h->height;
+		double sum[3] = { 0, 0, 0 };
+		float minValue = INFINITY, maxValue = -INFINITY;
+		if (frame.format == RGBA8)
+		{
+			for (size_t i = 0; i < n; ++i)
+				for (int c = 0; c < 3; ++c)
+					sum[c] += frame.data[4 * i + c];
+		}
+		else
+		{
+			const float* values = reinterpret_cast<const float*>(frame.data);
+			for (size_t i = 0; i < n; ++i)
+			{
+				sum[0] += values[i];
+				minValue = std::min(minValue, values[i]);
+				maxValue = std::max(maxValue, values[i]);
+			}
+		}
+		if (!reader.validate(frame))
+			continue;
+
+		if (frame.generation > last + 1 && last != 0)
+			printf("  (skipped %llu frames)\n", (unsigned long long)(frame.generation - last - 1));
+		last = frame.generation;
+
+		if (frame.format == RGBA8)
+			printf("frame %llu iteration %d %s mean rgb %.2f %.2f %.2f\n", (unsigned long long)frame.generation,
+				frame.iteration, fieldName(frame.field), sum[0] / n, sum[1] / n, sum[2] / n);
+		else
+			printf("frame %llu iteration %d %s min %g max %g mean %g\n", (unsigned long long)frame.generation,
+				frame.iteration, fieldName(frame.field), minValue, maxValue, sum[0] / n);
+
+		if (!dumpPrefix.empty() && reader.copyLatest(frame, copy.data()))
+			dumpFrame(dumpPrefix, h, frame, copy.data());
+
+		if (count > 0)
+			--count;
+	}
+
+	return 0;
+}
@@ -0,0 +1,191 @@
+#include "tracer.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <sstream>
+#include <thread>
+
+#include "profiler.h"
+
+namespace
+{
+	// distinguishes open() calls so cached thread tracks of a previous trace are not reused
+	std::atomic<uint64_t> sessions(0);
+}
+
+Tracer::Tracer()
+	: isOpen(false)
+	, capacity(0)
+	, ring(false)
+	, origin(0)
+	, ticksPerUs(1.0)
+	, session(0)
+{
+}
+
+Tracer::~Tracer()
+{
+	close();
+}
+
+uint64_t Tracer::ticks()
+{
+	return PhaseProfiler::ticks();
+}
+
+bool Tracer::open(const char* path_, size_t capacity_, bool ring_)
+{
+	close();
+
+	path = path_;
+	capacity = std::max<size_t>(capacity_, 16);
+	ring = ring_;
+
+	// calibrate the tick rate against the steady clock
+	auto t0 = std::chrono::steady_clock::now();
+	uint64_t c0 = ticks();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	auto t1 = std::chrono::steady_clock::now();
+	uint64_t c1 = ticks();
+	ticksPerUs = (c1 - c0) / std::chrono::duration<double, std::micro>(t1 - t0).count();
+	origin = c1;
+	session = ++sessions;
+
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f)
+	{
+		fprintf(stderr, "Error opening trace file %s\n", path.c_str());
+		return false;
+	}
+	fclose(f);
+
+	printf("> Tracing to %s (%zu events per thread%s)\n", path.c_str(), capacity, ring ? ", ring" : "");
+	isOpen = true;
+	return true;
+}
+
+void Tracer::close()
+{
+	if (!isOpen)
+		return;
+	isOpen = false;
+
+	write();
+
+	std::lock_guard<std::mutex> lock(tracksMutex);
+	tracks.clear();
+}
+
+Tracer::Track* Tracer::addTrack(const std::string& name)
+{
+	std::lock_guard<std::mutex> lock(tracksMutex);
+	Track* track = new Track;
+	track->name = name;
+	track->id = static_cast<uint32_t>(tracks.size() + 1);
+	track->events.resize(capacity);
+	track->count = 0;
+	track->dropped = 0;
+	tracks.emplace_back(track);
+	return track;
+}
+
+Tracer::Track* Tracer::threadTrack()
+{
+	static thread_local uint64_t owner = 0;
+	static thread_local Track* track = nullptr;
+	if (owner != session)
+	{
+		std::ostringstream name;
+		name << "thread " << std::this_thread::get_id();
+		track = addTrack(name.str());
+		owner = session;
+	}
+	return track;
+}
+
+Tracer::Track* Tracer::virtualTrack(const char* name)
+{
+	return addTrack(name);
+}
+
+void Tracer::setThreadName(const char* name)
+{
+	if (!isOpen)
+		return;
+	Track* track = threadTrack();
+	std::lock_guard<std::mutex> lock(tracksMutex);
+	track->name = name;
+}
+
+void Tracer::record(const char* name, const char* category, uint64_t startTicks, uint64_t endTicks, int32_t arg)
+{
+	recordOn(threadTrack(), name, category, startTicks, endTicks, arg);
+}
+
+void Tracer::recordOn(Track* track, const char* name, const char* category, uint64_t startTicks, uint64_t endTicks, int32_t arg)
+{
+	// single producer per track: only the owner thread advances count
+	uint64_t n = track->count.load(std::memory_order_relaxed);
+	if (n >= capacity && !ring)
+	{
+		track->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Event& e = track->events[n % capacity];
+	e.start = startTicks;
+	e.end = endTicks;
+	e.name = name;
+	e.category = category;
+	e.arg = arg;
+	track->count.store(n + 1, std::memory_order_release);
+}
+
+bool Tracer::write()
+{
+	FILE* f = fopen(path.c_str(), "w");
+	if (!f)
+	{
+		fprintf(stderr, "Error writing trace file %s\n", path.c_str());
+		return false;
+	}
+
+	std::lock_guard<std::mutex> lock(tracksMutex);
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"fluidsim\"}}");
+
+	size_t total = 0;
+	uint64_t lost = 0;
+	for (auto& t : tracks)
+	{
+		fprintf(f, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", t->id, t->name.c_str());
+		fprintf(f, ",\n{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"sort_index\":%u}}", t->id, t->id);
+
+		uint64_t count = t->count.load(std::memory_order_acquire);
+		uint64_t first = count > capacity ? count - capacity : 0;
+		lost += first + t->dropped.load(std::memory_order_relaxed);
+
+		for (uint64_t n = first; n < count; ++n)
+		{
+			const Event& e = t->events[n % capacity];
+			// events from before open() (e.g. GPU spans anchored in the past) are clamped
+			double ts = e.start > origin ? (e.start - origin) / ticksPerUs : 0.0;
+			double dur = e.end > e.start ? (e.end - e.start) / ticksPerUs : 0.0;
+			fprintf(f, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+				e.name, e.category, t->id, ts, dur);
+			if (e.arg >= 0)
+				fprintf(f, ",\"args\":{\"frame\":%d}", e.arg);
+			fprintf(f, "}");
+		}
+		total += count - first;
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	printf("- Wrote %zu trace events to %s", total, path.c_str());
+	if (lost > 0)
+		printf(" (%llu %s)", (unsigned long long)lost, ring ? "overwritten" : "dropped, buffer full");
+	printf("\n");
+	return true;
+}
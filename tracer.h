@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of the simulation in Chrome trace-event format (opens in Perfetto
+// or chrome://tracing).
+//
+// Every thread appends complete ("X") events to its own fixed-size buffer
+// without locking. A full buffer either drops new events or, in ring mode,
+// overwrites the oldest ones so a long run keeps its most recent history.
+// The trace is written by close(), after all producer threads have finished.
+class Tracer
+{
+public:
+	struct Track;
+
+	Tracer();
+	~Tracer();
+
+	// capacity is the number of events kept per thread
+	bool open(const char* path, size_t capacity = 1 << 20, bool ring = false);
+	void close();
+
+	bool enabled() const { return isOpen; }
+
+	static uint64_t ticks();
+
+	// name and category must be string literals (only the pointer is stored)
+	void record(const char* name, const char* category, uint64_t startTicks, uint64_t endTicks, int32_t arg = -1);
+	void recordOn(Track* track, const char* name, const char* category, uint64_t startTicks, uint64_t endTicks, int32_t arg = -1);
+
+	// a track that is not backed by a thread, e.g. the GPU timeline;
+	// it must only be written from one thread at a time
+	Track* virtualTrack(const char* name);
+
+	// label of the calling thread in the trace
+	void setThreadName(const char* name);
+
+	class Scope
+	{
+	public:
+		Scope(Tracer* tracer_, const char* name_, const char* category_, int32_t arg_ = -1)
+			: tracer(tracer_ && tracer_->isOpen ? tracer_ : nullptr)
+			, name(name_)
+			, category(category_)
+			, arg(arg_)
+			, start(tracer ? ticks() : 0)
+		{
+		}
+		~Scope()
+		{
+			if (tracer)
+				tracer->record(name, category, start, ticks(), arg);
+		}
+	private:
+		Tracer* tracer;
+		const char* name;
+		const char* category;
+		int32_t arg;
+		uint64_t start;
+	};
+
+	struct Event
+	{
+		uint64_t start;
+		uint64_t end;
+		const char* name;
+		const char* category;
+		int32_t arg;
+	};
+
+	struct Track
+	{
+		std::string name;
+		uint32_t id;
+		std::vector<Event> events;
+		std::atomic<uint64_t> count;
+		std::atomic<uint64_t> dropped;
+	};
+
+private:
+	Track* threadTrack();
+	Track* addTrack(const std::string& name);
+	bool write();
+
+	std::atomic<bool> isOpen;
+	std::string path;
+	size_t capacity;
+	bool ring;
+	uint64_t origin;
+	double ticksPerUs;
+	uint64_t session;
+
+	std::mutex tracksMutex;
+	std::vector<std::unique_ptr<Track>> tracks;
+};
@@ -0,0 +1,221 @@
+#include "trafficmodel.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include <Matog.h>
+#include "common.h"
+
+namespace TrafficModel
+{
+	const char* operatorName(int op)
+	{
+		static const char* names[OPERATOR_COUNT] = {
+			"advect", "jacobi", "divergence", "subtractGradient", "boundary", "addInk", "convertToColor2", "streamCollide", "advectDye",
+			"splat", "addDye"
+		};
+		return op >= 0 && op < OPERATOR_COUNT ? names[op] : "?";
+	}
+
+	Cost launch(Operator op, int width, int height, int species)
+	{
+		const double f = sizeof(float);
+		double cells = double(width) * height;
+		double border = 2.0 * (width + height) - 4.0;
+		Cost c = { 1.0, 0.0, 0.0 };
+		switch (op)
+		{
+		case ADVECT:			// u, v, q read, qNew written
+			c.bytes = 4 * f * cells;
+			c.flops = 19 * cells;
+			break;
+		case JACOBI:			// x, b read, xNew written
+			c.bytes = 3 * f * cells;
+			c.flops = 6 * cells;
+			break;
+		case DIVERGENCE:		// u, v read, div written
+			c.bytes = 3 * f * cells;
+			c.flops = 4 * cells;
+			break;
+		case SUBTRACT_GRADIENT:	// p, u, v read, uNew, vNew written
+			c.bytes = 5 * f * cells;
+			c.flops = 6 * cells;
+			break;
+		case BOUNDARY:			// only the border is read and written
+			c.bytes = 2 * f * border;
+			c.flops = border;
+			break;
+		case ADD_INK:			// u, v, ink read and written
+			c.bytes = 6 * f * cells;
+			c.flops = 20 * cells;
+			break;
+		case CONVERT_TO_COLOR2:	// r, g, b read, RGBA8 written
+			c.bytes = (3 * f + 4) * cells;
+			c.flops = 0;
+			break;
+		case STREAM_COLLIDE:	// 9 distributions read and written, forces read and cleared, u, v, p written
+			c.bytes = 25 * f * cells;
+			c.flops = 320 * cells;
+			break;
+		case ADVECT_DYE:		// u, v read once, every species read and written
+			c.bytes = (2 + 2 * species) * f * cells;
+			c.flops = (14 + 8 * species) * cells;
+			break;
+		case SPLAT:				// q read and written
+			c.bytes = 2 * f * cells;
+			c.flops = 16 * cells;
+			break;
+		case ADD_DYE:			// one species read and written; interleaved, its sectors carry every species
+			c.bytes = 2 * species * f * cells;
+			c.flops = 14 * cells;
+			break;
+		default:
+			break;
+		}
+		return c;
+	}
+
+	namespace
+	{
+		// on the ink grid, or the solver grid if solver
+		void add(Cost& total, Operator op, double count, const Step& step, bool solver = false)
+		{
+			int coarsening = solver ? std::max(step.coarsening, 1) : 1;
+			Cost c = launch(op, step.width / coarsening, step.height / coarsening, std::max(step.species, 1));
+			total.launches += count;
+			total.bytes += count * c.bytes;
+			total.flops += count * c.flops;
+		}
+
+		// FluidSimulation::injectInk: the force splats on the solver grid (into the
+		// lattice's force arrays on that engine), the dye on the ink grid
+		void addInjections(Cost& total, const Step& step)
+		{
+			add(total, SPLAT, 2.0 * step.injectionsPerFrame, step, true);
+			add(total, ADD_DYE, step.injectionsPerFrame, step);
+		}
+	}
+
+	Cost phase(PhaseProfiler::Phase phase, const Step& step)
+	{
+		// mirrors the launches of FluidSimulation::update()
+		Cost c = { 0.0, 0.0, 0.0 };
+		if (step.latticeSubsteps > 0)
+		{
+			// only the dye is advected, the lattice replaces diffusion and projection
+			if (phase == PhaseProfiler::ADVECTION)
+				add(c, ADVECT_DYE, 1, step);
+			else if (phase == PhaseProfiler::INJECTION)
+				addInjections(c, step);
+			else if (phase == PhaseProfiler::STREAM_COLLIDE)
+				add(c, STREAM_COLLIDE, step.latticeSubsteps, step, true);
+			return c;
+		}
+		switch (phase)
+		{
+		case PhaseProfiler::BOUNDARY:
+			add(c, BOUNDARY, 2, step, true);
+			break;
+		case PhaseProfiler::ADVECTION:
+			add(c, ADVECT, 3, step, true);
+			add(c, ADVECT_DYE, 1, step);
+			break;
+		case PhaseProfiler::INJECTION:
+			addInjections(c, step);
+			break;
+		case PhaseProfiler::DIFFUSION:
+			add(c, JACOBI, 2.0 * step.diffusionIterations, step, true);
+			break;
+		case PhaseProfiler::DIVERGENCE:
+			add(c, DIVERGENCE, 1, step, true);
+			break;
+		case PhaseProfiler::PRESSURE:
+			if (step.spectralPressure)
+				break;
+			add(c, BOUNDARY, step.pressureIterations, step, true);
+			add(c, JACOBI, step.pressureIterations, step, true);
+			break;
+		case PhaseProfiler::GRADIENT:
+			add(c, BOUNDARY, 2, step, true);
+			add(c, SUBTRACT_GRADIENT, 1, step, true);
+			break;
+		default:
+			break;
+		}
+		return c;
+	}
+
+	Peak devicePeak(CUdevice device)
+	{
+		Peak peak;
+		memset(&peak, 0, sizeof(peak));
+		cuDeviceGetName(peak.name, sizeof(peak.name) - 1, device);
+
+		int memoryClockKHz = 0, busWidth = 0, multiprocessors = 0, clockKHz = 0, major = 0, minor = 0;
+		CHECK(cuDeviceGetAttribute(&memoryClockKHz, CU_DEVICE_ATTRIBUTE_MEMORY_CLOCK_RATE, device));
+		CHECK(cuDeviceGetAttribute(&busWidth, CU_DEVICE_ATTRIBUTE_GLOBAL_MEMORY_BUS_WIDTH, device));
+		CHECK(cuDeviceGetAttribute(&multiprocessors, CU_DEVICE_ATTRIBUTE_MULTIPROCESSOR_COUNT, device));
+		CHECK(cuDeviceGetAttribute(&clockKHz, CU_DEVICE_ATTRIBUTE_CLOCK_RATE, device));
+		CHECK(cuDeviceGetAttribute(&major, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MAJOR, device));
+		CHECK(cuDeviceGetAttribute(&minor, CU_DEVICE_ATTRIBUTE_COMPUTE_CAPABILITY_MINOR, device));
+
+		// FP32 lanes per multiprocessor
+		int lanes = 128;
+		if (major == 2)
+			lanes = minor == 0 ? 32 : 48;
+		else if (major == 3)
+			lanes = 192;
+		else if ((major == 6 && minor == 0) || major == 7 || (major == 8 && minor == 0))
+			lanes = 64;
+
+		// double data rate memory, FMA counts as two flops
+		peak.bytesPerSecond = 2.0 * memoryClockKHz * 1e3 * busWidth / 8.0;
+		peak.flopsPerSecond = 2.0 * multiprocessors * lanes * clockKHz * 1e3;
+		return peak;
+	}
+
+	void printRoofline(FILE* out, const PhaseProfiler& profiler, const Step& step, const Peak& peak)
+	{
+		if (peak.bytesPerSecond <= 0.0 || peak.flopsPerSecond <= 0.0)
+			return;
+
+		double ridge = peak.flopsPerSecond / peak.bytesPerSecond;
+		fprintf(out, "- Roofline of %dx%d (%s: %.1f GB/s, %.1f GFLOP/s, ridge %.1f flop/B)\n", step.width, step.height,
+			peak.name, peak.bytesPerSecond * 1e-9, peak.flopsPerSecond * 1e-9, ridge);
+		fprintf(out, "  %-12s %9s %10s %11s %7s %9s %9s %9s %9s %7s\n", "phase", "launches", "MB/frame", "MFLOP/frame",
+			"flop/B", "ms", "GB/s", "GFLOP/s", "roof GB/s", "of roof");
+
+		Cost total = { 0.0, 0.0, 0.0 };
+		double totalMs = 0.0;
+		for (int p = PhaseProfiler::BOUNDARY; p <= PhaseProfiler::STREAM_COLLIDE; ++p)
+		{
+			size_t count = 0;
+			double ms = 0.0;
+			if (!profiler.phaseMean(static_cast<PhaseProfiler::Phase>(p), count, ms) || ms <= 0.0)
+				continue;
+			Cost c = phase(static_cast<PhaseProfiler::Phase>(p), step);
+			if (c.launches <= 0.0)
+				continue;
+
+			double intensity = c.bytes > 0.0 ? c.flops / c.bytes : 0.0;
+			double gbs = c.bytes / (ms * 1e6);
+			double gflops = c.flops / (ms * 1e6);
+			// the attainable bandwidth: memory bound below the ridge, compute bound above
+			double roof = intensity > ridge ? peak.flopsPerSecond / intensity : peak.bytesPerSecond;
+			fprintf(out, "  %-12s %9.1f %10.3f %11.3f %7.2f %9.4f %9.1f %9.1f %9.1f %6.1f%%\n",
+				PhaseProfiler::phaseName(p), c.launches, c.bytes * 1e-6, c.flops * 1e-6, intensity, ms,
+				gbs, gflops, roof * 1e-9, 100.0 * gbs / (roof * 1e-9));
+
+			total.launches += c.launches;
+			total.bytes += c.bytes;
+			total.flops += c.flops;
+			totalMs += ms;
+		}
+		if (step.spectralPressure && step.latticeSubsteps == 0)
+			fprintf(out, "  %-12s (DCT solve with host transfers, not modelled)\n", PhaseProfiler::phaseName(PhaseProfiler::PRESSURE));
+		if (totalMs > 0.0)
+			fprintf(out, "  %-12s %9.1f %10.3f %11.3f %7.2f %9.4f %9.1f %9.1f\n", "step", total.launches,
+				total.bytes * 1e-6, total.flops * 1e-6, total.bytes > 0.0 ? total.flops / total.bytes : 0.0, totalMs,
+				total.bytes / (totalMs * 1e6), total.flops / (totalMs * 1e6));
+	}
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstdio>
+
+#include <cuda.h>
+
+#include "profiler.h"
+
+// Analytic cost of the simulation kernels, derived from the grid size.
+//
+// Bytes are the compulsory DRAM traffic of a launch: every array a kernel
+// touches is read or written once per cell, stencil neighbours and the
+// interpolation gathers of advect are assumed to hit in cache. Flops count
+// the arithmetic of fluidSimKernel.cu per cell (min/max/clamp and index
+// arithmetic excluded, pow counted as 8).
+namespace TrafficModel
+{
+	enum Operator
+	{
+		ADVECT,
+		JACOBI,
+		DIVERGENCE,
+		SUBTRACT_GRADIENT,
+		BOUNDARY,
+		ADD_INK,
+		CONVERT_TO_COLOR2,
+		STREAM_COLLIDE,
+		ADVECT_DYE,
+		SPLAT,
+		ADD_DYE,
+		OPERATOR_COUNT
+	};
+
+	const char* operatorName(int op);
+
+	struct Cost
+	{
+		double launches;
+		double bytes;
+		double flops;
+	};
+
+	// one launch on a width x height grid; species is the channel count of ADVECT_DYE and ADD_DYE
+	Cost launch(Operator op, int width, int height, int species = 1);
+
+	// kernel launches of one update() phase
+	struct Step
+	{
+		int width, height;
+		// mean Jacobi or explicit passes per field and Jacobi pressure sweeps executed per step
+		double diffusionIterations;
+		double pressureIterations;
+		double injectionsPerFrame;	// injectInk calls, a splat of u and v and an addDye each
+		// stream-collide steps per frame of the lattice Boltzmann engine, 0 for stable fluids
+		int latticeSubsteps;
+		// u, v and p are on a grid this many times coarser than the ink along each axis
+		int coarsening;
+		int species;	// dye species
+		// the DCT pressure solve with its host transfers is not modelled, its phase is left out
+		bool spectralPressure;
+	};
+	Cost phase(PhaseProfiler::Phase phase, const Step& step);
+
+	struct Peak
+	{
+		char name[100];
+		double bytesPerSecond;
+		double flopsPerSecond;	// single precision FMA throughput
+	};
+	// theoretical peaks from the device attributes
+	Peak devicePeak(CUdevice device);
+
+	// achieved GB/s and GFLOP/s of the profiled phases against the roofline
+	void printRoofline(FILE* out, const PhaseProfiler& profiler, const Step& step, const Peak& peak);
+}